@@ -0,0 +1,472 @@
+// ArcData.cpp - File for reading archive data shared by the handlers
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "IndexCache.hpp"
+#include "Util.hpp"
+
+#include <CPP/7zip/Archive/Common/HandlerOut.h>
+#include <CPP/7zip/Common/LimitedStreams.h>
+#include <CPP/7zip/Common/MethodProps.h>
+#include <CPP/7zip/Common/ProgressUtils.h>
+#include <CPP/7zip/Common/StreamObjects.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <CPP/Common/Defs.h>
+#include <CPP/Common/StringConvert.h>
+#include <CPP/Windows/System.h>
+
+#include <cstring>
+
+#ifndef _WIN32
+#include <stdlib.h>
+#endif
+
+namespace ArcData
+{
+
+void GetUserDir(FString& dir)
+{
+#ifdef _WIN32
+    wchar_t path[MAX_PATH];
+    const DWORD len = GetEnvironmentVariableW(L"LOCALAPPDATA", path, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) {
+        dir.Empty();
+        return;
+    }
+    dir = us2fs(path);
+#else
+    const char* path = getenv("XDG_CACHE_HOME");
+    if (path && *path) {
+        dir = path;
+    } else {
+        path = getenv("HOME");
+        if (!path || !*path) {
+            dir.Empty();
+            return;
+        }
+        dir = path;
+        dir += FTEXT("/.cache");
+    }
+#endif
+    dir.Add_PathSepar();
+    dir += FTEXT("mkwcat7z");
+}
+
+static const UInt32 kBlockSizeMin = 1 << 12;
+static const UInt32 kBlockSizeMax = 1 << 26;
+static const UInt32 kRecurseDepthDefault = 4;
+static const UInt32 kRecurseDepthMax = 16;
+
+void CHandlerProps::Init()
+{
+    NumThreads = NWindows::NSystem::GetNumberOfProcessors();
+    CacheSize = (UInt64) 1 << 26;
+    BlockSize = 1 << 16;
+    IndexDir.Empty();
+    RecurseDepth = 0;
+}
+
+bool CHandlerProps::SetProperty(
+    const UString& name, const PROPVARIANT& value, HRESULT& hres
+)
+{
+    hres = S_OK;
+    if (name.IsPrefixedBy_Ascii_NoCase("mt")) {
+        bool forced;
+        NumThreads = NWindows::NSystem::GetNumberOfProcessors();
+        hres = ParseMtProp2(name.Ptr(2), value, NumThreads, forced);
+        return true;
+    }
+
+    // Sizes take the usual suffixes, and the cache can also be a percentage
+    // of the RAM size as in "p10"
+    if (name.IsPrefixedBy_Ascii_NoCase("cache")) {
+        UInt64 ramSize = (UInt64) 1 << 30;
+        NWindows::NSystem::GetRamSize(ramSize);
+        if (!NArchive::ParseSizeString(
+                name.Ptr(5), value, ramSize, CacheSize
+            )) {
+            hres = E_INVALIDARG;
+        }
+        return true;
+    }
+
+    if (name.IsPrefixedBy_Ascii_NoCase("bs")) {
+        UInt64 size;
+        if (!NArchive::ParseSizeString(name.Ptr(2), value, 0, size) ||
+            size < kBlockSizeMin || size > kBlockSizeMax) {
+            hres = E_INVALIDARG;
+        } else {
+            BlockSize = (UInt32) size;
+        }
+        return true;
+    }
+
+    // "index" alone or "index=on" for the default directory, or the
+    // directory itself
+    if (name.IsEqualTo_Ascii_NoCase("index")) {
+        bool on = true;
+        if (value.vt == VT_BSTR && !StringToBool(value.bstrVal, on)) {
+            IndexDir = us2fs(value.bstrVal);
+            return true;
+        }
+        hres = PROPVARIANT_to_bool(value, on);
+        IndexDir.Empty();
+        if (hres == S_OK && on) {
+            IndexCache::GetDefaultDir(IndexDir);
+        }
+        return true;
+    }
+
+    // "recurse" alone or "on" for the default depth, or the depth itself
+    if (name.IsPrefixedBy_Ascii_NoCase("recurse")) {
+        bool on = true;
+        RecurseDepth = kRecurseDepthDefault;
+        if (value.vt == VT_BSTR) {
+            hres = PROPVARIANT_to_bool(value, on);
+            if (!on) {
+                RecurseDepth = 0;
+            }
+        } else {
+            hres = ParsePropToUInt32(name.Ptr(7), value, RecurseDepth);
+        }
+        if (RecurseDepth > kRecurseDepthMax) {
+            hres = E_INVALIDARG;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+HRESULT CSource::Open(IInStream* stream)
+{
+    Close();
+
+    Byte magic[4];
+    RINOK(InStream_SeekSet(stream, 0))
+    RINOK(ReadStream_FALSE(stream, magic, sizeof(magic)))
+    RINOK(InStream_SeekSet(stream, 0))
+
+    if (Yaz0::IsHeader(magic)) {
+        RINOK(_yaz0.Open(stream))
+        _wrapper = kWrapYaz0;
+    } else if (Yay0::IsHeader(magic)) {
+        UInt64 packSize;
+        RINOK(InStream_GetSize_SeekToEnd(stream, packSize))
+        if (packSize > ((UInt32) 1 << 31)) {
+            return S_FALSE;
+        }
+        RINOK(InStream_SeekSet(stream, 0))
+        RINOK(_yay0.Open(stream, (size_t) packSize))
+        _wrapper = kWrapYay0;
+    }
+
+    _stream = stream;
+    return S_OK;
+}
+
+HRESULT CSource::OpenSeq(ISequentialInStream* stream)
+{
+    Close();
+
+    size_t size = sizeof(_head);
+    RINOK(ReadStream(stream, _head, &size))
+    _headSize = (UInt32) size;
+    _seqPos = size;
+
+    if (size == sizeof(_head) && Yaz0::IsHeader(_head)) {
+        RINOK(_yaz0.Open(stream, _head))
+        _wrapper = kWrapYaz0;
+    } else if (size >= 4 && Yay0::IsHeader(_head)) {
+        return S_FALSE;
+    }
+
+    _seqStream = stream;
+    return S_OK;
+}
+
+void CSource::Close()
+{
+    _stream.Release();
+    _seqStream.Release();
+    _seqPos = 0;
+    _headSize = 0;
+    _yaz0.Free();
+    _yay0.Free();
+    _wrapper = kWrapNone;
+}
+
+HRESULT CSource::EnsureDecoded(UInt64 end)
+{
+    return _wrapper == kWrapYaz0 ? _yaz0.EnsureDecoded(end)
+                                 : _yay0.EnsureDecoded(end);
+}
+
+const Byte* CSource::GetData() const
+{
+    return _wrapper == kWrapYaz0 ? _yaz0.GetData() : _yay0.GetData();
+}
+
+UInt64 CSource::GetDataSize() const
+{
+    return _wrapper == kWrapYaz0 ? _yaz0.GetSize() : _yay0.GetSize();
+}
+
+Byte* CSource::GetBuf()
+{
+    if (_buf.Size() == 0) {
+        _buf.Alloc(_blockSize);
+    }
+    return _buf;
+}
+
+HRESULT CSource::SeqSkipTo(UInt64 offset)
+{
+    if (offset < _seqPos) {
+        PRINT("ArcData: offset %llu already passed\n", offset);
+        return S_FALSE;
+    }
+
+    Byte* buf = GetBuf();
+    while (_seqPos < offset) {
+        size_t size = _blockSize;
+        if (size > offset - _seqPos) {
+            size = (size_t) (offset - _seqPos);
+        }
+        RINOK(ReadStream_FALSE(_seqStream, buf, size))
+        _seqPos += size;
+    }
+    return S_OK;
+}
+
+HRESULT CSource::Read(UInt64 offset, void* data, size_t size)
+{
+    if (size == 0) {
+        return S_OK;
+    }
+    if (_wrapper != kWrapNone) {
+        RINOK(EnsureDecoded(offset + size))
+        memcpy(data, GetData() + offset, size);
+        return S_OK;
+    }
+
+    if (IsSeq()) {
+        Byte* dest = (Byte*) data;
+        if (offset < _headSize) {
+            size_t n = _headSize - (size_t) offset;
+            if (n > size) {
+                n = size;
+            }
+            memcpy(dest, _head + offset, n);
+            dest += n;
+            offset += n;
+            size -= n;
+        }
+        if (size == 0) {
+            return S_OK;
+        }
+        RINOK(SeqSkipTo(offset))
+        RINOK(ReadStream_FALSE(_seqStream, dest, size))
+        _seqPos += size;
+        return S_OK;
+    }
+
+    RINOK(InStream_SeekSet(_stream, offset))
+    return ReadStream_FALSE(_stream, data, size);
+}
+
+HRESULT CSource::Copy(
+    UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+    ICompressProgressInfo* progress, bool& isOk
+)
+{
+    // Empty files often share their offset with the next file, which a
+    // sequential stream may already be past
+    if (size == 0) {
+        isOk = true;
+        return S_OK;
+    }
+
+    if (_wrapper != kWrapNone) {
+        isOk = EnsureDecoded(offset + size) == S_OK;
+        if (isOk && outStream) {
+            RINOK(WriteStream(outStream, GetData() + offset, (size_t) size))
+        }
+        return S_OK;
+    }
+
+    ISequentialInStream* inStream;
+    if (IsSeq()) {
+        // Data overlapping what has already been read can't be recovered
+        if (offset < _seqPos || SeqSkipTo(offset) != S_OK) {
+            isOk = false;
+            return S_OK;
+        }
+        inStream = _seqStream;
+    } else {
+        UInt64 pos;
+        RINOK(InStream_GetPos(_stream, pos))
+        if (pos != offset) {
+            RINOK(InStream_SeekSet(_stream, offset))
+        }
+        inStream = _stream;
+    }
+
+    Byte* buf = GetBuf();
+    UInt64 done = 0;
+    while (done < size) {
+        size_t cur = _blockSize;
+        if (cur > size - done) {
+            cur = (size_t) (size - done);
+        }
+        RINOK(ReadStream(inStream, buf, &cur))
+        if (cur == 0) {
+            break;
+        }
+        if (outStream) {
+            RINOK(WriteStream(outStream, buf, cur))
+        }
+        done += cur;
+        if (IsSeq()) {
+            _seqPos += cur;
+        }
+        if (progress) {
+            RINOK(progress->SetRatioInfo(&done, &done))
+        }
+    }
+    isOk = done == size;
+    return S_OK;
+}
+
+HRESULT CSource::GetStream(
+    UInt64 offset, UInt64 size, IUnknown* ref, ISequentialInStream** stream
+)
+{
+    if (_wrapper != kWrapNone) {
+        RINOK(EnsureDecoded(offset + size))
+        Create_BufInStream_WithReference(
+            GetData() + offset, (size_t) size, ref, stream
+        );
+        return S_OK;
+    }
+    if (IsSeq()) {
+        return S_FALSE;
+    }
+    return CreateLimitedInStream(_stream, offset, size, stream);
+}
+
+HRESULT CSource::GetTailStream(
+    UInt64 offset, IUnknown* ref, ISequentialInStream** stream
+)
+{
+    if (_wrapper != kWrapNone) {
+        const UInt64 size = GetDataSize();
+        if (offset > size) {
+            return S_FALSE;
+        }
+        return GetStream(offset, size - offset, ref, stream);
+    }
+
+    if (IsSeq()) {
+        RINOK(SeqSkipTo(offset))
+        // Whatever the caller reads isn't tracked, so nothing can be read
+        // through the source anymore
+        _seqPos = (UInt64) (Int64) -1;
+        CMyComPtr<ISequentialInStream> seqStream = _seqStream;
+        *stream = seqStream.Detach();
+        return S_OK;
+    }
+
+    RINOK(InStream_SeekSet(_stream, offset))
+    CMyComPtr<ISequentialInStream> seqStream = (IInStream*) _stream;
+    *stream = seqStream.Detach();
+    return S_OK;
+}
+
+static int CompareRanges(const CRange* a, const CRange* b, void*)
+{
+    if (a->Offset != b->Offset) {
+        return a->Offset < b->Offset ? -1 : 1;
+    }
+    return MyCompare(a->Index, b->Index);
+}
+
+void SortRanges(CRecordVector<CRange>& ranges)
+{
+    ranges.Sort(CompareRanges, NULL);
+}
+
+HRESULT ExtractRanges(
+    CSource& source, CRecordVector<CRange>& ranges, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+)
+{
+    auto copy = [&](const CRange& range, ISequentialOutStream* outStream,
+                    ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+        return source.Copy(
+            range.Offset, range.Size, outStream, progress, isOk
+        );
+    };
+    return ExtractRanges(ranges, testMode, extractCallback, copy);
+}
+
+HRESULT ExtractRanges(
+    CRecordVector<CRange>& ranges, Int32 testMode,
+    IArchiveExtractCallback* extractCallback, RangeCopyFunc copy, void* param
+)
+{
+    SortRanges(ranges);
+
+    UInt64 totalSize = 0;
+    unsigned i;
+    for (i = 0; i < ranges.Size(); i++) {
+        totalSize += ranges[i].Size;
+    }
+    RINOK(extractCallback->SetTotal(totalSize))
+
+    UInt64 currentTotalSize = 0;
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, false);
+
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+
+    for (i = 0; i < ranges.Size(); i++) {
+        lps->InSize = lps->OutSize = currentTotalSize;
+        RINOK(lps->SetCur())
+        const CRange& range = ranges[i];
+        CMyComPtr<ISequentialOutStream> realOutStream;
+        RINOK(extractCallback->GetStream(range.Index, &realOutStream, askMode))
+        currentTotalSize += range.Size;
+
+        if (range.IsDir) {
+            RINOK(extractCallback->PrepareOperation(askMode))
+            RINOK(extractCallback->SetOperationResult(
+                NArchive::NExtract::NOperationResult::kOK
+            ))
+            continue;
+        }
+        if (!testMode && !realOutStream)
+            continue;
+        RINOK(extractCallback->PrepareOperation(askMode))
+
+        bool isOk = true;
+        RINOK(copy(param, range, realOutStream, progress, isOk))
+        realOutStream.Release();
+        RINOK(extractCallback->SetOperationResult(
+            isOk ? NArchive::NExtract::NOperationResult::kOK
+                 : NArchive::NExtract::NOperationResult::kDataError
+        ))
+    }
+
+    lps->InSize = lps->OutSize = currentTotalSize;
+    return lps->SetCur();
+}
+
+} // namespace ArcData
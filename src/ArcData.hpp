@@ -0,0 +1,188 @@
+#pragma once
+
+#include "Types.h"
+#include "Yay0.hpp"
+#include "Yaz0.hpp"
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/MyString.h>
+#include <CPP/Common/MyVector.h>
+
+namespace ArcData
+{
+
+// Per user directory of the plugin, which holds the default index directory
+// and any files the plugin looks for, such as keys. Empty if there is none.
+void GetUserDir(FString& dir);
+
+// Properties that tune how a handler reads its archive, set from the command
+// line through ISetProperties. Each handler uses the ones that apply to it.
+struct CHandlerProps {
+    // -mmt: threads for decoding (and encoding, where the handler writes)
+    UInt32 NumThreads;
+    // -mcache: most decoded data to keep in memory between calls
+    UInt64 CacheSize;
+    // -mbs: size of the reads from the archive stream
+    UInt32 BlockSize;
+    // -mindex: directory to keep indexes of opened archives in, so that they
+    // don't have to be parsed again. Empty if turned off, as by default.
+    FString IndexDir;
+    // -mrecurse: how many levels of archives inside the archive to open and
+    // show as directories, 0 for none
+    UInt32 RecurseDepth;
+
+    CHandlerProps()
+    {
+        Init();
+    }
+
+    void Init();
+
+    // Returns false if name is not one of these properties. Otherwise hres
+    // is set to E_INVALIDARG if the value is bad.
+    bool SetProperty(
+        const UString& name, const PROPVARIANT& value, HRESULT& hres
+    );
+};
+
+enum EWrapper {
+    kWrapNone,
+    kWrapYaz0,
+    kWrapYay0,
+};
+
+// Archive bytes as seen by the archive handlers. These are read straight from
+// the archive stream, or from a Yaz0/Yay0 wrapper decoded in memory as far as
+// has been requested so far.
+class CSource
+{
+public:
+    CSource()
+      : _seqPos(0)
+      , _headSize(0)
+      , _wrapper(kWrapNone)
+      , _blockSize(1 << 16)
+    {
+    }
+
+    // Size of the reads made to copy or skip over archive data
+    void SetBlockSize(UInt32 blockSize)
+    {
+        _blockSize = blockSize;
+        _buf.Free();
+    }
+
+    // Detect the compression wrapper, if any, and open the archive data.
+    // Returns S_FALSE if the wrapper header is invalid.
+    HRESULT Open(IInStream* stream);
+    // Same for a stream that can't seek. Data can then only be read front to
+    // back: reads skip forward over anything in between, and reading data
+    // that has already been passed fails. Yay0 is not supported.
+    HRESULT OpenSeq(ISequentialInStream* stream);
+    void Close();
+
+    bool IsSeq() const
+    {
+        return _seqStream != NULL;
+    }
+
+    EWrapper GetWrapper() const
+    {
+        return _wrapper;
+    }
+
+    // Read exactly size bytes at offset. Returns S_FALSE if the data is
+    // truncated or corrupt.
+    HRESULT Read(UInt64 offset, void* data, size_t size);
+
+    // Copy size bytes at offset to outStream, which may be NULL to only test
+    // the data. isOk is cleared if the data is truncated or corrupt.
+    HRESULT Copy(
+        UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+        ICompressProgressInfo* progress, bool& isOk
+    );
+
+    // Stream over size bytes at offset. ref is kept alive for the lifetime
+    // of the stream, as the data may be served from memory owned by it.
+    HRESULT GetStream(
+        UInt64 offset, UInt64 size, IUnknown* ref, ISequentialInStream** stream
+    );
+
+    // Stream over everything from offset to the end, for handlers that
+    // decode the rest of the archive themselves. In sequential mode the
+    // source can't be read from afterwards.
+    HRESULT GetTailStream(
+        UInt64 offset, IUnknown* ref, ISequentialInStream** stream
+    );
+
+private:
+    HRESULT EnsureDecoded(UInt64 end);
+    const Byte* GetData() const;
+    UInt64 GetDataSize() const;
+    HRESULT SeqSkipTo(UInt64 offset);
+    Byte* GetBuf();
+
+    CMyComPtr<IInStream> _stream;
+    CMyComPtr<ISequentialInStream> _seqStream;
+    // Bytes consumed from _seqStream so far. The first _headSize of them
+    // were read ahead to detect the wrapper and are kept in _head.
+    UInt64 _seqPos;
+    Byte _head[Yaz0::kHeaderSize];
+    UInt32 _headSize;
+    EWrapper _wrapper;
+    Yaz0::CLazyBuffer _yaz0;
+    Yay0::CLazyBuffer _yay0;
+    UInt32 _blockSize;
+    CByteBuffer _buf;
+};
+
+// Data of one item to extract
+struct CRange {
+    UInt32 Index;
+    bool IsDir;
+    UInt64 Offset;
+    UInt64 Size;
+};
+
+// Sort by data offset, then by index
+void SortRanges(CRecordVector<CRange>& ranges);
+
+// Extract the items in ascending data offset order rather than the order
+// they were requested in. Reading the archive front to back keeps seeks
+// short and never decodes a wrapped archive further than needed.
+HRESULT ExtractRanges(
+    CSource& source, CRecordVector<CRange>& ranges, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+);
+
+// Copies the data of a file range, as CSource::Copy does
+typedef HRESULT (*RangeCopyFunc)(
+    void* param, const CRange& range, ISequentialOutStream* outStream,
+    ICompressProgressInfo* progress, bool& isOk
+);
+
+// Same for items whose data isn't all in one source. The offsets only give
+// the order to extract in, each range is read by copy.
+HRESULT ExtractRanges(
+    CRecordVector<CRange>& ranges, Int32 testMode,
+    IArchiveExtractCallback* extractCallback, RangeCopyFunc copy, void* param
+);
+
+template <typename F>
+HRESULT ExtractRanges(
+    CRecordVector<CRange>& ranges, Int32 testMode,
+    IArchiveExtractCallback* extractCallback, F& copy
+)
+{
+    return ExtractRanges(
+        ranges, testMode, extractCallback,
+        [](void* param, const CRange& range, ISequentialOutStream* outStream,
+           ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+            return (*(F*) param)(range, outStream, progress, isOk);
+        },
+        &copy
+    );
+}
+
+} // namespace ArcData
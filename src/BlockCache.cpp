@@ -0,0 +1,144 @@
+// BlockCache.cpp - File for caching decoded blocks
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "BlockCache.hpp"
+
+namespace BlockCache
+{
+
+static const UInt64 kNoBlock = (UInt64) (Int64) -1;
+
+HRESULT CCache::Alloc(size_t blockSize, UInt32 numSlots)
+{
+    Free();
+    if (numSlots == 0) {
+        return E_INVALIDARG;
+    }
+    _data.Alloc(blockSize * numSlots);
+    if (!_data.IsAllocated()) {
+        return E_OUTOFMEMORY;
+    }
+    _blockSize = blockSize;
+
+    // All slots start out empty, in a list from the first to the last
+    _slots.ClearAndSetSize(numSlots);
+    for (UInt32 i = 0; i < numSlots; i++) {
+        CSlot& slot = _slots[i];
+        slot.Block = kNoBlock;
+        slot.Prev = i != 0 ? i - 1 : kNoSlot;
+        slot.Next = i + 1 != numSlots ? i + 1 : kNoSlot;
+        slot.HashNext = kNoSlot;
+    }
+    _head = 0;
+    _tail = numSlots - 1;
+
+    unsigned numBuckets = 1;
+    while (numBuckets < numSlots) {
+        numBuckets <<= 1;
+    }
+    _buckets.ClearAndSetSize(numBuckets);
+    for (unsigned i = 0; i < numBuckets; i++) {
+        _buckets[i] = kNoSlot;
+    }
+    return S_OK;
+}
+
+void CCache::Free()
+{
+    _data.Free();
+    _blockSize = 0;
+    _slots.Clear();
+    _buckets.Clear();
+    _head = kNoSlot;
+    _tail = kNoSlot;
+}
+
+UInt32 CCache::Find(UInt64 block) const
+{
+    if (_buckets.Size() == 0) {
+        return kNoSlot;
+    }
+    UInt32 slot = _buckets[(UInt32) block & (_buckets.Size() - 1)];
+    while (slot != kNoSlot && _slots[slot].Block != block) {
+        slot = _slots[slot].HashNext;
+    }
+    return slot;
+}
+
+void CCache::Unlink(UInt32 slot)
+{
+    CSlot& s = _slots[slot];
+    if (s.Prev != kNoSlot) {
+        _slots[s.Prev].Next = s.Next;
+    } else {
+        _head = s.Next;
+    }
+    if (s.Next != kNoSlot) {
+        _slots[s.Next].Prev = s.Prev;
+    } else {
+        _tail = s.Prev;
+    }
+}
+
+void CCache::PushFront(UInt32 slot)
+{
+    CSlot& s = _slots[slot];
+    s.Prev = kNoSlot;
+    s.Next = _head;
+    if (_head != kNoSlot) {
+        _slots[_head].Prev = slot;
+    }
+    _head = slot;
+    if (_tail == kNoSlot) {
+        _tail = slot;
+    }
+}
+
+void CCache::RemoveHash(UInt32 slot)
+{
+    CSlot& s = _slots[slot];
+    if (s.Block == kNoBlock) {
+        return;
+    }
+    UInt32* link = &_buckets[(UInt32) s.Block & (_buckets.Size() - 1)];
+    while (*link != slot) {
+        link = &_slots[*link].HashNext;
+    }
+    *link = s.HashNext;
+    s.Block = kNoBlock;
+    s.HashNext = kNoSlot;
+}
+
+void CCache::Touch(UInt32 slot)
+{
+    Unlink(slot);
+    PushFront(slot);
+}
+
+UInt32 CCache::Take()
+{
+    const UInt32 slot = _tail;
+    RemoveHash(slot);
+    Touch(slot);
+    return slot;
+}
+
+void CCache::Set(UInt32 slot, UInt64 block)
+{
+    CSlot& s = _slots[slot];
+    UInt32& bucket = _buckets[(UInt32) block & (_buckets.Size() - 1)];
+    s.Block = block;
+    s.HashNext = bucket;
+    bucket = slot;
+}
+
+void CCache::Flush()
+{
+    for (unsigned i = 0; i < _slots.Size(); i++) {
+        RemoveHash(i);
+    }
+}
+
+} // namespace BlockCache
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Types.h"
+#include <CPP/Common/MyBuffer2.h>
+#include <CPP/Common/MyVector.h>
+
+// Blocks of decoded data that are decoded whole, such as the clusters of a
+// Wii partition or the groups of a WIA image, kept in memory so that reads
+// close together don't decode the same block again
+namespace BlockCache
+{
+
+static const UInt32 kNoSlot = (UInt32) (Int32) -1;
+
+// A fixed number of slots of the same size, each holding one block. Blocks
+// are found by number and the least recently used one is dropped first.
+class CCache
+{
+public:
+    CCache()
+      : _blockSize(0)
+      , _head(kNoSlot)
+      , _tail(kNoSlot)
+    {
+    }
+
+    // Make room for numSlots blocks of blockSize bytes, all empty. The data
+    // is aligned for vector code.
+    HRESULT Alloc(size_t blockSize, UInt32 numSlots);
+    void Free();
+
+    UInt32 GetNumSlots() const
+    {
+        return _slots.Size();
+    }
+
+    Byte* GetData(UInt32 slot)
+    {
+        return _data + slot * _blockSize;
+    }
+
+    // Slot holding block, or kNoSlot
+    UInt32 Find(UInt64 block) const;
+
+    // Mark slot as the most recently used
+    void Touch(UInt32 slot);
+
+    // Empty the least recently used slot to decode a block into. It's marked
+    // as the most recently used, so taking more slots before it's set never
+    // gives it again.
+    UInt32 Take();
+
+    // Record that slot now holds block
+    void Set(UInt32 slot, UInt64 block);
+
+    // Empty all slots
+    void Flush();
+
+private:
+    struct CSlot {
+        UInt64 Block;
+        // Neighbours in the LRU list, most recently used first
+        UInt32 Prev;
+        UInt32 Next;
+        // Next slot in the same hash bucket
+        UInt32 HashNext;
+    };
+
+    CMidAlignedBuffer _data;
+    size_t _blockSize;
+    CRecordVector<CSlot> _slots;
+    CRecordVector<UInt32> _buckets;
+    UInt32 _head;
+    UInt32 _tail;
+
+    void Unlink(UInt32 slot);
+    void PushFront(UInt32 slot);
+    void RemoveHash(UInt32 slot);
+};
+
+} // namespace BlockCache
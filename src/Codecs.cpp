@@ -9,20 +9,50 @@
 #include <C/7zVersion.h>
 #include <CPP/7zip/Archive/IArchive.h>
 #include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/RegisterCodec.h>
 #include <CPP/Common/ComTry.h>
+#include <CPP/Windows/Defs.h>
 
+// Pulls in the interface headers, so it has to come after MyInitGuid.h
+#include "Nested.hpp"
+
+#include <C/Aes.c>
+#include <C/AesOpt.c>
 #include <C/Alloc.c>
+#include <C/CpuArch.c>
+#include <C/LzFind.c>
+#include <C/LzFindMt.c>
+#include <C/LzFindOpt.c>
+#include <C/Lzma2Dec.c>
+#include <C/LzmaDec.c>
+#include <C/Sha1.c>
+#include <C/Sha1Opt.c>
+#include <C/SwapBytes.c>
+#include <C/Threads.c>
+#include <CPP/7zip/Archive/Common/HandlerOut.cpp>
+#include <CPP/7zip/Common/InBuffer.cpp>
 #include <CPP/7zip/Common/LimitedStreams.cpp>
+#include <CPP/7zip/Common/MethodProps.cpp>
 #include <CPP/7zip/Common/ProgressUtils.cpp>
 #include <CPP/7zip/Common/PropId.cpp>
 #include <CPP/7zip/Common/StreamObjects.cpp>
 #include <CPP/7zip/Common/StreamUtils.cpp>
+#include <CPP/7zip/Compress/BZip2Crc.cpp>
+#include <CPP/7zip/Compress/BZip2Decoder.cpp>
 #include <CPP/7zip/Compress/CopyCoder.cpp>
 #include <CPP/Common/IntToString.cpp>
+#include <CPP/Common/LzFindPrepare.cpp>
 #include <CPP/Common/MyString.cpp>
 #include <CPP/Common/StringConvert.cpp>
+#include <CPP/Common/StringToInt.cpp>
 #include <CPP/Common/UTFConvert.cpp>
+#include <CPP/Windows/FileDir.cpp>
+#include <CPP/Windows/FileFind.cpp>
+#include <CPP/Windows/FileIO.cpp>
+#include <CPP/Windows/FileName.cpp>
 #include <CPP/Windows/PropVariant.cpp>
+#include <CPP/Windows/System.cpp>
+#include <CPP/Windows/TimeUtils.cpp>
 
 static const unsigned kNumArcsMax = 72;
 static unsigned g_NumArcs = 0;
@@ -40,6 +70,16 @@ void RegisterArc(const CArcInfo* arcInfo) throw()
     // else throw 1;
 }
 
+static const unsigned kNumCodecsMax = 16;
+static unsigned g_NumCodecs = 0;
+static const CCodecInfo* g_Codecs[kNumCodecsMax];
+
+void RegisterCodec(const CCodecInfo* codecInfo) throw()
+{
+    if (g_NumCodecs < kNumCodecsMax)
+        g_Codecs[g_NumCodecs++] = codecInfo;
+}
+
 Z7_DEFINE_GUID(
     CLSID_CArchiveHandler, k_7zip_GUID_Data1, k_7zip_GUID_Data2,
     k_7zip_GUID_Data3_Common, 0x10, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x00
@@ -60,6 +100,74 @@ static inline HRESULT SetPropGUID(const GUID& guid, PROPVARIANT* value)
     return SetPropStrFromBin((const char*) &guid, sizeof(guid), value);
 }
 
+static void SetPropFromAscii(const char* s, PROPVARIANT* prop)
+{
+    const UINT len = (UINT) strlen(s);
+    BSTR dest = ::SysAllocStringLen(NULL, len);
+    if (dest) {
+        for (UINT i = 0; i <= len; i++)
+            dest[i] = (Byte) s[i];
+        prop->bstrVal = dest;
+        prop->vt = VT_BSTR;
+    }
+}
+
+static HRESULT MethodToClassID(UInt16 typeId, CMethodId id, PROPVARIANT* value)
+{
+    GUID clsId;
+    clsId.Data1 = k_7zip_GUID_Data1;
+    clsId.Data2 = k_7zip_GUID_Data2;
+    clsId.Data3 = typeId;
+    SetUi64(clsId.Data4, id)
+    return SetPropGUID(clsId, value);
+}
+
+static int FindCodecClassId(const GUID* clsid, bool& encode)
+{
+    if (clsid->Data1 != k_7zip_GUID_Data1 ||
+        clsid->Data2 != k_7zip_GUID_Data2)
+        return -1;
+    if (clsid->Data3 == k_7zip_GUID_Data3_Decoder)
+        encode = false;
+    else if (clsid->Data3 == k_7zip_GUID_Data3_Encoder)
+        encode = true;
+    else
+        return -1;
+
+    const UInt64 id = GetUi64(clsid->Data4);
+    for (unsigned i = 0; i < g_NumCodecs; i++) {
+        const CCodecInfo& codec = *g_Codecs[i];
+        if (codec.Id == id &&
+            (encode ? codec.CreateEncoder : codec.CreateDecoder))
+            return (int) i;
+    }
+    return -1;
+}
+
+static HRESULT CreateCoder2(bool encode, UInt32 index, const GUID* iid, void** outObject)
+{
+    *outObject = NULL;
+    if (index >= g_NumCodecs)
+        return E_INVALIDARG;
+    const CCodecInfo& codec = *g_Codecs[index];
+    const CreateCodecP create =
+        encode ? codec.CreateEncoder : codec.CreateDecoder;
+    if (!create)
+        return CLASS_E_CLASSNOTAVAILABLE;
+    // All of the plugin's codecs are single stream coders
+    if (*iid != IID_ICompressCoder)
+        return E_NOINTERFACE;
+
+    COM_TRY_BEGIN
+    void* c = create();
+    if (c) {
+        ((IUnknown*) c)->AddRef();
+        *outObject = c;
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
 static int FindFormatCalssId(const GUID* clsid)
 {
     GUID cls = *clsid;
@@ -73,6 +181,41 @@ static int FindFormatCalssId(const GUID* clsid)
     return -1;
 }
 
+static bool MatchSignature(const CArcInfo& arc, const Byte* p, size_t size)
+{
+    const Byte* sig = arc.Signature;
+    const size_t offset = arc.SignatureOffset;
+    if (!arc.IsMultiSignature())
+        return arc.SignatureSize != 0 && offset + arc.SignatureSize <= size &&
+               memcmp(p + offset, sig, arc.SignatureSize) == 0;
+    for (unsigned i = 0; i < arc.SignatureSize;) {
+        const unsigned len = sig[i++];
+        if (offset + len <= size && memcmp(p + offset, sig + i, len) == 0)
+            return true;
+        i += len;
+    }
+    return false;
+}
+
+// Formats without a signature are never matched, since any data could pass
+// for them
+const CArcInfo* Nested::FindFormat(const Byte* p, size_t size, unsigned& pos)
+{
+    // Containers on the first pass over the table, single file wrappers on
+    // the second
+    for (; pos < g_NumArcs * 2; pos++) {
+        const CArcInfo* arc = g_Arcs[pos % g_NumArcs];
+        const bool isWrapper = (arc->Flags & NArcInfoFlags::kKeepName) != 0;
+        if (isWrapper == (pos < g_NumArcs))
+            continue;
+        if (MatchSignature(*arc, p, size)) {
+            pos++;
+            return arc;
+        }
+    }
+    return NULL;
+}
+
 extern "C" {
 
 __DLLEXPORT
@@ -83,17 +226,74 @@ HRESULT GetModuleProp(PROPID propID, PROPVARIANT* value)
 }
 
 __DLLEXPORT
-HRESULT CreateDecoder(UInt32 index, const GUID* iid, void** outObject)
+HRESULT WINAPI CreateDecoder(UInt32 index, const GUID* iid, void** outObject)
 {
     PRINT("CreateDecoder(%u)\n", index);
-    return 0;
+
+    return CreateCoder2(false, index, iid, outObject);
 }
 
 __DLLEXPORT
-HRESULT CreateEncoder(UInt32 index, const GUID* iid, void** outObject)
+HRESULT WINAPI CreateEncoder(UInt32 index, const GUID* iid, void** outObject)
 {
     PRINT("CreateEncoder(%u)\n", index);
-    return 0;
+
+    return CreateCoder2(true, index, iid, outObject);
+}
+
+__DLLEXPORT
+HRESULT WINAPI GetNumberOfMethods(UInt32* numCodecs)
+{
+    PRINT("GetNumberOfMethods\n");
+
+    *numCodecs = g_NumCodecs;
+    return S_OK;
+}
+
+__DLLEXPORT
+HRESULT WINAPI
+GetMethodProperty(UInt32 codecIndex, PROPID propID, PROPVARIANT* value)
+{
+    PRINT("GetMethodProperty(%u, %lu)\n", codecIndex, propID);
+
+    NWindows::NCOM::PropVariant_Clear(value);
+    if (codecIndex >= g_NumCodecs)
+        return E_INVALIDARG;
+    const CCodecInfo& codec = *g_Codecs[codecIndex];
+    switch (propID) {
+    case NMethodPropID::kID:
+        value->uhVal.QuadPart = (UInt64) codec.Id;
+        value->vt = VT_UI8;
+        break;
+    case NMethodPropID::kName:
+        SetPropFromAscii(codec.Name, value);
+        break;
+    case NMethodPropID::kDecoder:
+        if (codec.CreateDecoder)
+            return MethodToClassID(
+                k_7zip_GUID_Data3_Decoder, codec.Id, value
+            );
+        break;
+    case NMethodPropID::kEncoder:
+        if (codec.CreateEncoder)
+            return MethodToClassID(
+                k_7zip_GUID_Data3_Encoder, codec.Id, value
+            );
+        break;
+    case NMethodPropID::kDecoderIsAssigned:
+        value->vt = VT_BOOL;
+        value->boolVal = BoolToVARIANT_BOOL(codec.CreateDecoder != NULL);
+        break;
+    case NMethodPropID::kEncoderIsAssigned:
+        value->vt = VT_BOOL;
+        value->boolVal = BoolToVARIANT_BOOL(codec.CreateEncoder != NULL);
+        break;
+    case NMethodPropID::kIsFilter:
+        value->vt = VT_BOOL;
+        value->boolVal = BoolToVARIANT_BOOL(codec.IsFilter);
+        break;
+    }
+    return S_OK;
 }
 
 __DLLEXPORT
@@ -135,9 +335,15 @@ CreateObject(const GUID* clsid, const GUID* iid, void** outObject)
 {
     PRINT("CreateObject\n");
 
-    return CreateArchiver(clsid, iid, outObject);
+    if (*iid == IID_ICompressCoder) {
+        bool encode;
+        const int codecIndex = FindCodecClassId(clsid, encode);
+        if (codecIndex < 0)
+            return CLASS_E_CLASSNOTAVAILABLE;
+        return CreateCoder2(encode, (UInt32) codecIndex, iid, outObject);
+    }
 
-    return 0;
+    return CreateArchiver(clsid, iid, outObject);
 }
 
 __DLLEXPORT
@@ -4,13 +4,19 @@
 // This file is part of the mkwcat 7-Zip plugin project.
 
 #include "Darch.hpp"
+#include "ArcData.hpp"
+#include "IndexCache.hpp"
+#include "Nested.hpp"
 #include "Util.hpp"
+#include "Validate.hpp"
 
 #include <C/CpuArch.h>
+#include <C/SwapBytes.h>
 
 #include <CPP/Common/ComTry.h>
 #include <CPP/Common/MyBuffer.h>
 #include <CPP/Common/MyCom.h>
+#include <CPP/Common/MyString.h>
 #include <CPP/Common/UTFConvert.h>
 
 #include <CPP/7zip/Archive/IArchive.h>
@@ -22,32 +28,50 @@
 
 #include <CPP/7zip/Compress/CopyCoder.h>
 
-struct CItem {
-    AString Name;
-    int Parent;
-    bool IsDir;
-    UInt32 Offset;
-    UInt32 Size;
-};
+typedef Darch::CItem CItem;
 
 struct CItemEx : public CItem {
     CByteArr Data;
 };
 
-Z7_CLASS_IMP_CHandler_IInArchive_2(IInArchiveGetStream, IOutArchive)
+Z7_CLASS_IMP_CHandler_IInArchive_5(
+    IArchiveGetRawProps, IArchiveOpenSeq, IInArchiveGetStream, IOutArchive,
+    ISetProperties
+)
 #if CLANG_FORMAT_WORKAROUND
     class CHandler
 {
 #endif
-    CMyComPtr<IInStream> _inStream;
-    CObjectVector<CItem> _items;
+    // Archive data, decoded from a Yaz0 or Yay0 wrapper if there is one
+    ArcData::CSource _source;
+    ArcData::CHandlerProps _handlerProps;
+    CRecordVector<CItem> _items;
     CByteArr _metadata;
-    UInt32 _rootCount;
-    UInt32 _strTabOffset;
     size_t _metadataSize;
 
-    int AddEntry(Byte* entries, int index, int parent, size_t maxSize);
-    HRESULT Open2(IInStream* stream);
+    // Full paths of all items one after another, each NUL terminated. Put
+    // together once a path is asked for, or when an index is saved.
+    CRecordVector<char> _pathArena;
+    CRecordVector<UInt32> _pathOffsets;
+
+    // Archives found among the items, when opening them is turned on
+    Nested::CExpander _nested;
+
+    const char* GetName(const CItem& item) const
+    {
+        return (const char*) (_metadata + item.NameOffset);
+    }
+
+    bool BuildPathArena()
+    {
+        return Darch::BuildPathArena(
+            _items, _metadata, _pathArena, _pathOffsets
+        );
+    }
+
+    HRESULT Open2();
+    bool LoadIndex(const IndexCache::CKey& key);
+    void SaveIndex(const IndexCache::CKey& key);
 };
 
 static const Byte kArcProps[] = {
@@ -65,69 +89,246 @@ IMP_IInArchive_ArcProps;
 
 static const UInt32 kHeaderSize = 0x20;
 
-int CHandler::AddEntry(Byte* entries, int index, int parent, size_t maxSize)
+namespace Darch
+{
+
+// Nodes converted to native byte order at a time. Small enough for the copy
+// to still be in cache when it's split into the field arrays.
+static const UInt32 kSwapChunkNodes = 1 << 10;
+
+static struct CSwapBytesInit {
+    CSwapBytesInit()
+    {
+        z7_SwapBytesPrepare();
+    }
+} g_SwapBytesInit;
+
+// Walks the node table depth first. Each directory node gives the index of
+// the node after its last one. The table is decoded up front into one array
+// per field, so the walk itself reads native integers, and the directories
+// being walked are kept on a stack rather than in the call stack, so that a
+// deeply nested table can't run it out.
+class CNodeParser
 {
-    PRINT("Index %d, parent %d\n", index, parent);
+public:
+    CNodeParser(
+        const Byte* nodes, size_t size, unsigned offsetShift,
+        CRecordVector<CItem>& items
+    )
+      : _nodes(nodes)
+      , _size(size)
+      , _offsetShift(offsetShift)
+      , _items(items)
+      , _numNodes(0)
+      , _strTabOffset(0)
+      , _namesTerminated(false)
+    {
+    }
 
-    if (index >= _rootCount) {
+    // Decode the node table. Returns false if it doesn't fit in the data.
+    bool Init();
+
+    // Add the items of all the nodes, with parent as the root's item.
+    // Returns false if the table is malformed.
+    bool AddEntries(int parent);
+
+private:
+    // A directory whose nodes are still being walked
+    struct CDir {
+        // Index of the node after its last one
+        UInt32 End;
+        // Item the nodes in it go under
+        int Parent;
+    };
+
+    const Byte* _nodes;
+    size_t _size;
+    unsigned _offsetShift;
+    CRecordVector<CItem>& _items;
+    UInt32 _numNodes;
+    UInt32 _strTabOffset;
+
+    // Set if the string table ends in a NUL, so that every name inside it
+    // ends too
+    bool _namesTerminated;
+    CByteArr _types;
+    CObjArray<UInt32> _nameOffsets;
+    CObjArray<UInt32> _dataOffsets;
+    CObjArray<UInt32> _sizes;
+};
+
+bool CNodeParser::Init()
+{
+    // The root's size is the number of nodes, which all have to come before
+    // the string table
+    _numNodes = GetBe32(_nodes + 8);
+    if (_numNodes > _size / 0xC) {
         return false;
     }
+    _strTabOffset = _numNodes * 0xC;
+
+    _types.Alloc(_numNodes);
+    _nameOffsets.Alloc(_numNodes);
+    _dataOffsets.Alloc(_numNodes);
+    _sizes.Alloc(_numNodes);
+    // Every node but the root gives an item
+    _items.Reserve(_items.Size() + _numNodes);
+
+    CObjArray<UInt32> words(MyMin(_numNodes, kSwapChunkNodes) * 3);
+    for (UInt32 first = 0; first < _numNodes; first += kSwapChunkNodes) {
+        const UInt32 count = MyMin(_numNodes - first, kSwapChunkNodes);
+        memcpy(words, _nodes + (size_t) first * 0xC, (size_t) count * 0xC);
+#ifdef MY_CPU_LE
+        z7_SwapBytes4(words, (size_t) count * 3);
+#endif
+        const UInt32* w = words;
+        for (UInt32 i = first; i < first + count; i++, w += 3) {
+            _types[i] = (Byte) (w[0] >> 24);
+            _nameOffsets[i] = w[0] & 0x00FFFFFF;
+            _dataOffsets[i] = w[1];
+            _sizes[i] = w[2];
+        }
+    }
 
-    size_t offset = index * 0xC;
-    if (offset + 0xC > maxSize) {
+    // Check all the nodes before anything is built from them: the type, that
+    // the name starts inside the table, and that a directory doesn't end
+    // past the last node
+    const UInt32 namesSize =
+        (UInt32) MyMin(_size - _strTabOffset, (size_t) 0xFFFFFFFF);
+    if (!Validate::AllBelow(_types, _numNodes, 2) ||
+        !Validate::AllBelow(_nameOffsets, _numNodes, namesSize) ||
+        !Validate::AllBelowWhere(_sizes, _types, 1, _numNodes, _numNodes + 1)) {
         return false;
     }
+    _namesTerminated = _nodes[_size - 1] == 0;
+    return true;
+}
+
+bool CNodeParser::AddEntries(int parent)
+{
+    CRecordVector<CDir> dirs;
+    UInt32 index = 0;
+    do {
+        PRINT("Index %u, parent %d\n", index, parent);
 
-    CItem item;
-    item.Parent = parent;
-    UInt32 stringOffset =
-        _strTabOffset + (GetBe32(entries + offset) & 0x00FFFFFF);
-    // Read file name string
-    UInt32 pos = stringOffset;
-    for (;;) {
-        if (pos >= maxSize)
+        if (index >= _numNodes) {
             return false;
-        const Byte c = entries[pos];
-        if (c == 0)
-            break;
-        pos++;
-    }
-    item.Name.SetFrom(
-        (const char*) (entries + stringOffset), pos - stringOffset
-    );
+        }
 
-    PRINT("str: %s\n", (const char*) (entries + stringOffset));
-
-    if (entries[offset] == 0x00) {
-        item.IsDir = false;
-        item.Offset = GetBe32(entries + offset + 0x4);
-        item.Size = GetBe32(entries + offset + 0x8);
-        _items.Add(item);
-        return index + 1;
-    } else if (entries[offset] == 0x01) {
-        item.IsDir = true;
-        UInt32 subItemEnd = GetBe32(entries + offset + 0x8);
-        if (!item.Name.IsEmpty()) {
-            parent = _items.Size();
-            _items.Add(item);
+        CItem item;
+        item.Parent = parent;
+        const UInt32 stringOffset = _strTabOffset + _nameOffsets[index];
+        // The name has to end inside the table
+        if (!_namesTerminated &&
+            memchr(_nodes + stringOffset, 0, _size - stringOffset) == NULL) {
+            return false;
         }
-        int subIndex = index + 1;
-        for (; (UInt32) subIndex < subItemEnd;) {
-            subIndex = AddEntry(entries, subIndex, parent, maxSize);
-            if (subIndex == -1) {
-                return -1;
+        const bool hasName = _nodes[stringOffset] != 0;
+        item.NameOffset = stringOffset;
+
+        PRINT("str: %s\n", (const char*) (_nodes + stringOffset));
+
+        if (_types[index] == 0x00) {
+            item.IsDir = false;
+            item.Offset = (UInt64) _dataOffsets[index] << _offsetShift;
+            item.Size = _sizes[index];
+            _items.Add(item);
+        } else {
+            item.IsDir = true;
+            item.Offset = 0;
+            item.Size = 0;
+            CDir dir;
+            dir.End = _sizes[index];
+            dir.Parent = parent;
+            // The root's name offset is 0, which in a disc FST is the name
+            // of the first item rather than an empty string
+            if (index != 0 && hasName) {
+                dir.Parent = _items.Size();
+                _items.Add(item);
             }
+            dirs.Add(dir);
         }
-        return subIndex;
-    } else {
-        return -1;
+        index++;
+
+        // A directory ends at its end or at the end of one inside it,
+        // whichever is later
+        while (dirs.Size() != 0 && index >= dirs.Back().End) {
+            dirs.DeleteBack();
+        }
+        if (dirs.Size() != 0) {
+            parent = dirs.Back().Parent;
+        }
+    } while (dirs.Size() != 0);
+    return true;
+}
+
+bool ParseNodes(
+    const Byte* nodes, size_t size, int parent, unsigned offsetShift,
+    CRecordVector<CItem>& items
+)
+{
+    if (size < 0xC || nodes[0] != 0x01) {
+        return false;
+    }
+    CNodeParser parser(nodes, size, offsetShift, items);
+    if (!parser.Init()) {
+        return false;
+    }
+    return parser.AddEntries(parent);
+}
+
+bool BuildPathArena(
+    const CRecordVector<CItem>& items, const Byte* names,
+    CRecordVector<char>& arena, CRecordVector<UInt32>& offsets
+)
+{
+    // A directory always comes before the items in it, so every parent's
+    // path is known by the time it's needed
+    const unsigned count = items.Size();
+    CRecordVector<UInt32> lengths;
+    lengths.ClearAndSetSize(count);
+    offsets.ClearAndSetSize(count);
+    UInt64 total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        const CItem& item = items[i];
+        const char* name = (const char*) (names + item.NameOffset);
+        lengths[i] = (UInt32) strlen(*name == 0 ? "unknown" : name);
+        if (item.Parent >= 0) {
+            lengths[i] += lengths[item.Parent] + 1;
+        }
+        offsets[i] = (UInt32) total;
+        total += lengths[i] + 1;
+        if (total > kPathArenaSizeMax) {
+            offsets.Clear();
+            return false;
+        }
+    }
+
+    arena.ClearAndSetSize(total);
+    for (unsigned i = 0; i < count; i++) {
+        const CItem& item = items[i];
+        char* path = &arena[offsets[i]];
+        if (item.Parent >= 0) {
+            memcpy(path, &arena[offsets[item.Parent]], lengths[item.Parent]);
+            path += lengths[item.Parent];
+            *path++ = CHAR_PATH_SEPARATOR;
+        }
+        const char* name = (const char*) (names + item.NameOffset);
+        strcpy(path, *name == 0 ? "unknown" : name);
     }
+    return true;
 }
 
-HRESULT CHandler::Open2(IInStream* stream)
+} // namespace Darch
+
+// Reads only the header and node table, which U8 places before the file
+// data. With a Yaz0 or Yay0 wrapper only those are decoded here, the file
+// data is decoded once it's extracted.
+HRESULT CHandler::Open2()
 {
     Byte buf[kHeaderSize];
-    RINOK(ReadStream_FALSE(stream, buf, kHeaderSize))
+    RINOK(_source.Read(0, buf, kHeaderSize))
+
     if (GetBe32(buf) != 0x55AA382D) {
         return S_FALSE;
     }
@@ -142,31 +343,105 @@ HRESULT CHandler::Open2(IInStream* stream)
 
     PRINT("OK %d\n", __LINE__);
 
-    RINOK(InStream_SeekSet(stream, entriesOffset))
     _metadata.Alloc(_metadataSize);
-    RINOK(ReadStream_FALSE(stream, &_metadata[0], _metadataSize))
+    RINOK(_source.Read(entriesOffset, &_metadata[0], _metadataSize))
 
     PRINT("OK %d\n", __LINE__);
 
-    if (_metadata[0] != 0x01) {
+    if (!Darch::ParseNodes(_metadata, _metadataSize, -1, 0, _items)) {
         return S_FALSE;
     }
 
-    _rootCount = GetBe32(&_metadata[0x8]);
-    _strTabOffset = _rootCount * 0xC;
+    PRINT("OK %d\n", __LINE__);
+
+    return S_OK;
+}
 
-    if (!AddEntry((Byte*) &_metadata[0], 0, -1, _metadataSize)) {
-        return S_FALSE;
+static const char* const kIndexFormat = "darch";
+
+// Item as stored in the index, without the padding of CItem so that no stray
+// bytes end up in the file
+struct CIndexItem {
+    UInt32 NameOffset;
+    Int32 Parent;
+    UInt32 Offset;
+    UInt32 Size;
+    UInt32 IsDir;
+};
+
+// The index holds the node table for the names and the items and paths
+// built from it
+bool CHandler::LoadIndex(const IndexCache::CKey& key)
+{
+    IndexCache::CReader reader;
+    CRecordVector<CIndexItem> items;
+    bool isOk = reader.Open(_handlerProps.IndexDir, kIndexFormat, key) &&
+                reader.ReadBuffer(_metadata, _metadataSize) &&
+                reader.ReadVector(items) && reader.ReadVector(_pathOffsets) &&
+                reader.ReadVector(_pathArena) &&
+                _pathOffsets.Size() == items.Size() &&
+                (items.Size() == 0 || _pathArena.Back() == 0);
+
+    // The checksum rules out a damaged index, this only makes sure that the
+    // tables fit together. Anything off and the index is taken as stale, so
+    // the archive is parsed again and the index written anew.
+    const bool namesTerminated =
+        isOk && _metadataSize != 0 && _metadata[_metadataSize - 1] == 0;
+    if (isOk) {
+        _items.ClearAndSetSize(items.Size());
+    }
+    for (unsigned i = 0; isOk && i < items.Size(); i++) {
+        const CIndexItem& src = items[i];
+        CItem& item = _items[i];
+        item.NameOffset = src.NameOffset;
+        item.Parent = src.Parent;
+        item.IsDir = src.IsDir != 0;
+        item.Offset = src.Offset;
+        item.Size = src.Size;
+        isOk = src.NameOffset < _metadataSize && src.Parent >= -1 &&
+               src.Parent < (int) i && _pathOffsets[i] < _pathArena.Size() &&
+               (namesTerminated ||
+                memchr(
+                    _metadata + src.NameOffset, 0,
+                    _metadataSize - src.NameOffset
+                ) != NULL);
     }
 
-    PRINT("OK %d\n", __LINE__);
+    if (!isOk) {
+        Close();
+    }
+    return isOk;
+}
 
-    return S_OK;
+void CHandler::SaveIndex(const IndexCache::CKey& key)
+{
+    if (!BuildPathArena()) {
+        return;
+    }
+    CRecordVector<CIndexItem> items;
+    items.ClearAndSetSize(_items.Size());
+    for (unsigned i = 0; i < _items.Size(); i++) {
+        const CItem& src = _items[i];
+        CIndexItem& item = items[i];
+        item.NameOffset = src.NameOffset;
+        item.Parent = src.Parent;
+        item.Offset = (UInt32) src.Offset;
+        item.Size = src.Size;
+        item.IsDir = src.IsDir;
+    }
+
+    IndexCache::CWriter writer;
+    writer.Add(_metadata, _metadataSize);
+    writer.AddVector(items);
+    writer.AddVector(_pathOffsets);
+    writer.AddVector(_pathArena);
+    // Failing to write it only means the next open parses the archive again
+    writer.Save(_handlerProps.IndexDir, kIndexFormat, key);
 }
 
 Z7_COM7F_IMF(CHandler::Open(
     IInStream* stream, const UInt64* /* maxCheckStartPosition */,
-    IArchiveOpenCallback* /* openArchiveCallback */
+    IArchiveOpenCallback* openArchiveCallback
 ))
 {
     PRINT("Open\n");
@@ -174,12 +449,50 @@ Z7_COM7F_IMF(CHandler::Open(
     COM_TRY_BEGIN
     {
         Close();
-        if (Open2(stream) != S_OK) {
+
+        // An index is only used when it's turned on and the host gives the
+        // archive's modification time
+        IndexCache::CKey key;
+        const bool useIndex =
+            !_handlerProps.IndexDir.IsEmpty() &&
+            IndexCache::GetKey(stream, openArchiveCallback, key) == S_OK;
+
+        const bool isIndexed = useIndex && LoadIndex(key);
+
+        if (_source.Open(stream) != S_OK ||
+            (!isIndexed && Open2() != S_OK)) {
             PRINT("Open failure\n");
             return S_FALSE;
         }
-        PRINT("Open ok\n");
-        _inStream = stream;
+        if (useIndex && !isIndexed) {
+            SaveIndex(key);
+        }
+        // The archive itself is fine even if none of its items open
+        if (_nested.Expand(
+                (IInArchive*) this, _items.Size(),
+                _handlerProps.RecurseDepth, _handlerProps.CacheSize
+            ) != S_OK) {
+            _nested.Clear();
+        }
+        PRINT(isIndexed ? "Open from index\n" : "Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::OpenSeq(ISequentialInStream* stream))
+{
+    PRINT("OpenSeq\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (_source.OpenSeq(stream) != S_OK || Open2() != S_OK) {
+            PRINT("OpenSeq failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("OpenSeq ok\n");
     }
     return S_OK;
     COM_TRY_END
@@ -189,10 +502,13 @@ Z7_COM7F_IMF(CHandler::Close())
 {
     PRINT("Close\n");
 
-    _inStream.Release();
+    _nested.Clear();
+    _source.Close();
     _items.Clear();
     _metadata.Free();
     _metadataSize = 0;
+    _pathArena.Clear();
+    _pathOffsets.Clear();
     return S_OK;
 }
 
@@ -200,7 +516,7 @@ Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
 {
     PRINT("GetNumberOfItems\n");
 
-    *numItems = _items.Size();
+    *numItems = _items.Size() + _nested.GetNumItems();
     return S_OK;
 }
 
@@ -215,7 +531,20 @@ Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
         prop = kHeaderSize + _metadataSize;
         break;
     case kpidExtension:
-        prop = "arc";
+        switch (_source.GetWrapper()) {
+        case ArcData::kWrapYaz0:
+            prop = "szs";
+            break;
+        case ArcData::kWrapYay0:
+            prop = "szp";
+            break;
+        default:
+            prop = "arc";
+            break;
+        }
+        break;
+    case kpidIsTree:
+        prop = true;
         break;
     }
     prop.Detach(value);
@@ -224,11 +553,11 @@ Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
 }
 
 static void
-Utf8StringToProp(const AString& s, NWindows::NCOM::CPropVariant& prop)
+Utf8StringToProp(const char* s, NWindows::NCOM::CPropVariant& prop)
 {
-    if (!s.IsEmpty()) {
+    if (*s != 0) {
         UString us;
-        ConvertUTF8ToUnicode(s, us);
+        Convert_UTF8_Buf_To_Unicode(s, strlen(s), us);
         prop = us;
     }
 }
@@ -250,33 +579,28 @@ Z7_COM7F_IMF(
     // PRINT("GetProperty\n");
 
     COM_TRY_BEGIN
+    if (index >= _items.Size()) {
+        return _nested.GetProperty(index, propID, value);
+    }
+
     NWindows::NCOM::CPropVariant prop;
     const CItem& item = _items[index];
 
     switch (propID) {
     case kpidPath: {
-        AString path;
-        unsigned cur = index;
-        for (;;) {
-            const CItem& item2 = _items[cur];
-            if (!path.IsEmpty()) {
-                path.InsertAtFront(CHAR_PATH_SEPARATOR);
-            }
-            if (item2.Name.IsEmpty()) {
-                path.Insert(0, "unknown");
-            } else {
-                path.Insert(0, item2.Name);
-            }
-            cur = (unsigned) item2.Parent;
-            if (item2.Parent < 0)
-                break;
+        if (_pathOffsets.Size() == 0 && !BuildPathArena()) {
+            return E_OUTOFMEMORY;
         }
-
-        PRINT("path: %s\n", &path[0]);
+        const char* path = &_pathArena[_pathOffsets[index]];
+        PRINT("path: %s\n", path);
         Utf8StringToProp(path, prop);
         break;
     }
 
+    case kpidName:
+        Utf8StringToProp(GetName(item), prop);
+        break;
+
     case kpidIsDir:
         prop = _items[index].IsDir;
         break;
@@ -292,6 +616,57 @@ Z7_COM7F_IMF(
     COM_TRY_END
 }
 
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+)
+{
+    if (index >= _items.Size()) {
+        return _nested.GetParent(index, parent, parentType);
+    }
+
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _items[index].Parent;
+    return S_OK;
+}
+
+// Names are handed out straight from the node table for hosts that take UTF-8
+// ones. 7-Zip only takes UTF-16 names here, and gets them from GetProperty
+// otherwise.
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    if (index >= _items.Size()) {
+        return _nested.GetRawProp(index, propID, data, dataSize, propType);
+    }
+
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (propID == kpidName) {
+        const char* name = GetName(_items[index]);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
+
 Z7_COM7F_IMF(CHandler::Extract(
     const UInt32* indices, UInt32 numItems, Int32 testMode,
     IArchiveExtractCallback* extractCallback
@@ -301,64 +676,33 @@ Z7_COM7F_IMF(CHandler::Extract(
 
     COM_TRY_BEGIN
     const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
-    if (allFilesMode)
-        numItems = _items.Size();
-    if (numItems == 0)
-        return S_OK;
-    UInt64 totalSize = 0;
-    UInt32 i;
-    for (i = 0; i < numItems; i++) {
-        const CItem& item = _items[allFilesMode ? i : indices[i]];
-        totalSize += item.Size;
-    }
-    extractCallback->SetTotal(totalSize);
-
-    UInt64 currentTotalSize = 0;
-
-    NCompress::CCopyCoder* copyCoderSpec = new NCompress::CCopyCoder();
-    CMyComPtr<ICompressCoder> copyCoder = copyCoderSpec;
-
-    CLocalProgress* lps = new CLocalProgress;
-    CMyComPtr<ICompressProgressInfo> progress = lps;
-    lps->Init(extractCallback, false);
-
-    CLimitedSequentialInStream* streamSpec = new CLimitedSequentialInStream;
-    CMyComPtr<ISequentialInStream> fileStream(streamSpec);
-    streamSpec->SetStream(_inStream);
-
-    for (i = 0; i < numItems; i++) {
-        lps->InSize = lps->OutSize = currentTotalSize;
-        RINOK(lps->SetCur())
-        CMyComPtr<ISequentialOutStream> realOutStream;
-        const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
-                                       : NArchive::NExtract::NAskMode::kExtract;
-        const UInt32 index = allFilesMode ? i : indices[i];
-        const CItem& item = _items[index];
-        RINOK(extractCallback->GetStream(index, &realOutStream, askMode))
-        currentTotalSize += item.Size;
+    const UInt32 numIndices = allFilesMode ? _items.Size() : numItems;
 
-        if (!testMode && !realOutStream)
-            continue;
-        RINOK(extractCallback->PrepareOperation(askMode))
-        if (testMode) {
-            RINOK(extractCallback->SetOperationResult(
-                NArchive::NExtract::NOperationResult::kOK
-            ))
+    // Items of nested archives come after the archive's own, and are
+    // extracted by the nested handlers once these are done
+    CRecordVector<ArcData::CRange> ranges;
+    for (UInt32 i = 0; i < numIndices; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        if (index >= _items.Size())
             continue;
-        }
-        bool isOk = true;
-        RINOK(InStream_SeekSet(_inStream, item.Offset))
-        streamSpec->Init(item.Size);
-        RINOK(copyCoder->Code(fileStream, realOutStream, NULL, NULL, progress))
-        isOk = (copyCoderSpec->TotalSize == item.Size);
-        realOutStream.Release();
-        RINOK(extractCallback->SetOperationResult(
-            isOk ? NArchive::NExtract::NOperationResult::kOK
-                 : NArchive::NExtract::NOperationResult::kDataError
-        ))
+        const CItem& item = _items[index];
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = item.IsDir ? 0 : item.Offset;
+        range.Size = item.IsDir ? 0 : item.Size;
+        ranges.Add(range);
     }
 
-    return S_OK;
+    auto extractOwn = [&](IArchiveExtractCallback* callback) -> HRESULT {
+        if (ranges.Size() == 0) {
+            return S_OK;
+        }
+        return ArcData::ExtractRanges(_source, ranges, testMode, callback);
+    };
+    return _nested.Extract(
+        indices, numItems, testMode, extractCallback, extractOwn
+    );
     COM_TRY_END
 }
 
@@ -401,20 +745,49 @@ Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
     *stream = NULL;
     COM_TRY_BEGIN
 
+    if (index >= _items.Size()) {
+        return _nested.GetStream(index, stream);
+    }
+
     const CItem& item = _items[index];
     if (item.IsDir == false) {
-        return CreateLimitedInStream(_inStream, item.Offset, item.Size, stream);
+        return _source.GetStream(
+            item.Offset, item.Size, _nested.GetStreamRef(this), stream
+        );
     }
 
     return S_FALSE;
     COM_TRY_END
 }
 
-static const Byte k_Signature[] = {0x55, 0xAA, 0x38, 0x2D};
+// Only the read block size, the index and opening nested archives apply
+// here: there is nothing to decode in parallel, and a Yaz0 or Yay0 wrapped
+// archive has to be held in memory in full
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        HRESULT hres;
+        if (!_handlerProps.SetProperty(names[i], values[i], hres)) {
+            return E_INVALIDARG;
+        }
+        RINOK(hres)
+    }
+    _source.SetBlockSize(_handlerProps.BlockSize);
+    return S_OK;
+}
+
+static const Byte k_Signature[] = {
+    4, 0x55, 0xAA, 0x38, 0x2D, //
+    4, 'Y', 'a', 'z', '0', //
+    4, 'Y', 'a', 'y', '0', //
+};
 
 REGISTER_ARC_I(
-    "darch", "arc u8", NULL, 0xA1, //
+    "darch", "arc u8 szs szp carc", NULL, 0xA1, //
     k_Signature, //
     0, //
-    NArcInfoFlags::kPreArc, 0
+    NArcInfoFlags::kPreArc | NArcInfoFlags::kMultiSignature, 0
 )
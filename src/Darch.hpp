@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Types.h"
+#include <CPP/Common/MyVector.h>
 #include <CPP/Windows/PropVariant.h>
 #include <windows.h>
 
@@ -9,4 +10,36 @@ namespace Darch
 
 NWindows::NCOM::CPropVariant GetProperty(PROPID propId);
 
-}
+// Item of a U8 node table. The GameCube FST has the same layout, so disc
+// images are read with these too.
+struct CItem {
+    // Offset of the NUL terminated name in the node table
+    UInt32 NameOffset;
+    int Parent;
+    bool IsDir;
+    UInt64 Offset;
+    UInt32 Size;
+};
+
+// Add the items of the node table at nodes, with its string table after the
+// nodes. The root node isn't added, the items in it get parent as theirs.
+// File offsets are shifted left by offsetShift, which is 2 in a Wii
+// partition. Returns false if the table is malformed.
+bool ParseNodes(
+    const Byte* nodes, size_t size, int parent, unsigned offsetShift,
+    CRecordVector<CItem>& items
+);
+
+// Most that the paths of all items may take up together. A deeply nested
+// table can make them huge from a few megabytes of nodes.
+static const UInt32 kPathArenaSizeMax = 1 << 28;
+
+// Put together the full path of every item, each NUL terminated one after
+// another in arena. names is what the name offsets are relative to. Returns
+// false, leaving offsets empty, if they'd be more than kPathArenaSizeMax.
+bool BuildPathArena(
+    const CRecordVector<CItem>& items, const Byte* names,
+    CRecordVector<char>& arena, CRecordVector<UInt32>& offsets
+);
+
+} // namespace Darch
@@ -4,7 +4,13 @@
 // This file is part of the mkwcat 7-Zip plugin project.
 
 #include "GFArch.hpp"
+#include "ArcData.hpp"
+#include "IndexCache.hpp"
+#include "Nested.hpp"
+#include "NitroLz.hpp"
+#include "Parallel.hpp"
 #include "Util.hpp"
+#include "Validate.hpp"
 
 #include <C/CpuArch.h>
 
@@ -13,8 +19,11 @@
 #include <CPP/Common/MyCom.h>
 #include <CPP/Common/UTFConvert.h>
 
+#include <CPP/7zip/Archive/Common/HandlerOut.h>
 #include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/InBuffer.h>
 #include <CPP/7zip/Common/LimitedStreams.h>
+#include <CPP/7zip/Common/MethodProps.h>
 #include <CPP/7zip/Common/ProgressUtils.h>
 #include <CPP/7zip/Common/RegisterArc.h>
 #include <CPP/7zip/Common/StreamObjects.h>
@@ -32,12 +41,24 @@ enum CompressionType {
     GFCP_COMP_COUNT,
 };
 
-Z7_CLASS_IMP_CHandler_IInArchive_2(IInArchiveGetStream, IOutArchive)
+// Header fields that the reader doesn't use, written for new archives.
+// Updated archives keep the values they had.
+static const UInt32 kDefaultVersion = 0x300;
+static const UInt32 kDefaultFlags = 1;
+static const UInt32 kDefaultGFCPVersion = 1;
+
+Z7_CLASS_IMP_CHandler_IInArchive_5(
+    IArchiveGetRawProps, IArchiveOpenSeq, IInArchiveGetStream, IOutArchive,
+    ISetProperties
+)
 #if CLANG_FORMAT_WORKAROUND
     class CHandler
 {
 #endif
-    CMyComPtr<IInStream> _inStream;
+    // The header, metadata and GFCP payload are laid out in increasing
+    // offsets, so the archive can also be read front to back from a stream
+    // that can't seek
+    ArcData::CSource _source;
     CByteArr _metadata;
     size_t _metadataSize;
     size_t _metadataOffset;
@@ -50,15 +71,81 @@ Z7_CLASS_IMP_CHandler_IInArchive_2(IInArchiveGetStream, IOutArchive)
     UInt32 _decompressedSize;
     UInt32 _compressedSize;
 
-    CObjectVector<AString> _pathTable;
+    // Header fields the reader doesn't use, kept when updating
+    UInt32 _version;
+    UInt32 _flags;
+    UInt32 _gfcpVersion;
+
+    // Directory each item is in, or -1 for the root. Together with the name
+    // offset in the item's entry this is all that's kept of its path.
+    CRecordVector<int> _parents;
+
+    // Full paths of all items one after another, each NUL terminated. Only
+    // put together once a path is asked for or an index is saved, so hosts
+    // that build the tree from the raw properties never need it.
+    CRecordVector<char> _pathArena;
+    CRecordVector<UInt32> _pathOffsets;
+
+    // Items chained by the name hash stored in their entry, only built in
+    // strict mode where every name is looked up. The table size is a power
+    // of two.
+    CRecordVector<UInt32> _hashHeads;
+    CRecordVector<UInt32> _hashNext;
+
+    // Check name hashes and duplicate names while opening
+    bool _strict;
+    bool _headersError;
+
+    NArchive::CSingleMethodProps _props;
+    ArcData::CHandlerProps _handlerProps;
+
+    // The whole decoded payload of a compressed archive, kept once it's been
+    // decoded if it's no larger than the cache size
+    CByteBuffer _payloadCache;
+    bool _isPayloadCached;
 
-    HRESULT Open2(IInStream* stream);
+    // Archives found among the items, when opening them is turned on
+    Nested::CExpander _nested;
+
+    const char* GetName(UInt32 index) const
+    {
+        return (const char*) (_metadata +
+                              (GetUi32(_metadata + index * 0x10 + 8) &
+                               0x00FFFFFF) -
+                              _metadataOffset);
+    }
+
+    int FindChild(int parent, const char* name, size_t len, UInt32 hash) const;
+    bool BuildPathArena();
+    HRESULT DecodePayload(CByteBuffer& payload);
+    HRESULT CachePayload();
+    HRESULT ReadPayload(CByteBuffer& payload);
+    HRESULT Open2();
+    HRESULT Extract2(
+        const UInt32* indices, UInt32 numItems, Int32 testMode,
+        IArchiveExtractCallback* extractCallback
+    );
+    bool LoadIndex(const IndexCache::CKey& key);
+    void SaveIndex(const IndexCache::CKey& key);
+
+public:
+    CHandler()
+      : _version(kDefaultVersion)
+      , _flags(kDefaultFlags)
+      , _gfcpVersion(kDefaultGFCPVersion)
+      , _strict(false)
+      , _headersError(false)
+      , _isPayloadCached(false)
+    {
+    }
 };
 
 static const Byte kArcProps[] = {
     kpidHeadersSize,
 };
 
+static const UInt32 kNoItem = (UInt32) (Int32) -1;
+
 static const Byte kProps[] = {
     kpidPath,
     kpidIsDir,
@@ -70,17 +157,75 @@ IMP_IInArchive_ArcProps;
 
 static const UInt32 kHeaderSize = 0x1C;
 static const UInt32 kGFCPHeaderSize = 0x14;
+// Most that the paths of all items may take up together
+static const UInt32 kPathArenaSizeMax = 1 << 28;
 
-static UInt32 CalcNameCrc(const char* name)
+static UInt32 CalcNameCrc(const char* name, size_t len)
 {
     UInt32 crc = 0;
-    for (int i = 0; name[i]; i++) {
+    for (size_t i = 0; i < len; i++) {
         crc = name[i] + crc * 137;
     }
     return crc;
 }
 
-HRESULT CHandler::Open2(IInStream* stream)
+int CHandler::FindChild(
+    int parent, const char* name, size_t len, UInt32 hash
+) const
+{
+    for (UInt32 index = _hashHeads[hash & (_hashHeads.Size() - 1)];
+         index != kNoItem; index = _hashNext[index]) {
+        if (GetUi32(_metadata + index * 0x10 + 4) != hash ||
+            _parents[index] != parent) {
+            continue;
+        }
+        const char* name2 = GetName(index);
+        if (memcmp(name2, name, len) == 0 && name2[len] == 0) {
+            return (int) index;
+        }
+    }
+    return -1;
+}
+
+// Returns false, leaving the offsets empty, if the paths would take up more
+// than kPathArenaSizeMax, which deeply nested directories can make them
+bool CHandler::BuildPathArena()
+{
+    // A directory always comes before the items in it, so every parent's
+    // path is known by the time it's needed
+    CRecordVector<UInt32> lengths;
+    lengths.ClearAndSetSize(_itemCount);
+    _pathOffsets.ClearAndSetSize(_itemCount);
+    UInt64 total = 0;
+    for (UInt32 i = 0; i < _itemCount; i++) {
+        const int parent = _parents[i];
+        lengths[i] = (UInt32) strlen(GetName(i));
+        if (parent >= 0) {
+            lengths[i] += lengths[parent] + 1;
+        }
+        _pathOffsets[i] = (UInt32) total;
+        total += lengths[i] + 1;
+        if (total > kPathArenaSizeMax) {
+            _pathOffsets.Clear();
+            return false;
+        }
+    }
+
+    _pathArena.ClearAndSetSize(total);
+    for (UInt32 i = 0; i < _itemCount; i++) {
+        char* path = &_pathArena[_pathOffsets[i]];
+        const int parent = _parents[i];
+        if (parent >= 0) {
+            memcpy(path, &_pathArena[_pathOffsets[parent]], lengths[parent]);
+            path += lengths[parent];
+            *path++ = CHAR_PATH_SEPARATOR;
+        }
+        strcpy(path, GetName(i));
+    }
+    return true;
+}
+
+HRESULT CHandler::Open2()
 {
     _metadataSize = 0;
     _metadataOffset = 0;
@@ -88,12 +233,15 @@ HRESULT CHandler::Open2(IInStream* stream)
     _dataOffset = 0;
     _itemCount = 0;
     _fileCount = 0;
+    _gfcpVersion = kDefaultGFCPVersion;
 
     Byte buf[kHeaderSize];
-    RINOK(ReadStream_FALSE(stream, buf, kHeaderSize))
+    RINOK(_source.Read(0, buf, kHeaderSize))
     if (GetBe32(buf) != 0x47464143) {
         return S_FALSE;
     }
+    _version = GetUi32(buf + 4);
+    _flags = GetUi32(buf + 8);
 
     PRINT("OK %d\n", __LINE__);
 
@@ -105,9 +253,8 @@ HRESULT CHandler::Open2(IInStream* stream)
 
     PRINT("OK %d\n", __LINE__);
 
-    RINOK(InStream_SeekSet(stream, _metadataOffset))
     _metadata.Alloc(_metadataSize);
-    RINOK(ReadStream_FALSE(stream, &_metadata[0], _metadataSize))
+    RINOK(_source.Read(_metadataOffset, &_metadata[0], _metadataSize))
 
     PRINT("OK %d\n", __LINE__);
 
@@ -116,10 +263,24 @@ HRESULT CHandler::Open2(IInStream* stream)
         return S_OK;
     }
 
-    if (count * 0x10 + 4 >= _metadataSize) {
+    if (count > (_metadataSize - 4) / 0x10 ||
+        count * 0x10 + 4 >= _metadataSize) {
         return S_FALSE;
     }
 
+    unsigned numHeads = 0;
+    if (_strict) {
+        numHeads = 16;
+        while (numHeads < count) {
+            numHeads <<= 1;
+        }
+        _hashHeads.ClearAndSetSize(numHeads);
+        for (unsigned i = 0; i < numHeads; i++) {
+            _hashHeads[i] = kNoItem;
+        }
+        _hashNext.ClearAndSetSize(count);
+    }
+
     if (_metadata[_metadataSize - 1] != 0) {
         return S_FALSE;
     }
@@ -133,13 +294,13 @@ HRESULT CHandler::Open2(IInStream* stream)
     PRINT("OK %d\n", __LINE__);
 
     Byte gfcp[kGFCPHeaderSize];
-    RINOK(InStream_SeekSet(stream, _dataOffset))
-    RINOK(ReadStream_FALSE(stream, gfcp, kGFCPHeaderSize))
+    RINOK(_source.Read(_dataOffset, gfcp, kGFCPHeaderSize))
 
     if (GetBe32(gfcp) != 0x47464350) {
         return S_FALSE;
     }
 
+    _gfcpVersion = GetUi32(gfcp + 0x4);
     _compressionType = (CompressionType) GetUi32(gfcp + 0x8);
     _decompressedSize = GetUi32(gfcp + 0xC);
     _compressedSize = GetUi32(gfcp + 0x10);
@@ -152,10 +313,39 @@ HRESULT CHandler::Open2(IInStream* stream)
         return S_FALSE;
     }
 
+    // Check the name offsets and file data ranges of all items at once,
+    // before building anything from them. Directories keep the end of their
+    // items where files keep the data offset, so they're given an empty
+    // range.
+    {
+        CObjArray<UInt32> nameOffsets(count);
+        CObjArray<UInt32> dataOffsets(count);
+        CObjArray<UInt32> sizes(count);
+        for (UInt32 index = 0; index < count; index++) {
+            const Byte* entry = _metadata + index * 0x10 + 4;
+            const UInt32 fileMask = (entry[7] & 0x01) ? 0 : 0xFFFFFFFF;
+            nameOffsets[index] =
+                (GetUi32(entry + 4) & 0x00FFFFFF) - (UInt32) _metadataOffset;
+            dataOffsets[index] =
+                (GetUi32(entry + 0xC) - (UInt32) _dataOffset) & fileMask;
+            sizes[index] = GetUi32(entry + 8) & fileMask;
+        }
+        if (!Validate::AllBelow(nameOffsets, count, (UInt32) _metadataSize)) {
+            return S_FALSE;
+        }
+        // The data isn't needed to list the items, so these only fail on
+        // extraction
+        if (!Validate::AllRangesWithin(
+                dataOffsets, sizes, count, _decompressedSize
+            )) {
+            PRINT("File data out of range\n");
+            _headersError = true;
+        }
+    }
+
     // Verify item list
     CObjectVector<UInt32> dirStack;
-    AString rootName;
-    rootName = "";
+    int parent = -1;
 
     for (UInt32 index = 0; index < count; index++) {
         UInt32 offset = index * 0x10 + 4;
@@ -169,28 +359,31 @@ HRESULT CHandler::Open2(IInStream* stream)
         BYTE flags = nameOffset >> 24;
         nameOffset &= 0x00FFFFFF;
 
-        if (nameOffset < _metadataOffset ||
-            nameOffset >= _metadataOffset + _metadataSize) {
-            return S_FALSE;
-        }
-
         const char* name =
             (const char*) &_metadata[nameOffset - _metadataOffset];
         if (name[0] == 0) {
             return S_FALSE;
         }
 
-        if (CalcNameCrc(name) != nameHash) {
-            PRINT("Name hash mismatch\n");
-            // return S_FALSE;
+        // Games look items up by their hash, so in strict mode make sure
+        // that every item can be found by its name
+        if (_strict) {
+            const size_t nameLen = strlen(name);
+            if (CalcNameCrc(name, nameLen) != nameHash) {
+                PRINT("Name hash mismatch: %s\n", name);
+                _headersError = true;
+            } else if (FindChild(parent, name, nameLen, nameHash) >= 0) {
+                PRINT("Duplicate name: %s\n", name);
+                _headersError = true;
+            }
+            UInt32& head = _hashHeads[nameHash & (numHeads - 1)];
+            _hashNext[index] = head;
+            head = index;
         }
 
-        AString name2;
-        name2 = rootName;
-        name2 += name;
-        _pathTable.Add(name2);
+        _parents.Add(parent);
 
-        PRINT("Name: %s\n", &name2[0]);
+        PRINT("Name: %s\n", name);
 
         if (flags & 0x01) {
             // Directory
@@ -205,8 +398,7 @@ HRESULT CHandler::Open2(IInStream* stream)
                 if (GetUi32(_metadata + dirStack[i] * 0x10 + 4 + 0xC) ==
                     _metadataOffset + offset + 0x10) {
                     found = true;
-                    rootName = _pathTable[dirStack[i]];
-                    rootName += CHAR_PATH_SEPARATOR;
+                    parent = (int) dirStack[i];
 
                     dirStack.Delete(i);
                     break;
@@ -232,9 +424,94 @@ HRESULT CHandler::Open2(IInStream* stream)
     return S_OK;
 }
 
+static const char* const kIndexFormat = "gfarch";
+static const unsigned kNumIndexFields = 11;
+
+// The index holds the header fields, the metadata as it is in the archive,
+// and the parents and paths built from it. Strict mode never uses one, so the
+// hash chains aren't kept.
+bool CHandler::LoadIndex(const IndexCache::CKey& key)
+{
+    IndexCache::CReader reader;
+    UInt64 fields[kNumIndexFields];
+    bool isOk = reader.Open(_handlerProps.IndexDir, kIndexFormat, key) &&
+                reader.Read(fields, sizeof(fields)) &&
+                reader.ReadBuffer(_metadata, _metadataSize) &&
+                reader.ReadVector(_parents) &&
+                reader.ReadVector(_pathOffsets) &&
+                reader.ReadVector(_pathArena);
+    if (isOk) {
+        _version = (UInt32) fields[0];
+        _flags = (UInt32) fields[1];
+        _gfcpVersion = (UInt32) fields[2];
+        _metadataOffset = (size_t) fields[3];
+        _itemCount = (UInt32) fields[4];
+        _fileCount = (UInt32) fields[5];
+        _dataSize = (size_t) fields[6];
+        _dataOffset = (size_t) fields[7];
+        _compressionType = (CompressionType) fields[8];
+        _decompressedSize = (UInt32) fields[9];
+        _compressedSize = (UInt32) fields[10];
+    }
+
+    // The checksum rules out a damaged index, this only makes sure that the
+    // tables fit together. Anything off and the index is taken as stale, so
+    // the archive is parsed again and the index written anew.
+    isOk = isOk && _compressionType < GFCP_COMP_COUNT &&
+           _metadataSize >= 4 && GetUi32(_metadata) == _itemCount &&
+           _itemCount <= (_metadataSize - 4) / 0x10 &&
+           _parents.Size() == _itemCount &&
+           _pathOffsets.Size() == _itemCount &&
+           (_itemCount == 0 ||
+            (_pathArena.Back() == 0 && _metadata[_metadataSize - 1] == 0));
+    for (UInt32 i = 0; isOk && i < _itemCount; i++) {
+        const UInt32 nameOffset =
+            GetUi32(_metadata + i * 0x10 + 8) & 0x00FFFFFF;
+        isOk = _parents[i] >= -1 && _parents[i] < (int) i &&
+               nameOffset >= _metadataOffset &&
+               nameOffset - _metadataOffset < _metadataSize &&
+               _pathOffsets[i] < _pathArena.Size();
+    }
+
+    if (!isOk) {
+        Close();
+    }
+    return isOk;
+}
+
+void CHandler::SaveIndex(const IndexCache::CKey& key)
+{
+    if (_itemCount != 0 && !BuildPathArena()) {
+        return;
+    }
+
+    const UInt64 fields[kNumIndexFields] = {
+        _version,
+        _flags,
+        _gfcpVersion,
+        _metadataOffset,
+        _itemCount,
+        _fileCount,
+        _dataSize,
+        _dataOffset,
+        (UInt64) _compressionType,
+        _decompressedSize,
+        _compressedSize,
+    };
+
+    IndexCache::CWriter writer;
+    writer.Add(fields, sizeof(fields));
+    writer.Add(_metadata, _metadataSize);
+    writer.AddVector(_parents);
+    writer.AddVector(_pathOffsets);
+    writer.AddVector(_pathArena);
+    // Failing to write it only means the next open parses the archive again
+    writer.Save(_handlerProps.IndexDir, kIndexFormat, key);
+}
+
 Z7_COM7F_IMF(CHandler::Open(
     IInStream* stream, const UInt64* /* maxCheckStartPosition */,
-    IArchiveOpenCallback* /* openArchiveCallback */
+    IArchiveOpenCallback* openArchiveCallback
 ))
 {
     PRINT("Open\n");
@@ -242,12 +519,58 @@ Z7_COM7F_IMF(CHandler::Open(
     COM_TRY_BEGIN
     {
         Close();
-        if (Open2(stream) != S_OK) {
+
+        // An index is only used when it's turned on and the host gives the
+        // archive's modification time. Strict mode always parses, since
+        // checking the names is what it's asked for.
+        IndexCache::CKey key;
+        const bool useIndex =
+            !_handlerProps.IndexDir.IsEmpty() && !_strict &&
+            IndexCache::GetKey(stream, openArchiveCallback, key) == S_OK;
+
+        const bool isIndexed = useIndex && LoadIndex(key);
+
+        if (_source.Open(stream) != S_OK ||
+            (!isIndexed && Open2() != S_OK)) {
             PRINT("Open failure\n");
             return S_FALSE;
         }
-        PRINT("Open ok\n");
-        _inStream = stream;
+        // An index is loaded without the checks, so one isn't kept for an
+        // archive they found problems in
+        if (useIndex && !isIndexed && !_headersError) {
+            SaveIndex(key);
+        }
+        // The archive itself is fine even if none of its items open. A payload
+        // too large for the cache is decoded from the start for every
+        // stream, so the items are probed in one pass instead.
+        const bool probeInOnePass =
+            _compressionType != GFCP_NONE && !_source.IsSeq() &&
+            _decompressedSize > _handlerProps.CacheSize;
+        if (_nested.Expand(
+                (IInArchive*) this, _itemCount, _handlerProps.RecurseDepth,
+                _handlerProps.CacheSize, probeInOnePass
+            ) != S_OK) {
+            _nested.Clear();
+        }
+        PRINT(isIndexed ? "Open from index\n" : "Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::OpenSeq(ISequentialInStream* stream))
+{
+    PRINT("OpenSeq\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (_source.OpenSeq(stream) != S_OK || Open2() != S_OK) {
+            PRINT("OpenSeq failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("OpenSeq ok\n");
     }
     return S_OK;
     COM_TRY_END
@@ -257,9 +580,20 @@ Z7_COM7F_IMF(CHandler::Close())
 {
     PRINT("Close\n");
 
-    _inStream.Release();
+    _nested.Clear();
+    _source.Close();
+    _version = kDefaultVersion;
+    _flags = kDefaultFlags;
+    _gfcpVersion = kDefaultGFCPVersion;
     _metadata.Free();
-    _pathTable.Clear();
+    _pathArena.Clear();
+    _pathOffsets.Clear();
+    _parents.Clear();
+    _hashHeads.Clear();
+    _hashNext.Clear();
+    _payloadCache.Free();
+    _isPayloadCached = false;
+    _headersError = false;
     _metadataSize = 0;
     return S_OK;
 }
@@ -268,7 +602,7 @@ Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
 {
     PRINT("GetNumberOfItems\n");
 
-    *numItems = _itemCount;
+    *numItems = _itemCount + _nested.GetNumItems();
     return S_OK;
 }
 
@@ -285,22 +619,20 @@ Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
     case kpidExtension:
         prop = "gfa";
         break;
+    case kpidIsTree:
+        prop = true;
+        break;
+    case kpidWarningFlags:
+        if (_headersError) {
+            prop = (UInt32) kpv_ErrorFlags_HeadersError;
+        }
+        break;
     }
     prop.Detach(value);
     return S_OK;
     COM_TRY_END
 }
 
-static void
-Utf8StringToProp(const AString& s, NWindows::NCOM::CPropVariant& prop)
-{
-    if (!s.IsEmpty()) {
-        UString us;
-        ConvertUTF8ToUnicode(s, us);
-        prop = us;
-    }
-}
-
 Z7_COM7F_IMF(
     CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
 )
@@ -308,18 +640,32 @@ Z7_COM7F_IMF(
     // PRINT("GetProperty\n");
 
     COM_TRY_BEGIN
-    NWindows::NCOM::CPropVariant prop;
     if (index >= _itemCount) {
-        return S_FALSE;
+        return _nested.GetProperty(index, propID, value);
     }
 
+    NWindows::NCOM::CPropVariant prop;
+
     UInt32 offset = index * 0x10 + 4;
 
     switch (propID) {
     case kpidPath: {
-        AString path = _pathTable[index];
-        PRINT("Path: %s\n", &path[0]);
-        Utf8StringToProp(path, prop);
+        if (_pathOffsets.Size() == 0 && !BuildPathArena()) {
+            return E_OUTOFMEMORY;
+        }
+        const char* path = &_pathArena[_pathOffsets[index]];
+        PRINT("Path: %s\n", path);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(path, strlen(path), us);
+        prop = us;
+        break;
+    }
+
+    case kpidName: {
+        const char* name = GetName(index);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(name, strlen(name), us);
+        prop = us;
         break;
     }
 
@@ -338,378 +684,989 @@ Z7_COM7F_IMF(
     COM_TRY_END
 }
 
-struct OutputListEntry {
-    size_t offset;
-    size_t size;
-    UInt32 index;
-    bool skip;
-    bool open;
-    CMyComPtr<ISequentialOutStream> outStream;
-};
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
 
-#define LOGTHING PRINT("Skip: %d\n", outputs[0].skip);
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
 
-/* Decompress data from input to output */
-static HRESULT CopyDecodeBPE(
-    ISequentialInStream* inStream, UInt32 decompSize, OutputListEntry* outputs,
-    size_t outputCount, IArchiveExtractCallback* extractCallback,
-    ICompressProgressInfo* progress, UInt32 askMode
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
 )
 {
-    LOGTHING
-
-    unsigned char left[256], right[256], stack[256];
-    short int c, count, i, size;
-
-    UInt64 totalSize = 0;
+    if (index >= _itemCount) {
+        return _nested.GetParent(index, parent, parentType);
+    }
 
-    auto getByte = [&]() -> int {
-        unsigned char b;
-        if (inStream->Read(&b, 1, NULL) != S_OK) {
-            return EOF;
-        }
-        return b;
-    };
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _parents[index];
+    return S_OK;
+}
 
-    class COperation
-    {
-    public:
-        COperation(IArchiveExtractCallback* extractCallback)
-        {
-            _extractCallback = extractCallback;
-            _result = extractCallback->PrepareOperation(
-                NArchive::NExtract::NAskMode::kExtract
-            );
-            if (_result == S_OK) {
-                _hasOperation = true;
-            }
-        }
+// Names as they are in the metadata, for hosts that take UTF-8 ones. 7-Zip
+// asks GetProperty for kpidName instead.
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    if (index >= _itemCount) {
+        return _nested.GetRawProp(index, propID, data, dataSize, propType);
+    }
 
-        ~COperation()
-        {
-            if (_result == S_OK && _hasOperation) {
-                _result = _extractCallback->SetOperationResult(
-                    NArchive::NExtract::NOperationResult::kDataError
-                );
-            }
-        }
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
 
-        HRESULT PrepareOperation(UInt32 askMode)
-        {
-            if (_result != S_OK) {
-                return _result;
-            }
-            if (_hasOperation) {
-                RINOK(EndOperation(NArchive::NExtract::NOperationResult::kOK));
-            }
-            _result = _extractCallback->PrepareOperation(askMode);
-            if (_result == S_OK) {
-                _hasOperation = true;
-            }
-            return _result;
-        }
+    if (propID == kpidName) {
+        const char* name = GetName(index);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
 
-        HRESULT EndOperation(int result)
-        {
-            if (_result == S_OK) {
-                _result = _extractCallback->SetOperationResult(result);
-                if (_result == S_OK) {
-                    _hasOperation = false;
-                }
-            }
-            return _result;
-        }
+// Byte pair encoding as used by GFCP. The payload is a series of blocks, each
+// made of a pair table and the packed bytes. Decoding can stop after any
+// output byte and pick up again on the next call, so the payload is decoded
+// in small pieces rather than as a whole.
+class CBpeDecoder
+{
+public:
+    void Init()
+    {
+        _stackSize = 0;
+        _blockRem = 0;
+    }
 
-        IArchiveExtractCallback* _extractCallback;
-        bool _hasOperation = false;
-        HRESULT _result;
-    };
+    // Decode up to size bytes to out. processed is less than size only if
+    // the input ended. Returns S_FALSE if the data is corrupt.
+    HRESULT Decode(CInBuffer& in, Byte* out, size_t size, size_t& processed);
 
-    COperation operation(extractCallback);
-    RINOK(operation._result)
+private:
+    bool ReadTable(CInBuffer& in, unsigned count);
 
-    /* Unpack each block until end of file */
-    while ((count = getByte()) != EOF) {
+    Byte _left[256];
+    Byte _right[256];
+    Byte _stack[256];
+    unsigned _stackSize;
+    UInt32 _blockRem;
+};
 
-        /* Set left to itself as literal flag */
-        for (i = 0; i < 256; i++)
-            left[i] = i;
+bool CBpeDecoder::ReadTable(CInBuffer& in, unsigned count)
+{
+    // A byte that maps to itself is a literal
+    for (unsigned i = 0; i < 256; i++) {
+        _left[i] = (Byte) i;
+    }
 
-        /* Read pair table */
-        for (c = 0;;) {
+    for (unsigned c = 0;;) {
+        // Skip a run of literal bytes
+        if (count > 127) {
+            c += count - 127;
+            count = 0;
+        }
+        if (c == 256) {
+            break;
+        }
 
-            /* Skip range of literal bytes */
-            if (count > 127) {
-                c += count - 127;
-                count = 0;
+        // Read pairs, there is no right byte for a literal
+        for (unsigned i = 0; i <= count; i++, c++) {
+            Byte b;
+            if (c >= 256 || !in.ReadByte(b)) {
+                return false;
             }
-            if (c == 256)
-                break;
-
-            if (c > 256) {
-                PRINT("Invalid byte %d %lld\n", __LINE__, totalSize);
-                return S_FALSE;
+            _left[c] = b;
+            if (b != c && !in.ReadByte(_right[c])) {
+                return false;
             }
+        }
+        if (c == 256) {
+            break;
+        }
 
-            /* Read pairs, skip right if literal */
-            for (i = 0; i <= count; i++, c++) {
-                int n = getByte();
-                if (n == EOF) {
-                    PRINT("Unexpected EOF\n");
-                    return S_FALSE;
-                }
+        Byte b;
+        if (!in.ReadByte(b)) {
+            return false;
+        }
+        count = b;
+    }
 
-                left[c] = n;
-                if (c != left[c]) {
-                    n = getByte();
-                    if (n == EOF) {
-                        PRINT("Unexpected EOF\n");
-                        return S_FALSE;
-                    }
+    Byte hi, lo;
+    if (!in.ReadByte(hi) || !in.ReadByte(lo)) {
+        return false;
+    }
+    _blockRem = ((UInt32) hi << 8) | lo;
+    return true;
+}
 
-                    right[c] = n;
+HRESULT
+CBpeDecoder::Decode(CInBuffer& in, Byte* out, size_t size, size_t& processed)
+{
+    size_t pos = 0;
+    HRESULT res = S_OK;
+    while (pos < size) {
+        unsigned c;
+        if (_stackSize != 0) {
+            c = _stack[--_stackSize];
+        } else {
+            Byte b;
+            if (_blockRem == 0) {
+                // The input may only end between blocks
+                if (!in.ReadByte(b)) {
+                    break;
                 }
+                if (!ReadTable(in, b)) {
+                    res = S_FALSE;
+                    break;
+                }
+                continue;
             }
-            if (c == 256)
+            if (!in.ReadByte(b)) {
+                res = S_FALSE;
                 break;
-            if (c > 256) {
-                PRINT("Invalid byte %d\n", __LINE__);
-                return S_FALSE;
-            }
-            count = getByte();
-            if (count == EOF) {
-                PRINT("Unexpected EOF\n");
-                return S_FALSE;
             }
+            _blockRem--;
+            c = b;
         }
 
-        /* Calculate packed data block size */
-        int n = getByte();
-        if (n == EOF) {
-            PRINT("Unexpected EOF\n");
-            return S_FALSE;
-        }
-        size = 256 * n;
-        n = getByte();
-        if (n == EOF) {
-            PRINT("Unexpected EOF\n");
-            return S_FALSE;
+        if (_left[c] == c) {
+            out[pos++] = (Byte) c;
+            continue;
         }
-        size += n;
-
-        /* Unpack data block */
-        for (i = 0;;) {
 
-            /* Pop byte from stack or read byte */
-            if (i > 0)
-                c = stack[--i];
-            else {
-                if (!size--)
-                    break;
-                c = getByte();
-                if (c == EOF) {
-                    PRINT("Unexpected EOF\n");
-                    return S_FALSE;
-                }
-            }
+        // Expand the pair, left byte first
+        if (_stackSize + 2 > 256) {
+            res = S_FALSE;
+            break;
+        }
+        _stack[_stackSize++] = _right[c];
+        _stack[_stackSize++] = _left[c];
+    }
+    processed = pos;
+    return res;
+}
 
-            /* Output byte or push pair on stack */
-            if (c >= 256) {
-                PRINT("Invalid byte %d\n", __LINE__);
-                return S_FALSE;
+// Size of the BPE block at the start of p, pair table included, or 0 if it
+// runs past size or the table is invalid
+static size_t GetBpeBlockSize(const Byte* p, size_t size)
+{
+    size_t pos = 0;
+    if (size == 0) {
+        return 0;
+    }
+    unsigned count = p[pos++];
+    for (unsigned c = 0;;) {
+        if (count > 127) {
+            c += count - 127;
+            count = 0;
+        }
+        if (c == 256) {
+            break;
+        }
+        for (unsigned i = 0; i <= count; i++, c++) {
+            if (c >= 256 || pos >= size) {
+                return 0;
             }
-            if (c == left[c]) {
-                for (size_t o = 0; o < outputCount; o++) {
-                    if (totalSize >= outputs[o].offset &&
-                        totalSize < outputs[o].offset + outputs[o].size) {
-                        if (!outputs[o].open) {
-                            // End current operation to start a new one
-                            PRINT("End operation\n");
-                            RINOK(operation.EndOperation(
-                                NArchive::NExtract::NOperationResult::kOK
-                            ))
-
-                            RINOK(extractCallback->GetStream(
-                                outputs[o].index, &outputs[o].outStream,
-                                outputs[o].skip
-                                    ? NArchive::NExtract::NAskMode::kSkip
-                                    : NArchive::NExtract::NAskMode::kExtract
-                            ))
-                            outputs[o].open = true;
-                            auto mode =
-                                outputs[o].outStream
-                                    ? askMode
-                                    : NArchive::NExtract::NAskMode::kSkip;
-                            RINOK(operation.PrepareOperation(mode))
-                            if (mode == NArchive::NExtract::NAskMode::kSkip) {
-                                PRINT(
-                                    "Skip operation %u %d\n", outputs[o].index,
-                                    (int) outputs[o].skip
-                                );
-                            } else {
-                                PRINT(
-                                    "New operation %u %d\n", outputs[o].index,
-                                    (int) outputs[o].skip
-                                );
-                            }
-                        }
-
-                        if (outputs[o].outStream) {
-                            char data = c;
-                            outputs[o].outStream->Write(&data, 1, NULL);
-                        }
-                    }
-
-                    if (outputs[o].open &&
-                        totalSize + 1 >= outputs[o].offset + outputs[o].size) {
-                        // Open but not in range, so close it
-                        PRINT("End operation for close\n");
-
-                        if (outputs[o].outStream) {
-                            outputs[o].outStream.Release();
-                        }
-
-                        RINOK(operation.EndOperation(
-                            NArchive::NExtract::NOperationResult::kOK
-                        ))
-
-                        outputs[o].open = false;
-                        outputs[o].outStream = nullptr;
-                    }
-                }
-
-                totalSize++;
-                if (totalSize >= decompSize) {
-                    return S_OK;
-                }
-
-                if (progress && (totalSize & (((UInt32) 1 << 8) - 1)) == 0) {
-                    RINOK(progress->SetRatioInfo(&totalSize, &totalSize))
-                }
-            } else {
-                if (c >= 256 || i + 2 >= 256) {
-                    PRINT("Invalid byte %d\n", __LINE__);
-                    return S_FALSE;
-                }
-
-                stack[i++] = right[c];
-                stack[i++] = left[c];
+            if (p[pos++] != c && pos++ >= size) {
+                return 0;
             }
         }
+        if (c == 256) {
+            break;
+        }
+        if (pos >= size) {
+            return 0;
+        }
+        count = p[pos++];
     }
 
-    PRINT("Unexpected EOF\n");
-    return S_FALSE;
+    if (size - pos < 2) {
+        return 0;
+    }
+    const size_t n = GetBe16(p + pos);
+    pos += 2;
+    return n <= size - pos ? pos + n : 0;
 }
 
-Z7_COM7F_IMF(CHandler::Extract(
-    const UInt32* indices, UInt32 numItems, Int32 testMode,
-    IArchiveExtractCallback* extractCallback
-))
-{
-    PRINT("Extract\n");
+// Packed bytes decoded by one job in multi-threaded mode
+static const size_t kBpeDecodeJobSize = 1 << 18;
 
-    if (_compressionType == GFCP_NONE) {
-        return S_FALSE;
+// Blocks don't depend on each other, so the payload is cut at block
+// boundaries and the pieces are decoded on their own, then joined in order.
+// Returns S_FALSE if the data is corrupt or doesn't decode to exactly
+// unpackSize bytes.
+static HRESULT DecodeBpeParallel(
+    const Byte* packed, size_t packSize, Byte* out, size_t unpackSize,
+    UInt32 numThreads
+)
+{
+    if (packSize == 0) {
+        return unpackSize == 0 ? S_OK : S_FALSE;
     }
 
-    COM_TRY_BEGIN
-    OutputListEntry* outputs = new OutputListEntry[_itemCount];
-    for (UInt32 i = 0; i < _itemCount; i++) {
-        Byte* offset = _metadata + i * 0x10 + 0x4;
-        if (GetUi32(offset + 0x4) & 0x01000000) {
-            // Skip directories
-            outputs[i] = {
-                .offset = 0,
-                .size = 0,
-                .index = i,
-                .skip = true,
-                .open = false,
-                .outStream = nullptr,
-            };
-            continue;
+    CRecordVector<size_t> jobStarts;
+    jobStarts.Add(0);
+    for (size_t pos = 0; pos < packSize;) {
+        const size_t n = GetBpeBlockSize(packed + pos, packSize - pos);
+        if (n == 0) {
+            return S_FALSE;
+        }
+        pos += n;
+        if (pos - jobStarts.Back() >= kBpeDecodeJobSize && pos < packSize) {
+            jobStarts.Add(pos);
         }
-
-        outputs[i] = {
-            .offset = GetUi32(offset + 0xC) - _dataOffset,
-            .size = GetUi32(offset + 0x8),
-            .index = i,
-            .skip = true,
-            .open = false,
-            .outStream = nullptr,
-        };
-
-        PRINT("File %d: %zu %zu\n", i, outputs[i].offset, outputs[i].size);
     }
-
-    LOGTHING
-
-    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
-    if (allFilesMode)
-        numItems = _itemCount;
-    UInt64 totalSize = 0;
-    UInt32 realItemCount = 0;
-    UInt32 i;
-    for (i = 0; i < numItems; i++) {
-        const UInt32 index = allFilesMode ? i : indices[i];
-        PRINT("Extract Index: %d\n", index);
-        if (index >= _itemCount) {
-            return S_FALSE;
+    jobStarts.Add(packSize);
+    const unsigned numJobs = jobStarts.Size() - 1;
+
+    CObjArray<CByteBuffer> bufs(numJobs);
+    CRecordVector<size_t> sizes;
+    sizes.ClearAndSetSize(numJobs);
+
+    auto decodeJob = [&](UInt32 index) -> HRESULT {
+        const size_t start = jobStarts[index];
+        const size_t size = jobStarts[index + 1] - start;
+        CBufInStream* inSpec = new CBufInStream;
+        CMyComPtr<ISequentialInStream> inStream = inSpec;
+        inSpec->Init(packed + start, size);
+        CInBuffer in;
+        if (!in.Create(1 << 16)) {
+            return E_OUTOFMEMORY;
         }
-
-        outputs[index].skip = false;
-
-        Byte* offset = _metadata + index * 0x10 + 4;
-        if (GetUi32(offset + 4) & 0x01000000) {
-            // Skip directories
-            continue;
+        in.SetStream(inStream);
+        in.Init();
+
+        // The decoded size isn't known up front, the buffer grows as needed
+        CBpeDecoder decoder;
+        decoder.Init();
+        CByteBuffer& buf = bufs[index];
+        buf.Alloc(size * 4);
+        size_t pos = 0;
+        for (;;) {
+            size_t processed;
+            RINOK(decoder.Decode(in, buf + pos, buf.Size() - pos, processed))
+            pos += processed;
+            if (pos != buf.Size()) {
+                break;
+            }
+            if (pos > unpackSize) {
+                return S_FALSE;
+            }
+            buf.ChangeSize_KeepData(pos * 2, pos);
         }
+        sizes[index] = pos;
+        return S_OK;
+    };
+    RINOK(Parallel::For(numThreads, numJobs, decodeJob))
 
-        if (outputs[index].offset + outputs[index].size > totalSize) {
-            totalSize = outputs[index].offset + outputs[index].size;
+    size_t pos = 0;
+    for (unsigned i = 0; i < numJobs; i++) {
+        if (sizes[i] > unpackSize - pos) {
+            return S_FALSE;
         }
-
-        realItemCount++;
+        memcpy(out + pos, bufs[i], sizes[i]);
+        pos += sizes[i];
     }
+    return pos == unpackSize ? S_OK : S_FALSE;
+}
 
-    LOGTHING
-
-    extractCallback->SetTotal(totalSize);
-    if (totalSize > _decompressedSize) {
-        PRINT("Invalid total size\n");
-        return S_FALSE;
+// Input bytes per BPE block. Smaller blocks leave more byte values unused
+// that can stand in for pairs; the packed size of a block must fit in 16 bits.
+static const size_t kBpeBlockSize = 0x2000;
+// Most a block can grow by: the pair table and the packed size
+static const size_t kBpeMaxBlockOverhead = 256 * 3 + 2;
+// Input encoded by one job in multi-threaded mode
+static const size_t kBpeChunkSize = 1 << 19;
+// A pair that occurs fewer times doesn't pay for its table entry
+static const unsigned kBpeMinPairCount = 4;
+// Stack depth needed to expand a block is kept within what the reference
+// expander has room for
+static const unsigned kBpeMaxStack = 30;
+
+class CBpeEncoder
+{
+public:
+    CBpeEncoder()
+      : _counts(1 << 16)
+    {
+        memset(_counts, 0, (1 << 16) * sizeof(UInt16));
     }
 
-    CLocalProgress* lps = new CLocalProgress;
-    CMyComPtr<ICompressProgressInfo> progress = lps;
-    lps->Init(extractCallback, false);
-
-    CLimitedSequentialInStream* streamSpec = new CLimitedSequentialInStream;
-    CMyComPtr<ISequentialInStream> fileStream(streamSpec);
-    streamSpec->SetStream(_inStream);
+    // Encode a block of at most kBpeBlockSize bytes to dest, which must have
+    // room for size + kBpeMaxBlockOverhead bytes. Returns the encoded size.
+    size_t EncodeBlock(const Byte* src, size_t size, Byte* dest);
 
-    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
-                                   : NArchive::NExtract::NAskMode::kExtract;
+private:
+    unsigned GetPairStack(unsigned a, unsigned b) const
+    {
+        // The pair is pushed as two entries, then the left one is expanded
+        // on top of the right one
+        unsigned n = _stack[b];
+        if (n < 1u + _stack[a]) {
+            n = 1u + _stack[a];
+        }
+        return n < 2 ? 2 : n;
+    }
 
-    RINOK(InStream_SeekSet(_inStream, _dataOffset + kGFCPHeaderSize));
-    streamSpec->Init(_decompressedSize);
+    CObjArray<UInt16> _counts;
+    Byte _buf[kBpeBlockSize];
+    Byte _left[256];
+    Byte _right[256];
+    Byte _stack[256];
+};
 
-    PRINT("Decompressing %llu bytes\n", totalSize);
-    bool isOk = CopyDecodeBPE(
-                    fileStream, totalSize, outputs, _itemCount, extractCallback,
-                    progress, askMode
-                ) == S_OK;
-    PRINT("Decompressing done: %d\n", isOk);
+size_t CBpeEncoder::EncodeBlock(const Byte* src, size_t size, Byte* dest)
+{
+    memcpy(_buf, src, size);
+    size_t n = size;
 
-    for (i = 0; i < realItemCount; i++) {
-        if (outputs[i].outStream) {
-            outputs[i].outStream.Release();
-        }
+    bool used[256] = {};
+    for (size_t i = 0; i < n; i++) {
+        used[_buf[i]] = true;
+    }
+    for (unsigned c = 0; c < 256; c++) {
+        _left[c] = (Byte) c;
+        _stack[c] = 0;
     }
 
-    delete[] outputs;
+    // Replace the most common pair with an unused byte value until either
+    // runs out
+    unsigned nextCode = 256;
+    for (;;) {
+        while (nextCode != 0 && used[nextCode - 1]) {
+            nextCode--;
+        }
+        if (nextCode == 0 || n < 2) {
+            break;
+        }
+
+        unsigned best = 0, bestPair = 0;
+        for (size_t i = 0; i + 1 < n; i++) {
+            const unsigned pair = ((unsigned) _buf[i] << 8) | _buf[i + 1];
+            const unsigned count = ++_counts[pair];
+            if (count > best &&
+                GetPairStack(_buf[i], _buf[i + 1]) <= kBpeMaxStack) {
+                best = count;
+                bestPair = pair;
+            }
+        }
+        for (size_t i = 0; i + 1 < n; i++) {
+            _counts[((unsigned) _buf[i] << 8) | _buf[i + 1]] = 0;
+        }
+        if (best < kBpeMinPairCount) {
+            break;
+        }
+
+        const unsigned code = --nextCode;
+        const Byte a = (Byte) (bestPair >> 8), b = (Byte) bestPair;
+        _left[code] = a;
+        _right[code] = b;
+        _stack[code] = (Byte) GetPairStack(a, b);
+        used[code] = true;
+
+        size_t j = 0;
+        for (size_t i = 0; i < n;) {
+            if (_buf[i] == a && i + 1 < n && _buf[i + 1] == b) {
+                _buf[j++] = (Byte) code;
+                i += 2;
+            } else {
+                _buf[j++] = _buf[i++];
+            }
+        }
+        n = j;
+    }
+
+    // Pair table. A count above 127 skips that many minus 127 literals and
+    // is followed by a single entry, otherwise count + 1 entries follow.
+    Byte* p = dest;
+    for (unsigned c = 0; c < 256;) {
+        unsigned run = 0;
+        while (run < 128 && c + run < 256 && _left[c + run] == c + run) {
+            run++;
+        }
+        unsigned numEntries = 1;
+        if (run != 0) {
+            *p++ = (Byte) (run + 127);
+            c += run;
+            if (c == 256) {
+                break;
+            }
+        } else {
+            while (numEntries < 128 && c + numEntries < 256 &&
+                   _left[c + numEntries] != c + numEntries) {
+                numEntries++;
+            }
+            *p++ = (Byte) (numEntries - 1);
+        }
+        for (; numEntries != 0; numEntries--, c++) {
+            *p++ = _left[c];
+            if (_left[c] != c) {
+                *p++ = _right[c];
+            }
+        }
+    }
+
+    *p++ = (Byte) (n >> 8);
+    *p++ = (Byte) n;
+    memcpy(p, _buf, n);
+    return (size_t) (p - dest) + n;
+}
+
+// Encoded payload, split into chunks that were encoded independently
+struct CPackChunks {
+    CObjArray<CByteBuffer> Bufs;
+    CRecordVector<size_t> Sizes;
+    UInt64 TotalSize;
+};
+
+static HRESULT EncodeBpe(
+    const Byte* data, size_t size, UInt32 numThreads, CPackChunks& chunks,
+    ICompressProgressInfo* progress
+)
+{
+    const size_t numChunks = (size + kBpeChunkSize - 1) / kBpeChunkSize;
+    chunks.Bufs.Alloc(numChunks);
+    chunks.Sizes.ClearAndSetSize((unsigned) numChunks);
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+
+    UInt64 inProcessed = 0;
+    auto encodeChunk = [&](UInt32 index) -> HRESULT {
+        const size_t start = (size_t) index * kBpeChunkSize;
+        size_t end = start + kBpeChunkSize;
+        if (end > size) {
+            end = size;
+        }
+        const size_t numBlocks = (end - start + kBpeBlockSize - 1) /
+                                 kBpeBlockSize;
+        CByteBuffer& buf = chunks.Bufs[index];
+        buf.Alloc(end - start + numBlocks * kBpeMaxBlockOverhead);
+
+        // Blocks don't depend on each other, they only share the encoder
+        // to save setting it up for each one
+        CBpeEncoder encoder;
+        size_t pos = 0;
+        for (size_t block = start; block < end; block += kBpeBlockSize) {
+            size_t cur = end - block;
+            if (cur > kBpeBlockSize) {
+                cur = kBpeBlockSize;
+            }
+            pos += encoder.EncodeBlock(data + block, cur, buf + pos);
+        }
+        chunks.Sizes[index] = pos;
+
+        if (progress && numThreads == 1) {
+            inProcessed += end - start;
+            RINOK(progress->SetRatioInfo(&inProcessed, NULL))
+        }
+        return S_OK;
+    };
+    RINOK(Parallel::For(numThreads, (UInt32) numChunks, encodeChunk))
+
+    chunks.TotalSize = 0;
+    for (size_t i = 0; i < numChunks; i++) {
+        chunks.TotalSize += chunks.Sizes[(unsigned) i];
+    }
+    return S_OK;
+}
+
+// Reads the GFCP payload from its start, decoding it on the way
+class CPayloadReader
+{
+public:
+    // bufSize is the size of the reads from stream. Returns S_FALSE if an
+    // LZ77 payload doesn't start with a valid header for unpackSize bytes.
+    HRESULT Init(
+        ISequentialInStream* stream, UInt32 packSize, UInt32 unpackSize,
+        CompressionType type, size_t bufSize
+    );
+
+    // Read up to size bytes to data. processed is less than size only if the
+    // input ended. Returns S_FALSE if the data is corrupt.
+    HRESULT Read(Byte* data, size_t size, size_t& processed);
+
+    UInt64 GetInProcessed() const
+    {
+        return _type == GFCP_LZ77 ? _lz.GetInProcessed()
+                                  : _in.GetProcessedSize();
+    }
+
+private:
+    CMyComPtr<ISequentialInStream> _limitedStream;
+    CInBuffer _in;
+    CBpeDecoder _bpe;
+    CompressionType _type;
 
+    // LZ77 output is decoded into a window and copied out from there
+    NitroLz::CDecoder _lz;
+    CByteBuffer _window;
+    size_t _windowPos;
+};
+
+HRESULT CPayloadReader::Init(
+    ISequentialInStream* stream, UInt32 packSize, UInt32 unpackSize,
+    CompressionType type, size_t bufSize
+)
+{
+    _type = type;
+
+    CLimitedSequentialInStream* limitedSpec = new CLimitedSequentialInStream;
+    _limitedStream = limitedSpec;
+    limitedSpec->SetStream(stream);
+    limitedSpec->Init(packSize);
+
+    if (type == GFCP_LZ77) {
+        // Taken to be a complete LZ10 (or LZ11) file the way the SDK's CX
+        // library writes one, so it has its own size besides the GFCP
+        // header's and the two have to agree
+        if (!_lz.Create(bufSize)) {
+            return E_OUTOFMEMORY;
+        }
+        _lz.SetStream(_limitedStream);
+        NitroLz::CHeader header;
+        RINOK(_lz.ReadHeader(header))
+        if (header.UnpackSize != unpackSize) {
+            return S_FALSE;
+        }
+        _window.Alloc(NitroLz::kMaxDistance + bufSize);
+        _lz.Init(header.Type, _window, _window.Size(), unpackSize);
+        _windowPos = 0;
+        return S_OK;
+    }
+
+    if (!_in.Create(bufSize)) {
+        return E_OUTOFMEMORY;
+    }
+    _in.SetStream(_limitedStream);
+    _in.Init();
+    _bpe.Init();
+    return S_OK;
+}
+
+HRESULT CPayloadReader::Read(Byte* data, size_t size, size_t& processed)
+{
+    if (_type == GFCP_NONE) {
+        processed = _in.ReadBytes(data, size);
+        return S_OK;
+    }
+    if (_type == GFCP_BPE) {
+        return _bpe.Decode(_in, data, size, processed);
+    }
+
+    processed = 0;
+    while (processed < size) {
+        size_t cur = _lz.GetBufPos() - _windowPos;
+        if (cur != 0) {
+            if (cur > size - processed) {
+                cur = size - processed;
+            }
+            memcpy(data + processed, _window + _windowPos, cur);
+            _windowPos += cur;
+            processed += cur;
+            continue;
+        }
+        if (_lz.IsFinished()) {
+            break;
+        }
+        if (_windowPos == _window.Size()) {
+            _lz.ShiftWindow();
+            _windowPos = _lz.GetBufPos();
+        }
+        const HRESULT res = _lz.Decode(_window.Size());
+        if (res != S_OK && _lz.GetBufPos() == _windowPos) {
+            return res;
+        }
+    }
+    return S_OK;
+}
+
+// Hands the payload to the items to extract as it's decoded. The items are
+// sorted by offset and taken one at a time, so an item that starts before the
+// previous one ends can't be served by the same pass. It's copied from the
+// cached payload if there is one, or else added to deferred to be extracted by
+// another pass. Without either it's reported as a data error.
+class CRouter
+{
+public:
+    CRouter(
+        const CRecordVector<ArcData::CRange>& ranges, Int32 testMode,
+        IArchiveExtractCallback* extractCallback,
+        CRecordVector<ArcData::CRange>* deferred
+    )
+      : _ranges(ranges)
+      , _extractCallback(extractCallback)
+      , _testMode(testMode)
+      , _deferred(deferred)
+      , _cache(NULL)
+      , _cacheSize(0)
+      , _next(0)
+      , _isOpen(false)
+      , _itemEnd(0)
+    {
+    }
+
+    void SetCache(const Byte* cache, size_t cacheSize)
+    {
+        _cache = cache;
+        _cacheSize = cacheSize;
+    }
+
+    // Pass on data[0 .. size), which is at pos in the payload
+    HRESULT Write(UInt64 pos, const Byte* data, size_t size);
+
+    // End the open item and every item not reached yet with opRes
+    HRESULT Finish(Int32 opRes);
+
+private:
+    Int32 GetAskMode() const
+    {
+        return _testMode ? NArchive::NExtract::NAskMode::kTest
+                         : NArchive::NExtract::NAskMode::kExtract;
+    }
+
+    HRESULT StartItems(UInt64 pos);
+    HRESULT StartItem(const ArcData::CRange& range, bool& isStarted);
+    HRESULT EndItem(Int32 opRes);
+
+    const CRecordVector<ArcData::CRange>& _ranges;
+    IArchiveExtractCallback* _extractCallback;
+    Int32 _testMode;
+    CRecordVector<ArcData::CRange>* _deferred;
+    const Byte* _cache;
+    size_t _cacheSize;
+    unsigned _next;
+    bool _isOpen;
+    UInt64 _itemEnd;
+    CMyComPtr<ISequentialOutStream> _outStream;
+};
+
+HRESULT CRouter::StartItem(const ArcData::CRange& range, bool& isStarted)
+{
+    isStarted = false;
+    RINOK(_extractCallback->GetStream(range.Index, &_outStream, GetAskMode()))
+    if (!_testMode && !_outStream) {
+        return S_OK;
+    }
+    RINOK(_extractCallback->PrepareOperation(GetAskMode()))
+    isStarted = true;
     return S_OK;
+}
+
+HRESULT CRouter::EndItem(Int32 opRes)
+{
+    _isOpen = false;
+    _outStream.Release();
+    return _extractCallback->SetOperationResult(opRes);
+}
+
+HRESULT CRouter::StartItems(UInt64 pos)
+{
+    while (!_isOpen && _next < _ranges.Size() &&
+           _ranges[_next].Offset <= pos) {
+        const ArcData::CRange& range = _ranges[_next++];
+        if (range.Size != 0 && range.Offset < pos && !_cache && _deferred) {
+            _deferred->Add(range);
+            continue;
+        }
+        bool isStarted;
+        RINOK(StartItem(range, isStarted))
+        if (!isStarted) {
+            continue;
+        }
+        if (range.Size == 0) {
+            RINOK(EndItem(NArchive::NExtract::NOperationResult::kOK))
+        } else if (range.Offset < pos && _cache) {
+            if (range.Size > _cacheSize - range.Offset) {
+                RINOK(EndItem(
+                    NArchive::NExtract::NOperationResult::kUnexpectedEnd
+                ))
+                continue;
+            }
+            if (_outStream) {
+                RINOK(WriteStream(
+                    _outStream, _cache + (size_t) range.Offset,
+                    (size_t) range.Size
+                ))
+            }
+            RINOK(EndItem(NArchive::NExtract::NOperationResult::kOK))
+        } else if (range.Offset < pos) {
+            PRINT("Item %u overlaps the previous one\n", range.Index);
+            RINOK(EndItem(NArchive::NExtract::NOperationResult::kDataError))
+        } else {
+            _isOpen = true;
+            _itemEnd = range.Offset + range.Size;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT CRouter::Write(UInt64 pos, const Byte* data, size_t size)
+{
+    while (size != 0) {
+        RINOK(StartItems(pos))
+        if (!_isOpen) {
+            // Skip the gap up to the next item
+            if (_next == _ranges.Size()) {
+                return S_OK;
+            }
+            const UInt64 gap = _ranges[_next].Offset - pos;
+            if (gap >= size) {
+                return S_OK;
+            }
+            pos += gap;
+            data += gap;
+            size -= (size_t) gap;
+            continue;
+        }
+
+        size_t cur = size;
+        if (cur > _itemEnd - pos) {
+            cur = (size_t) (_itemEnd - pos);
+        }
+        if (_outStream) {
+            RINOK(WriteStream(_outStream, data, cur))
+        }
+        pos += cur;
+        data += cur;
+        size -= cur;
+        if (pos == _itemEnd) {
+            RINOK(EndItem(NArchive::NExtract::NOperationResult::kOK))
+        }
+    }
+    return StartItems(pos);
+}
+
+HRESULT CRouter::Finish(Int32 opRes)
+{
+    if (_isOpen) {
+        RINOK(EndItem(opRes))
+    }
+    while (_next < _ranges.Size()) {
+        const ArcData::CRange& range = _ranges[_next++];
+        bool isStarted;
+        RINOK(StartItem(range, isStarted))
+        if (isStarted) {
+            RINOK(EndItem(
+                range.Size == 0 ? NArchive::NExtract::NOperationResult::kOK
+                                : opRes
+            ))
+        }
+    }
+    return S_OK;
+}
+
+// Extract the archive's own items among indices
+HRESULT CHandler::Extract2(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+)
+{
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    if (allFilesMode)
+        numItems = _itemCount;
+    if (numItems == 0)
+        return S_OK;
+
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+
+    // Directories have no data, so get them out of the way first. Offsets of
+    // files are relative to the start of the decompressed payload.
+    CRecordVector<ArcData::CRange> ranges;
+    UInt64 totalSize = 0;
+    for (UInt32 i = 0; i < numItems; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        // Items of nested archives are extracted by their own handlers
+        if (index >= _itemCount) {
+            continue;
+        }
+
+        const Byte* entry = _metadata + index * 0x10 + 4;
+        if (GetUi32(entry + 4) & 0x01000000) {
+            CMyComPtr<ISequentialOutStream> realOutStream;
+            RINOK(extractCallback->GetStream(index, &realOutStream, askMode))
+            RINOK(extractCallback->PrepareOperation(askMode))
+            RINOK(extractCallback->SetOperationResult(
+                NArchive::NExtract::NOperationResult::kOK
+            ))
+            continue;
+        }
+
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = false;
+        range.Size = GetUi32(entry + 8);
+        // Data that starts before the payload can never be reached
+        range.Offset = GetUi32(entry + 0xC) >= _dataOffset
+                           ? GetUi32(entry + 0xC) - _dataOffset
+                           : (UInt64) (Int64) -1;
+        if (range.Offset != (UInt64) (Int64) -1 &&
+            range.Offset + range.Size > totalSize) {
+            totalSize = range.Offset + range.Size;
+        }
+        ranges.Add(range);
+    }
+    if (ranges.Size() == 0) {
+        return S_OK;
+    }
+    ArcData::SortRanges(ranges);
+
+    if (totalSize > _decompressedSize) {
+        totalSize = _decompressedSize;
+    }
+    RINOK(extractCallback->SetTotal(totalSize))
+
+    // With more than one thread a BPE payload is decoded in parallel up
+    // front, as long as it fits in the cache
+    if (_handlerProps.NumThreads > 1 && _compressionType == GFCP_BPE) {
+        const HRESULT res = CachePayload();
+        if (res != S_FALSE) {
+            RINOK(res)
+        }
+    }
+
+    const size_t blockSize = _handlerProps.BlockSize;
+    CByteBuffer buf(blockSize);
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, false);
+
+    // One pass over the payload, only as far as the last item
+    auto extractPass = [&](CRouter& router) -> HRESULT {
+        CMyComPtr<ISequentialInStream> tailStream;
+        CPayloadReader reader;
+        if (!_isPayloadCached) {
+            if (_source.GetTailStream(
+                    _dataOffset + kGFCPHeaderSize, (IInArchive*) this,
+                    &tailStream
+                ) != S_OK) {
+                return router.Finish(
+                    NArchive::NExtract::NOperationResult::kUnexpectedEnd
+                );
+            }
+
+            const HRESULT initRes = reader.Init(
+                tailStream, _compressedSize, _decompressedSize,
+                _compressionType, blockSize
+            );
+            if (initRes == S_FALSE) {
+                return router.Finish(
+                    NArchive::NExtract::NOperationResult::kDataError
+                );
+            }
+            RINOK(initRes)
+        } else {
+            router.SetCache(_payloadCache, _payloadCache.Size());
+        }
+
+        Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
+        UInt64 pos = 0;
+        while (pos < totalSize) {
+            size_t cur = blockSize;
+            if (cur > totalSize - pos) {
+                cur = (size_t) (totalSize - pos);
+            }
+
+            if (_isPayloadCached) {
+                RINOK(router.Write(pos, _payloadCache + (size_t) pos, cur))
+                pos += cur;
+                lps->InSize = pos;
+                lps->OutSize = pos;
+                RINOK(lps->SetCur())
+                continue;
+            }
+
+            size_t processed;
+            const HRESULT res = reader.Read(buf, cur, processed);
+            RINOK(router.Write(pos, buf, processed))
+            pos += processed;
+            lps->InSize = reader.GetInProcessed();
+            lps->OutSize = pos;
+            RINOK(lps->SetCur())
+
+            if (res != S_OK) {
+                PRINT("Corrupt data at %llu\n", pos);
+                opRes = NArchive::NExtract::NOperationResult::kDataError;
+                break;
+            }
+            if (processed < cur) {
+                PRINT("Unexpected end at %llu\n", pos);
+                opRes = NArchive::NExtract::NOperationResult::kUnexpectedEnd;
+                break;
+            }
+        }
+
+        // Anything still left ends past the decompressed size
+        if (opRes == NArchive::NExtract::NOperationResult::kOK) {
+            opRes = NArchive::NExtract::NOperationResult::kUnexpectedEnd;
+        }
+        return router.Finish(opRes);
+    };
+
+    // Items that overlap the one before them are served from the cached
+    // payload. Without one they're left for another pass, after caching the
+    // payload if it fits, which a stream that can't seek doesn't allow.
+    CRecordVector<ArcData::CRange> deferred;
+    for (;;) {
+        {
+            CRouter router(
+                ranges, testMode, extractCallback,
+                _source.IsSeq() ? NULL : &deferred
+            );
+            RINOK(extractPass(router))
+        }
+        if (deferred.Size() == 0) {
+            return S_OK;
+        }
+        PRINT("%u overlapping items left\n", deferred.Size());
+
+        const HRESULT cacheRes = CachePayload();
+        if (cacheRes != S_FALSE) {
+            RINOK(cacheRes)
+        }
+        ranges = deferred;
+        deferred.Clear();
+
+        // Each pass adds what it goes over to the total
+        lps->ProgressOffset += totalSize;
+        totalSize = 0;
+        for (unsigned i = 0; i < ranges.Size(); i++) {
+            if (ranges[i].Offset + ranges[i].Size > totalSize) {
+                totalSize = ranges[i].Offset + ranges[i].Size;
+            }
+        }
+        if (totalSize > _decompressedSize) {
+            totalSize = _decompressedSize;
+        }
+        RINOK(extractCallback->SetTotal(lps->ProgressOffset + totalSize))
+    }
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    auto extractOwn = [&](IArchiveExtractCallback* callback) -> HRESULT {
+        return Extract2(indices, numItems, testMode, callback);
+    };
+    return _nested.Extract(
+        indices, numItems, testMode, extractCallback, extractOwn
+    );
     COM_TRY_END
 }
 
@@ -719,13 +1676,502 @@ Z7_COM7F_IMF(CHandler::GetFileTimeType(UInt32* type))
     return S_OK;
 }
 
+// Item of the archive being written. Directories that aren't passed by the
+// host but are implied by the paths in them are added too.
+struct CUpdateNode {
+    AString Name;
+    UInt32 Hash;
+    int Parent;
+    bool IsDir;
+    bool HasFiles;
+    // Index passed to the update callback, or -1 for an implied directory
+    int UpdateIndex;
+    // Item of the current archive whose data is kept, or -1 for new data
+    int ArcIndex;
+    UInt64 Size;
+    int FirstChild;
+    int LastChild;
+    int NextSibling;
+    int HashNext;
+
+    // Set once the entries are laid out
+    UInt32 FirstEntry;
+    UInt32 DataOffset;
+};
+
+// Directories and file data are aligned to this
+static const UInt32 kDataAlign = 0x20;
+
+class CUpdateTree
+{
+public:
+    CUpdateTree(unsigned numHeadsLog)
+      : _rootFirst(-1)
+      , _rootLast(-1)
+    {
+        _heads.ClearAndSetSize(1u << numHeadsLog);
+        for (unsigned i = 0; i < _heads.Size(); i++) {
+            _heads[i] = -1;
+        }
+    }
+
+    // Add the item at path, along with any directories it implies
+    HRESULT Add(
+        const UString& path, bool isDir, int updateIndex, int arcIndex,
+        UInt64 size
+    );
+
+    // Lay out the entries: the items in the root, then the items in each
+    // directory in the order the directories appear. Empty directories are
+    // left out, the format can't describe them.
+    void Order();
+
+    CObjectVector<CUpdateNode> Nodes;
+    CRecordVector<unsigned> Entries;
+
+private:
+    int Find(int parent, const AString& name, UInt32 hash) const;
+    int AddNode(int parent, const AString& name, UInt32 hash, bool isDir);
+    void AddChildren(int first);
+
+    CRecordVector<int> _heads;
+    int _rootFirst;
+    int _rootLast;
+};
+
+int CUpdateTree::Find(int parent, const AString& name, UInt32 hash) const
+{
+    int i = _heads[(hash ^ (UInt32) parent) & (_heads.Size() - 1)];
+    for (; i >= 0; i = Nodes[i].HashNext) {
+        const CUpdateNode& node = Nodes[i];
+        if (node.Hash == hash && node.Parent == parent && node.Name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int CUpdateTree::AddNode(
+    int parent, const AString& name, UInt32 hash, bool isDir
+)
+{
+    const int index = (int) Nodes.Size();
+    CUpdateNode& node = Nodes.AddNew();
+    node.Name = name;
+    node.Hash = hash;
+    node.Parent = parent;
+    node.IsDir = isDir;
+    node.HasFiles = false;
+    node.UpdateIndex = -1;
+    node.ArcIndex = -1;
+    node.Size = 0;
+    node.FirstChild = -1;
+    node.LastChild = -1;
+    node.NextSibling = -1;
+
+    int& head = _heads[(hash ^ (UInt32) parent) & (_heads.Size() - 1)];
+    node.HashNext = head;
+    head = index;
+
+    int& last = parent < 0 ? _rootLast : Nodes[parent].LastChild;
+    if (last < 0) {
+        (parent < 0 ? _rootFirst : Nodes[parent].FirstChild) = index;
+    } else {
+        Nodes[last].NextSibling = index;
+    }
+    last = index;
+    return index;
+}
+
+HRESULT CUpdateTree::Add(
+    const UString& path, bool isDir, int updateIndex, int arcIndex, UInt64 size
+)
+{
+    int parent = -1;
+    unsigned pos = 0;
+    for (;;) {
+        unsigned end = pos;
+        while (end < path.Len() && path[end] != WCHAR_PATH_SEPARATOR &&
+               path[end] != L'/') {
+            end++;
+        }
+        const bool isLast = end == path.Len();
+
+        AString name;
+        ConvertUnicodeToUTF8(path.Mid(pos, end - pos), name);
+        if (name.IsEmpty()) {
+            return E_INVALIDARG;
+        }
+        const UInt32 hash = CalcNameCrc(name, name.Len());
+        int index = Find(parent, name, hash);
+
+        if (!isLast) {
+            if (index < 0) {
+                index = AddNode(parent, name, hash, true);
+            } else if (!Nodes[index].IsDir) {
+                return E_INVALIDARG;
+            }
+            parent = index;
+            pos = end + 1;
+            continue;
+        }
+
+        if (index >= 0) {
+            // Only a directory that so far was implied can be added again
+            CUpdateNode& node = Nodes[index];
+            if (!isDir || !node.IsDir || node.UpdateIndex >= 0) {
+                return E_INVALIDARG;
+            }
+            node.UpdateIndex = updateIndex;
+            return S_OK;
+        }
+
+        index = AddNode(parent, name, hash, isDir);
+        CUpdateNode& node = Nodes[index];
+        node.UpdateIndex = updateIndex;
+        node.ArcIndex = arcIndex;
+        node.Size = size;
+        for (int i = index; !isDir && i >= 0 && !Nodes[i].HasFiles;
+             i = Nodes[i].Parent) {
+            Nodes[i].HasFiles = true;
+        }
+        return S_OK;
+    }
+}
+
+void CUpdateTree::AddChildren(int first)
+{
+    for (int i = first; i >= 0; i = Nodes[i].NextSibling) {
+        if (Nodes[i].HasFiles) {
+            Entries.Add((unsigned) i);
+        }
+    }
+}
+
+void CUpdateTree::Order()
+{
+    Entries.Clear();
+    AddChildren(_rootFirst);
+    for (unsigned i = 0; i < Entries.Size(); i++) {
+        CUpdateNode& node = Nodes[Entries[i]];
+        if (node.IsDir) {
+            node.FirstEntry = Entries.Size();
+            AddChildren(node.FirstChild);
+        }
+    }
+}
+
+HRESULT CHandler::DecodePayload(CByteBuffer& payload)
+{
+    CMyComPtr<ISequentialInStream> tailStream;
+    RINOK(_source.GetTailStream(
+        _dataOffset + kGFCPHeaderSize, (IInArchive*) this, &tailStream
+    ))
+    payload.Alloc(_decompressedSize);
+
+    if (_compressionType == GFCP_BPE && _handlerProps.NumThreads > 1) {
+        CByteBuffer packed(_compressedSize);
+        RINOK(ReadStream_FALSE(tailStream, packed, _compressedSize))
+        return DecodeBpeParallel(
+            packed, _compressedSize, payload, _decompressedSize,
+            _handlerProps.NumThreads
+        );
+    }
+
+    CPayloadReader reader;
+    RINOK(reader.Init(
+        tailStream, _compressedSize, _decompressedSize, _compressionType,
+        _handlerProps.BlockSize
+    ))
+    size_t processed;
+    RINOK(reader.Read(payload, _decompressedSize, processed))
+    return processed == _decompressedSize ? S_OK : S_FALSE;
+}
+
+// Returns S_FALSE if the payload isn't worth caching or can't be cached
+HRESULT CHandler::CachePayload()
+{
+    if (_isPayloadCached) {
+        return S_OK;
+    }
+    if (_compressionType == GFCP_NONE || _source.IsSeq() ||
+        _decompressedSize > _handlerProps.CacheSize) {
+        return S_FALSE;
+    }
+
+    const HRESULT res = DecodePayload(_payloadCache);
+    if (res != S_OK) {
+        _payloadCache.Free();
+        return res;
+    }
+    _isPayloadCached = true;
+    return S_OK;
+}
+
+HRESULT CHandler::ReadPayload(CByteBuffer& payload)
+{
+    if (_itemCount == 0) {
+        payload.Free();
+        return S_OK;
+    }
+    if (_isPayloadCached) {
+        payload.CopyFrom(_payloadCache, _payloadCache.Size());
+        return S_OK;
+    }
+    return DecodePayload(payload);
+}
+
 Z7_COM7F_IMF(CHandler::UpdateItems(
     ISequentialOutStream* outStream, UInt32 numItems,
     IArchiveUpdateCallback* callback
 ))
 {
+    PRINT("UpdateItems\n");
+
     COM_TRY_BEGIN
+    // Level 0 stores the payload as it is. Otherwise it's BPE, as in the
+    // archives that ship with the games, unless LZ77 is asked for.
+    CompressionType type = GFCP_BPE;
+    const AString& method = _props.MethodName;
+    if (_props.GetLevel() == 0 || method.IsEqualTo_Ascii_NoCase("Copy")) {
+        type = GFCP_NONE;
+    } else if (method.IsEqualTo_Ascii_NoCase("LZ77")) {
+        type = GFCP_LZ77;
+    } else if (!method.IsEmpty() && !method.IsEqualTo_Ascii_NoCase("BPE")) {
+        return E_INVALIDARG;
+    }
+
+    unsigned numHeadsLog = 4;
+    while (numHeadsLog < 24 && (1u << numHeadsLog) < numItems) {
+        numHeadsLog++;
+    }
+    CUpdateTree tree(numHeadsLog);
+
+    bool needPayload = false;
+    UInt64 newDataSize = 0;
+    for (UInt32 i = 0; i < numItems; i++) {
+        Int32 newData, newProps;
+        UInt32 indexInArchive;
+        RINOK(callback->GetUpdateItemInfo(
+            i, &newData, &newProps, &indexInArchive
+        ))
+        if (!IntToBool(newProps) || !IntToBool(newData)) {
+            if (indexInArchive >= _itemCount) {
+                return E_INVALIDARG;
+            }
+        }
+
+        // Properties come from the host or the current archive
+        IArchiveUpdateCallback* propSource = NULL;
+        UInt32 propIndex = indexInArchive;
+        if (IntToBool(newProps)) {
+            propSource = callback;
+            propIndex = i;
+        }
+        NWindows::NCOM::CPropVariant pathProp, isDirProp;
+        if (propSource) {
+            RINOK(propSource->GetProperty(propIndex, kpidPath, &pathProp))
+            RINOK(propSource->GetProperty(propIndex, kpidIsDir, &isDirProp))
+        } else {
+            RINOK(GetProperty(propIndex, kpidPath, &pathProp))
+            RINOK(GetProperty(propIndex, kpidIsDir, &isDirProp))
+        }
+        if (pathProp.vt != VT_BSTR) {
+            return E_INVALIDARG;
+        }
+        const bool isDir =
+            isDirProp.vt == VT_BOOL && isDirProp.boolVal != VARIANT_FALSE;
+
+        UInt64 size = 0;
+        int arcIndex = -1;
+        if (!isDir) {
+            if (IntToBool(newData)) {
+                NWindows::NCOM::CPropVariant prop;
+                RINOK(callback->GetProperty(i, kpidSize, &prop))
+                if (prop.vt != VT_UI8) {
+                    return E_INVALIDARG;
+                }
+                size = prop.uhVal.QuadPart;
+                newDataSize += size;
+            } else {
+                arcIndex = (int) indexInArchive;
+                size = GetUi32(_metadata + indexInArchive * 0x10 + 4 + 8);
+                needPayload = true;
+            }
+        }
+
+        RINOK(tree.Add(pathProp.bstrVal, isDir, (int) i, arcIndex, size))
+    }
+    tree.Order();
+
+    // Metadata: the item count, the entries and then the names
+    const UInt32 count = tree.Entries.Size();
+    UInt64 metadataSize = 4 + (UInt64) count * 0x10;
+    unsigned i;
+    for (i = 0; i < count; i++) {
+        metadataSize += tree.Nodes[tree.Entries[i]].Name.Len() + 1;
+    }
+    // Name offsets are stored in 24 bits
+    if (kHeaderSize + metadataSize > 0x1000000) {
+        return E_INVALIDARG;
+    }
+    const UInt32 dataOffset =
+        (kHeaderSize + (UInt32) metadataSize + kDataAlign - 1) &
+        ~(kDataAlign - 1);
+
+    UInt64 payloadSize = 0;
+    for (i = 0; i < count; i++) {
+        CUpdateNode& node = tree.Nodes[tree.Entries[i]];
+        if (!node.IsDir) {
+            payloadSize = (payloadSize + kDataAlign - 1) &
+                          ~(UInt64) (kDataAlign - 1);
+            node.DataOffset = (UInt32) payloadSize;
+            payloadSize += node.Size;
+        }
+    }
+    if (dataOffset + payloadSize > 0xFFFFFFFF) {
+        return E_INVALIDARG;
+    }
+
+    CByteBuffer metadata((size_t) metadataSize);
+    SetUi32(metadata, count);
+    UInt32 namePos = 4 + count * 0x10;
+    for (i = 0; i < count; i++) {
+        const CUpdateNode& node = tree.Nodes[tree.Entries[i]];
+        Byte* entry = metadata + 4 + i * 0x10;
+        UInt32 flags = node.IsDir ? 0x01 : 0;
+        // The last item of each directory ends its list
+        int next = node.NextSibling;
+        while (next >= 0 && !tree.Nodes[next].HasFiles) {
+            next = tree.Nodes[next].NextSibling;
+        }
+        if (next < 0) {
+            flags |= 0x80;
+        }
+        SetUi32(entry, node.Hash);
+        SetUi32(entry + 4, (kHeaderSize + namePos) | (flags << 24));
+        if (node.IsDir) {
+            SetUi32(entry + 8, 0);
+            SetUi32(entry + 0xC, kHeaderSize + 4 + node.FirstEntry * 0x10);
+        } else {
+            SetUi32(entry + 8, (UInt32) node.Size);
+            SetUi32(entry + 0xC, dataOffset + node.DataOffset);
+        }
+        memcpy(metadata + namePos, node.Name, node.Name.Len() + 1);
+        namePos += node.Name.Len() + 1;
+    }
+
+    // Reading the new files and then compressing the whole payload, which
+    // carries on from where the reading left off
+    const bool store = type == GFCP_NONE;
+    RINOK(callback->SetTotal(newDataSize + (store ? 0 : payloadSize)))
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(callback, true);
+
+    // The whole payload is put together in memory, as the header before it
+    // needs its compressed size
+    CByteBuffer oldPayload;
+    if (needPayload) {
+        RINOK(ReadPayload(oldPayload))
+    }
+    CByteBuffer payload((size_t) payloadSize);
+    memset(payload, 0, (size_t) payloadSize);
+    UInt64 inProcessed = 0;
+    for (i = 0; i < count; i++) {
+        const CUpdateNode& node = tree.Nodes[tree.Entries[i]];
+        if (node.IsDir) {
+            continue;
+        }
+        Byte* dest = payload + node.DataOffset;
+
+        if (node.ArcIndex >= 0) {
+            const Byte* entry = _metadata + node.ArcIndex * 0x10 + 4;
+            const UInt32 offset = GetUi32(entry + 0xC);
+            if (offset < _dataOffset ||
+                offset - _dataOffset + node.Size > oldPayload.Size()) {
+                return S_FALSE;
+            }
+            memcpy(
+                dest, oldPayload + (offset - _dataOffset), (size_t) node.Size
+            );
+            continue;
+        }
 
+        CMyComPtr<ISequentialInStream> fileInStream;
+        RINOK(callback->GetStream((UInt32) node.UpdateIndex, &fileInStream))
+        if (!fileInStream) {
+            return S_FALSE;
+        }
+        RINOK(ReadStream_FAIL(fileInStream, dest, (size_t) node.Size))
+        fileInStream.Release();
+        RINOK(callback->SetOperationResult(
+            NArchive::NUpdate::NOperationResult::kOK
+        ))
+
+        inProcessed += node.Size;
+        lps->InSize = lps->OutSize = inProcessed;
+        RINOK(lps->SetCur())
+    }
+    oldPayload.Free();
+
+    // The encoders count from the start of the payload
+    lps->ProgressOffset = inProcessed;
+    lps->InSize = lps->OutSize = 0;
+    CPackChunks chunks;
+    if (type == GFCP_BPE) {
+        RINOK(EncodeBpe(
+            payload, (size_t) payloadSize, _handlerProps.NumThreads, chunks,
+            progress
+        ))
+    } else if (type == GFCP_LZ77) {
+        NitroLz::CEncodeProps lzProps;
+        lzProps.Level = _props.GetLevel();
+        lzProps.NumThreads = _handlerProps.NumThreads;
+        chunks.Bufs.Alloc(1);
+        size_t lzSize;
+        RINOK(NitroLz::Encode(
+            payload, (size_t) payloadSize, NitroLz::kTypeLz10, lzProps, true,
+            chunks.Bufs[0], lzSize, progress
+        ))
+        chunks.Sizes.Add(lzSize);
+        chunks.TotalSize = lzSize;
+    }
+    const UInt64 packSize = store ? payloadSize : chunks.TotalSize;
+    if (dataOffset + kGFCPHeaderSize + packSize > 0xFFFFFFFF) {
+        return E_INVALIDARG;
+    }
+
+    Byte header[kHeaderSize];
+    SetBe32(header, 0x47464143);
+    SetUi32(header + 4, _version);
+    SetUi32(header + 8, _flags);
+    SetUi32(header + 0xC, kHeaderSize);
+    SetUi32(header + 0x10, (UInt32) metadataSize);
+    SetUi32(header + 0x14, dataOffset);
+    SetUi32(header + 0x18, kGFCPHeaderSize + (UInt32) packSize);
+    RINOK(WriteStream(outStream, header, kHeaderSize))
+    RINOK(WriteStream(outStream, metadata, (size_t) metadataSize))
+
+    Byte pad[kDataAlign] = {};
+    RINOK(WriteStream(
+        outStream, pad, dataOffset - kHeaderSize - (size_t) metadataSize
+    ))
+
+    Byte gfcp[kGFCPHeaderSize];
+    SetBe32(gfcp, 0x47464350);
+    SetUi32(gfcp + 4, _gfcpVersion);
+    SetUi32(gfcp + 8, type);
+    SetUi32(gfcp + 0xC, (UInt32) payloadSize);
+    SetUi32(gfcp + 0x10, (UInt32) packSize);
+    RINOK(WriteStream(outStream, gfcp, kGFCPHeaderSize))
+
+    if (store) {
+        return WriteStream(outStream, payload, (size_t) payloadSize);
+    }
+    for (i = 0; i < chunks.Sizes.Size(); i++) {
+        RINOK(WriteStream(outStream, chunks.Bufs[i], chunks.Sizes[i]))
+    }
     return S_OK;
     COM_TRY_END
 }
@@ -737,10 +2183,111 @@ Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
     *stream = NULL;
     COM_TRY_BEGIN
 
-    return S_FALSE;
+    if (index >= _itemCount) {
+        return _nested.GetStream(index, stream);
+    }
+
+    const Byte* entry = _metadata + index * 0x10 + 4;
+    if (GetUi32(entry + 4) & 0x01000000) {
+        return S_FALSE;
+    }
+    const UInt32 size = GetUi32(entry + 8);
+    if (GetUi32(entry + 0xC) < _dataOffset) {
+        return S_FALSE;
+    }
+    const UInt64 offset = GetUi32(entry + 0xC) - _dataOffset;
+    if (offset + size > _decompressedSize) {
+        return S_FALSE;
+    }
+
+    const UInt64 payloadOffset = _dataOffset + kGFCPHeaderSize;
+    if (_compressionType == GFCP_NONE) {
+        return _source.GetStream(
+            payloadOffset + offset, size, _nested.GetStreamRef(this), stream
+        );
+    }
+
+    // Decoding has to start from the beginning of the payload, which can't
+    // be done more than once from a stream that can't seek
+    if (_source.IsSeq()) {
+        return S_FALSE;
+    }
+
+    // Decode the whole payload once if it fits in the cache, so that later
+    // items don't have to start over
+    const HRESULT cacheRes = CachePayload();
+    if (cacheRes == S_OK) {
+        Create_BufInStream_WithReference(
+            _payloadCache + (size_t) offset, size, _nested.GetStreamRef(this),
+            stream
+        );
+        return S_OK;
+    }
+    if (cacheRes != S_FALSE) {
+        return cacheRes;
+    }
+
+    CMyComPtr<ISequentialInStream> tailStream;
+    RINOK(_source.GetTailStream(payloadOffset, (IInArchive*) this, &tailStream))
+    CPayloadReader reader;
+    RINOK(reader.Init(
+        tailStream, _compressedSize, _decompressedSize, _compressionType,
+        _handlerProps.BlockSize
+    ))
+
+    // Only the item itself is kept, everything before it is decoded to a
+    // scratch buffer and dropped
+    const size_t blockSize = _handlerProps.BlockSize;
+    CByteBuffer scratch(blockSize);
+    for (UInt64 pos = 0; pos < offset;) {
+        size_t cur = blockSize;
+        if (cur > offset - pos) {
+            cur = (size_t) (offset - pos);
+        }
+        size_t processed;
+        RINOK(reader.Read(scratch, cur, processed))
+        if (processed != cur) {
+            return S_FALSE;
+        }
+        pos += cur;
+    }
+
+    CReferenceBuf* refBuf = new CReferenceBuf;
+    CMyComPtr<IUnknown> ref = refBuf;
+    refBuf->Buf.Alloc(size);
+    size_t processed;
+    RINOK(reader.Read(refBuf->Buf, size, processed))
+    if (processed != size) {
+        return S_FALSE;
+    }
+    Create_BufInStream_WithReference(refBuf->Buf, size, ref, stream);
+    return S_OK;
     COM_TRY_END
 }
 
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _strict = false;
+    _props.Init();
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        HRESULT hres;
+        if (name.IsEqualTo("strict")) {
+            RINOK(PROPVARIANT_to_bool(values[i], _strict))
+        } else if (_handlerProps.SetProperty(name, values[i], hres)) {
+            RINOK(hres)
+        } else {
+            RINOK(_props.SetProperty(names[i], values[i]))
+        }
+    }
+    _source.SetBlockSize(_handlerProps.BlockSize);
+    return S_OK;
+}
+
 static const Byte k_Signature[] = {0x47, 0x46, 0x41, 0x43};
 
 REGISTER_ARC_I(
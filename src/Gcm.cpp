@@ -0,0 +1,427 @@
+// Gcm.cpp - File for reading GameCube disc images
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Gcm.hpp"
+#include "ArcData.hpp"
+#include "Darch.hpp"
+#include "Nested.hpp"
+#include "Types.h"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+
+namespace Gcm
+{
+
+typedef Darch::CItem CItem;
+
+static const unsigned kDolNumSections = 18;
+
+// Names of the items that aren't in the FST, laid out as Dolphin does. They
+// go after the FST so that all names are looked up in the same buffer.
+static const char kSysNames[] = "sys\0"
+                                "boot.bin\0"
+                                "bi2.bin\0"
+                                "apploader.img\0"
+                                "main.dol\0"
+                                "fst.bin\0"
+                                "files";
+
+Z7_CLASS_IMP_CHandler_IInArchive_3(
+    IArchiveGetRawProps, IInArchiveGetStream, ISetProperties
+)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    ArcData::CHandlerProps _handlerProps;
+    CRecordVector<CItem> _items;
+    // The FST followed by kSysNames
+    CByteBuffer _names;
+    UInt32 _fstSize;
+
+    CRecordVector<char> _pathArena;
+    CRecordVector<UInt32> _pathOffsets;
+
+    // Archives found among the files, when opening them is turned on
+    Nested::CExpander _nested;
+
+    const char* GetName(const CItem& item) const
+    {
+        return (const char*) (_names + item.NameOffset);
+    }
+
+    int AddSysItem(
+        UInt32& nameOffset, int parent, bool isDir, UInt64 offset, UInt32 size
+    );
+    HRESULT Open2();
+
+public:
+    CHandler()
+      : _fstSize(0)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidHeadersSize,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+    kpidOffset,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+UInt32 GetApploaderSize(const Byte* header)
+{
+    return kApploaderHeaderSize + GetBe32(header + 0x14) +
+           GetBe32(header + 0x18);
+}
+
+UInt32 GetDolSize(const Byte* header)
+{
+    UInt32 size = kDolHeaderSize;
+    for (unsigned i = 0; i < kDolNumSections; i++) {
+        const UInt32 end =
+            GetBe32(header + i * 4) + GetBe32(header + 0x90 + i * 4);
+        if (end > size) {
+            size = end;
+        }
+    }
+    return size;
+}
+
+// Add an item named by the next of kSysNames
+int CHandler::AddSysItem(
+    UInt32& nameOffset, int parent, bool isDir, UInt64 offset, UInt32 size
+)
+{
+    CItem item;
+    item.NameOffset = nameOffset;
+    item.Parent = parent;
+    item.IsDir = isDir;
+    item.Offset = offset;
+    item.Size = size;
+    nameOffset += (UInt32) strlen(GetName(item)) + 1;
+    return _items.Add(item);
+}
+
+// Only the disc header, the apploader and DOL headers and the FST are read.
+// File data stays on the disc until it's asked for.
+HRESULT CHandler::Open2()
+{
+    Byte boot[kBootSize];
+    RINOK(_source.Read(0, boot, kBootSize))
+    if (GetBe32(boot + kMagicOffset) != kMagic) {
+        return S_FALSE;
+    }
+
+    const UInt32 dolOffset = GetBe32(boot + 0x420);
+    const UInt32 fstOffset = GetBe32(boot + 0x424);
+    _fstSize = GetBe32(boot + 0x428);
+    if (_fstSize < 0xC || _fstSize > kFstSizeMax) {
+        return S_FALSE;
+    }
+
+    Byte apploader[kApploaderHeaderSize];
+    RINOK(_source.Read(kApploaderOffset, apploader, kApploaderHeaderSize))
+    const UInt32 apploaderSize = GetApploaderSize(apploader);
+
+    Byte dol[kDolHeaderSize];
+    RINOK(_source.Read(dolOffset, dol, kDolHeaderSize))
+    const UInt32 dolSize = GetDolSize(dol);
+
+    _names.Alloc(_fstSize + sizeof(kSysNames));
+    RINOK(_source.Read(fstOffset, _names, _fstSize))
+    memcpy(_names + _fstSize, kSysNames, sizeof(kSysNames));
+
+    UInt32 nameOffset = _fstSize;
+    const int sys = AddSysItem(nameOffset, -1, true, 0, 0);
+    AddSysItem(nameOffset, sys, false, 0, kBootSize);
+    AddSysItem(nameOffset, sys, false, kBi2Offset, kBi2Size);
+    AddSysItem(nameOffset, sys, false, kApploaderOffset, apploaderSize);
+    AddSysItem(nameOffset, sys, false, dolOffset, dolSize);
+    AddSysItem(nameOffset, sys, false, fstOffset, _fstSize);
+    const int files = AddSysItem(nameOffset, -1, true, 0, 0);
+
+    if (!Darch::ParseNodes(_names, _fstSize, files, 0, _items)) {
+        return S_FALSE;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (_source.Open(stream) != S_OK || Open2() != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        // The disc itself is fine even if none of its files open
+        if (_nested.Expand(
+                (IInArchive*) this, _items.Size(),
+                _handlerProps.RecurseDepth, _handlerProps.CacheSize
+            ) != S_OK) {
+            _nested.Clear();
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _nested.Clear();
+    _source.Close();
+    _items.Clear();
+    _names.Free();
+    _fstSize = 0;
+    _pathArena.Clear();
+    _pathOffsets.Clear();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _items.Size() + _nested.GetNumItems();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidHeadersSize:
+        prop = kApploaderOffset + _fstSize;
+        break;
+    case kpidExtension:
+        prop = "iso";
+        break;
+    case kpidIsTree:
+        prop = true;
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    if (index >= _items.Size()) {
+        return _nested.GetProperty(index, propID, value);
+    }
+
+    NWindows::NCOM::CPropVariant prop;
+    const CItem& item = _items[index];
+
+    switch (propID) {
+    case kpidPath: {
+        if (_pathOffsets.Size() == 0 &&
+            !Darch::BuildPathArena(_items, _names, _pathArena, _pathOffsets)) {
+            return E_OUTOFMEMORY;
+        }
+        const char* path = &_pathArena[_pathOffsets[index]];
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(path, strlen(path), us);
+        prop = us;
+        break;
+    }
+
+    case kpidName: {
+        const char* name = GetName(item);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(name, strlen(name), us);
+        prop = us;
+        break;
+    }
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+    case kpidPackSize:
+        prop = item.Size;
+        break;
+
+    case kpidOffset:
+        if (!item.IsDir) {
+            prop = item.Offset;
+        }
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+)
+{
+    if (index >= _items.Size()) {
+        return _nested.GetParent(index, parent, parentType);
+    }
+
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _items[index].Parent;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    if (index >= _items.Size()) {
+        return _nested.GetRawProp(index, propID, data, dataSize, propType);
+    }
+
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (propID == kpidName) {
+        const char* name = GetName(_items[index]);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    const UInt32 numIndices = allFilesMode ? _items.Size() : numItems;
+
+    // Files are read in disc order, so pulling a few out of an image only
+    // reads those
+    CRecordVector<ArcData::CRange> ranges;
+    for (UInt32 i = 0; i < numIndices; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        if (index >= _items.Size())
+            continue;
+        const CItem& item = _items[index];
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = item.IsDir ? 0 : item.Offset;
+        range.Size = item.IsDir ? 0 : item.Size;
+        ranges.Add(range);
+    }
+
+    auto extractOwn = [&](IArchiveExtractCallback* callback) -> HRESULT {
+        if (ranges.Size() == 0) {
+            return S_OK;
+        }
+        return ArcData::ExtractRanges(_source, ranges, testMode, callback);
+    };
+    return _nested.Extract(
+        indices, numItems, testMode, extractCallback, extractOwn
+    );
+    COM_TRY_END
+}
+
+// Streams are slices of the disc stream, nothing is copied
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    PRINT("GetStream\n");
+
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    if (index >= _items.Size()) {
+        return _nested.GetStream(index, stream);
+    }
+
+    const CItem& item = _items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    return _source.GetStream(
+        item.Offset, item.Size, _nested.GetStreamRef(this), stream
+    );
+    COM_TRY_END
+}
+
+// The read block size and opening nested archives apply here
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        HRESULT hres;
+        if (!_handlerProps.SetProperty(names[i], values[i], hres)) {
+            return E_INVALIDARG;
+        }
+        RINOK(hres)
+    }
+    _source.SetBlockSize(_handlerProps.BlockSize);
+    return S_OK;
+}
+
+static const Byte k_Signature[] = {0xC2, 0x33, 0x9F, 0x3D};
+
+REGISTER_ARC_I(
+    "gcm", "gcm iso", NULL, 0xA7, //
+    k_Signature, //
+    kMagicOffset, //
+    0, 0
+)
+
+} // namespace Gcm
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Types.h"
+
+namespace Gcm
+{
+
+static const UInt32 kMagic = 0xC2339F3D;
+static const UInt32 kMagicOffset = 0x1C;
+
+// Start of a GameCube disc, which the data of a Wii partition starts with
+// too: the disc header, the debug info after it, then the apploader
+static const UInt32 kBootSize = 0x440;
+static const UInt32 kBi2Offset = 0x440;
+static const UInt32 kBi2Size = 0x2000;
+static const UInt32 kApploaderOffset = 0x2440;
+static const UInt32 kApploaderHeaderSize = 0x20;
+static const UInt32 kDolHeaderSize = 0x100;
+
+// Refuse to allocate more than this for the FST
+static const UInt32 kFstSizeMax = 1 << 26;
+
+// Size of the apploader from its header
+UInt32 GetApploaderSize(const Byte* header);
+
+// Size of a DOL from its header. It ends where its last text or data section
+// does.
+UInt32 GetDolSize(const Byte* header);
+
+} // namespace Gcm
@@ -0,0 +1,281 @@
+// IndexCache.cpp - File for caching parsed archive indexes on disk
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "IndexCache.hpp"
+#include "ArcData.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/IntToString.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/StringConvert.h>
+#include <CPP/Windows/FileDir.h>
+#include <CPP/Windows/FileIO.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace IndexCache
+{
+
+// "MKIX", version, format name, key, checksum of everything after the header
+static const UInt32 kSignature = 0x58494B4D;
+static const UInt32 kVersion = 1;
+static const size_t kFormatNameSize = 8;
+static const size_t kHeaderSize = 0x30;
+
+// Bytes at the start of the archive that go into the key
+static const size_t kHeaderHashSize = 1 << 12;
+
+static const UInt64 kHashInit = 0xCBF29CE484222325;
+
+// FNV-1a
+static UInt64 CalcHash(const Byte* p, size_t size, UInt64 hash = kHashInit)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+HRESULT GetKey(IInStream* stream, IArchiveOpenCallback* callback, CKey& key)
+{
+    if (!callback) {
+        return S_FALSE;
+    }
+    CMyComPtr<IArchiveOpenVolumeCallback> volumeCallback;
+    callback->QueryInterface(
+        IID_IArchiveOpenVolumeCallback, (void**) &volumeCallback
+    );
+    if (!volumeCallback) {
+        return S_FALSE;
+    }
+    NWindows::NCOM::CPropVariant prop;
+    RINOK(volumeCallback->GetProperty(kpidMTime, &prop))
+    if (prop.vt != VT_FILETIME) {
+        return S_FALSE;
+    }
+    key.MTime = ((UInt64) prop.filetime.dwHighDateTime << 32) |
+                prop.filetime.dwLowDateTime;
+
+    RINOK(InStream_GetSize_SeekToEnd(stream, key.Size))
+    RINOK(InStream_SeekToBegin(stream))
+    Byte buf[kHeaderHashSize];
+    size_t size = kHeaderHashSize;
+    RINOK(ReadStream(stream, buf, &size))
+    key.HeaderHash = CalcHash(buf, size);
+    return InStream_SeekToBegin(stream);
+}
+
+void GetDefaultDir(FString& dir)
+{
+    ArcData::GetUserDir(dir);
+    if (dir.IsEmpty()) {
+        return;
+    }
+    dir.Add_PathSepar();
+    dir += FTEXT("index");
+}
+
+static FString GetPath(const FString& dir, const char* format, const CKey& key)
+{
+    Byte keyBytes[0x18];
+    SetUi64(keyBytes, key.Size)
+    SetUi64(keyBytes + 8, key.MTime)
+    SetUi64(keyBytes + 0x10, key.HeaderHash)
+    char hex[32];
+    ConvertUInt64ToHex(CalcHash(keyBytes, sizeof(keyBytes)), hex);
+
+    AString name(format);
+    name += '-';
+    name += hex;
+    name += ".idx";
+
+    FString path = dir;
+    path.Add_PathSepar();
+    path += fas2fs(name);
+    return path;
+}
+
+static void SetHeader(Byte* p, const char* format, const CKey& key)
+{
+    memset(p, 0, kHeaderSize);
+    SetUi32(p, kSignature)
+    SetUi32(p + 4, kVersion)
+    memcpy(p + 8, format, MyMin(strlen(format), kFormatNameSize));
+    SetUi64(p + 0x10, key.Size)
+    SetUi64(p + 0x18, key.MTime)
+    SetUi64(p + 0x20, key.HeaderHash)
+}
+
+// Sections are a 64-bit size followed by the data, padded to 8 bytes so that
+// every section can be used in place from the mapping
+void CWriter::Add(const void* data, size_t size)
+{
+    const size_t padded = (size + 7) & ~(size_t) 7;
+    const size_t needed = _size + 8 + padded;
+    if (needed > _buf.Size()) {
+        size_t newSize = _buf.Size() < (1 << 16) ? (1 << 16) : _buf.Size();
+        while (newSize < needed) {
+            newSize *= 2;
+        }
+        _buf.ChangeSize_KeepData(newSize, _size);
+    }
+
+    SetUi64(_buf + _size, size)
+    if (size != 0) {
+        memcpy(_buf + _size + 8, data, size);
+    }
+    memset(_buf + _size + 8 + size, 0, padded - size);
+    _size = needed;
+}
+
+HRESULT CWriter::Save(const FString& dir, const char* format, const CKey& key)
+{
+    using namespace NWindows::NFile;
+
+    if (!NDir::CreateComplexDir(dir)) {
+        return GetLastError_noZero_HRESULT();
+    }
+
+    Byte header[kHeaderSize];
+    SetHeader(header, format, key);
+    SetUi64(header + 0x28, CalcHash(_buf, _size))
+
+    const FString path = GetPath(dir, format, key);
+    FString tempPath = path;
+    tempPath += FTEXT(".tmp");
+
+    {
+        NIO::COutFile file;
+        if (!file.Create(tempPath, true) ||
+            !file.WriteFull(header, kHeaderSize) ||
+            !file.WriteFull(_buf, _size) || !file.Close()) {
+            const HRESULT res = GetLastError_noZero_HRESULT();
+            NDir::DeleteFileAlways(tempPath);
+            return res;
+        }
+    }
+
+    // An older index for the same key gets replaced
+    NDir::DeleteFileAlways(path);
+    if (!NDir::MyMoveFile(tempPath, path)) {
+        const HRESULT res = GetLastError_noZero_HRESULT();
+        NDir::DeleteFileAlways(tempPath);
+        return res;
+    }
+    return S_OK;
+}
+
+bool CReader::Open(const FString& dir, const char* format, const CKey& key)
+{
+    Close();
+    const FString path = GetPath(dir, format, key);
+
+#ifdef _WIN32
+    NWindows::NFile::NIO::CInFile file;
+    UInt64 fileSize;
+    if (!file.Open(path) || !file.GetLength(fileSize) ||
+        fileSize < kHeaderSize || fileSize != (size_t) fileSize) {
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingW(
+        file.GetHandle(), NULL, PAGE_READONLY, 0, 0, NULL
+    );
+    if (!mapping) {
+        return false;
+    }
+    // The view stays valid after the handles are closed
+    _view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!_view) {
+        return false;
+    }
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) kHeaderSize) {
+        close(fd);
+        return false;
+    }
+    const UInt64 fileSize = (UInt64) st.st_size;
+    void* view = mmap(NULL, (size_t) fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    _view = view;
+#endif
+
+    _data = (const Byte*) _view;
+    _size = (size_t) fileSize;
+
+    Byte header[kHeaderSize];
+    SetHeader(header, format, key);
+    if (memcmp(_data, header, 0x28) != 0 ||
+        GetUi64(_data + 0x28) !=
+            CalcHash(_data + kHeaderSize, _size - kHeaderSize)) {
+        PRINT("Stale or damaged index\n");
+        Close();
+        return false;
+    }
+    _pos = kHeaderSize;
+    return true;
+}
+
+void CReader::Close()
+{
+    if (_view) {
+#ifdef _WIN32
+        UnmapViewOfFile(_view);
+#else
+        munmap(_view, _size);
+#endif
+    }
+    _view = NULL;
+    _data = NULL;
+    _size = 0;
+    _pos = 0;
+}
+
+bool CReader::Read(const Byte*& data, size_t& size)
+{
+    if (_size - _pos < 8) {
+        return false;
+    }
+    const UInt64 size64 = GetUi64(_data + _pos);
+    const size_t rem = _size - _pos - 8;
+    if (size64 > rem || ((size64 + 7) & ~(UInt64) 7) > rem) {
+        return false;
+    }
+    data = _data + _pos + 8;
+    size = (size_t) size64;
+    _pos += 8 + (size_t) ((size64 + 7) & ~(UInt64) 7);
+    return true;
+}
+
+bool CReader::Read(void* dest, size_t size)
+{
+    const Byte* data;
+    size_t size2;
+    if (!Read(data, size2) || size2 != size) {
+        return false;
+    }
+    memcpy(dest, data, size);
+    return true;
+}
+
+} // namespace IndexCache
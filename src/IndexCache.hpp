@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Types.h"
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyString.h>
+#include <CPP/Common/MyVector.h>
+
+// Index files that let a handler skip parsing an archive it has opened
+// before. An index is a list of sections holding whatever the handler built
+// while parsing, stored in a cache directory under a key made from the
+// archive's size, modification time and a hash of its first bytes.
+namespace IndexCache
+{
+
+struct CKey {
+    UInt64 Size;
+    UInt64 MTime;
+    UInt64 HeaderHash;
+};
+
+// Build the key for the archive being opened. Returns S_FALSE if the host
+// doesn't give a modification time for it, in which case there's nothing
+// to tell a changed archive from the one that was indexed.
+HRESULT GetKey(IInStream* stream, IArchiveOpenCallback* callback, CKey& key);
+
+// Per user cache directory, used when no directory is given
+void GetDefaultDir(FString& dir);
+
+class CWriter
+{
+public:
+    CWriter()
+      : _size(0)
+    {
+    }
+
+    void Add(const void* data, size_t size);
+
+    void AddUi64(UInt64 value)
+    {
+        Add(&value, sizeof(value));
+    }
+
+    template <typename T>
+    void AddVector(const CRecordVector<T>& v)
+    {
+        Add(v.Size() != 0 ? &v[0] : NULL, v.Size() * sizeof(T));
+    }
+
+    // Write the index for key to dir. It goes to a temporary file first, so
+    // that an open running at the same time never maps half an index.
+    HRESULT Save(const FString& dir, const char* format, const CKey& key);
+
+private:
+    CByteBuffer _buf;
+    size_t _size;
+};
+
+class CReader
+{
+public:
+    CReader()
+      : _view(NULL)
+      , _data(NULL)
+      , _size(0)
+      , _pos(0)
+    {
+    }
+
+    ~CReader()
+    {
+        Close();
+    }
+
+    // Map the index for key from dir. Returns false if there isn't one, or
+    // if it doesn't match the key or fails its checksum.
+    bool Open(const FString& dir, const char* format, const CKey& key);
+    void Close();
+
+    // Sections are read back in the order they were added. Each of these
+    // returns false if there are no sections left or the next one doesn't
+    // have a fitting size.
+    bool Read(const Byte*& data, size_t& size);
+    bool Read(void* dest, size_t size);
+
+    bool ReadUi64(UInt64& value)
+    {
+        return Read(&value, sizeof(value));
+    }
+
+    template <typename T>
+    bool ReadVector(CRecordVector<T>& v)
+    {
+        const Byte* data;
+        size_t size;
+        if (!Read(data, size) || size % sizeof(T) != 0 ||
+            size / sizeof(T) > k_VectorSizeMax) {
+            return false;
+        }
+        v.ClearAndSetSize((unsigned) (size / sizeof(T)));
+        if (size != 0) {
+            memcpy(&v[0], data, size);
+        }
+        return true;
+    }
+
+    bool ReadBuffer(CByteArr& buf, size_t& size)
+    {
+        const Byte* data;
+        if (!Read(data, size)) {
+            return false;
+        }
+        buf.Alloc(size);
+        memcpy(buf, data, size);
+        return true;
+    }
+
+private:
+    void* _view;
+    const Byte* _data;
+    size_t _size;
+    size_t _pos;
+};
+
+} // namespace IndexCache
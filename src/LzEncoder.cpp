@@ -0,0 +1,449 @@
+// LzEncoder.cpp - File for the LZ encoder shared by Yaz0 and NitroLz
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "LzEncoder.hpp"
+#include "Parallel.hpp"
+
+#include <C/Alloc.h>
+#include <C/LzFind.h>
+#include <C/LzFindMt.h>
+
+#include <cstring>
+
+namespace LzEncoder
+{
+
+static const UInt32 kInfinity = 0xFFFFFFFF;
+static const UInt32 kOptWindow = 1 << 12;
+
+// Token stream for one chunk of input: one flag bit per token (set for a
+// literal) and the token payloads. Chunks are joined into flag groups in
+// order once every chunk is encoded.
+struct CTokenBuf {
+    const CFormat* Format;
+    CByteBuffer Flags;
+    CByteBuffer Payload;
+    size_t NumTokens;
+    size_t PayloadSize;
+
+    void Alloc(const CFormat& format, size_t inSize)
+    {
+        Format = &format;
+        Flags.Alloc(inSize / 8 + 1);
+        memset(Flags, 0, Flags.Size());
+        Payload.Alloc(inSize);
+        NumTokens = 0;
+        PayloadSize = 0;
+    }
+
+    bool IsLiteral(size_t t) const
+    {
+        return (Flags[t >> 3] & (0x80 >> (t & 7))) != 0;
+    }
+
+    void PutLiteral(Byte b)
+    {
+        Flags[NumTokens >> 3] |= (Byte) (0x80 >> (NumTokens & 7));
+        Payload[PayloadSize++] = b;
+        NumTokens++;
+    }
+
+    void PutMatch(UInt32 len, UInt32 dist)
+    {
+        PayloadSize += Format->PutMatch(Payload + PayloadSize, len, dist);
+        NumTokens++;
+    }
+};
+
+class CChunkEncoder
+{
+public:
+    CChunkEncoder(const CFormat& format, UInt32 level, bool multiThread);
+    ~CChunkEncoder();
+
+    // Encode data[start, end), using data[primeStart, start) as history
+    HRESULT Encode(
+        const Byte* data, size_t primeStart, size_t start, size_t end,
+        CTokenBuf& tokens
+    );
+
+private:
+    const CFormat& _format;
+    UInt32 _level;
+    bool _mt;
+    CMatchFinder _mf;
+    CMatchFinderMt _mfMt;
+    IMatchFinder2 _vt;
+    void* _mfObj;
+
+    const Byte* _cur;
+    CObjArray<UInt32> _matches;
+
+    // Optimal parser state
+    UInt32 _optCost[kOptWindow + 1];
+    UInt16 _optLen[kOptWindow + 1];
+    UInt16 _optDist[kOptWindow + 1];
+    UInt16 _optPath[kOptWindow + 1];
+
+    UInt32 GetMatches()
+    {
+        _vt.GetNumAvailableBytes(_mfObj);
+        _cur = _vt.GetPointerToCurrentPos(_mfObj);
+        return (UInt32) (_vt.GetMatches(_mfObj, _matches) - _matches);
+    }
+
+    void Skip(UInt32 num)
+    {
+        if (num != 0) {
+            _vt.Skip(_mfObj, num);
+        }
+    }
+
+    void EncodeGreedy(size_t size, CTokenBuf& tokens);
+    void EncodeLazy(size_t size, CTokenBuf& tokens);
+    void EncodeOptimal(size_t size, CTokenBuf& tokens);
+    void EmitOptimalPath(const Byte* data, UInt32 end, CTokenBuf& tokens);
+};
+
+CChunkEncoder::CChunkEncoder(
+    const CFormat& format, UInt32 level, bool multiThread
+)
+  : _format(format)
+  , _level(level)
+  , _mt(multiThread)
+  , _mfObj(NULL)
+  , _matches(format.MaxMatch * 2 + 2)
+{
+    MatchFinder_Construct(&_mf);
+    _mfMt.MatchFinder = &_mf;
+    MatchFinderMt_Construct(&_mfMt);
+}
+
+CChunkEncoder::~CChunkEncoder()
+{
+    MatchFinderMt_Destruct(&_mfMt, &g_BigAlloc);
+    MatchFinder_Free(&_mf, &g_BigAlloc);
+}
+
+HRESULT CChunkEncoder::Encode(
+    const Byte* data, size_t primeStart, size_t start, size_t end,
+    CTokenBuf& tokens
+)
+{
+    const size_t size = end - start;
+    if (size == 0) {
+        return S_OK;
+    }
+
+    if (_level == 0) {
+        for (size_t i = start; i < end; i++) {
+            tokens.PutLiteral(data[i]);
+        }
+        return S_OK;
+    }
+
+    static const UInt32 kCutValues[10] = {0, 4, 8, 16, 16, 24, 32, 32, 48, 64};
+    _mf.btMode = _level >= 4 ? 1 : 0;
+    _mf.numHashBytes = 4;
+    _mf.cutValue = kCutValues[_level];
+    _mf.expectedDataSize = end - primeStart;
+    MatchFinder_SET_DIRECT_INPUT_BUF(&_mf, data + primeStart, end - primeStart)
+
+    if (_mt && _mf.btMode) {
+        if (MatchFinderMt_Create(
+                &_mfMt, _format.MaxDistance, 0, _format.MaxMatch, 0,
+                &g_BigAlloc
+            ) != SZ_OK) {
+            return E_OUTOFMEMORY;
+        }
+        MatchFinderMt_CreateVTable(&_mfMt, &_vt);
+        _mfObj = &_mfMt;
+        if (MatchFinderMt_InitMt(&_mfMt) != SZ_OK) {
+            return E_FAIL;
+        }
+    } else {
+        _mt = false;
+        if (!MatchFinder_Create(
+                &_mf, _format.MaxDistance, 0, _format.MaxMatch, 0,
+                &g_BigAlloc
+            )) {
+            return E_OUTOFMEMORY;
+        }
+        MatchFinder_CreateVTable(&_mf, &_vt);
+        _mfObj = &_mf;
+    }
+    _vt.Init(_mfObj);
+    Skip((UInt32) (start - primeStart));
+
+    if (_level <= 3) {
+        EncodeGreedy(size, tokens);
+    } else if (_level <= 6) {
+        EncodeLazy(size, tokens);
+    } else {
+        EncodeOptimal(size, tokens);
+    }
+
+    if (_mt) {
+        MatchFinderMt_ReleaseStream(&_mfMt);
+    }
+
+    return _mf.result == SZ_OK ? S_OK : E_FAIL;
+}
+
+void CChunkEncoder::EncodeGreedy(size_t size, CTokenBuf& tokens)
+{
+    for (size_t pos = 0; pos < size;) {
+        const UInt32 num = GetMatches();
+        const UInt32 len = num != 0 ? _matches[num - 2] : 0;
+        if (len >= _format.MinMatch) {
+            tokens.PutMatch(len, _matches[num - 1] + 1);
+            Skip(len - 1);
+            pos += len;
+        } else {
+            tokens.PutLiteral(_cur[0]);
+            pos++;
+        }
+    }
+}
+
+void CChunkEncoder::EncodeLazy(size_t size, CTokenBuf& tokens)
+{
+    // Matches this long are taken without checking the next position
+    static const UInt32 kLazyLimit = 64;
+
+    UInt32 num = GetMatches();
+    UInt32 len = num != 0 ? _matches[num - 2] : 0;
+    UInt32 dist = num != 0 ? _matches[num - 1] + 1 : 0;
+    const Byte* cur = _cur;
+
+    for (size_t pos = 0; pos < size;) {
+        if (len < _format.MinMatch) {
+            tokens.PutLiteral(cur[0]);
+            if (++pos == size) {
+                break;
+            }
+            num = GetMatches();
+            len = num != 0 ? _matches[num - 2] : 0;
+            dist = num != 0 ? _matches[num - 1] + 1 : 0;
+            cur = _cur;
+            continue;
+        }
+
+        if (len < kLazyLimit && pos + 1 < size) {
+            const UInt32 num1 = GetMatches();
+            const UInt32 len1 = num1 != 0 ? _matches[num1 - 2] : 0;
+            if (len1 > len) {
+                // A longer match starts at the next byte, defer to it
+                tokens.PutLiteral(cur[0]);
+                pos++;
+                len = len1;
+                dist = _matches[num1 - 1] + 1;
+                cur = _cur;
+                continue;
+            }
+            tokens.PutMatch(len, dist);
+            Skip(len - 2);
+        } else {
+            tokens.PutMatch(len, dist);
+            Skip(len - 1);
+        }
+
+        pos += len;
+        if (pos == size) {
+            break;
+        }
+        num = GetMatches();
+        len = num != 0 ? _matches[num - 2] : 0;
+        dist = num != 0 ? _matches[num - 1] + 1 : 0;
+        cur = _cur;
+    }
+}
+
+void CChunkEncoder::EmitOptimalPath(
+    const Byte* data, UInt32 end, CTokenBuf& tokens
+)
+{
+    UInt32 numSteps = 0;
+    for (UInt32 i = end; i != 0; i -= _optLen[i]) {
+        _optPath[numSteps++] = (UInt16) i;
+    }
+
+    UInt32 prev = 0;
+    while (numSteps != 0) {
+        const UInt32 i = _optPath[--numSteps];
+        if (_optLen[i] == 1) {
+            tokens.PutLiteral(data[prev]);
+        } else {
+            tokens.PutMatch(_optLen[i], _optDist[i]);
+        }
+        prev = i;
+    }
+}
+
+void CChunkEncoder::EncodeOptimal(size_t size, CTokenBuf& tokens)
+{
+    static const UInt32 kFastBytes[10] = {
+        0, 0, 0, 0, 0, 0, 0, 32, 64, 128,
+    };
+    const UInt32 fastBytes = kFastBytes[_level];
+
+    for (size_t start = 0; start < size;) {
+        UInt32 window = kOptWindow;
+        if (window > size - start) {
+            window = (UInt32) (size - start);
+        }
+
+        _optCost[0] = 0;
+        for (UInt32 i = 1; i <= window; i++) {
+            _optCost[i] = kInfinity;
+        }
+
+        const Byte* base = NULL;
+        UInt32 i = 0;
+        UInt32 longLen = 0;
+        UInt32 longDist = 0;
+        for (; i < window; i++) {
+            const UInt32 num = GetMatches();
+            if (i == 0) {
+                base = _cur;
+            }
+
+            const UInt32 cost = _optCost[i];
+            if (cost + _format.LiteralCost < _optCost[i + 1]) {
+                _optCost[i + 1] = cost + _format.LiteralCost;
+                _optLen[i + 1] = 1;
+            }
+
+            if (num == 0) {
+                continue;
+            }
+
+            if (_matches[num - 2] >= fastBytes) {
+                // Long enough that the parse before it can be settled now
+                longLen = _matches[num - 2];
+                longDist = _matches[num - 1] + 1;
+                break;
+            }
+
+            UInt32 len = _format.MinMatch;
+            for (UInt32 m = 0; m < num; m += 2) {
+                UInt32 maxLen = _matches[m];
+                if (maxLen > window - i) {
+                    maxLen = window - i;
+                }
+                const UInt32 dist = _matches[m + 1] + 1;
+                for (; len <= maxLen; len++) {
+                    const UInt32 c = cost + _format.GetMatchCost(len);
+                    if (c < _optCost[i + len]) {
+                        _optCost[i + len] = c;
+                        _optLen[i + len] = (UInt16) len;
+                        _optDist[i + len] = (UInt16) dist;
+                    }
+                }
+            }
+        }
+
+        EmitOptimalPath(base, i, tokens);
+        start += i;
+
+        if (longLen != 0) {
+            tokens.PutMatch(longLen, longDist);
+            Skip(longLen - 1);
+            start += longLen;
+        }
+    }
+}
+
+HRESULT Encode(
+    const CFormat& format, const Byte* data, size_t size,
+    const CEncodeProps& props, size_t headerSize, CByteBuffer& out,
+    size_t& outSize, ICompressProgressInfo* progress
+)
+{
+    UInt32 level = props.Level;
+    if (level > 9) {
+        level = 9;
+    }
+    size_t chunkSize = props.ChunkSize;
+    if (chunkSize < format.MaxDistance) {
+        chunkSize = format.MaxDistance;
+    }
+    UInt32 numThreads = props.NumThreads;
+    if (numThreads == 0) {
+        numThreads = 1;
+    }
+
+    // A single thread gets one chunk. With several threads and input that
+    // doesn't split, the binary tree match finder gets its own threads.
+    const size_t numChunks =
+        numThreads == 1 || size == 0 ? 1 : (size + chunkSize - 1) / chunkSize;
+    if (numChunks == 1) {
+        chunkSize = size;
+    }
+    const bool mtMatchFinder = numChunks == 1 && numThreads > 1;
+
+    CObjArray<CTokenBuf> chunks(numChunks);
+    UInt64 inProcessed = 0;
+
+    auto encodeChunk = [&](UInt32 index) -> HRESULT {
+        const size_t start = (size_t) index * chunkSize;
+        size_t end = start + chunkSize;
+        if (end > size) {
+            end = size;
+        }
+        const size_t primeStart =
+            start < format.MaxDistance ? 0 : start - format.MaxDistance;
+
+        chunks[index].Alloc(format, end - start);
+        CChunkEncoder* encoder =
+            new CChunkEncoder(format, level, mtMatchFinder);
+        HRESULT res =
+            encoder->Encode(data, primeStart, start, end, chunks[index]);
+        delete encoder;
+        RINOK(res)
+
+        if (progress && numThreads == 1) {
+            inProcessed += end - start;
+            RINOK(progress->SetRatioInfo(&inProcessed, NULL))
+        }
+        return S_OK;
+    };
+    RINOK(Parallel::For(numThreads, (UInt32) numChunks, encodeChunk))
+
+    size_t maxSize = headerSize;
+    for (size_t i = 0; i < numChunks; i++) {
+        maxSize += chunks[i].PayloadSize + chunks[i].NumTokens / 8 + 1;
+    }
+    out.Alloc(maxSize);
+
+    Byte* p = out;
+    size_t pos = headerSize;
+    size_t flagPos = 0;
+    unsigned groupCount = 0;
+    for (size_t i = 0; i < numChunks; i++) {
+        const CTokenBuf& chunk = chunks[i];
+        const Byte* payload = chunk.Payload;
+        for (size_t t = 0; t < chunk.NumTokens; t++) {
+            if (groupCount == 0) {
+                flagPos = pos++;
+                p[flagPos] = 0;
+            }
+            const bool isLiteral = chunk.IsLiteral(t);
+            if (isLiteral == format.LiteralFlag) {
+                p[flagPos] |= (Byte) (0x80 >> groupCount);
+            }
+            const unsigned n = isLiteral ? 1 : format.GetMatchSize(payload);
+            memcpy(p + pos, payload, n);
+            payload += n;
+            pos += n;
+            groupCount = (groupCount + 1) & 7;
+        }
+    }
+
+    outSize = pos;
+    return S_OK;
+}
+
+} // namespace LzEncoder
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Types.h"
+#include <CPP/7zip/ICoder.h>
+#include <CPP/Common/MyBuffer.h>
+
+// Encoder shared by the LZ formats with a 4 KiB window and tokens in groups
+// of eight behind a flag byte (Yaz0 and NitroLz). Match finding, parsing and
+// threading live here, the formats only describe how tokens are priced and
+// written.
+namespace LzEncoder
+{
+
+struct CEncodeProps {
+    // 0: literals only, 1-3: greedy hash chain, 4-6: lazy binary tree,
+    // 7-9: optimal parse
+    UInt32 Level = 5;
+    UInt32 NumThreads = 1;
+    // Input is split into chunks of this size in multi-threaded mode. Each
+    // chunk primes its match finder with the preceding window of input, so
+    // splitting costs almost nothing in ratio.
+    UInt32 ChunkSize = 1 << 20;
+};
+
+struct CFormat {
+    UInt32 MinMatch;
+    UInt32 MaxMatch;
+    UInt32 MaxDistance;
+    // Token costs in bits, including the flag bit
+    UInt32 LiteralCost;
+    UInt32 (*GetMatchCost)(UInt32 len);
+    // Write a match token to p and return its size. dist is 1 for the
+    // previous byte. A token may not be larger than the bytes it covers.
+    unsigned (*PutMatch)(Byte* p, UInt32 len, UInt32 dist);
+    // Size of the match token starting at p
+    unsigned (*GetMatchSize)(const Byte* p);
+    // Flag bit value that marks a literal
+    bool LiteralFlag;
+};
+
+// Compress data into out[headerSize ..), flag bytes MSB first. The header
+// itself is left for the caller to fill in.
+HRESULT Encode(
+    const CFormat& format, const Byte* data, size_t size,
+    const CEncodeProps& props, size_t headerSize, CByteBuffer& out,
+    size_t& outSize, ICompressProgressInfo* progress
+);
+
+} // namespace LzEncoder
@@ -0,0 +1,613 @@
+// Narc.cpp - File for decoding Nintendo DS NARC archives
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "NitroLz.hpp"
+#include "Types.h"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/IntToString.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/MethodProps.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamObjects.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+namespace Narc
+{
+
+static const UInt32 kHeaderSize = 0x10;
+static const UInt32 kChunkHeaderSize = 0x8;
+static const UInt32 kBtafHeaderSize = 0xC;
+static const UInt32 kBtafEntrySize = 0x8;
+static const UInt32 kFntEntrySize = 0x8;
+
+// Refuse to allocate more than this for the allocation and name tables
+static const UInt32 kMetadataSizeMax = 1 << 26;
+// Or for the paths of all items, which a deeply nested archive could
+// otherwise make huge from small tables
+static const UInt32 kPathsSizeMax = 1 << 26;
+
+// Directories are numbered from this in the name table
+static const UInt32 kDirIdBase = 0xF000;
+
+// Bytes read from the start of a file to tell if it's LZ10/LZ11 compressed
+static const UInt32 kLzCheckSize = 1 << 8;
+
+static const UInt32 kNoPath = (UInt32) (Int32) -1;
+
+struct CItem {
+    // Offset of the full path in _paths
+    UInt32 PathOffset;
+    bool IsDir;
+    // Set once the file has been looked at for LZ10/LZ11 compression
+    bool LzChecked;
+    // LZ10/LZ11 type of a compressed file, 0 if it's stored as is or -mlz is
+    // off
+    Byte LzType;
+    // Offset in the GMIF data
+    UInt32 Offset;
+    UInt32 Size;
+    UInt32 UnpackSize;
+};
+
+Z7_CLASS_IMP_CHandler_IInArchive_2(IInArchiveGetStream, ISetProperties)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    // Files first, in the order of the allocation table, then directories
+    CRecordVector<CItem> _items;
+    // Null terminated paths of all items, built once at open
+    CRecordVector<wchar_t> _paths;
+
+    // Header, BTAF and BTNF, up to the start of the file data. Allocation
+    // entries and names are read from here as they are rather than copied
+    // out.
+    CByteArr _metadata;
+    UInt32 _metadataSize;
+    UInt32 _dataOffset;
+    UInt32 _dataSize;
+    const Byte* _fat;
+    UInt32 _numFiles;
+    const Byte* _fnt;
+    UInt32 _fntSize;
+    UInt32 _numDirs;
+    CByteArr _dirVisited;
+    // -mlz: extract LZ10/LZ11 compressed files decompressed
+    bool _lz;
+
+    HRESULT SetPath(
+        UInt32 index, int parent, const char* name, size_t nameLen
+    );
+    HRESULT AddDir(UInt32 dirIndex, int parent);
+    HRESULT CheckLz(CItem& item);
+    HRESULT DecodeLz(CItem& item, CByteBuffer& buf);
+    HRESULT Open2(IInStream* stream);
+
+public:
+    CHandler()
+      : _lz(false)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidHeadersSize,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+    kpidPackSize,
+    kpidOffset,
+    kpidMethod,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+HRESULT CHandler::SetPath(
+    UInt32 index, int parent, const char* name, size_t nameLen
+)
+{
+    UString name16;
+    if (!Convert_UTF8_Buf_To_Unicode(name, nameLen, name16)) {
+        PRINT("NARC: name is not valid UTF-8\n");
+    }
+    if (name16.IsEmpty()) {
+        name16 = "unknown";
+    }
+
+    // The parent's path is always complete by now, so it can be copied
+    // straight out of the buffer
+    const UInt32 parentPos = parent >= 0 ? _items[parent].PathOffset : 0;
+    UInt32 parentLen = 0;
+    if (parent >= 0) {
+        while (_paths[parentPos + parentLen] != 0) {
+            parentLen++;
+        }
+    }
+    if ((UInt64) _paths.Size() + parentLen + name16.Len() + 2 >
+        kPathsSizeMax) {
+        return S_FALSE;
+    }
+
+    _items[index].PathOffset = _paths.Size();
+    if (parent >= 0) {
+        for (UInt32 i = 0; i < parentLen; i++) {
+            _paths.Add(_paths[parentPos + i]);
+        }
+        _paths.Add(WCHAR_PATH_SEPARATOR);
+    }
+    for (unsigned i = 0; i < name16.Len(); i++) {
+        _paths.Add(name16[i]);
+    }
+    _paths.Add(0);
+    return S_OK;
+}
+
+HRESULT CHandler::AddDir(UInt32 dirIndex, int parent)
+{
+    PRINT("Dir %u, parent %d\n", dirIndex, parent);
+
+    if (dirIndex >= _numDirs || _dirVisited[dirIndex]) {
+        return S_FALSE;
+    }
+    _dirVisited[dirIndex] = 1;
+
+    // Each directory's entries are a run of names, files first numbered on
+    // from the directory's first file ID
+    const Byte* dirEntry = _fnt + dirIndex * kFntEntrySize;
+    UInt32 pos = GetUi32(dirEntry);
+    UInt32 fileId = GetUi16(dirEntry + 4);
+    for (;;) {
+        if (pos >= _fntSize) {
+            return S_FALSE;
+        }
+        const Byte type = _fnt[pos++];
+        if (type == 0) {
+            return S_OK;
+        }
+        const UInt32 nameLen = type & 0x7F;
+        if (nameLen == 0 || nameLen > _fntSize - pos) {
+            return S_FALSE;
+        }
+        const char* name = (const char*) _fnt + pos;
+        pos += nameLen;
+
+        if (!(type & 0x80)) {
+            if (fileId >= _numFiles) {
+                return S_FALSE;
+            }
+            if (_items[fileId].PathOffset == kNoPath) {
+                RINOK(SetPath(fileId, parent, name, nameLen))
+            }
+            fileId++;
+            continue;
+        }
+
+        if (pos + 2 > _fntSize) {
+            return S_FALSE;
+        }
+        const UInt32 id = GetUi16(_fnt + pos);
+        pos += 2;
+        if (id <= kDirIdBase) {
+            return S_FALSE;
+        }
+
+        CItem item;
+        item.PathOffset = kNoPath;
+        item.IsDir = true;
+        item.LzChecked = true;
+        item.LzType = 0;
+        item.Offset = 0;
+        item.Size = 0;
+        item.UnpackSize = 0;
+        const int index = (int) _items.Add(item);
+        RINOK(SetPath(index, parent, name, nameLen))
+        RINOK(AddDir(id - kDirIdBase, index))
+    }
+}
+
+// With -mlz, files are taken as LZ10/LZ11 compressed if they start with a
+// header whose sizes fit the file, followed by tokens that decode cleanly.
+// Token streams never take more than a flag bit per byte over the data itself,
+// nor less than the most a match can expand to. Each file is only read for
+// this the first time its size or data is asked for.
+HRESULT CHandler::CheckLz(CItem& item)
+{
+    if (item.LzChecked) {
+        return S_OK;
+    }
+    item.LzChecked = true;
+    if (!_lz || item.Size < 4) {
+        return S_OK;
+    }
+
+    Byte buf[kLzCheckSize];
+    const size_t size = MyMin(item.Size, kLzCheckSize);
+    NitroLz::CHeader header;
+    const HRESULT res =
+        _source.Read((UInt64) _dataOffset + item.Offset, buf, size);
+    if (res == S_FALSE) {
+        return S_OK;
+    }
+    RINOK(res)
+    if (!NitroLz::ParseHeader(buf, size, header, 0) ||
+        !NitroLz::IsSizePlausible(header, item.Size) ||
+        !NitroLz::IsCompressed(buf, size)) {
+        return S_OK;
+    }
+    item.LzType = header.Type;
+    item.UnpackSize = header.UnpackSize;
+    return S_OK;
+}
+
+// Decode a compressed file in full. If it doesn't decode after all, it's
+// taken as stored from then on and buf is left empty, so the stored bytes are
+// given instead.
+HRESULT CHandler::DecodeLz(CItem& item, CByteBuffer& buf)
+{
+    buf.Free();
+    CMyComPtr<ISequentialInStream> inStream;
+    HRESULT res = _source.GetStream(
+        (UInt64) _dataOffset + item.Offset, item.Size, (IInArchive*) this,
+        &inStream
+    );
+    if (res == S_OK) {
+        NitroLz::CDecoder decoder;
+        if (!decoder.Create()) {
+            return E_OUTOFMEMORY;
+        }
+        decoder.SetStream(inStream);
+        NitroLz::CHeader header;
+        res = decoder.ReadHeader(header, item.LzType);
+        if (res == S_OK) {
+            buf.Alloc(item.UnpackSize);
+            decoder.Init(header.Type, buf, item.UnpackSize, item.UnpackSize);
+            res = decoder.Decode(item.UnpackSize);
+            if (res == S_OK && decoder.IsFinished()) {
+                return S_OK;
+            }
+        }
+    }
+    if (res != S_OK && res != S_FALSE) {
+        return res;
+    }
+
+    PRINT("NARC: LZ decode failed, giving the stored data\n");
+    buf.Free();
+    item.LzType = 0;
+    item.UnpackSize = item.Size;
+    return S_OK;
+}
+
+HRESULT CHandler::Open2(IInStream* stream)
+{
+    RINOK(_source.Open(stream))
+    Byte header[kHeaderSize + kBtafHeaderSize];
+    RINOK(_source.Read(0, header, sizeof(header)))
+
+    if (GetBe32(header) != 0x4E415243 || header[4] != 0xFE ||
+        header[5] != 0xFF) {
+        return S_FALSE;
+    }
+    const UInt32 headerSize = GetUi16(header + 0xC);
+    if (headerSize != kHeaderSize || GetUi16(header + 0xE) < 3) {
+        return S_FALSE;
+    }
+
+    // The chunks come in a fixed order, and the file data starts after the
+    // GMIF header. Only the sizes are needed to read all of the tables in
+    // one go.
+    const Byte* btaf = header + kHeaderSize;
+    if (GetBe32(btaf) != 0x42544146) {
+        return S_FALSE;
+    }
+    const UInt32 btafSize = GetUi32(btaf + 4);
+    _numFiles = GetUi16(btaf + 8);
+    if (btafSize < kBtafHeaderSize + _numFiles * kBtafEntrySize ||
+        btafSize > kMetadataSizeMax - headerSize) {
+        return S_FALSE;
+    }
+
+    const UInt32 btnfOffset = headerSize + btafSize;
+    Byte btnfHeader[kChunkHeaderSize];
+    RINOK(_source.Read(btnfOffset, btnfHeader, kChunkHeaderSize))
+    if (GetBe32(btnfHeader) != 0x42544E46) {
+        return S_FALSE;
+    }
+    const UInt32 btnfSize = GetUi32(btnfHeader + 4);
+    // Summed in 64 bits so the GMIF header can't wrap back into the buffer
+    if (btnfSize < kChunkHeaderSize + kFntEntrySize ||
+        (UInt64) btnfOffset + btnfSize + kChunkHeaderSize > kMetadataSizeMax) {
+        return S_FALSE;
+    }
+
+    const UInt32 gmifOffset = btnfOffset + btnfSize;
+    _dataOffset = gmifOffset + kChunkHeaderSize;
+    _metadataSize = _dataOffset;
+    _metadata.Alloc(_metadataSize);
+    RINOK(_source.Read(0, _metadata, _metadataSize))
+
+    const Byte* gmif = _metadata + gmifOffset;
+    if (GetBe32(gmif) != 0x474D4946 || GetUi32(gmif + 4) < kChunkHeaderSize) {
+        return S_FALSE;
+    }
+    _dataSize = GetUi32(gmif + 4) - kChunkHeaderSize;
+
+    _fat = _metadata + headerSize + kBtafHeaderSize;
+    _fnt = _metadata + btnfOffset + kChunkHeaderSize;
+    _fntSize = btnfSize - kChunkHeaderSize;
+
+    // The root's parent field holds the number of directories
+    _numDirs = GetUi16(_fnt + 6);
+    if (_numDirs == 0 || _numDirs > _fntSize / kFntEntrySize) {
+        return S_FALSE;
+    }
+
+    _items.ClearAndReserve(_numFiles + _numDirs - 1);
+    for (UInt32 i = 0; i < _numFiles; i++) {
+        const Byte* entry = _fat + i * kBtafEntrySize;
+        CItem item;
+        item.PathOffset = kNoPath;
+        item.IsDir = false;
+        item.LzChecked = false;
+        item.LzType = 0;
+        item.Offset = GetUi32(entry);
+        const UInt32 end = GetUi32(entry + 4);
+        if (end < item.Offset || end > _dataSize) {
+            return S_FALSE;
+        }
+        item.Size = end - item.Offset;
+        item.UnpackSize = item.Size;
+        _items.Add(item);
+    }
+
+    _dirVisited.Alloc(_numDirs);
+    memset(_dirVisited, 0, _numDirs);
+    RINOK(AddDir(0, -1))
+
+    // Files left out of the name table, which is all of them in archives
+    // built without names, are known by their index
+    for (UInt32 i = 0; i < _numFiles; i++) {
+        if (_items[i].PathOffset == kNoPath) {
+            char s[16];
+            ConvertUInt32ToString(i, s);
+            const size_t len = strlen(s);
+            memcpy(s + len, ".bin", 5);
+            RINOK(SetPath(i, -1, s, len + 4))
+        }
+    }
+
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (Open2(stream) != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _source.Close();
+    _items.Clear();
+    _paths.Clear();
+    _metadata.Free();
+    _metadataSize = 0;
+    _numFiles = 0;
+    _dirVisited.Free();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _items.Size();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidHeadersSize:
+        prop = _metadataSize;
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    CItem& item = _items[index];
+
+    switch (propID) {
+    case kpidPath:
+        prop = &_paths[item.PathOffset];
+        break;
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+        if (!item.IsDir) {
+            RINOK(CheckLz(item))
+            prop = item.UnpackSize;
+        }
+        break;
+
+    case kpidPackSize:
+        if (!item.IsDir) {
+            prop = item.Size;
+        }
+        break;
+
+    case kpidOffset:
+        if (!item.IsDir) {
+            prop = (UInt64) _dataOffset + item.Offset;
+        }
+        break;
+
+    case kpidMethod:
+        // Compressed files extract decompressed
+        RINOK(CheckLz(item))
+        if (item.LzType != 0) {
+            prop = item.LzType == NitroLz::kTypeLz11 ? "LZ11" : "LZ10";
+        }
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    if (allFilesMode)
+        numItems = _items.Size();
+    if (numItems == 0)
+        return S_OK;
+
+    CRecordVector<ArcData::CRange> ranges;
+    ranges.ClearAndSetSize(numItems);
+    for (UInt32 i = 0; i < numItems; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        CItem& item = _items[index];
+        RINOK(CheckLz(item))
+        ArcData::CRange& range = ranges[i];
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = (UInt64) _dataOffset + item.Offset;
+        range.Size = item.UnpackSize;
+    }
+
+    auto copy = [&](const ArcData::CRange& range,
+                    ISequentialOutStream* outStream,
+                    ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+        CItem& item = _items[range.Index];
+        CByteBuffer buf;
+        if (item.LzType != 0) {
+            RINOK(DecodeLz(item, buf))
+        }
+        if (item.LzType == 0) {
+            return _source.Copy(
+                range.Offset, item.Size, outStream, progress, isOk
+            );
+        }
+        if (outStream) {
+            RINOK(WriteStream(outStream, buf, buf.Size()))
+        }
+        if (progress) {
+            const UInt64 packSize = item.Size;
+            const UInt64 unpackSize = buf.Size();
+            RINOK(progress->SetRatioInfo(&packSize, &unpackSize))
+        }
+        return S_OK;
+    };
+    return ArcData::ExtractRanges(ranges, testMode, extractCallback, copy);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    CItem& item = _items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    RINOK(CheckLz(item))
+
+    // Compressed files are small enough to decode in full
+    CReferenceBuf* refBuf = new CReferenceBuf;
+    CMyComPtr<IUnknown> ref = refBuf;
+    if (item.LzType != 0) {
+        RINOK(DecodeLz(item, refBuf->Buf))
+    }
+    if (item.LzType == 0) {
+        return _source.GetStream(
+            (UInt64) _dataOffset + item.Offset, item.Size, (IInArchive*) this,
+            stream
+        );
+    }
+    Create_BufInStream_WithReference(
+        refBuf->Buf, refBuf->Buf.Size(), ref, stream
+    );
+    return S_OK;
+
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _lz = false;
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        if (name.IsEqualTo("lz")) {
+            RINOK(PROPVARIANT_to_bool(values[i], _lz))
+        } else {
+            return E_INVALIDARG;
+        }
+    }
+    return S_OK;
+}
+
+static const Byte k_Signature[] = {'N', 'A', 'R', 'C', 0xFE, 0xFF};
+
+REGISTER_ARC_I(
+    "narc", "narc", NULL, 0xAE, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kPreArc, 0
+)
+
+} // namespace Narc
@@ -0,0 +1,748 @@
+// Nested.cpp - File for opening archives stored inside other archives
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Nested.hpp"
+#include "Util.hpp"
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+#include <CPP/Windows/PropVariantConv.h>
+
+#include <CPP/7zip/Common/StreamUtils.h>
+
+namespace Nested
+{
+
+static const UInt32 kNoItem = (UInt32) (Int32) -1;
+
+// Bytes read from the start of an item to match signatures against
+static const size_t kProbeSize = 0x40;
+
+// Hands an extraction in a nested archive, or of the outer archive's own
+// items, on to the host's callback, with the item numbers the host knows
+Z7_CLASS_IMP_COM_1(CExtractCallback, IArchiveExtractCallback)
+Z7_IFACE_COM7_IMP(IProgress)
+#if CLANG_FORMAT_WORKAROUND
+    class CExtractCallback
+{
+#endif
+    CMyComPtr<IArchiveExtractCallback> _callback;
+    UInt32 _firstItem;
+
+public:
+    // The outer archive's total is passed on with AddedTotal added, that of
+    // a nested archive isn't passed on at all
+    bool PassTotal;
+    UInt64 AddedTotal;
+    UInt64 Total;
+    // Progress is given on top of what's been done in earlier archives
+    UInt64 CompletedBase;
+    UInt64 Completed;
+
+    CExtractCallback(IArchiveExtractCallback* callback, UInt32 firstItem)
+      : _callback(callback)
+      , _firstItem(firstItem)
+      , PassTotal(false)
+      , AddedTotal(0)
+      , Total(0)
+      , CompletedBase(0)
+      , Completed(0)
+    {
+    }
+};
+
+Z7_COM7F_IMF(CExtractCallback::SetTotal(UInt64 total))
+{
+    Total = total;
+    if (!PassTotal) {
+        return S_OK;
+    }
+    return _callback->SetTotal(total + AddedTotal);
+}
+
+Z7_COM7F_IMF(CExtractCallback::SetCompleted(const UInt64* completeValue))
+{
+    if (!completeValue) {
+        return S_OK;
+    }
+    Completed = *completeValue;
+    const UInt64 value = CompletedBase + Completed;
+    return _callback->SetCompleted(&value);
+}
+
+Z7_COM7F_IMF(CExtractCallback::GetStream(
+    UInt32 index, ISequentialOutStream** outStream, Int32 askExtractMode
+))
+{
+    return _callback->GetStream(_firstItem + index, outStream, askExtractMode);
+}
+
+Z7_COM7F_IMF(CExtractCallback::PrepareOperation(Int32 askExtractMode))
+{
+    return _callback->PrepareOperation(askExtractMode);
+}
+
+Z7_COM7F_IMF(CExtractCallback::SetOperationResult(Int32 opRes))
+{
+    return _callback->SetOperationResult(opRes);
+}
+
+// Stream of a nested item given to the host. The nested archive reads through
+// a stream that doesn't hold the outer handler, so this holds it instead.
+Z7_CLASS_IMP_IInStream(CItemStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CItemStream
+{
+#endif
+    CMyComPtr<IInStream> _stream;
+    CMyComPtr<IUnknown> _ref;
+
+public:
+    CItemStream(IInStream* stream, IUnknown* ref)
+      : _stream(stream)
+      , _ref(ref)
+    {
+    }
+};
+
+Z7_COM7F_IMF(CItemStream::Read(void* data, UInt32 size, UInt32* processed))
+{
+    return _stream->Read(data, size, processed);
+}
+
+Z7_COM7F_IMF(
+    CItemStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
+)
+{
+    return _stream->Seek(offset, seekOrigin, newPosition);
+}
+
+// Same for a stream that can't seek
+Z7_CLASS_IMP_COM_1(CSeqItemStream, ISequentialInStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CSeqItemStream
+{
+#endif
+    CMyComPtr<ISequentialInStream> _stream;
+    CMyComPtr<IUnknown> _ref;
+
+public:
+    CSeqItemStream(ISequentialInStream* stream, IUnknown* ref)
+      : _stream(stream)
+      , _ref(ref)
+    {
+    }
+};
+
+Z7_COM7F_IMF(CSeqItemStream::Read(void* data, UInt32 size, UInt32* processed))
+{
+    return _stream->Read(data, size, processed);
+}
+
+// Keeps the first kProbeSize bytes of each item extracted to it, and drops
+// the rest
+Z7_CLASS_IMP_COM_1(CProbeStream, ISequentialOutStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CProbeStream
+{
+#endif
+public:
+    Byte* Probe;
+    Byte* ProbeSize;
+};
+
+Z7_COM7F_IMF(
+    CProbeStream::Write(const void* data, UInt32 size, UInt32* processed)
+)
+{
+    const size_t cur = MyMin((size_t) size, kProbeSize - *ProbeSize);
+    memcpy(Probe + *ProbeSize, data, cur);
+    *ProbeSize += (Byte) cur;
+    if (processed) {
+        *processed = size;
+    }
+    return S_OK;
+}
+
+Z7_CLASS_IMP_COM_1(CProbeCallback, IArchiveExtractCallback)
+Z7_IFACE_COM7_IMP(IProgress)
+#if CLANG_FORMAT_WORKAROUND
+    class CProbeCallback
+{
+#endif
+    Byte* _probes;
+    Byte* _probeSizes;
+
+public:
+    CProbeCallback(Byte* probes, Byte* probeSizes)
+      : _probes(probes)
+      , _probeSizes(probeSizes)
+    {
+    }
+};
+
+Z7_COM7F_IMF(CProbeCallback::SetTotal(UInt64))
+{
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CProbeCallback::SetCompleted(const UInt64*))
+{
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CProbeCallback::GetStream(
+    UInt32 index, ISequentialOutStream** outStream, Int32 /* askExtractMode */
+))
+{
+    CProbeStream* probeStreamSpec = new CProbeStream;
+    CMyComPtr<ISequentialOutStream> probeStream = probeStreamSpec;
+    probeStreamSpec->Probe = _probes + (size_t) index * kProbeSize;
+    probeStreamSpec->ProbeSize = _probeSizes + index;
+    *outStream = probeStream.Detach();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CProbeCallback::PrepareOperation(Int32))
+{
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CProbeCallback::SetOperationResult(Int32))
+{
+    return S_OK;
+}
+
+void CExpander::Clear()
+{
+    for (unsigned i = 0; i < _arcs.Size(); i++) {
+        _arcs[i].Archive->Close();
+    }
+    _arcs.Clear();
+    _nodes.Clear();
+    _items.Clear();
+    _outer = NULL;
+    _firstIndex = 0;
+}
+
+HRESULT CExpander::Expand(
+    IInArchive* outer, UInt32 numItems, UInt32 maxDepth, UInt64 maxSize,
+    bool probeInOnePass
+)
+{
+    Clear();
+    _outer = outer;
+    _isExpanding = true;
+    const HRESULT res =
+        Expand2(outer, numItems, maxDepth, maxSize, probeInOnePass);
+    _isExpanding = false;
+    return res;
+}
+
+HRESULT CExpander::Expand2(
+    IInArchive* outer, UInt32 numItems, UInt32 maxDepth, UInt64 maxSize,
+    bool probeInOnePass
+)
+{
+    _firstIndex = numItems;
+
+    CMyComPtr<IInArchiveGetStream> getStream;
+    outer->QueryInterface(IID_IInArchiveGetStream, (void**) &getStream);
+    CMyComPtr<IArchiveGetRawProps> rawProps;
+    outer->QueryInterface(IID_IArchiveGetRawProps, (void**) &rawProps);
+    if (maxDepth == 0 || !getStream) {
+        return S_OK;
+    }
+
+    UInt64 sizeLeft = maxSize;
+    if (probeInOnePass) {
+        CByteBuffer probes, probeSizes;
+        RINOK(ProbeItems(outer, numItems, maxSize, probes, probeSizes))
+        for (UInt32 i = 0; i < numItems; i++) {
+            RINOK(OpenItem(
+                outer, getStream, rawProps, i, i, sizeLeft,
+                probes + (size_t) i * kProbeSize, probeSizes[i]
+            ))
+        }
+    } else {
+        for (UInt32 i = 0; i < numItems; i++) {
+            RINOK(OpenItem(outer, getStream, rawProps, i, i, sizeLeft))
+        }
+    }
+
+    // One level at a time: the items of the archives opened on one level are
+    // looked through once all of that level has been opened
+    unsigned levelStart = 0;
+    for (UInt32 depth = 1; depth < maxDepth; depth++) {
+        const unsigned levelEnd = _arcs.Size();
+        for (unsigned a = levelStart; a < levelEnd; a++) {
+            // CObjectVector keeps its items in place as it grows
+            const CArc& arc = _arcs[a];
+            if (!arc.GetStream) {
+                continue;
+            }
+            for (UInt32 i = 0; i < arc.NumItems; i++) {
+                RINOK(OpenItem(
+                    arc.Archive, arc.GetStream, arc.RawProps, i,
+                    arc.FirstItem + i, sizeLeft
+                ))
+            }
+        }
+        levelStart = levelEnd;
+    }
+
+    PRINT("Nested archives: %u\n", _arcs.Size());
+    return S_OK;
+}
+
+// Whether item index of archive is a file no larger than sizeLeft
+static HRESULT IsFileWithin(
+    IInArchive* archive, UInt32 index, UInt64 sizeLeft, bool& isWithin,
+    UInt64& size
+)
+{
+    isWithin = false;
+    NWindows::NCOM::CPropVariant prop;
+    RINOK(archive->GetProperty(index, kpidIsDir, &prop))
+    if (prop.vt == VT_BOOL && prop.boolVal != VARIANT_FALSE) {
+        return S_OK;
+    }
+    prop.Clear();
+    RINOK(archive->GetProperty(index, kpidSize, &prop))
+    isWithin = ConvertPropVariantToUInt64(prop, size) && size <= sizeLeft;
+    return S_OK;
+}
+
+// Read the start of every file of archive that could be opened, in one
+// extraction. Items that aren't read are left with a probe size of 0.
+HRESULT CExpander::ProbeItems(
+    IInArchive* archive, UInt32 numItems, UInt64 maxSize, CByteBuffer& probes,
+    CByteBuffer& probeSizes
+)
+{
+    probes.Alloc((size_t) numItems * kProbeSize);
+    probeSizes.Alloc(numItems);
+    if (numItems != 0) {
+        memset(probeSizes, 0, numItems);
+    }
+
+    CRecordVector<UInt32> indices;
+    for (UInt32 i = 0; i < numItems; i++) {
+        bool isWithin;
+        UInt64 size;
+        RINOK(IsFileWithin(archive, i, maxSize, isWithin, size))
+        if (isWithin && size != 0) {
+            indices.Add(i);
+        }
+    }
+    if (indices.IsEmpty()) {
+        return S_OK;
+    }
+
+    CMyComPtr<IArchiveExtractCallback> callback =
+        new CProbeCallback(probes, probeSizes);
+    return archive->Extract(&indices.Front(), indices.Size(), 0, callback);
+}
+
+// Open item index of archive, numbered hostIndex for the host, as an archive
+// if it is one. If probe is given, it's the start of the item, and the item
+// is only read through a stream if it matches a signature. Anything that
+// keeps it from being opened just leaves it as a plain file.
+HRESULT CExpander::OpenItem(
+    IInArchive* archive, IInArchiveGetStream* getStream,
+    IArchiveGetRawProps* rawProps, UInt32 index, UInt32 hostIndex,
+    UInt64& sizeLeft, const Byte* probe, size_t probeSize
+)
+{
+    UInt64 size;
+    bool isWithin;
+    RINOK(IsFileWithin(archive, index, sizeLeft, isWithin, size))
+    if (!isWithin) {
+        return S_OK;
+    }
+    unsigned pos = 0;
+    if (probe && !FindFormat(probe, probeSize, pos)) {
+        return S_OK;
+    }
+
+    CMyComPtr<ISequentialInStream> seqStream;
+    if (getStream->GetStream(index, &seqStream) != S_OK || !seqStream) {
+        return S_OK;
+    }
+    CMyComPtr<IInStream> stream;
+    seqStream.QueryInterface(IID_IInStream, &stream);
+    if (!stream) {
+        return S_OK;
+    }
+
+    Byte probeBuf[kProbeSize];
+    if (!probe) {
+        probeSize = kProbeSize;
+        RINOK(ReadStream(stream, probeBuf, &probeSize))
+        probe = probeBuf;
+    }
+
+    CMyComPtr<IInArchive> nested;
+    for (pos = 0;;) {
+        const CArcInfo* arcInfo = FindFormat(probe, probeSize, pos);
+        if (!arcInfo) {
+            return S_OK;
+        }
+        RINOK(InStream_SeekToBegin(stream))
+        nested = arcInfo->CreateInArchive();
+        const UInt64 maxCheckStartPosition = 0;
+        if (nested->Open(stream, &maxCheckStartPosition, NULL) == S_OK) {
+            PRINT("Nested %s at %u\n", arcInfo->Name, hostIndex);
+            break;
+        }
+        nested->Close();
+        nested.Release();
+    }
+
+    UInt32 numItems;
+    RINOK(nested->GetNumberOfItems(&numItems))
+    if (numItems >= k_VectorSizeMax - _firstIndex - _items.Size()) {
+        nested->Close();
+        return S_OK;
+    }
+
+    // The directory goes where the archive item is
+    UString path;
+    UInt32 parent = kNoItem;
+    UInt32 parentType;
+    {
+        NWindows::NCOM::CPropVariant prop;
+        if (hostIndex < _firstIndex) {
+            RINOK(archive->GetProperty(index, kpidPath, &prop))
+            if (rawProps) {
+                RINOK(rawProps->GetParent(index, &parent, &parentType))
+            }
+        } else {
+            RINOK(GetProperty(hostIndex, kpidPath, &prop))
+            RINOK(GetParent(hostIndex, &parent, &parentType))
+        }
+        if (prop.vt == VT_BSTR) {
+            path = prop.bstrVal;
+        }
+    }
+
+    const unsigned arcIndex = _arcs.Size();
+    CArc& arc = _arcs.AddNew();
+    arc.Archive = nested;
+    nested.QueryInterface(IID_IArchiveGetRawProps, &arc.RawProps);
+    nested.QueryInterface(IID_IInArchiveGetStream, &arc.GetStream);
+    arc.NumItems = numItems;
+
+    const UString name = path.Ptr(path.ReverseFind_PathSepar() + 1);
+    const int dot = name.ReverseFind_Dot();
+    arc.BaseName = dot > 0 ? name.Left((unsigned) dot) : name;
+    arc.Path = path;
+    arc.Path += L".d";
+    UString dirName = name;
+    dirName += L".d";
+    arc.DirIndex = AddDir(parent, dirName, arc.Path);
+
+    arc.FirstItem = _firstIndex + _items.Size();
+    CItem item;
+    item.Arc = arcIndex;
+    item.Node = -1;
+    for (UInt32 i = 0; i < numItems; i++) {
+        item.Index = i;
+        _items.Add(item);
+    }
+    if (!arc.RawProps) {
+        RINOK(AddTree(arcIndex))
+    }
+
+    sizeLeft -= size;
+    return S_OK;
+}
+
+// Add a directory of the last archive opened
+UInt32
+CExpander::AddDir(UInt32 parent, const UString& name, const UString& path)
+{
+    CNode& node = _nodes.AddNew();
+    node.Parent = parent;
+    ConvertUnicodeToUTF8(name, node.Name);
+    node.Path = path;
+
+    CItem item;
+    item.Arc = _arcs.Size() - 1;
+    item.Index = kNoItem;
+    item.Node = (int) _nodes.Size() - 1;
+    _items.Add(item);
+    return _firstIndex + _items.Size() - 1;
+}
+
+// Directory at path in the nested archive, added along with the ones above it
+// if they aren't items of the archive
+UInt32 CExpander::FindDir(
+    const CArc& arc, UStringVector& dirPaths, CRecordVector<UInt32>& dirs,
+    const UString& path
+)
+{
+    if (path.IsEmpty()) {
+        return arc.DirIndex;
+    }
+    // Siblings tend to come one after another
+    for (unsigned i = dirPaths.Size(); i != 0;) {
+        i--;
+        if (dirPaths[i] == path) {
+            return dirs[i];
+        }
+    }
+
+    const int sep = path.ReverseFind_PathSepar();
+    const UInt32 parent =
+        FindDir(arc, dirPaths, dirs, path.Left(sep < 0 ? 0 : (unsigned) sep));
+    UString fullPath = arc.Path;
+    fullPath.Add_PathSepar();
+    fullPath += path;
+    const UInt32 index = AddDir(parent, path.Ptr(sep + 1), fullPath);
+    dirPaths.Add(path);
+    dirs.Add(index);
+    return index;
+}
+
+// Handlers without a tree of their own only give full paths, so the tree is
+// made from those here, adding the directories that aren't items themselves
+HRESULT CExpander::AddTree(unsigned arcIndex)
+{
+    const CArc& arc = _arcs[arcIndex];
+
+    UStringVector paths;
+    UStringVector dirPaths;
+    CRecordVector<UInt32> dirs;
+    for (UInt32 i = 0; i < arc.NumItems; i++) {
+        NWindows::NCOM::CPropVariant prop;
+        RINOK(arc.Archive->GetProperty(i, kpidPath, &prop))
+        const UString path =
+            prop.vt == VT_BSTR ? UString(prop.bstrVal) : arc.BaseName;
+        prop.Clear();
+        RINOK(arc.Archive->GetProperty(i, kpidIsDir, &prop))
+        if (prop.vt == VT_BOOL && prop.boolVal != VARIANT_FALSE) {
+            dirPaths.Add(path);
+            dirs.Add(arc.FirstItem + i);
+        }
+        paths.Add(path);
+    }
+
+    for (UInt32 i = 0; i < arc.NumItems; i++) {
+        const UString& path = paths[i];
+        const int sep = path.ReverseFind_PathSepar();
+        const UInt32 parent = FindDir(
+            arc, dirPaths, dirs, path.Left(sep < 0 ? 0 : (unsigned) sep)
+        );
+
+        CNode& node = _nodes.AddNew();
+        node.Parent = parent;
+        ConvertUnicodeToUTF8(path.Ptr(sep + 1), node.Name);
+        _items[arc.FirstItem - _firstIndex + i].Node = (int) _nodes.Size() - 1;
+    }
+    return S_OK;
+}
+
+HRESULT CExpander::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+{
+    const CItem& item = _items[index - _firstIndex];
+    const CArc& arc = _arcs[item.Arc];
+
+    NWindows::NCOM::CPropVariant prop;
+    // Items placed in the tree here are also named here, as the nested
+    // handler may not know them by name alone
+    if (propID == kpidName && item.Node >= 0) {
+        UString name;
+        ConvertUTF8ToUnicode(_nodes[item.Node].Name, name);
+        prop = name;
+        prop.Detach(value);
+        return S_OK;
+    }
+    if (item.Index == kNoItem) {
+        switch (propID) {
+        case kpidPath:
+            prop = _nodes[item.Node].Path;
+            break;
+        case kpidIsDir:
+            prop = true;
+            break;
+        }
+        prop.Detach(value);
+        return S_OK;
+    }
+
+    if (propID != kpidPath) {
+        return arc.Archive->GetProperty(item.Index, propID, value);
+    }
+
+    RINOK(arc.Archive->GetProperty(item.Index, kpidPath, &prop))
+    UString path = arc.Path;
+    path.Add_PathSepar();
+    path += prop.vt == VT_BSTR ? UString(prop.bstrVal) : arc.BaseName;
+    prop = path;
+    prop.Detach(value);
+    return S_OK;
+}
+
+HRESULT CExpander::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+{
+    const CItem& item = _items[index - _firstIndex];
+    const CArc& arc = _arcs[item.Arc];
+
+    *parentType = NParentType::kDir;
+    if (item.Node >= 0) {
+        *parent = _nodes[item.Node].Parent;
+        return S_OK;
+    }
+
+    *parent = arc.DirIndex;
+    if (arc.RawProps) {
+        UInt32 nestedParent;
+        RINOK(arc.RawProps->GetParent(item.Index, &nestedParent, parentType))
+        if (nestedParent != kNoItem) {
+            *parent = arc.FirstItem + nestedParent;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT CExpander::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+)
+{
+    const CItem& item = _items[index - _firstIndex];
+    const CArc& arc = _arcs[item.Arc];
+
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (item.Node >= 0) {
+        if (propID == kpidName) {
+            const AString& name = _nodes[item.Node].Name;
+            *data = name.Ptr();
+            *dataSize = name.Len() + 1;
+            *propType = NPropDataType::kUtf8z;
+        }
+        return S_OK;
+    }
+
+    if (arc.RawProps) {
+        return arc.RawProps->GetRawProp(
+            item.Index, propID, data, dataSize, propType
+        );
+    }
+    return S_OK;
+}
+
+HRESULT CExpander::GetStream(UInt32 index, ISequentialInStream** stream)
+{
+    const CItem& item = _items[index - _firstIndex];
+    const CArc& arc = _arcs[item.Arc];
+
+    *stream = NULL;
+    if (item.Index == kNoItem || !arc.GetStream) {
+        return S_FALSE;
+    }
+    CMyComPtr<ISequentialInStream> seqStream;
+    RINOK(arc.GetStream->GetStream(item.Index, &seqStream))
+    if (!seqStream) {
+        return S_FALSE;
+    }
+    CMyComPtr<IInStream> inStream;
+    seqStream.QueryInterface(IID_IInStream, &inStream);
+    CMyComPtr<ISequentialInStream> refStream;
+    if (inStream) {
+        refStream = new CItemStream(inStream, _outer);
+    } else {
+        refStream = new CSeqItemStream(seqStream, _outer);
+    }
+    *stream = refStream.Detach();
+    return S_OK;
+}
+
+HRESULT CExpander::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* callback, ExtractOwnFunc extractOwn, void* param
+)
+{
+    if (_items.Size() == 0) {
+        return extractOwn(param, callback);
+    }
+
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    if (allFilesMode) {
+        numItems = _firstIndex + _items.Size();
+    }
+
+    // Split the items up by the archive they're in. The host asks for them
+    // in increasing order, which they keep.
+    CObjectVector<CRecordVector<UInt32>> arcIndices;
+    for (unsigned i = 0; i < _arcs.Size(); i++) {
+        arcIndices.AddNew();
+    }
+    CRecordVector<UInt32> dirs;
+    UInt64 nestedTotal = 0;
+    for (UInt32 i = 0; i < numItems; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        if (index < _firstIndex) {
+            continue;
+        }
+        const CItem& item = _items[index - _firstIndex];
+        if (item.Index == kNoItem) {
+            dirs.Add(index);
+            continue;
+        }
+        arcIndices[item.Arc].Add(item.Index);
+        NWindows::NCOM::CPropVariant prop;
+        RINOK(_arcs[item.Arc].Archive->GetProperty(item.Index, kpidSize, &prop))
+        UInt64 size;
+        if (ConvertPropVariantToUInt64(prop, size)) {
+            nestedTotal += size;
+        }
+    }
+
+    UInt64 completed;
+    {
+        CExtractCallback* callbackSpec = new CExtractCallback(callback, 0);
+        CMyComPtr<IArchiveExtractCallback> ownCallback = callbackSpec;
+        callbackSpec->PassTotal = true;
+        callbackSpec->AddedTotal = nestedTotal;
+        RINOK(extractOwn(param, ownCallback))
+        completed = callbackSpec->Total;
+    }
+    RINOK(callback->SetTotal(completed + nestedTotal))
+
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+    for (unsigned i = 0; i < dirs.Size(); i++) {
+        CMyComPtr<ISequentialOutStream> outStream;
+        RINOK(callback->GetStream(dirs[i], &outStream, askMode))
+        RINOK(callback->PrepareOperation(askMode))
+        RINOK(callback->SetOperationResult(
+            NArchive::NExtract::NOperationResult::kOK
+        ))
+    }
+
+    for (unsigned i = 0; i < _arcs.Size(); i++) {
+        const CRecordVector<UInt32>& list = arcIndices[i];
+        if (list.Size() == 0) {
+            continue;
+        }
+        CExtractCallback* callbackSpec =
+            new CExtractCallback(callback, _arcs[i].FirstItem);
+        CMyComPtr<IArchiveExtractCallback> nestedCallback = callbackSpec;
+        callbackSpec->CompletedBase = completed;
+        RINOK(_arcs[i].Archive->Extract(
+            &list[0], list.Size(), testMode, nestedCallback
+        ))
+        completed += callbackSpec->Completed;
+    }
+    return S_OK;
+}
+
+} // namespace Nested
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Types.h"
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/MyString.h>
+#include <CPP/Common/MyVector.h>
+
+// Archives stored as items of another archive. They're opened in place over
+// the stream the outer handler gives for the item, without a temporary copy,
+// and their items are shown after the outer archive's own, in a directory
+// named after the item with ".d" added.
+namespace Nested
+{
+
+// Find the next format after pos whose signature matches the start of p.
+// Start with pos set to 0. Containers come before single file wrappers such
+// as Yaz0, so a Yaz0 compressed U8 archive opens as the U8 archive itself.
+// Defined next to the format table in Codecs.cpp.
+const CArcInfo* FindFormat(const Byte* p, size_t size, unsigned& pos);
+
+class CExpander
+{
+public:
+    CExpander()
+      : _outer(NULL)
+      , _isExpanding(false)
+      , _firstIndex(0)
+    {
+    }
+
+    ~CExpander()
+    {
+        Clear();
+    }
+
+    // Open the archives found in the numItems items of outer, and in the
+    // items of those in turn, down to maxDepth levels. Archives are opened
+    // while their sizes add up to no more than maxSize, since a compressed
+    // one may be held in memory in full. Handlers whose every stream decodes
+    // the archive from the start set probeInOnePass, so that the signatures
+    // of their items are read in a single extraction, and only the items
+    // that match one are opened through a stream.
+    HRESULT Expand(
+        IInArchive* outer, UInt32 numItems, UInt32 maxDepth, UInt64 maxSize,
+        bool probeInOnePass = false
+    );
+
+    // Nested archives keep streams from the outer handler, so this has to be
+    // called from the handler's Close, and the expander has to be a member
+    // declared after everything those streams read from
+    void Clear();
+
+    // Reference for the outer handler's GetStream to keep in the streams it
+    // gives out. Streams for the nested archives don't keep one, as the
+    // handler already holds the archives, and one back to it would keep both
+    // alive when the host releases the handler without closing it.
+    IUnknown* GetStreamRef(IInArchive* outer) const
+    {
+        return _isExpanding ? NULL : outer;
+    }
+
+    UInt32 GetNumItems() const
+    {
+        return _items.Size();
+    }
+
+    // These take indices as the host sees them, starting after the outer
+    // archive's own items. Streams given out keep the outer handler alive.
+    HRESULT GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value);
+    HRESULT GetParent(UInt32 index, UInt32* parent, UInt32* parentType);
+    HRESULT GetRawProp(
+        UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+        UInt32* propType
+    );
+    HRESULT GetStream(UInt32 index, ISequentialInStream** stream);
+
+    // Extracts the outer archive's own items among indices, through the
+    // callback it's given in place of callback
+    typedef HRESULT (*ExtractOwnFunc)(
+        void* param, IArchiveExtractCallback* callback
+    );
+
+    // Extract the items among indices: the outer archive's own with
+    // extractOwn, then the nested ones. The sizes of the nested items are
+    // added to the total the outer archive sets, and their progress carries
+    // on from where it left off.
+    HRESULT Extract(
+        const UInt32* indices, UInt32 numItems, Int32 testMode,
+        IArchiveExtractCallback* callback, ExtractOwnFunc extractOwn,
+        void* param
+    );
+
+    template <typename F>
+    HRESULT Extract(
+        const UInt32* indices, UInt32 numItems, Int32 testMode,
+        IArchiveExtractCallback* callback, F& extractOwn
+    )
+    {
+        return Extract(
+            indices, numItems, testMode, callback,
+            [](void* param, IArchiveExtractCallback* callback) -> HRESULT {
+                return (*(F*) param)(callback);
+            },
+            &extractOwn
+        );
+    }
+
+private:
+    struct CArc {
+        CMyComPtr<IInArchive> Archive;
+        CMyComPtr<IArchiveGetRawProps> RawProps;
+        CMyComPtr<IInArchiveGetStream> GetStream;
+        // Index of the directory standing for the archive, and of its
+        // first item
+        UInt32 DirIndex;
+        UInt32 FirstItem;
+        UInt32 NumItems;
+        UString Path;
+        // Item name without the extension, for single file wrappers that
+        // don't name their item
+        UString BaseName;
+    };
+
+    // Place in the tree of an item the nested handler can't give one for
+    struct CNode {
+        UInt32 Parent;
+        AString Name;
+        // Full path, for directories added here
+        UString Path;
+    };
+
+    struct CItem {
+        unsigned Arc;
+        // Index in the nested archive, or kNoItem for a directory added here
+        UInt32 Index;
+        // Index in _nodes, or -1 if the nested handler has its own tree
+        int Node;
+    };
+
+    // Not held, as it holds the expander
+    IInArchive* _outer;
+    bool _isExpanding;
+    CObjectVector<CArc> _arcs;
+    CObjectVector<CNode> _nodes;
+    CRecordVector<CItem> _items;
+    UInt32 _firstIndex;
+
+    HRESULT ProbeItems(
+        IInArchive* archive, UInt32 numItems, UInt64 maxSize,
+        CByteBuffer& probes, CByteBuffer& probeSizes
+    );
+    HRESULT OpenItem(
+        IInArchive* archive, IInArchiveGetStream* getStream,
+        IArchiveGetRawProps* rawProps, UInt32 index, UInt32 hostIndex,
+        UInt64& sizeLeft, const Byte* probe = NULL, size_t probeSize = 0
+    );
+    UInt32 AddDir(UInt32 parent, const UString& name, const UString& path);
+    UInt32 FindDir(
+        const CArc& arc, UStringVector& dirPaths, CRecordVector<UInt32>& dirs,
+        const UString& path
+    );
+    HRESULT Expand2(
+        IInArchive* outer, UInt32 numItems, UInt32 maxDepth, UInt64 maxSize,
+        bool probeInOnePass
+    );
+    HRESULT AddTree(unsigned arcIndex);
+};
+
+} // namespace Nested
@@ -0,0 +1,791 @@
+// NitroLz.cpp - File for Nintendo LZ10/LZ11 compression
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "NitroLz.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/ProgressUtils.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/RegisterCodec.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <cstring>
+
+namespace NitroLz
+{
+
+// Method IDs for the plugin's own codecs are 0x7F4D00xx
+static const UInt64 kMethodIdLz10 = 0x7F4D0010;
+static const UInt64 kMethodIdLz11 = 0x7F4D0011;
+static const UInt64 kMethodIdLz77 = 0x7F4D0077;
+
+// Tokens that IsCompressed has to get through when the data it's given ends
+// first: four flag bytes' worth, which take at most 0x84 bytes
+static const UInt32 kCheckTokensMin = 32;
+
+// Compressed files may be padded past the end of the token stream
+static const UInt32 kPaddingMax = 0x20;
+
+// Most a byte of token stream can expand to: eight 18-byte LZ10 matches take
+// 17 bytes, and eight 0x10110-byte LZ11 matches take 33
+static const UInt32 kLz10RatioMax = 9;
+static const UInt32 kLz11RatioMax = 0x4000;
+
+static inline bool IsMagic(const Byte* p)
+{
+    return p[0] == 'L' && p[1] == 'Z' && p[2] == '7' && p[3] == '7';
+}
+
+bool ParseHeader(
+    const Byte* p, size_t size, CHeader& header, Byte requiredType
+)
+{
+    size_t pos = 0;
+    header.HasMagic = false;
+    if (requiredType == 0 && size >= 4 && IsMagic(p)) {
+        header.HasMagic = true;
+        pos = 4;
+    }
+    if (pos + 4 > size) {
+        return false;
+    }
+
+    header.Type = p[pos];
+    if (header.Type != kTypeLz10 && header.Type != kTypeLz11) {
+        return false;
+    }
+    if (requiredType != 0 && header.Type != requiredType) {
+        return false;
+    }
+
+    header.UnpackSize = GetUi32(p + pos) >> 8;
+    pos += 4;
+    if (header.UnpackSize == 0) {
+        // Sizes of 16 MiB and up follow in an extra word
+        if (pos + 4 > size) {
+            return false;
+        }
+        header.UnpackSize = GetUi32(p + pos);
+        pos += 4;
+    }
+    header.Size = (UInt32) pos;
+    return true;
+}
+
+bool IsCompressed(const Byte* p, size_t size)
+{
+    CHeader header;
+    if (!ParseHeader(p, size, header, 0)) {
+        return false;
+    }
+
+    // Walk the tokens without producing output, checking that no match
+    // reaches back before the start of the data
+    const bool isLz11 = header.Type == kTypeLz11;
+    size_t pos = header.Size;
+    UInt64 outPos = 0;
+    UInt32 numTokens = 0;
+    while (pos < size && outPos < header.UnpackSize) {
+        const Byte flags = p[pos++];
+        for (unsigned i = 0; i < 8 && outPos < header.UnpackSize; i++) {
+            if (!(flags & (0x80 >> i))) {
+                if (pos++ >= size) {
+                    return numTokens >= kCheckTokensMin;
+                }
+                outPos++;
+                numTokens++;
+                continue;
+            }
+            if (pos + 2 > size) {
+                return numTokens >= kCheckTokensMin;
+            }
+            UInt32 len;
+            const Byte b0 = p[pos];
+            if (!isLz11) {
+                len = (b0 >> 4) + 3;
+            } else if ((b0 >> 4) == 0) {
+                if (pos + 3 > size) {
+                    return numTokens >= kCheckTokensMin;
+                }
+                len = (((UInt32) (b0 & 0xF) << 4) | (p[pos + 1] >> 4)) + 0x11;
+                pos++;
+            } else if ((b0 >> 4) == 1) {
+                if (pos + 4 > size) {
+                    return numTokens >= kCheckTokensMin;
+                }
+                len = (((UInt32) (b0 & 0xF) << 12) |
+                       ((UInt32) p[pos + 1] << 4) | (p[pos + 2] >> 4)) +
+                      0x111;
+                pos += 2;
+            } else {
+                len = (b0 >> 4) + 1;
+            }
+            const UInt32 dist = (((UInt32) (p[pos] & 0xF) << 8) | p[pos + 1]) + 1;
+            pos += 2;
+            if (dist > outPos) {
+                return false;
+            }
+            outPos += len;
+            numTokens++;
+        }
+    }
+    return outPos >= header.UnpackSize || numTokens >= kCheckTokensMin;
+}
+
+bool IsSizePlausible(const CHeader& header, UInt64 packSize)
+{
+    if (header.UnpackSize == 0 || packSize <= header.Size) {
+        return false;
+    }
+    const UInt64 tokensSize = packSize - header.Size;
+    const UInt32 ratioMax =
+        header.Type == kTypeLz11 ? kLz11RatioMax : kLz10RatioMax;
+    return tokensSize <= (UInt64) header.UnpackSize +
+                             (header.UnpackSize + 7) / 8 + kPaddingMax &&
+           header.UnpackSize <= tokensSize * ratioMax;
+}
+
+CDecoder::CDecoder()
+  : _type(kTypeLz10)
+  , _buf(NULL)
+  , _bufSize(0)
+  , _bufPos(0)
+  , _bufStart(0)
+  , _unpackSize(0)
+{
+}
+
+bool CDecoder::Create(size_t inBufSize)
+{
+    return _in.Create(inBufSize);
+}
+
+HRESULT CDecoder::ReadHeader(CHeader& header, Byte requiredType)
+{
+    _in.Init();
+
+    Byte buf[kHeaderSizeMax];
+    size_t size = 4;
+    if (_in.ReadBytes(buf, 4) != 4) {
+        return S_FALSE;
+    }
+    if (requiredType == 0 && IsMagic(buf)) {
+        if (_in.ReadBytes(buf + size, 4) != 4) {
+            return S_FALSE;
+        }
+        size += 4;
+    }
+    if ((GetUi32(buf + size - 4) >> 8) == 0) {
+        if (_in.ReadBytes(buf + size, 4) != 4) {
+            return S_FALSE;
+        }
+        size += 4;
+    }
+    return ParseHeader(buf, size, header, requiredType) ? S_OK : S_FALSE;
+}
+
+void CDecoder::Init(Byte type, Byte* buf, size_t bufSize, UInt64 unpackSize)
+{
+    _type = type;
+    _buf = buf;
+    _bufSize = bufSize;
+    _bufPos = 0;
+    _bufStart = 0;
+    _unpackSize = unpackSize;
+    _flags = 0;
+    _numFlagBits = 0;
+    _matchDist = 0;
+    _matchRem = 0;
+}
+
+static inline void CopyMatch(Byte* dest, size_t dist, size_t n)
+{
+    const Byte* src = dest - dist;
+    if (dist >= n) {
+        memcpy(dest, src, n);
+        return;
+    }
+    if (dist == 1) {
+        memset(dest, *src, n);
+        return;
+    }
+    // Overlapping, but 8 byte steps never read bytes written by the same
+    // step as long as the distance is at least 8
+    if (dist >= 8) {
+        for (; n >= 8; n -= 8) {
+            SetUi64(dest, GetUi64(src))
+            dest += 8;
+            src += 8;
+        }
+    }
+    for (; n != 0; n--) {
+        *dest++ = *src++;
+    }
+}
+
+HRESULT CDecoder::Decode(size_t limit)
+{
+    if (limit > _bufSize) {
+        limit = _bufSize;
+    }
+    if (_bufStart + limit > _unpackSize) {
+        limit = (size_t) (_unpackSize - _bufStart);
+    }
+
+    Byte* buf = _buf;
+    size_t pos = _bufPos;
+    UInt32 flags = _flags;
+    UInt32 numFlagBits = _numFlagBits;
+    HRESULT res = S_OK;
+
+    while (pos < limit) {
+        if (_matchRem != 0) {
+            size_t n = limit - pos;
+            if (n > _matchRem) {
+                n = _matchRem;
+            }
+            _matchRem -= (UInt32) n;
+            CopyMatch(buf + pos, _matchDist, n);
+            pos += n;
+            continue;
+        }
+
+        if (numFlagBits == 0) {
+            Byte b;
+            if (!_in.ReadByte(b)) {
+                res = S_FALSE;
+                break;
+            }
+            flags = b;
+            numFlagBits = 8;
+        }
+
+        if (!(flags & 0x80)) {
+            // Literals are stored back to back, so a whole run of clear flag
+            // bits is copied from the input at once
+            UInt32 run = 1;
+            while (run < numFlagBits && !(flags & (0x80 >> run))) {
+                run++;
+            }
+            if (run > limit - pos) {
+                run = (UInt32) (limit - pos);
+            }
+            const size_t n = _in.ReadBytes(buf + pos, run);
+            pos += n;
+            if (n != run) {
+                res = S_FALSE;
+                break;
+            }
+            flags <<= run;
+            numFlagBits -= run;
+            continue;
+        }
+        flags <<= 1;
+        numFlagBits--;
+
+        Byte b0, b1;
+        if (!_in.ReadByte(b0) || !_in.ReadByte(b1)) {
+            res = S_FALSE;
+            break;
+        }
+        UInt32 len;
+        if (_type == kTypeLz10) {
+            len = (b0 >> 4) + 3;
+        } else if ((b0 >> 4) == 0) {
+            Byte b2;
+            if (!_in.ReadByte(b2)) {
+                res = S_FALSE;
+                break;
+            }
+            len = (((UInt32) (b0 & 0xF) << 4) | (b1 >> 4)) + 0x11;
+            b0 = b1;
+            b1 = b2;
+        } else if ((b0 >> 4) == 1) {
+            Byte b2, b3;
+            if (!_in.ReadByte(b2) || !_in.ReadByte(b3)) {
+                res = S_FALSE;
+                break;
+            }
+            len = (((UInt32) (b0 & 0xF) << 12) | ((UInt32) b1 << 4) |
+                   (b2 >> 4)) +
+                  0x111;
+            b0 = b2;
+            b1 = b3;
+        } else {
+            len = (b0 >> 4) + 1;
+        }
+        const UInt32 dist = (((UInt32) (b0 & 0xF) << 8) | b1) + 1;
+        if (dist > pos) {
+            PRINT("NitroLz: bad distance %u at %zu\n", dist, pos);
+            res = S_FALSE;
+            break;
+        }
+        _matchDist = dist;
+        _matchRem = len;
+    }
+
+    _bufPos = pos;
+    _flags = flags;
+    _numFlagBits = numFlagBits;
+    return res;
+}
+
+void CDecoder::ShiftWindow()
+{
+    size_t keep = kMaxDistance;
+    if (keep > _bufPos) {
+        keep = _bufPos;
+    }
+    memmove(_buf, _buf + _bufPos - keep, keep);
+    _bufStart += _bufPos - keep;
+    _bufPos = keep;
+}
+
+Z7_COM7F_IMF(CCoder::Code(
+    ISequentialInStream* inStream, ISequentialOutStream* outStream,
+    const UInt64* /* inSize */, const UInt64* outSize,
+    ICompressProgressInfo* progress
+))
+{
+    COM_TRY_BEGIN
+    CDecoder decoder;
+    if (!decoder.Create()) {
+        return E_OUTOFMEMORY;
+    }
+    decoder.SetStream(inStream);
+
+    CHeader header;
+    RINOK(decoder.ReadHeader(header, _type))
+    UInt64 unpackSize = header.UnpackSize;
+    if (outSize && *outSize < unpackSize) {
+        unpackSize = *outSize;
+    }
+
+    static const size_t kWindowSize = kMaxDistance + (1 << 20);
+    CByteBuffer window(kWindowSize);
+    decoder.Init(header.Type, window, kWindowSize, unpackSize);
+
+    size_t written = 0;
+    for (;;) {
+        const HRESULT res = decoder.Decode(kWindowSize);
+        const size_t pos = decoder.GetBufPos();
+        if (outStream && pos > written) {
+            RINOK(WriteStream(outStream, window + written, pos - written))
+        }
+
+        if (progress) {
+            const UInt64 inProcessed = decoder.GetInProcessed();
+            const UInt64 outProcessed = decoder.GetOutProcessed();
+            RINOK(progress->SetRatioInfo(&inProcessed, &outProcessed))
+        }
+
+        if (decoder.IsFinished()) {
+            return S_OK;
+        }
+        if (res != S_OK) {
+            return res;
+        }
+        decoder.ShiftWindow();
+        written = decoder.GetBufPos();
+    }
+    COM_TRY_END
+}
+
+//
+// Encoder
+//
+
+// LZ11 can encode matches up to 0x10110 bytes, but past 0x110 they take a
+// fourth byte and the parser's cost tables would have to grow with them. A
+// run that long costs a few bytes every 0x110 instead.
+static const UInt32 kMaxMatchLz10 = 0x12;
+static const UInt32 kMaxMatchLz11 = 0x110;
+
+// Token cost in bits, including the flag bit
+static const UInt32 kLiteralCost = 9;
+static const UInt32 kShortMatchCost = 17;
+static const UInt32 kLongMatchCost = 25;
+
+static UInt32 GetMatchCostLz10(UInt32 /* len */)
+{
+    return kShortMatchCost;
+}
+
+static UInt32 GetMatchCostLz11(UInt32 len)
+{
+    return len <= 0x10 ? kShortMatchCost : kLongMatchCost;
+}
+
+static unsigned PutMatchLz10(Byte* p, UInt32 len, UInt32 dist)
+{
+    dist--;
+    p[0] = (Byte) (((len - 3) << 4) | (dist >> 8));
+    p[1] = (Byte) dist;
+    return 2;
+}
+
+static unsigned PutMatchLz11(Byte* p, UInt32 len, UInt32 dist)
+{
+    dist--;
+    if (len <= 0x10) {
+        p[0] = (Byte) (((len - 1) << 4) | (dist >> 8));
+        p[1] = (Byte) dist;
+        return 2;
+    }
+    len -= 0x11;
+    p[0] = (Byte) (len >> 4);
+    p[1] = (Byte) (((len & 0xF) << 4) | (dist >> 8));
+    p[2] = (Byte) dist;
+    return 3;
+}
+
+static unsigned GetMatchSizeLz10(const Byte* /* p */)
+{
+    return 2;
+}
+
+static unsigned GetMatchSizeLz11(const Byte* p)
+{
+    switch (p[0] >> 4) {
+    case 0:
+        return 3;
+    case 1:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+static const LzEncoder::CFormat kFormatLz10 = {
+    kMinMatch, kMaxMatchLz10, kMaxDistance, kLiteralCost,
+    GetMatchCostLz10, PutMatchLz10, GetMatchSizeLz10, false,
+};
+
+static const LzEncoder::CFormat kFormatLz11 = {
+    kMinMatch, kMaxMatchLz11, kMaxDistance, kLiteralCost,
+    GetMatchCostLz11, PutMatchLz11, GetMatchSizeLz11, false,
+};
+
+HRESULT Encode(
+    const Byte* data, size_t size, Byte type, const CEncodeProps& props,
+    bool withHeader, CByteBuffer& out, size_t& outSize,
+    ICompressProgressInfo* progress
+)
+{
+    if (size > 0xFFFFFFFF || (type != kTypeLz10 && type != kTypeLz11)) {
+        return E_INVALIDARG;
+    }
+
+    // Sizes of 16 MiB and up, or zero, go in an extra word
+    size_t headerSize = 0;
+    if (withHeader) {
+        headerSize = size != 0 && size < (1 << 24) ? 4 : 8;
+    }
+
+    RINOK(LzEncoder::Encode(
+        type == kTypeLz10 ? kFormatLz10 : kFormatLz11, data, size, props,
+        headerSize, out, outSize, progress
+    ))
+
+    if (headerSize == 4) {
+        SetUi32(out, (UInt32) size << 8 | type)
+    } else if (headerSize == 8) {
+        SetUi32(out, type)
+        SetUi32(out + 4, (UInt32) size)
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CEncoder::Code(
+    ISequentialInStream* inStream, ISequentialOutStream* outStream,
+    const UInt64* inSize, const UInt64* /* outSize */,
+    ICompressProgressInfo* progress
+))
+{
+    COM_TRY_BEGIN
+    // The header needs the size up front, so the whole input is read first
+    CByteBuffer data;
+    size_t size = 0;
+    data.Alloc(inSize && *inSize < 0xFFFFFFFF ? (size_t) *inSize + 1 : 1 << 16);
+    // The size has to fit in the header, and the buffer mustn't wrap around
+    // size_t as it grows
+    const size_t sizeMax =
+        (size_t) MyMin((UInt64) 0xFFFFFFFF, (UInt64) (size_t) -1);
+    for (;;) {
+        if (size == data.Size()) {
+            if (size >= sizeMax) {
+                return E_INVALIDARG;
+            }
+            data.ChangeSize_KeepData(
+                size <= sizeMax / 2 ? size * 2 : sizeMax, size
+            );
+        }
+        size_t n = data.Size() - size;
+        RINOK(ReadStream(inStream, data + size, &n))
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+
+    CByteBuffer out;
+    size_t outSize;
+    RINOK(Encode(data, size, _type, _props, true, out, outSize, progress))
+    return WriteStream(outStream, out, outSize);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CEncoder::SetCoderProperties(
+    const PROPID* propIDs, const PROPVARIANT* props, UInt32 numProps
+))
+{
+    for (UInt32 i = 0; i < numProps; i++) {
+        const PROPVARIANT& prop = props[i];
+        switch (propIDs[i]) {
+        case NCoderPropID::kLevel:
+            if (prop.vt != VT_UI4) {
+                return E_INVALIDARG;
+            }
+            _props.Level = prop.ulVal;
+            break;
+        case NCoderPropID::kNumThreads:
+            if (prop.vt != VT_UI4) {
+                return E_INVALIDARG;
+            }
+            _props.NumThreads = prop.ulVal;
+            break;
+        }
+    }
+    return S_OK;
+}
+
+static void* CreateLz10Decoder()
+{
+    return (void*) (ICompressCoder*) (new CCoder(kTypeLz10));
+}
+
+static void* CreateLz11Decoder()
+{
+    return (void*) (ICompressCoder*) (new CCoder(kTypeLz11));
+}
+
+static void* CreateLz77Decoder()
+{
+    return (void*) (ICompressCoder*) (new CCoder(0));
+}
+
+static void* CreateLz10Encoder()
+{
+    return (void*) (ICompressCoder*) (new CEncoder(kTypeLz10));
+}
+
+static void* CreateLz11Encoder()
+{
+    return (void*) (ICompressCoder*) (new CEncoder(kTypeLz11));
+}
+
+REGISTER_CODEC_2(
+    Lz10, CreateLz10Decoder, CreateLz10Encoder, kMethodIdLz10, "LZ10"
+)
+REGISTER_CODEC_2(
+    Lz11, CreateLz11Decoder, CreateLz11Encoder, kMethodIdLz11, "LZ11"
+)
+REGISTER_CODEC_2(Lz77, CreateLz77Decoder, NULL, kMethodIdLz77, "LZ77")
+
+//
+// Archive handler
+//
+
+Z7_CLASS_IMP_CHandler_IInArchive_0
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    CMyComPtr<IInStream> _inStream;
+    CHeader _header;
+    UInt64 _packSize;
+};
+
+static const Byte kArcProps[] = {
+    kpidPhySize,
+    kpidMethod,
+};
+
+static const Byte kProps[] = {
+    kpidSize,
+    kpidPackSize,
+    kpidMethod,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+
+        Byte buf[1 << 8];
+        size_t size = sizeof(buf);
+        RINOK(ReadStream(stream, buf, &size))
+        if (!IsCompressed(buf, size) || !ParseHeader(buf, size, _header, 0)) {
+            return S_FALSE;
+        }
+
+        RINOK(InStream_GetSize_SeekToEnd(stream, _packSize))
+        if (!IsSizePlausible(_header, _packSize)) {
+            return S_FALSE;
+        }
+        _inStream = stream;
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _inStream.Release();
+    _packSize = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = 1;
+    return S_OK;
+}
+
+static const char* GetMethodName(const CHeader& header)
+{
+    return header.Type == kTypeLz11 ? "LZ11" : "LZ10";
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidPhySize:
+        prop = _packSize;
+        break;
+    case kpidMethod:
+        prop = GetMethodName(_header);
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetProperty(
+    UInt32 /* index */, PROPID propID, PROPVARIANT* value
+))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidSize:
+        prop = _header.UnpackSize;
+        break;
+    case kpidPackSize:
+        prop = _packSize;
+        break;
+    case kpidMethod:
+        prop = GetMethodName(_header);
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    if (numItems == 0) {
+        return S_OK;
+    }
+    if (numItems != (UInt32) (Int32) -1 && (numItems != 1 || indices[0] != 0)) {
+        return E_INVALIDARG;
+    }
+
+    extractCallback->SetTotal(_header.UnpackSize);
+
+    CMyComPtr<ISequentialOutStream> realOutStream;
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+    RINOK(extractCallback->GetStream(0, &realOutStream, askMode))
+    if (!testMode && !realOutStream) {
+        return S_OK;
+    }
+    RINOK(extractCallback->PrepareOperation(askMode))
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, true);
+
+    CMyComPtr<ICompressCoder> coder = new CCoder(0);
+    RINOK(InStream_SeekSet(_inStream, 0))
+    const UInt64 unpackSize = _header.UnpackSize;
+    const HRESULT res =
+        coder->Code(_inStream, realOutStream, NULL, &unpackSize, progress);
+
+    Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
+    if (res == S_FALSE) {
+        opRes = NArchive::NExtract::NOperationResult::kDataError;
+    } else {
+        RINOK(res)
+    }
+
+    realOutStream.Release();
+    return extractCallback->SetOperationResult(opRes);
+    COM_TRY_END
+}
+
+API_FUNC_static_IsArc IsArc_NitroLz(const Byte* p, size_t size)
+{
+    if (size < 0x10) {
+        return k_IsArc_Res_NEED_MORE;
+    }
+    // The file is at least as big as what's given here, which can't be more
+    // tokens than the unpack size needs
+    CHeader header;
+    if (!ParseHeader(p, size, header, 0) || header.UnpackSize == 0 ||
+        size - header.Size > (UInt64) header.UnpackSize +
+                                 (header.UnpackSize + 7) / 8 + kPaddingMax) {
+        return k_IsArc_Res_NO;
+    }
+    return IsCompressed(p, size) ? k_IsArc_Res_YES : k_IsArc_Res_NO;
+}
+}
+
+REGISTER_ARC_I_NO_SIG(
+    "lz", "lz lz77 cmp", NULL, 0xA6, //
+    0, //
+    0, IsArc_NitroLz
+)
+
+} // namespace NitroLz
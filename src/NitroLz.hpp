@@ -0,0 +1,150 @@
+#pragma once
+
+#include "LzEncoder.hpp"
+#include "Types.h"
+#include <CPP/7zip/Common/InBuffer.h>
+#include <CPP/7zip/ICoder.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+
+// Nintendo DS/Wii BIOS style LZ compression: LZ10, LZ11, and either one
+// behind an "LZ77" magic
+namespace NitroLz
+{
+
+static const Byte kTypeLz10 = 0x10;
+static const Byte kTypeLz11 = 0x11;
+static const UInt32 kMinMatch = 3;
+static const UInt32 kMaxDistance = 0x1000;
+
+// "LZ77" magic, type and size, extended size
+static const UInt32 kHeaderSizeMax = 12;
+
+struct CHeader {
+    Byte Type;
+    bool HasMagic;
+    UInt32 UnpackSize;
+    UInt32 Size;
+};
+
+// Parse the header at the start of p. The "LZ77" magic is only accepted when
+// requiredType is 0, otherwise the type has to match.
+bool ParseHeader(
+    const Byte* p, size_t size, CHeader& header, Byte requiredType
+);
+
+// Check that p starts with a header and data that decodes without errors as
+// far as size goes, which has to take in at least a few full flag bytes of
+// tokens unless the data ends before. Used to detect headerless formats.
+bool IsCompressed(const Byte* p, size_t size);
+
+// Check that the unpack size in header is one that packSize bytes of header
+// and tokens could decode to, allowing for padding after the tokens
+bool IsSizePlausible(const CHeader& header, UInt64 packSize);
+
+// Incremental decoder, used the same way as Yaz0::CDecoder
+class CDecoder
+{
+public:
+    CDecoder();
+
+    bool Create(size_t inBufSize = 1 << 16);
+    void SetStream(ISequentialInStream* stream)
+    {
+        _in.SetStream(stream);
+    }
+
+    // Read the header from the start of the stream. Returns S_FALSE if it's
+    // not valid, or if requiredType is not 0 and doesn't match.
+    HRESULT ReadHeader(CHeader& header, Byte requiredType = 0);
+
+    void Init(Byte type, Byte* buf, size_t bufSize, UInt64 unpackSize);
+
+    // Decode until buf[0 .. limit) is filled or the end of the data is
+    // reached. Returns S_FALSE on corrupt or truncated input.
+    HRESULT Decode(size_t limit);
+
+    // Move the last kMaxDistance bytes to the start of the buffer so that
+    // decoding can continue into the freed space.
+    void ShiftWindow();
+
+    size_t GetBufPos() const
+    {
+        return _bufPos;
+    }
+
+    UInt64 GetOutProcessed() const
+    {
+        return _bufStart + _bufPos;
+    }
+
+    UInt64 GetInProcessed() const
+    {
+        return _in.GetProcessedSize();
+    }
+
+    bool IsFinished() const
+    {
+        return GetOutProcessed() == _unpackSize;
+    }
+
+private:
+    CInBuffer _in;
+    Byte _type;
+    Byte* _buf;
+    size_t _bufSize;
+    size_t _bufPos;
+    UInt64 _bufStart;
+    UInt64 _unpackSize;
+
+    UInt32 _flags;
+    UInt32 _numFlagBits;
+    UInt32 _matchDist;
+    UInt32 _matchRem;
+};
+
+// Decoder registered as a codec. The input is a complete compressed file,
+// header included. type is kTypeLz10 or kTypeLz11 for the bare formats, or 0
+// to accept either, with or without the "LZ77" magic.
+Z7_CLASS_IMP_COM_1(CCoder, ICompressCoder)
+#if CLANG_FORMAT_WORKAROUND
+    class CCoder
+{
+#endif
+    Byte _type;
+
+public:
+    CCoder(Byte type)
+      : _type(type)
+    {
+    }
+};
+
+typedef LzEncoder::CEncodeProps CEncodeProps;
+
+// Compress data as type, kTypeLz10 or kTypeLz11. withHeader writes the type
+// and size header first; without it only the token stream is written, for
+// containers that keep the sizes themselves.
+HRESULT Encode(
+    const Byte* data, size_t size, Byte type, const CEncodeProps& props,
+    bool withHeader, CByteBuffer& out, size_t& outSize,
+    ICompressProgressInfo* progress
+);
+
+// Encoder registered as a codec, writing a complete file with the header
+Z7_CLASS_IMP_COM_2(CEncoder, ICompressCoder, ICompressSetCoderProperties)
+#if CLANG_FORMAT_WORKAROUND
+    class CEncoder
+{
+#endif
+    Byte _type;
+    CEncodeProps _props;
+
+public:
+    CEncoder(Byte type)
+      : _type(type)
+    {
+    }
+};
+
+} // namespace NitroLz
@@ -0,0 +1,111 @@
+// Parallel.cpp - Fork/join helper for the multi-threaded coders
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Parallel.hpp"
+#include "Util.hpp"
+
+#include <C/Threads.h>
+
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Windows/Thread.h>
+
+namespace Parallel
+{
+
+struct CContext {
+    JobFunc Func;
+    void* Param;
+    UInt32 NumJobs;
+    UInt32 NextJob;
+    HRESULT Result;
+    ::CCriticalSection Lock;
+
+    bool TakeJob(UInt32& index)
+    {
+        CriticalSection_Enter(&Lock);
+        const bool ok = Result == S_OK && NextJob < NumJobs;
+        if (ok) {
+            index = NextJob++;
+        }
+        CriticalSection_Leave(&Lock);
+        return ok;
+    }
+
+    void SetResult(HRESULT res)
+    {
+        CriticalSection_Enter(&Lock);
+        if (Result == S_OK) {
+            Result = res;
+        }
+        CriticalSection_Leave(&Lock);
+    }
+
+    void Work()
+    {
+        UInt32 index;
+        while (TakeJob(index)) {
+            HRESULT res;
+            try {
+                res = Func(Param, index);
+            } catch (...) {
+                res = E_OUTOFMEMORY;
+            }
+            if (res != S_OK) {
+                SetResult(res);
+            }
+        }
+    }
+};
+
+static THREAD_FUNC_DECL WorkerThread(void* param)
+{
+    ((CContext*) param)->Work();
+    return 0;
+}
+
+HRESULT Run(UInt32 numThreads, UInt32 numJobs, JobFunc func, void* param)
+{
+    if (numThreads > numJobs) {
+        numThreads = numJobs;
+    }
+
+    if (numThreads <= 1) {
+        for (UInt32 i = 0; i < numJobs; i++) {
+            RINOK(func(param, i))
+        }
+        return S_OK;
+    }
+
+    CContext ctx;
+    ctx.Func = func;
+    ctx.Param = param;
+    ctx.NumJobs = numJobs;
+    ctx.NextJob = 0;
+    ctx.Result = S_OK;
+    if (CriticalSection_Init(&ctx.Lock) != 0) {
+        return E_FAIL;
+    }
+
+    // The calling thread is the last worker
+    CObjArray<NWindows::CThread> threads(numThreads - 1);
+    UInt32 numCreated = 0;
+    for (; numCreated < numThreads - 1; numCreated++) {
+        if (threads[numCreated].Create(WorkerThread, &ctx) != 0) {
+            PRINT("Thread create failed\n");
+            break;
+        }
+    }
+
+    ctx.Work();
+
+    for (UInt32 i = 0; i < numCreated; i++) {
+        threads[i].Wait_Close();
+    }
+    CriticalSection_Delete(&ctx.Lock);
+
+    return ctx.Result;
+}
+
+} // namespace Parallel
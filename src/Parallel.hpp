@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Types.h"
+
+namespace Parallel
+{
+
+typedef HRESULT (*JobFunc)(void* param, UInt32 index);
+
+// Run func(param, index) for every index in [0, numJobs) on up to numThreads
+// threads, including the calling thread. Jobs are handed out in ascending
+// order; after the first failure no new jobs are started and that error is
+// returned.
+HRESULT Run(UInt32 numThreads, UInt32 numJobs, JobFunc func, void* param);
+
+template <typename F>
+HRESULT For(UInt32 numThreads, UInt32 numJobs, F& func)
+{
+    return Run(
+        numThreads, numJobs,
+        [](void* param, UInt32 index) -> HRESULT {
+            return (*(F*) param)(index);
+        },
+        &func
+    );
+}
+
+} // namespace Parallel
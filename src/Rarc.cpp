@@ -0,0 +1,469 @@
+// Rarc.cpp - File for decoding GameCube/Wii JSystem RARC archives
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "Types.h"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+
+namespace Rarc
+{
+
+static const UInt32 kHeaderSize = 0x20;
+static const UInt32 kInfoSize = 0x20;
+static const UInt32 kNodeSize = 0x10;
+static const UInt32 kEntrySize = 0x14;
+
+// Refuse to allocate more than this for the node, entry and string tables
+static const UInt32 kMetadataSizeMax = 1 << 26;
+// Or for the paths of all items, which a deeply nested archive could
+// otherwise make huge from small tables
+static const UInt32 kPathsSizeMax = 1 << 26;
+
+// Entry flags
+static const Byte kEntryDir = 0x02;
+static const Byte kEntryCompressed = 0x04;
+static const Byte kEntryYaz0 = 0x80;
+
+struct CItem {
+    // Offset of the name in the string table
+    UInt32 NameOffset;
+    // Offset of the full path in _paths
+    UInt32 PathOffset;
+    bool IsDir;
+    Byte Flags;
+    UInt64 Offset;
+    UInt32 Size;
+};
+
+// A node whose entries are still being walked
+struct CNodePos {
+    UInt32 Next;
+    UInt32 End;
+    // Item of the directory the entries are in
+    int Parent;
+};
+
+Z7_CLASS_IMP_CHandler_IInArchive_1(IInArchiveGetStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    CRecordVector<CItem> _items;
+    // Null terminated paths of all items, built once at open
+    CRecordVector<wchar_t> _paths;
+
+    // Info block and the node, entry and string tables, which sit between
+    // the header and the file data. Nodes, entries and names are read from
+    // here as they are rather than copied out.
+    CByteArr _metadata;
+    UInt32 _metadataSize;
+    UInt32 _infoOffset;
+    UInt32 _dataOffset;
+    const Byte* _nodes;
+    const Byte* _entries;
+    const Byte* _strings;
+    UInt32 _numNodes;
+    UInt32 _numEntries;
+    UInt32 _stringsSize;
+    CByteArr _nodeVisited;
+
+    const char* GetName(UInt32 offset, size_t& len) const;
+    HRESULT AddItem(
+        CItem& item, int parent, const char* name, size_t nameLen
+    );
+    HRESULT PushNode(
+        UInt32 nodeIndex, int parent, CRecordVector<CNodePos>& stack
+    );
+    HRESULT AddNodes();
+    HRESULT Open2(IInStream* stream);
+};
+
+static const Byte kArcProps[] = {
+    kpidHeadersSize,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+    kpidMethod,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+const char* CHandler::GetName(UInt32 offset, size_t& len) const
+{
+    if (offset >= _stringsSize) {
+        return NULL;
+    }
+    const char* name = (const char*) _strings + offset;
+    const void* end = memchr(name, 0, _stringsSize - offset);
+    if (end == NULL) {
+        return NULL;
+    }
+    len = (size_t) ((const char*) end - name);
+    return name;
+}
+
+HRESULT CHandler::AddItem(
+    CItem& item, int parent, const char* name, size_t nameLen
+)
+{
+    UString name16;
+    if (!Convert_UTF8_Buf_To_Unicode(name, nameLen, name16)) {
+        PRINT("RARC: name is not valid UTF-8\n");
+    }
+    if (name16.IsEmpty()) {
+        name16 = "unknown";
+    }
+
+    // The parent's path is always complete by now, so it can be copied
+    // straight out of the buffer
+    const UInt32 parentPos = parent >= 0 ? _items[parent].PathOffset : 0;
+    UInt32 parentLen = 0;
+    if (parent >= 0) {
+        while (_paths[parentPos + parentLen] != 0) {
+            parentLen++;
+        }
+    }
+    if ((UInt64) _paths.Size() + parentLen + name16.Len() + 2 >
+        kPathsSizeMax) {
+        return S_FALSE;
+    }
+
+    item.PathOffset = _paths.Size();
+    if (parent >= 0) {
+        for (UInt32 i = 0; i < parentLen; i++) {
+            _paths.Add(_paths[parentPos + i]);
+        }
+        _paths.Add(WCHAR_PATH_SEPARATOR);
+    }
+    for (unsigned i = 0; i < name16.Len(); i++) {
+        _paths.Add(name16[i]);
+    }
+    _paths.Add(0);
+
+    _items.Add(item);
+    return S_OK;
+}
+
+HRESULT CHandler::PushNode(
+    UInt32 nodeIndex, int parent, CRecordVector<CNodePos>& stack
+)
+{
+    PRINT("Node %u, parent %d\n", nodeIndex, parent);
+
+    if (nodeIndex >= _numNodes || _nodeVisited[nodeIndex]) {
+        return S_FALSE;
+    }
+    _nodeVisited[nodeIndex] = 1;
+
+    const Byte* node = _nodes + nodeIndex * kNodeSize;
+    const UInt32 count = GetBe16(node + 0xA);
+    const UInt32 first = GetBe32(node + 0xC);
+    if (first > _numEntries || count > _numEntries - first) {
+        return S_FALSE;
+    }
+
+    CNodePos pos;
+    pos.Next = first;
+    pos.End = first + count;
+    pos.Parent = parent;
+    stack.Add(pos);
+    return S_OK;
+}
+
+// Walks the directories depth first, with the nodes still being walked kept
+// on a stack rather than in the call stack. A node is only entered once, so
+// the stack never holds more than all of them.
+HRESULT CHandler::AddNodes()
+{
+    CRecordVector<CNodePos> stack;
+    RINOK(PushNode(0, 0, stack))
+
+    while (stack.Size() != 0) {
+        CNodePos& pos = stack.Back();
+        if (pos.Next == pos.End) {
+            stack.DeleteBack();
+            continue;
+        }
+        const Byte* entry = _entries + pos.Next++ * kEntrySize;
+        const int parent = pos.Parent;
+
+        CItem item;
+        item.Flags = entry[4];
+        item.NameOffset = GetBe32(entry + 4) & 0x00FFFFFF;
+        item.IsDir = (item.Flags & kEntryDir) != 0;
+
+        size_t nameLen;
+        const char* name = GetName(item.NameOffset, nameLen);
+        if (name == NULL) {
+            return S_FALSE;
+        }
+
+        if (item.IsDir) {
+            // Every directory lists itself and its parent
+            if ((nameLen == 1 && name[0] == '.') ||
+                (nameLen == 2 && name[0] == '.' && name[1] == '.')) {
+                continue;
+            }
+            item.Offset = 0;
+            item.Size = 0;
+            const int index = (int) _items.Size();
+            RINOK(AddItem(item, parent, name, nameLen))
+            RINOK(PushNode(GetBe32(entry + 8), index, stack))
+        } else {
+            item.Offset = (UInt64) _infoOffset + _dataOffset + GetBe32(entry + 8);
+            item.Size = GetBe32(entry + 0xC);
+            RINOK(AddItem(item, parent, name, nameLen))
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT CHandler::Open2(IInStream* stream)
+{
+    // With a Yaz0/Yay0 wrapper only the header and tables are decoded here,
+    // the file data is decoded once it's extracted
+    RINOK(_source.Open(stream))
+    Byte header[kHeaderSize];
+    RINOK(_source.Read(0, header, kHeaderSize))
+
+    if (GetBe32(header) != 0x52415243) {
+        return S_FALSE;
+    }
+
+    _infoOffset = GetBe32(header + 0x8);
+    _dataOffset = GetBe32(header + 0xC);
+    if (_infoOffset < kHeaderSize || _dataOffset < kInfoSize ||
+        _dataOffset > kMetadataSizeMax) {
+        return S_FALSE;
+    }
+
+    _metadataSize = _dataOffset;
+    _metadata.Alloc(_metadataSize);
+    RINOK(_source.Read(_infoOffset, _metadata, _metadataSize))
+
+    const Byte* info = _metadata;
+    _numNodes = GetBe32(info + 0x0);
+    const UInt32 nodesOffset = GetBe32(info + 0x4);
+    _numEntries = GetBe32(info + 0x8);
+    const UInt32 entriesOffset = GetBe32(info + 0xC);
+    _stringsSize = GetBe32(info + 0x10);
+    const UInt32 stringsOffset = GetBe32(info + 0x14);
+
+    if (_numNodes == 0 || nodesOffset > _metadataSize ||
+        _numNodes > (_metadataSize - nodesOffset) / kNodeSize ||
+        entriesOffset > _metadataSize ||
+        _numEntries > (_metadataSize - entriesOffset) / kEntrySize ||
+        stringsOffset > _metadataSize ||
+        _stringsSize > _metadataSize - stringsOffset) {
+        return S_FALSE;
+    }
+
+    _nodes = info + nodesOffset;
+    _entries = info + entriesOffset;
+    _strings = info + stringsOffset;
+
+    _nodeVisited.Alloc(_numNodes);
+    memset(_nodeVisited, 0, _numNodes);
+
+    // Each entry gives one item, plus one for the root node
+    _items.ClearAndReserve(_numEntries + 1);
+
+    // The root node's name is used as the top directory
+    CItem root;
+    root.Flags = kEntryDir;
+    root.NameOffset = GetBe32(_nodes + 4);
+    root.IsDir = true;
+    root.Offset = 0;
+    root.Size = 0;
+    size_t nameLen;
+    const char* name = GetName(root.NameOffset, nameLen);
+    if (name == NULL) {
+        return S_FALSE;
+    }
+    RINOK(AddItem(root, -1, name, nameLen))
+
+    return AddNodes();
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (Open2(stream) != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _source.Close();
+    _items.Clear();
+    _paths.Clear();
+    _metadata.Free();
+    _metadataSize = 0;
+    _nodeVisited.Free();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _items.Size();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidHeadersSize:
+        prop = _infoOffset + _metadataSize;
+        break;
+    case kpidExtension:
+        switch (_source.GetWrapper()) {
+        case ArcData::kWrapYaz0:
+            prop = "szs";
+            break;
+        case ArcData::kWrapYay0:
+            prop = "szp";
+            break;
+        default:
+            prop = "arc";
+            break;
+        }
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    const CItem& item = _items[index];
+
+    switch (propID) {
+    case kpidPath:
+        prop = &_paths[item.PathOffset];
+        break;
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+    case kpidPackSize:
+        if (!item.IsDir) {
+            prop = item.Size;
+        }
+        break;
+
+    case kpidMethod:
+        // Compressed files are stored as is, and extract as the Yaz0 or
+        // Yay0 file they are
+        if (!item.IsDir && (item.Flags & kEntryCompressed)) {
+            prop = (item.Flags & kEntryYaz0) ? "Yaz0" : "Yay0";
+        }
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    if (allFilesMode)
+        numItems = _items.Size();
+    if (numItems == 0)
+        return S_OK;
+
+    CRecordVector<ArcData::CRange> ranges;
+    ranges.ClearAndSetSize(numItems);
+    for (UInt32 i = 0; i < numItems; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        const CItem& item = _items[index];
+        ArcData::CRange& range = ranges[i];
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = item.Offset;
+        range.Size = item.Size;
+    }
+
+    return ArcData::ExtractRanges(_source, ranges, testMode, extractCallback);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    const CItem& item = _items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    return _source.GetStream(
+        item.Offset, item.Size, (IInArchive*) this, stream
+    );
+
+    COM_TRY_END
+}
+
+static const Byte k_Signature[] = {
+    4, 'R', 'A', 'R', 'C', //
+    4, 'Y', 'a', 'z', '0', //
+    4, 'Y', 'a', 'y', '0', //
+};
+
+REGISTER_ARC_I(
+    "rarc", "arc rarc szs szp carc", NULL, 0xA4, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kPreArc | NArcInfoFlags::kMultiSignature, 0
+)
+
+} // namespace Rarc
@@ -0,0 +1,406 @@
+// Sarc.cpp - File for decoding Wii U/Switch SARC archives
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "Types.h"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/IntToString.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/MyString.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+
+namespace Sarc
+{
+
+static const UInt32 kHeaderSize = 0x14;
+static const UInt32 kSfatHeaderSize = 0xC;
+static const UInt32 kSfatNodeSize = 0x10;
+static const UInt32 kSfntHeaderSize = 0x8;
+
+// Refuse to allocate more than this for the file and name tables
+static const UInt32 kMetadataSizeMax = 1 << 26;
+
+// Set in a node's attributes if it has a name
+static const UInt32 kNodeHasName = 0x01000000;
+
+Z7_CLASS_IMP_CHandler_IInArchive_1(IInArchiveGetStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    bool _isBe;
+    bool _headersError;
+
+    // Everything before the file data: the header, SFAT and SFNT. Nodes and
+    // names are read from here as they are rather than copied out.
+    CByteArr _metadata;
+    UInt32 _metadataSize;
+    UInt32 _dataOffset;
+    const Byte* _nodes;
+    UInt32 _numNodes;
+    UInt32 _hashKey;
+    const char* _names;
+    UInt32 _namesSize;
+
+    UInt32 Get16(const Byte* p) const
+    {
+        return _isBe ? GetBe16(p) : GetUi16(p);
+    }
+
+    UInt32 Get32(const Byte* p) const
+    {
+        return _isBe ? GetBe32(p) : GetUi32(p);
+    }
+
+    const Byte* GetNode(UInt32 index) const
+    {
+        return _nodes + index * kSfatNodeSize;
+    }
+
+    const char* GetName(UInt32 index, size_t& len) const;
+    UInt32 CalcNameHash(const char* name, size_t len) const;
+    int FindItem(const char* path, size_t len) const;
+    HRESULT Open2(IInStream* stream);
+};
+
+static const Byte kArcProps[] = {
+    kpidHeadersSize,
+    kpidBigEndian,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidSize,
+    kpidOffset,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+const char* CHandler::GetName(UInt32 index, size_t& len) const
+{
+    const UInt32 attr = Get32(GetNode(index) + 4);
+    if (!(attr & kNodeHasName)) {
+        return NULL;
+    }
+    const UInt32 offset = (attr & 0xFFFF) * 4;
+    if (offset >= _namesSize) {
+        return NULL;
+    }
+    const char* name = _names + offset;
+    const void* end = memchr(name, 0, _namesSize - offset);
+    if (end == NULL) {
+        return NULL;
+    }
+    len = (size_t) ((const char*) end - name);
+    return name;
+}
+
+UInt32 CHandler::CalcNameHash(const char* name, size_t len) const
+{
+    UInt32 hash = 0;
+    for (size_t i = 0; i < len; i++) {
+        hash = hash * _hashKey + (UInt32) (Int32) (signed char) name[i];
+    }
+    return hash;
+}
+
+// The SFAT is sorted by name hash, which is what the games themselves rely
+// on to look files up
+int CHandler::FindItem(const char* path, size_t len) const
+{
+    const UInt32 hash = CalcNameHash(path, len);
+    UInt32 left = 0, right = _numNodes;
+    while (left < right) {
+        const UInt32 mid = (left + right) / 2;
+        const UInt32 midHash = Get32(GetNode(mid));
+        if (hash < midHash) {
+            right = mid;
+        } else if (hash > midHash) {
+            left = mid + 1;
+        } else {
+            // Nodes with colliding hashes sit next to each other, so step
+            // back to the first one and compare names from there
+            UInt32 i = mid;
+            while (i > 0 && Get32(GetNode(i - 1)) == hash) {
+                i--;
+            }
+            for (; i < _numNodes && Get32(GetNode(i)) == hash; i++) {
+                size_t nameLen;
+                const char* name = GetName(i, nameLen);
+                if (name != NULL && nameLen == len &&
+                    memcmp(name, path, len) == 0) {
+                    return (int) i;
+                }
+            }
+            return -1;
+        }
+    }
+    return -1;
+}
+
+HRESULT CHandler::Open2(IInStream* stream)
+{
+    // With a Yaz0/Yay0 wrapper only the tables are decoded here, the file
+    // data is decoded once it's extracted
+    RINOK(_source.Open(stream))
+    Byte header[kHeaderSize];
+    RINOK(_source.Read(0, header, kHeaderSize))
+
+    if (GetBe32(header) != 0x53415243) {
+        return S_FALSE;
+    }
+    if (header[6] == 0xFE && header[7] == 0xFF) {
+        _isBe = true;
+    } else if (header[6] == 0xFF && header[7] == 0xFE) {
+        _isBe = false;
+    } else {
+        return S_FALSE;
+    }
+
+    const UInt32 headerSize = Get16(header + 4);
+    _dataOffset = Get32(header + 0xC);
+    if (headerSize < kHeaderSize ||
+        _dataOffset < headerSize + kSfatHeaderSize + kSfntHeaderSize ||
+        _dataOffset > kMetadataSizeMax) {
+        return S_FALSE;
+    }
+
+    _metadataSize = _dataOffset;
+    _metadata.Alloc(_metadataSize);
+    RINOK(_source.Read(0, _metadata, _metadataSize))
+
+    const Byte* sfat = _metadata + headerSize;
+    if (GetBe32(sfat) != 0x53464154) {
+        return S_FALSE;
+    }
+    const UInt32 sfatHeaderSize = Get16(sfat + 4);
+    _numNodes = Get16(sfat + 6);
+    _hashKey = Get32(sfat + 8);
+    if (sfatHeaderSize < kSfatHeaderSize) {
+        return S_FALSE;
+    }
+
+    const UInt32 nodesOffset = headerSize + sfatHeaderSize;
+    const UInt32 sfntOffset = nodesOffset + _numNodes * kSfatNodeSize;
+    if (sfntOffset > _metadataSize - kSfntHeaderSize) {
+        return S_FALSE;
+    }
+    _nodes = _metadata + nodesOffset;
+
+    const Byte* sfnt = _metadata + sfntOffset;
+    if (GetBe32(sfnt) != 0x53464E54) {
+        return S_FALSE;
+    }
+    const UInt32 sfntHeaderSize = Get16(sfnt + 4);
+    if (sfntHeaderSize < kSfntHeaderSize ||
+        sfntHeaderSize > _metadataSize - sfntOffset) {
+        return S_FALSE;
+    }
+    _names = (const char*) sfnt + sfntHeaderSize;
+    _namesSize = _metadataSize - sfntOffset - sfntHeaderSize;
+
+    _headersError = false;
+    for (UInt32 i = 0; i < _numNodes; i++) {
+        const Byte* node = GetNode(i);
+        if (Get32(node + 0xC) < Get32(node + 0x8)) {
+            return S_FALSE;
+        }
+
+        // Every name must resolve back to its own node, otherwise the games
+        // wouldn't be able to find the file either
+        size_t nameLen;
+        const char* name = GetName(i, nameLen);
+        if (name != NULL && FindItem(name, nameLen) != (int) i) {
+            PRINT("SARC: node %u is not found by its name\n", i);
+            _headersError = true;
+        }
+    }
+
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (Open2(stream) != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _source.Close();
+    _metadata.Free();
+    _metadataSize = 0;
+    _numNodes = 0;
+    _headersError = false;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _numNodes;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidHeadersSize:
+        prop = _metadataSize;
+        break;
+    case kpidBigEndian:
+        prop = _isBe;
+        break;
+    case kpidExtension:
+        switch (_source.GetWrapper()) {
+        case ArcData::kWrapYaz0:
+            prop = "szs";
+            break;
+        case ArcData::kWrapYay0:
+            prop = "szp";
+            break;
+        default:
+            prop = "sarc";
+            break;
+        }
+        break;
+    case kpidWarningFlags:
+        if (_headersError) {
+            prop = (UInt32) kpv_ErrorFlags_HeadersError;
+        }
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    const Byte* node = GetNode(index);
+
+    switch (propID) {
+    case kpidPath: {
+        UString path;
+        size_t nameLen;
+        const char* name = GetName(index, nameLen);
+        if (name != NULL) {
+            Convert_UTF8_Buf_To_Unicode(name, nameLen, path);
+            path.Replace(L'/', WCHAR_PATH_SEPARATOR);
+        } else {
+            // Unnamed files are only known by their hash
+            char s[16];
+            ConvertUInt32ToHex8Digits(Get32(node), s);
+            path = s;
+            path += ".bin";
+        }
+        prop = path;
+        break;
+    }
+
+    case kpidSize:
+    case kpidPackSize:
+        prop = Get32(node + 0xC) - Get32(node + 0x8);
+        break;
+
+    case kpidOffset:
+        prop = (UInt64) _dataOffset + Get32(node + 0x8);
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    if (allFilesMode)
+        numItems = _numNodes;
+    if (numItems == 0)
+        return S_OK;
+
+    CRecordVector<ArcData::CRange> ranges;
+    ranges.ClearAndSetSize(numItems);
+    for (UInt32 i = 0; i < numItems; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        const Byte* node = GetNode(index);
+        ArcData::CRange& range = ranges[i];
+        range.Index = index;
+        range.IsDir = false;
+        range.Offset = (UInt64) _dataOffset + Get32(node + 0x8);
+        range.Size = Get32(node + 0xC) - Get32(node + 0x8);
+    }
+
+    return ArcData::ExtractRanges(_source, ranges, testMode, extractCallback);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    const Byte* node = GetNode(index);
+    return _source.GetStream(
+        (UInt64) _dataOffset + Get32(node + 0x8),
+        Get32(node + 0xC) - Get32(node + 0x8), (IInArchive*) this, stream
+    );
+
+    COM_TRY_END
+}
+
+static const Byte k_Signature[] = {
+    4, 'S', 'A', 'R', 'C', //
+    4, 'Y', 'a', 'z', '0', //
+    4, 'Y', 'a', 'y', '0', //
+};
+
+REGISTER_ARC_I(
+    "sarc", "sarc pack szs szp", NULL, 0xA5, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kPreArc | NArcInfoFlags::kMultiSignature, 0
+)
+
+} // namespace Sarc
@@ -0,0 +1,571 @@
+// Sparse.cpp - File for reading CISO and WBFS disc images
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/ProgressUtils.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <cstring>
+
+// Disc images stored as fixed size blocks, with the blocks the disc doesn't
+// use left out. The image is given as a single item, whose stream can be
+// opened by the GameCube and Wii disc handlers in turn.
+namespace Sparse
+{
+
+enum EFormat {
+    kFormatCiso,
+    kFormatWbfs,
+};
+
+// CISO: a header with the block size and a byte for each block, set if the
+// block is stored. Stored blocks follow the header in order.
+static const UInt32 kCisoHeaderSize = 0x8000;
+static const UInt32 kCisoMapOffset = 8;
+static const UInt32 kCisoNumBlocksMax = kCisoHeaderSize - kCisoMapOffset;
+
+// WBFS: a drive image in sectors, holding up to a sector's worth of discs.
+// Only the first disc is read. Its info, in the sector after the header, is
+// a copy of the disc header followed by the sector that each block of the
+// disc is stored in, or 0 if it's left out.
+static const UInt32 kWbfsHeaderSize = 12;
+static const UInt32 kWbfsDiscHeaderSize = 0x100;
+// Blocks cover a dual layer Wii disc
+static const UInt64 kWbfsDiscSize = (UInt64) 143432 * 2 * 0x8000;
+
+// Block sizes of the formats are powers of two within these
+static const unsigned kBlockSizeLogMin = 9;
+static const unsigned kBlockSizeLogMax = 30;
+
+static const UInt32 kHole = (UInt32) (Int32) -1;
+
+// Where the blocks of the image are stored
+class CImage
+{
+public:
+    CImage()
+      : _dataOffset(0)
+      , _blockSize(0)
+      , _numStored(0)
+    {
+    }
+
+    // Returns S_FALSE if the header is bad
+    HRESULT Open(IInStream* stream, EFormat format);
+    void Close();
+
+    UInt64 GetSize() const
+    {
+        return (UInt64) _blocks.Size() * _blockSize;
+    }
+
+    UInt64 GetPackSize() const
+    {
+        return (UInt64) _numStored * _blockSize;
+    }
+
+    UInt32 GetBlockSize() const
+    {
+        return _blockSize;
+    }
+
+    // Read up to size bytes at offset. Blocks stored one after another are
+    // read together, and left out blocks are zeros that aren't read at all.
+    // processed is short only at the end of the image or the file.
+    HRESULT Read(UInt64 offset, void* data, size_t size, size_t& processed);
+
+    // Copy the whole image to outStream in reads of up to readSize bytes,
+    // which may be NULL to only test it. isOk is cleared if the file ends
+    // before the last stored block does.
+    HRESULT Copy(
+        ISequentialOutStream* outStream, ICompressProgressInfo* progress,
+        size_t readSize, bool& isOk
+    );
+
+private:
+    CMyComPtr<IInStream> _stream;
+    UInt64 _dataOffset;
+    UInt32 _blockSize;
+    UInt32 _numStored;
+    // Stored block of each block, or kHole
+    CRecordVector<UInt32> _blocks;
+
+    HRESULT OpenCiso();
+    HRESULT OpenWbfs();
+    UInt64 GetRun(UInt64 offset, UInt64 size, bool& isHole) const;
+};
+
+HRESULT CImage::OpenCiso()
+{
+    CByteBuffer header(kCisoHeaderSize);
+    RINOK(ReadStream_FALSE(_stream, header, kCisoHeaderSize))
+    if (GetUi32(header) != 0x4F534943) {
+        return S_FALSE;
+    }
+    _blockSize = GetUi32(header + 4);
+    if (_blockSize < ((UInt32) 1 << kBlockSizeLogMin) ||
+        _blockSize > ((UInt32) 1 << kBlockSizeLogMax) ||
+        (_blockSize & (_blockSize - 1)) != 0) {
+        return S_FALSE;
+    }
+    _dataOffset = kCisoHeaderSize;
+
+    // The image ends with the last stored block
+    const Byte* map = header + kCisoMapOffset;
+    UInt32 numBlocks = kCisoNumBlocksMax;
+    while (numBlocks != 0 && map[numBlocks - 1] == 0) {
+        numBlocks--;
+    }
+    _blocks.ClearAndReserve(numBlocks);
+    for (UInt32 i = 0; i < numBlocks; i++) {
+        if (map[i] > 1) {
+            return S_FALSE;
+        }
+        _blocks.AddInReserved(map[i] != 0 ? _numStored++ : kHole);
+    }
+    return S_OK;
+}
+
+HRESULT CImage::OpenWbfs()
+{
+    Byte header[kWbfsHeaderSize + 1];
+    RINOK(ReadStream_FALSE(_stream, header, sizeof(header)))
+    if (GetBe32(header) != 0x57424653) {
+        return S_FALSE;
+    }
+    const unsigned sectorSizeLog = header[8];
+    const unsigned blockSizeLog = header[9];
+    // The first entry of the disc table is set if there's a disc
+    if (sectorSizeLog < kBlockSizeLogMin || blockSizeLog > kBlockSizeLogMax ||
+        blockSizeLog < sectorSizeLog || header[kWbfsHeaderSize] == 0) {
+        return S_FALSE;
+    }
+    _blockSize = (UInt32) 1 << blockSizeLog;
+    _dataOffset = 0;
+
+    const UInt32 numBlocks = (UInt32) (kWbfsDiscSize >> blockSizeLog);
+    CByteBuffer table((size_t) numBlocks * 2);
+    RINOK(InStream_SeekSet(
+        _stream, ((UInt64) 1 << sectorSizeLog) + kWbfsDiscHeaderSize
+    ))
+    RINOK(ReadStream_FALSE(_stream, table, table.Size()))
+
+    UInt32 end = numBlocks;
+    while (end != 0 && GetBe16(table + (end - 1) * 2) == 0) {
+        end--;
+    }
+    _blocks.ClearAndReserve(end);
+    for (UInt32 i = 0; i < end; i++) {
+        const UInt32 block = GetBe16(table + i * 2);
+        _blocks.AddInReserved(block != 0 ? block : kHole);
+        _numStored += block != 0;
+    }
+    return S_OK;
+}
+
+HRESULT CImage::Open(IInStream* stream, EFormat format)
+{
+    Close();
+    _stream = stream;
+    RINOK(InStream_SeekToBegin(stream))
+    const HRESULT res = format == kFormatCiso ? OpenCiso() : OpenWbfs();
+    if (res == S_OK && _blocks.Size() == 0) {
+        return S_FALSE;
+    }
+    return res;
+}
+
+void CImage::Close()
+{
+    _stream.Release();
+    _blocks.Clear();
+    _dataOffset = 0;
+    _blockSize = 0;
+    _numStored = 0;
+}
+
+// Length of the run at offset, up to size, that's either all left out or
+// stored in one piece
+UInt64 CImage::GetRun(UInt64 offset, UInt64 size, bool& isHole) const
+{
+    const UInt32 first = (UInt32) (offset / _blockSize);
+    const UInt32 stored = _blocks[first];
+    isHole = stored == kHole;
+
+    UInt64 run = _blockSize - offset % _blockSize;
+    for (UInt32 block = first + 1; run < size && block < _blocks.Size();
+         block++) {
+        const UInt32 expected = isHole ? kHole : stored + (block - first);
+        if (_blocks[block] != expected) {
+            break;
+        }
+        run += _blockSize;
+    }
+    return run < size ? run : size;
+}
+
+HRESULT CImage::Read(UInt64 offset, void* data, size_t size, size_t& processed)
+{
+    processed = 0;
+    const UInt64 end = GetSize();
+    if (offset >= end) {
+        return S_OK;
+    }
+    if (size > end - offset) {
+        size = (size_t) (end - offset);
+    }
+
+    Byte* dest = (Byte*) data;
+    while (size != 0) {
+        bool isHole;
+        const size_t cur = (size_t) GetRun(offset, size, isHole);
+        if (isHole) {
+            memset(dest, 0, cur);
+        } else {
+            const UInt32 block = _blocks[(UInt32) (offset / _blockSize)];
+            RINOK(InStream_SeekSet(
+                _stream, _dataOffset + (UInt64) block * _blockSize +
+                             offset % _blockSize
+            ))
+            size_t read = cur;
+            RINOK(ReadStream(_stream, dest, &read))
+            if (read != cur) {
+                processed += read;
+                return S_OK;
+            }
+        }
+        processed += cur;
+        dest += cur;
+        offset += cur;
+        size -= cur;
+    }
+    return S_OK;
+}
+
+HRESULT CImage::Copy(
+    ISequentialOutStream* outStream, ICompressProgressInfo* progress,
+    size_t readSize, bool& isOk
+)
+{
+    CByteBuffer buf(readSize);
+    CByteBuffer zeros;
+    const UInt64 size = GetSize();
+    UInt64 done = 0;
+    while (done < size) {
+        bool isHole;
+        const UInt64 run = GetRun(done, size - done, isHole);
+        if (isHole && zeros.Size() == 0) {
+            zeros.Alloc(readSize);
+            memset(zeros, 0, readSize);
+        }
+        for (UInt64 pos = 0; pos < run;) {
+            size_t cur = readSize;
+            if (cur > run - pos) {
+                cur = (size_t) (run - pos);
+            }
+            if (!isHole) {
+                size_t read;
+                RINOK(Read(done + pos, buf, cur, read))
+                if (read != cur) {
+                    isOk = false;
+                    return S_OK;
+                }
+            }
+            if (outStream) {
+                RINOK(WriteStream(outStream, isHole ? zeros : buf, cur))
+            }
+            pos += cur;
+            if (progress) {
+                const UInt64 total = done + pos;
+                RINOK(progress->SetRatioInfo(&total, &total))
+            }
+        }
+        done += run;
+    }
+    return S_OK;
+}
+
+// Stream over the image, for GetStream
+Z7_CLASS_IMP_IInStream(CImageStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CImageStream
+{
+#endif
+    CMyComPtr<IUnknown> _ref;
+    CImage* _image;
+    UInt64 _pos;
+
+public:
+    // ref keeps the handler that owns image alive
+    void Init(CImage* image, IUnknown* ref)
+    {
+        _ref = ref;
+        _image = image;
+        _pos = 0;
+    }
+};
+
+Z7_COM7F_IMF(CImageStream::Read(void* data, UInt32 size, UInt32* processed))
+{
+    if (processed) {
+        *processed = 0;
+    }
+    size_t read;
+    RINOK(_image->Read(_pos, data, size, read))
+    _pos += read;
+    if (processed) {
+        *processed = (UInt32) read;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CImageStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
+)
+{
+    switch (seekOrigin) {
+    case STREAM_SEEK_SET:
+        break;
+    case STREAM_SEEK_CUR:
+        offset += _pos;
+        break;
+    case STREAM_SEEK_END:
+        offset += _image->GetSize();
+        break;
+    default:
+        return STG_E_INVALIDFUNCTION;
+    }
+    if (offset < 0) {
+        return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+    }
+    _pos = (UInt64) offset;
+    if (newPosition) {
+        *newPosition = _pos;
+    }
+    return S_OK;
+}
+
+Z7_CLASS_IMP_CHandler_IInArchive_2(IInArchiveGetStream, ISetProperties)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    EFormat _format;
+    ArcData::CHandlerProps _handlerProps;
+    CImage _image;
+    UInt64 _phySize;
+
+public:
+    CHandler(EFormat format)
+      : _format(format)
+      , _phySize(0)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidPhySize,
+    kpidClusterSize,
+};
+
+static const Byte kProps[] = {
+    kpidSize,
+    kpidPackSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (_image.Open(stream, _format) != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        RINOK(InStream_GetSize_SeekToEnd(stream, _phySize))
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _image.Close();
+    _phySize = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = 1;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidPhySize:
+        prop = _phySize;
+        break;
+    case kpidClusterSize:
+        prop = _image.GetBlockSize();
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetProperty(
+    UInt32 /* index */, PROPID propID, PROPVARIANT* value
+))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidSize:
+        prop = _image.GetSize();
+        break;
+    case kpidPackSize:
+        prop = _image.GetPackSize();
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    if (numItems == 0) {
+        return S_OK;
+    }
+    if (numItems != (UInt32) (Int32) -1 && (numItems != 1 || indices[0] != 0)) {
+        return E_INVALIDARG;
+    }
+
+    RINOK(extractCallback->SetTotal(_image.GetSize()))
+
+    CMyComPtr<ISequentialOutStream> realOutStream;
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+    RINOK(extractCallback->GetStream(0, &realOutStream, askMode))
+    if (!testMode && !realOutStream) {
+        return S_OK;
+    }
+    RINOK(extractCallback->PrepareOperation(askMode))
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, false);
+
+    bool isOk = true;
+    RINOK(_image.Copy(realOutStream, progress, _handlerProps.BlockSize, isOk))
+
+    realOutStream.Release();
+    return extractCallback->SetOperationResult(
+        isOk ? NArchive::NExtract::NOperationResult::kOK
+             : NArchive::NExtract::NOperationResult::kUnexpectedEnd
+    );
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetStream(UInt32 /* index */, ISequentialInStream** stream)
+)
+{
+    PRINT("GetStream\n");
+
+    *stream = NULL;
+    COM_TRY_BEGIN
+    CImageStream* streamSpec = new CImageStream;
+    CMyComPtr<ISequentialInStream> streamTemp = streamSpec;
+    streamSpec->Init(&_image, (IInArchive*) this);
+    *stream = streamTemp.Detach();
+    return S_OK;
+    COM_TRY_END
+}
+
+// -mbs sets the size of the reads when extracting. Runs of stored blocks are
+// read in pieces of that size however many blocks they cover.
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        HRESULT hres;
+        if (_handlerProps.SetProperty(name, values[i], hres)) {
+            RINOK(hres)
+        } else {
+            return E_INVALIDARG;
+        }
+    }
+    return S_OK;
+}
+
+} // namespace Sparse
+
+namespace Ciso
+{
+
+static const Byte k_Signature[] = {'C', 'I', 'S', 'O'};
+
+REGISTER_ARC_I_CLS(
+    Sparse::CHandler(Sparse::kFormatCiso), //
+    "ciso", "ciso", ".iso", 0xAA, //
+    k_Signature, //
+    0, //
+    0, 0
+)
+
+} // namespace Ciso
+
+namespace Wbfs
+{
+
+static const Byte k_Signature[] = {'W', 'B', 'F', 'S'};
+
+REGISTER_ARC_I_CLS(
+    Sparse::CHandler(Sparse::kFormatWbfs), //
+    "wbfs", "wbfs", ".iso", 0xAB, //
+    k_Signature, //
+    0, //
+    0, 0
+)
+
+} // namespace Wbfs
@@ -0,0 +1,386 @@
+// Validate.cpp - Bulk range checks over metadata tables
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Validate.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#if defined(MY_CPU_X86_OR_AMD64)
+#  if defined(__clang__) || defined(__GNUC__)
+#    define VALIDATE_ATTRIB_SSE41 __attribute__((__target__("sse4.1")))
+#    define VALIDATE_ATTRIB_AVX2 __attribute__((__target__("avx2")))
+#  else
+#    define VALIDATE_ATTRIB_SSE41
+#    define VALIDATE_ATTRIB_AVX2
+#  endif
+#  define USE_VALIDATE_X86
+#  include <immintrin.h>
+#elif defined(MY_CPU_ARM64)
+#  define USE_VALIDATE_NEON
+#  include <arm_neon.h>
+#endif
+
+namespace Validate
+{
+
+//
+// Plain code, also used for whatever is left after the vector loops
+//
+
+static bool AllBelow_Base(const UInt32* values, size_t count, UInt32 limit)
+{
+    UInt32 bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= (UInt32) (values[i] >= limit);
+    }
+    return bad == 0;
+}
+
+static bool AllBelow8_Base(const Byte* values, size_t count, Byte limit)
+{
+    UInt32 bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= (UInt32) (values[i] >= limit);
+    }
+    return bad == 0;
+}
+
+static bool AllBelowWhere_Base(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+)
+{
+    UInt32 bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= (UInt32) (keys[i] == key && values[i] >= limit);
+    }
+    return bad == 0;
+}
+
+static bool AllRangesWithin_Base(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+)
+{
+    UInt32 bad = 0;
+    for (size_t i = 0; i < count; i++) {
+        bad |= (UInt32) (offsets[i] > limit || sizes[i] > limit - offsets[i]);
+    }
+    return bad == 0;
+}
+
+// The vector code has no unsigned compare, so a <= b is tested as
+// max(a, b) == b. Lanes that fail leave bits set in an accumulator, which is
+// only looked at once at the end.
+
+#ifdef USE_VALIDATE_X86
+
+VALIDATE_ATTRIB_SSE41
+static bool AllBelow_SSE41(const UInt32* values, size_t count, UInt32 limit)
+{
+    const __m128i max = _mm_set1_epi32((int) (limit - 1));
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (values + i));
+        bad = _mm_or_si128(bad, _mm_xor_si128(_mm_max_epu32(v, max), max));
+    }
+    return _mm_testz_si128(bad, bad) &&
+           AllBelow_Base(values + i, count - i, limit);
+}
+
+VALIDATE_ATTRIB_SSE41
+static bool AllBelow8_SSE41(const Byte* values, size_t count, Byte limit)
+{
+    const __m128i max = _mm_set1_epi8((char) (limit - 1));
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (values + i));
+        bad = _mm_or_si128(bad, _mm_xor_si128(_mm_max_epu8(v, max), max));
+    }
+    return _mm_testz_si128(bad, bad) &&
+           AllBelow8_Base(values + i, count - i, limit);
+}
+
+// The keys are widened to 32 bits four at a time to line up with the values
+VALIDATE_ATTRIB_SSE41
+static bool AllBelowWhere_SSE41(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+)
+{
+    const __m128i max = _mm_set1_epi32((int) (limit - 1));
+    const __m128i k = _mm_set1_epi32(key);
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (values + i));
+        const __m128i m = _mm_cmpeq_epi32(
+            _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int) GetUi32(keys + i))), k
+        );
+        bad = _mm_or_si128(
+            bad,
+            _mm_and_si128(m, _mm_xor_si128(_mm_max_epu32(v, max), max))
+        );
+    }
+    return _mm_testz_si128(bad, bad) &&
+           AllBelowWhere_Base(values + i, keys + i, key, count - i, limit);
+}
+
+VALIDATE_ATTRIB_SSE41
+static bool AllRangesWithin_SSE41(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+)
+{
+    const __m128i lim = _mm_set1_epi32((int) limit);
+    __m128i bad = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i o = _mm_loadu_si128((const __m128i*) (offsets + i));
+        const __m128i s = _mm_loadu_si128((const __m128i*) (sizes + i));
+        // Room left after the offset, which is only garbage in lanes where
+        // the offset is already past the limit
+        const __m128i left = _mm_sub_epi32(lim, o);
+        bad = _mm_or_si128(bad, _mm_xor_si128(_mm_max_epu32(o, lim), lim));
+        bad = _mm_or_si128(bad, _mm_xor_si128(_mm_max_epu32(s, left), left));
+    }
+    return _mm_testz_si128(bad, bad) &&
+           AllRangesWithin_Base(offsets + i, sizes + i, count - i, limit);
+}
+
+VALIDATE_ATTRIB_AVX2
+static bool AllBelow_AVX2(const UInt32* values, size_t count, UInt32 limit)
+{
+    const __m256i max = _mm256_set1_epi32((int) (limit - 1));
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+        bad = _mm256_or_si256(
+            bad, _mm256_xor_si256(_mm256_max_epu32(v, max), max)
+        );
+    }
+    return _mm256_testz_si256(bad, bad) &&
+           AllBelow_Base(values + i, count - i, limit);
+}
+
+VALIDATE_ATTRIB_AVX2
+static bool AllBelow8_AVX2(const Byte* values, size_t count, Byte limit)
+{
+    const __m256i max = _mm256_set1_epi8((char) (limit - 1));
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+        bad = _mm256_or_si256(
+            bad, _mm256_xor_si256(_mm256_max_epu8(v, max), max)
+        );
+    }
+    return _mm256_testz_si256(bad, bad) &&
+           AllBelow8_Base(values + i, count - i, limit);
+}
+
+VALIDATE_ATTRIB_AVX2
+static bool AllBelowWhere_AVX2(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+)
+{
+    const __m256i max = _mm256_set1_epi32((int) (limit - 1));
+    const __m256i k = _mm256_set1_epi32(key);
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*) (values + i));
+        const __m256i m = _mm256_cmpeq_epi32(
+            _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (keys + i))),
+            k
+        );
+        bad = _mm256_or_si256(
+            bad, _mm256_and_si256(
+                     m, _mm256_xor_si256(_mm256_max_epu32(v, max), max)
+                 )
+        );
+    }
+    return _mm256_testz_si256(bad, bad) &&
+           AllBelowWhere_Base(values + i, keys + i, key, count - i, limit);
+}
+
+VALIDATE_ATTRIB_AVX2
+static bool AllRangesWithin_AVX2(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+)
+{
+    const __m256i lim = _mm256_set1_epi32((int) limit);
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i o = _mm256_loadu_si256((const __m256i*) (offsets + i));
+        const __m256i s = _mm256_loadu_si256((const __m256i*) (sizes + i));
+        const __m256i left = _mm256_sub_epi32(lim, o);
+        bad = _mm256_or_si256(
+            bad, _mm256_xor_si256(_mm256_max_epu32(o, lim), lim)
+        );
+        bad = _mm256_or_si256(
+            bad, _mm256_xor_si256(_mm256_max_epu32(s, left), left)
+        );
+    }
+    return _mm256_testz_si256(bad, bad) &&
+           AllRangesWithin_Base(offsets + i, sizes + i, count - i, limit);
+}
+
+#endif // USE_VALIDATE_X86
+
+#ifdef USE_VALIDATE_NEON
+
+static bool AllBelow_NEON(const UInt32* values, size_t count, UInt32 limit)
+{
+    const uint32x4_t max = vdupq_n_u32(limit - 1);
+    uint32x4_t bad = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        bad = vorrq_u32(bad, vcgtq_u32(vld1q_u32(values + i), max));
+    }
+    return vmaxvq_u32(bad) == 0 && AllBelow_Base(values + i, count - i, limit);
+}
+
+static bool AllBelow8_NEON(const Byte* values, size_t count, Byte limit)
+{
+    const uint8x16_t max = vdupq_n_u8((Byte) (limit - 1));
+    uint8x16_t bad = vdupq_n_u8(0);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        bad = vorrq_u8(bad, vcgtq_u8(vld1q_u8(values + i), max));
+    }
+    return vmaxvq_u8(bad) == 0 && AllBelow8_Base(values + i, count - i, limit);
+}
+
+// Eight keys are widened at a time, for two vectors of values
+static bool AllBelowWhere_NEON(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+)
+{
+    const uint32x4_t max = vdupq_n_u32(limit - 1);
+    const uint32x4_t k = vdupq_n_u32(key);
+    uint32x4_t bad = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const uint16x8_t keys16 = vmovl_u8(vld1_u8(keys + i));
+        bad = vorrq_u32(
+            bad, vandq_u32(
+                     vceqq_u32(vmovl_u16(vget_low_u16(keys16)), k),
+                     vcgtq_u32(vld1q_u32(values + i), max)
+                 )
+        );
+        bad = vorrq_u32(
+            bad, vandq_u32(
+                     vceqq_u32(vmovl_u16(vget_high_u16(keys16)), k),
+                     vcgtq_u32(vld1q_u32(values + i + 4), max)
+                 )
+        );
+    }
+    return vmaxvq_u32(bad) == 0 &&
+           AllBelowWhere_Base(values + i, keys + i, key, count - i, limit);
+}
+
+static bool AllRangesWithin_NEON(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+)
+{
+    const uint32x4_t lim = vdupq_n_u32(limit);
+    uint32x4_t bad = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const uint32x4_t o = vld1q_u32(offsets + i);
+        const uint32x4_t s = vld1q_u32(sizes + i);
+        bad = vorrq_u32(bad, vcgtq_u32(o, lim));
+        bad = vorrq_u32(bad, vcgtq_u32(s, vsubq_u32(lim, o)));
+    }
+    return vmaxvq_u32(bad) == 0 &&
+           AllRangesWithin_Base(offsets + i, sizes + i, count - i, limit);
+}
+
+#endif // USE_VALIDATE_NEON
+
+typedef bool (*AllBelowFunc)(const UInt32*, size_t, UInt32);
+typedef bool (*AllBelow8Func)(const Byte*, size_t, Byte);
+typedef bool (*AllBelowWhereFunc)(
+    const UInt32*, const Byte*, Byte, size_t, UInt32
+);
+typedef bool (*AllRangesWithinFunc)(
+    const UInt32*, const UInt32*, size_t, UInt32
+);
+
+static AllBelowFunc g_AllBelow = AllBelow_Base;
+static AllBelow8Func g_AllBelow8 = AllBelow8_Base;
+static AllBelowWhereFunc g_AllBelowWhere = AllBelowWhere_Base;
+static AllRangesWithinFunc g_AllRangesWithin = AllRangesWithin_Base;
+
+static struct CValidateInit {
+    CValidateInit()
+    {
+#if defined(USE_VALIDATE_X86)
+        if (CPU_IsSupported_AVX2()) {
+            PRINT("Validate: AVX2\n");
+            g_AllBelow = AllBelow_AVX2;
+            g_AllBelow8 = AllBelow8_AVX2;
+            g_AllBelowWhere = AllBelowWhere_AVX2;
+            g_AllRangesWithin = AllRangesWithin_AVX2;
+        } else if (CPU_IsSupported_SSE41()) {
+            PRINT("Validate: SSE4.1\n");
+            g_AllBelow = AllBelow_SSE41;
+            g_AllBelow8 = AllBelow8_SSE41;
+            g_AllBelowWhere = AllBelowWhere_SSE41;
+            g_AllRangesWithin = AllRangesWithin_SSE41;
+        }
+#elif defined(USE_VALIDATE_NEON)
+        if (CPU_IsSupported_NEON()) {
+            PRINT("Validate: NEON\n");
+            g_AllBelow = AllBelow_NEON;
+            g_AllBelow8 = AllBelow8_NEON;
+            g_AllBelowWhere = AllBelowWhere_NEON;
+            g_AllRangesWithin = AllRangesWithin_NEON;
+        }
+#endif
+    }
+} g_ValidateInit;
+
+bool AllBelow(const UInt32* values, size_t count, UInt32 limit)
+{
+    if (limit == 0) {
+        return count == 0;
+    }
+    return g_AllBelow(values, count, limit);
+}
+
+bool AllBelow(const Byte* values, size_t count, Byte limit)
+{
+    if (limit == 0) {
+        return count == 0;
+    }
+    return g_AllBelow8(values, count, limit);
+}
+
+bool AllBelowWhere(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+)
+{
+    if (limit == 0) {
+        return AllBelowWhere_Base(values, keys, key, count, limit);
+    }
+    return g_AllBelowWhere(values, keys, key, count, limit);
+}
+
+bool AllRangesWithin(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+)
+{
+    return g_AllRangesWithin(offsets, sizes, count, limit);
+}
+
+} // namespace Validate
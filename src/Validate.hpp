@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Types.h"
+
+// Bulk checks over the fields of a whole metadata table, run before any items
+// are built from it so that a malformed table is turned down up front. Each
+// one goes over the arrays with AVX2, SSE4.1 or NEON when the CPU has it.
+namespace Validate
+{
+
+// True if every one of values[0 .. count) is below limit
+bool AllBelow(const UInt32* values, size_t count, UInt32 limit);
+bool AllBelow(const Byte* values, size_t count, Byte limit);
+
+// Same, only for the values whose key is key. The keys are byte fields, such
+// as node types, which are widened as they're loaded rather than kept in
+// 32-bit arrays.
+bool AllBelowWhere(
+    const UInt32* values, const Byte* keys, Byte key, size_t count,
+    UInt32 limit
+);
+
+// True if offsets[i] + sizes[i] is no more than limit for every i, with sums
+// that wrap around counting as past it
+bool AllRangesWithin(
+    const UInt32* offsets, const UInt32* sizes, size_t count, UInt32 limit
+);
+
+} // namespace Validate
@@ -0,0 +1,774 @@
+// Wad.cpp - File for reading Wii WAD packages
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "Darch.hpp"
+#include "Types.h"
+#include "Util.hpp"
+#include "Wii.hpp"
+
+#include <C/Aes.h>
+#include <C/CpuArch.h>
+#include <C/Sha1.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/IntToString.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyBuffer2.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <cstring>
+
+// A WAD holds a title as it's installed: the certificate chain, ticket and
+// TMD, then each content of the TMD encrypted with the title key. Contents
+// that are U8 archives, as the banner and most channel data are, have their
+// files listed as well.
+namespace Wad
+{
+
+typedef Darch::CItem CItem;
+
+static const UInt32 kHeaderSize = 0x20;
+// Each part of the package starts on this alignment
+static const UInt32 kAlign = 0x40;
+
+// Both the ticket and the TMD are signed with RSA-2048
+static const UInt32 kSignatureType = 0x00010001;
+
+static const UInt32 kTmdNumContentsOffset = 0x1DE;
+static const UInt32 kTmdContentsOffset = 0x1E4;
+static const UInt32 kTmdContentSize = 0x24;
+
+static const UInt32 kU8Magic = 0x55AA382D;
+static const UInt32 kU8HeaderSize = 0x20;
+// The banner has its U8 archive after an IMET header, which some have an
+// extra 0x40 bytes in front of
+static const UInt32 kImetMagic = 0x494D4554;
+static const UInt32 kImetMagicOffset = 0x40;
+static const UInt32 kImetSize = 0x600;
+
+static UInt64 Align(UInt64 value, UInt32 align)
+{
+    return (value + align - 1) & ~(UInt64) (align - 1);
+}
+
+// The AES code wants its key schedule and data 16-byte aligned
+static UInt32* GetAligned(UInt32* p)
+{
+    return p + ((0 - (unsigned) (ptrdiff_t) p) & 0xF) / sizeof(UInt32);
+}
+
+// A content from the TMD
+struct CContent {
+    UInt32 Id;
+    UInt16 Index;
+    UInt32 Size;
+    Byte Hash[SHA1_DIGEST_SIZE];
+    // Where the encrypted data starts in the package
+    UInt64 Offset;
+    // Item of the content as a whole
+    int Item;
+};
+
+Z7_CLASS_IMP_CHandler_IInArchive_3(
+    IArchiveGetRawProps, IInArchiveGetStream, ISetProperties
+)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    ArcData::CHandlerProps _handlerProps;
+    // -mkey: file holding the common keys, as for Wii discs
+    FString _keyFile;
+
+    CRecordVector<CItem> _items;
+    // Content whose decrypted data each item is in, or -1 if it's read from
+    // the package as it's stored
+    CRecordVector<int> _itemContents;
+    CRecordVector<CContent> _contents;
+    UInt64 _phySize;
+    bool _isKeyMissing;
+
+    // Names of all items, the U8 node tables among them
+    CByteBuffer _names;
+    size_t _namesSize;
+    CRecordVector<char> _pathArena;
+    CRecordVector<UInt32> _pathOffsets;
+
+    // Key schedule of the title key at _aes + _aesOffset, with the IV in
+    // front of it
+    UInt32 _aes[AES_NUM_IVMRK_WORDS + 3];
+    unsigned _aesOffset;
+    // Contents are decrypted up to _batchSize bytes at a time into _buf,
+    // which is aligned as the wide AES code needs
+    CMidAlignedBuffer _buf;
+    size_t _batchSize;
+
+    UInt32 AddName(const void* data, size_t size);
+    int AddItem(
+        const char* name, int parent, bool isDir, UInt64 offset, UInt32 size,
+        int content
+    );
+    const char* GetPath(UInt32 index);
+
+    HRESULT DecryptBlocks(const CContent& content, UInt64 offset, size_t size);
+    HRESULT GetData(
+        unsigned index, UInt64 offset, UInt64 size, const Byte*& data,
+        size_t& processed
+    );
+    HRESULT ReadContent(
+        unsigned index, UInt64 offset, void* data, size_t size
+    );
+    HRESULT CopyContent(
+        unsigned index, UInt64 offset, UInt64 size, bool verify,
+        ISequentialOutStream* outStream, ICompressProgressInfo* progress,
+        bool& isOk
+    );
+    static HRESULT ReadData(
+        void* param, int content, UInt64 offset, void* data, size_t size
+    );
+
+    HRESULT AddU8(unsigned index);
+    HRESULT Open2();
+
+public:
+    CHandler()
+      : _phySize(0)
+      , _isKeyMissing(false)
+      , _namesSize(0)
+      , _aesOffset(0)
+      , _batchSize(0)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidPhySize,
+    kpidWarning,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+// Append to the names, returning the offset of the data
+UInt32 CHandler::AddName(const void* data, size_t size)
+{
+    const size_t needed = _namesSize + size;
+    if (needed > _names.Size()) {
+        size_t newSize = _names.Size() < (1 << 10) ? (1 << 10) : _names.Size();
+        while (newSize < needed) {
+            newSize *= 2;
+        }
+        _names.ChangeSize_KeepData(newSize, _namesSize);
+    }
+    memcpy(_names + _namesSize, data, size);
+    const UInt32 offset = (UInt32) _namesSize;
+    _namesSize = needed;
+    return offset;
+}
+
+int CHandler::AddItem(
+    const char* name, int parent, bool isDir, UInt64 offset, UInt32 size,
+    int content
+)
+{
+    CItem item;
+    item.NameOffset = AddName(name, strlen(name) + 1);
+    item.Parent = parent;
+    item.IsDir = isDir;
+    item.Offset = offset;
+    item.Size = size;
+    _itemContents.Add(content);
+    return _items.Add(item);
+}
+
+const char* CHandler::GetPath(UInt32 index)
+{
+    if (_pathOffsets.Size() == 0 &&
+        !Darch::BuildPathArena(_items, _names, _pathArena, _pathOffsets)) {
+        return NULL;
+    }
+    return &_pathArena[_pathOffsets[index]];
+}
+
+// Decrypt size bytes of content at offset, both a multiple of the AES block
+// size, to _buf. The whole run is decrypted in one call, so the wide AES code
+// has plenty of blocks to work on at once.
+HRESULT CHandler::DecryptBlocks(
+    const CContent& content, UInt64 offset, size_t size
+)
+{
+    UInt32* aes = _aes + _aesOffset;
+    Byte iv[AES_BLOCK_SIZE];
+    if (offset == 0) {
+        // The IV of a content is its index, padded with zeros
+        memset(iv, 0, AES_BLOCK_SIZE);
+        iv[0] = (Byte) (content.Index >> 8);
+        iv[1] = (Byte) content.Index;
+    } else {
+        // Otherwise it's the encrypted block before
+        RINOK(_source.Read(
+            content.Offset + offset - AES_BLOCK_SIZE, iv, AES_BLOCK_SIZE
+        ))
+    }
+    RINOK(_source.Read(content.Offset + offset, _buf, size))
+    AesCbc_Init(aes, iv);
+    g_AesCbc_Decode(aes, _buf, size / AES_BLOCK_SIZE);
+    return S_OK;
+}
+
+// Decrypt as much of size bytes of content index at offset as fits in a
+// batch, pointing data at them. Returns S_FALSE if they go past the end of
+// the content or the package.
+HRESULT CHandler::GetData(
+    unsigned index, UInt64 offset, UInt64 size, const Byte*& data,
+    size_t& processed
+)
+{
+    const CContent& content = _contents[index];
+    if (offset > content.Size || size > content.Size - offset) {
+        return S_FALSE;
+    }
+    const UInt64 start = offset & ~(UInt64) (AES_BLOCK_SIZE - 1);
+    const size_t skip = (size_t) (offset - start);
+    processed = _batchSize - skip;
+    if (processed > size) {
+        processed = (size_t) size;
+    }
+    RINOK(DecryptBlocks(
+        content, start, (size_t) Align(skip + processed, AES_BLOCK_SIZE)
+    ))
+    data = _buf + skip;
+    return S_OK;
+}
+
+// Read exactly size bytes of content index at offset. Returns S_FALSE if they
+// go past the end of the content or the package.
+HRESULT CHandler::ReadContent(
+    unsigned index, UInt64 offset, void* data, size_t size
+)
+{
+    Byte* dest = (Byte*) data;
+    while (size != 0) {
+        const Byte* cur;
+        size_t processed;
+        RINOK(GetData(index, offset, size, cur, processed))
+        memcpy(dest, cur, processed);
+        dest += processed;
+        offset += processed;
+        size -= processed;
+    }
+    return S_OK;
+}
+
+// Copy size bytes of content index at offset to outStream, which may be NULL
+// to only test the data. If verify is set the range is the whole content,
+// and it's checked against the hash in the TMD.
+HRESULT CHandler::CopyContent(
+    unsigned index, UInt64 offset, UInt64 size, bool verify,
+    ISequentialOutStream* outStream, ICompressProgressInfo* progress,
+    bool& isOk
+)
+{
+    CSha1 sha;
+    if (verify) {
+        Sha1_Init(&sha);
+    }
+    UInt64 done = 0;
+    while (done < size) {
+        const Byte* data;
+        size_t processed;
+        const HRESULT res = GetData(
+            index, offset + done, size - done, data, processed
+        );
+        if (res == S_FALSE) {
+            isOk = false;
+            return S_OK;
+        }
+        RINOK(res)
+        if (verify) {
+            Sha1_Update(&sha, data, processed);
+        }
+        if (outStream) {
+            RINOK(WriteStream(outStream, data, processed))
+        }
+        done += processed;
+        if (progress) {
+            RINOK(progress->SetRatioInfo(&done, &done))
+        }
+    }
+    if (verify) {
+        Byte digest[SHA1_DIGEST_SIZE];
+        Sha1_Final(&sha, digest);
+        isOk = memcmp(digest, _contents[index].Hash, SHA1_DIGEST_SIZE) == 0;
+    }
+    return S_OK;
+}
+
+HRESULT CHandler::ReadData(
+    void* param, int content, UInt64 offset, void* data, size_t size
+)
+{
+    CHandler* handler = (CHandler*) param;
+    if (content < 0) {
+        return handler->_source.Read(offset, data, size);
+    }
+    return handler->ReadContent((unsigned) content, offset, data, size);
+}
+
+// List the files of content index if it's a U8 archive, in a directory named
+// as nested archives are. Only the U8 header and node table are decrypted and
+// read in, and the table is copied into the name table for the node names; the
+// files themselves stay in the content and are read from there on extract.
+HRESULT CHandler::AddU8(unsigned index)
+{
+    const CContent& content = _contents[index];
+    Byte header[kU8HeaderSize];
+    UInt32 base = 0;
+    if (content.Size < kU8HeaderSize) {
+        return S_OK;
+    }
+    RINOK(ReadContent(index, 0, header, kU8HeaderSize))
+    if (GetBe32(header) != kU8Magic) {
+        // Look for the IMET header in front of the banner
+        for (UInt32 extra = 0; extra <= kAlign && base == 0; extra += kAlign) {
+            Byte magic[4];
+            if (content.Size >= extra + kImetSize + kU8HeaderSize &&
+                ReadContent(index, extra + kImetMagicOffset, magic, 4) ==
+                    S_OK &&
+                GetBe32(magic) == kImetMagic) {
+                base = extra + kImetSize;
+            }
+        }
+        if (base == 0) {
+            return S_OK;
+        }
+        RINOK(ReadContent(index, base, header, kU8HeaderSize))
+        if (GetBe32(header) != kU8Magic) {
+            return S_OK;
+        }
+    }
+
+    const UInt32 entriesOffset = GetBe32(header + 4);
+    const UInt32 metadataSize = GetBe32(header + 8);
+    if (entriesOffset < kU8HeaderSize || metadataSize < 0xC ||
+        entriesOffset > content.Size - base ||
+        metadataSize > content.Size - base - entriesOffset) {
+        return S_OK;
+    }
+    CByteBuffer metadata(metadataSize);
+    RINOK(ReadContent(index, base + entriesOffset, metadata, metadataSize))
+
+    AString name((const char*) (_names + _items[content.Item].NameOffset));
+    name += ".d";
+    const unsigned first = _items.Size();
+    const int dir = AddItem(name, -1, true, 0, 0, -1);
+    if (!Darch::ParseNodes(metadata, metadataSize, dir, 0, _items)) {
+        _items.DeleteFrom(first);
+        _itemContents.DeleteFrom(first);
+        return S_OK;
+    }
+    const UInt32 nameBase = AddName(metadata, metadataSize);
+    for (unsigned i = first + 1; i < _items.Size(); i++) {
+        CItem& item = _items[i];
+        item.NameOffset += nameBase;
+        item.Offset += base;
+        _itemContents.Add(item.IsDir ? -1 : (int) index);
+    }
+    return S_OK;
+}
+
+HRESULT CHandler::Open2()
+{
+    Byte header[kHeaderSize];
+    RINOK(_source.Read(0, header, kHeaderSize))
+    const UInt32 type = GetBe16(header + 4);
+    if (GetBe32(header) != kHeaderSize || (type != 0x4973 && type != 0x6962) ||
+        GetBe16(header + 6) != 0) {
+        return S_FALSE;
+    }
+
+    // Certificates, revocation list, ticket, TMD, contents and footer, in
+    // that order
+    const UInt32 certSize = GetBe32(header + 0x08);
+    const UInt32 crlSize = GetBe32(header + 0x0C);
+    const UInt32 ticketSize = GetBe32(header + 0x10);
+    const UInt32 tmdSize = GetBe32(header + 0x14);
+    const UInt32 dataSize = GetBe32(header + 0x18);
+    const UInt32 footerSize = GetBe32(header + 0x1C);
+    const UInt64 certOffset = Align(kHeaderSize, kAlign);
+    const UInt64 ticketOffset = certOffset + Align(certSize, kAlign) +
+                                Align(crlSize, kAlign);
+    const UInt64 tmdOffset = ticketOffset + Align(ticketSize, kAlign);
+    const UInt64 dataOffset = tmdOffset + Align(tmdSize, kAlign);
+    const UInt64 footerOffset = dataOffset + Align(dataSize, kAlign);
+    _phySize = footerOffset + footerSize;
+    if (ticketSize < Wii::kTicketSize || tmdSize < kTmdContentsOffset) {
+        return S_FALSE;
+    }
+
+    Byte ticket[Wii::kTicketSize];
+    RINOK(_source.Read(ticketOffset, ticket, Wii::kTicketSize))
+    if (GetBe32(ticket) != kSignatureType) {
+        return S_FALSE;
+    }
+    Byte tmdHeader[kTmdContentsOffset];
+    RINOK(_source.Read(tmdOffset, tmdHeader, kTmdContentsOffset))
+    const UInt32 numContents = GetBe16(tmdHeader + kTmdNumContentsOffset);
+    if (GetBe32(tmdHeader) != kSignatureType ||
+        tmdSize < kTmdContentsOffset + numContents * kTmdContentSize) {
+        return S_FALSE;
+    }
+    CByteBuffer table(numContents * kTmdContentSize);
+    RINOK(_source.Read(
+        tmdOffset + kTmdContentsOffset, table, table.Size()
+    ))
+
+    AddItem("cert.bin", -1, false, certOffset, certSize, -1);
+    AddItem("ticket.bin", -1, false, ticketOffset, ticketSize, -1);
+    AddItem("tmd.bin", -1, false, tmdOffset, tmdSize, -1);
+    if (footerSize != 0) {
+        AddItem("footer.bin", -1, false, footerOffset, footerSize, -1);
+    }
+
+    // Contents follow one another in TMD order. A package may leave out the
+    // ones the system already has, so the ones past the end aren't listed.
+    UInt64 offset = dataOffset;
+    const UInt64 dataEnd = dataOffset + dataSize;
+    for (UInt32 i = 0; i < numContents; i++) {
+        const Byte* entry = table + i * kTmdContentSize;
+        const UInt64 size = GetBe64(entry + 8);
+        if (offset > dataEnd || size > dataSize ||
+            Align(size, AES_BLOCK_SIZE) > dataEnd - offset) {
+            break;
+        }
+        CContent content;
+        content.Id = GetBe32(entry);
+        content.Index = GetBe16(entry + 4);
+        content.Size = (UInt32) size;
+        memcpy(content.Hash, entry + 0x10, SHA1_DIGEST_SIZE);
+        content.Offset = offset;
+        content.Item = -1;
+        _contents.Add(content);
+        offset += Align(size, kAlign);
+    }
+
+    CByteBuffer keys;
+    Wii::LoadCommonKeys(_keyFile, keys);
+    const unsigned keyIndex = Wii::GetKeyIndex(ticket);
+    if ((keyIndex + 1) * Wii::kKeySize > keys.Size()) {
+        _isKeyMissing = true;
+        return S_OK;
+    }
+    // The title key is decrypted once, and its key schedule kept for all
+    // contents
+    Byte titleKey[Wii::kKeySize];
+    Wii::DecryptTitleKey(ticket, keys + keyIndex * Wii::kKeySize, titleKey);
+    _aesOffset = (unsigned) (GetAligned(_aes) - _aes);
+    Aes_SetKey_Dec(_aes + _aesOffset + 4, titleKey, Wii::kKeySize);
+    _batchSize = _handlerProps.BlockSize & ~(size_t) (AES_BLOCK_SIZE - 1);
+    _buf.Alloc(_batchSize);
+
+    for (unsigned i = 0; i < _contents.Size(); i++) {
+        CContent& content = _contents[i];
+        char name[16];
+        ConvertUInt32ToHex8Digits(content.Id, name);
+        MyStringLower_Ascii(name);
+        strcat(name, ".app");
+        content.Item = AddItem(name, -1, false, 0, content.Size, (int) i);
+    }
+    // A content cut off by the end of the package just isn't opened
+    for (unsigned i = 0; i < _contents.Size(); i++) {
+        const HRESULT res = AddU8(i);
+        if (res != S_OK && res != S_FALSE) {
+            return res;
+        }
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (_source.Open(stream) != S_OK || Open2() != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _source.Close();
+    _items.Clear();
+    _itemContents.Clear();
+    _contents.Clear();
+    _namesSize = 0;
+    _pathArena.Clear();
+    _pathOffsets.Clear();
+    _phySize = 0;
+    _isKeyMissing = false;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _items.Size();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidPhySize:
+        prop = _phySize;
+        break;
+    case kpidIsTree:
+        prop = true;
+        break;
+    case kpidWarning:
+        if (_isKeyMissing) {
+            prop = "Common key not found, the contents are not listed";
+        }
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    const CItem& item = _items[index];
+
+    switch (propID) {
+    case kpidPath: {
+        const char* path = GetPath(index);
+        if (path == NULL) {
+            return E_OUTOFMEMORY;
+        }
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(path, strlen(path), us);
+        prop = us;
+        break;
+    }
+
+    case kpidName: {
+        const char* name = (const char*) (_names + item.NameOffset);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(name, strlen(name), us);
+        prop = us;
+        break;
+    }
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+    case kpidPackSize:
+        prop = item.Size;
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+)
+{
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _items[index].Parent;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (propID == kpidName) {
+        const char* name = (const char*) (_names + _items[index].NameOffset);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    const UInt32 numIndices = allFilesMode ? _items.Size() : numItems;
+    if (numIndices == 0) {
+        return S_OK;
+    }
+
+    // Ranges are ordered by where their data is stored in the package
+    CRecordVector<ArcData::CRange> ranges;
+    for (UInt32 i = 0; i < numIndices; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        const CItem& item = _items[index];
+        const int content = _itemContents[index];
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = 0;
+        range.Size = 0;
+        if (!item.IsDir) {
+            range.Offset = item.Offset;
+            if (content >= 0) {
+                range.Offset += _contents[content].Offset;
+            }
+            range.Size = item.Size;
+        }
+        ranges.Add(range);
+    }
+
+    // A content extracted whole is checked against its hash
+    auto copy = [&](const ArcData::CRange& range,
+                    ISequentialOutStream* outStream,
+                    ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+        const CItem& item = _items[range.Index];
+        const int content = _itemContents[range.Index];
+        if (content < 0) {
+            return _source.Copy(
+                item.Offset, item.Size, outStream, progress, isOk
+            );
+        }
+        return CopyContent(
+            (unsigned) content, item.Offset, item.Size,
+            _contents[content].Item == (int) range.Index, outStream, progress,
+            isOk
+        );
+    };
+    return ArcData::ExtractRanges(ranges, testMode, extractCallback, copy);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    PRINT("GetStream\n");
+
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    const CItem& item = _items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    const int content = _itemContents[index];
+    if (content < 0) {
+        return _source.GetStream(
+            item.Offset, item.Size, (IInArchive*) this, stream
+        );
+    }
+    Wii::CreateDiscStream(
+        ReadData, this, content, item.Offset, item.Size, (IInArchive*) this,
+        stream
+    );
+    return S_OK;
+    COM_TRY_END
+}
+
+// Besides the common key file, the block size sets how much of a content is
+// decrypted at a time
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _keyFile.Empty();
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        HRESULT hres;
+        if (name.IsEqualTo("key")) {
+            if (values[i].vt != VT_BSTR) {
+                return E_INVALIDARG;
+            }
+            _keyFile = us2fs(values[i].bstrVal);
+        } else if (_handlerProps.SetProperty(name, values[i], hres)) {
+            RINOK(hres)
+        } else {
+            return E_INVALIDARG;
+        }
+    }
+    _source.SetBlockSize(_handlerProps.BlockSize);
+    return S_OK;
+}
+
+// Header size, then the type: "Is" for an installable title, "ib" for boot2
+static const Byte k_Signature[] = {
+    6, 0, 0, 0, 0x20, 'I', 's', //
+    6, 0, 0, 0, 0x20, 'i', 'b', //
+};
+
+REGISTER_ARC_I(
+    "wad", "wad", NULL, 0xAC, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kMultiSignature, 0
+)
+
+} // namespace Wad
@@ -0,0 +1,1280 @@
+// Wia.cpp - File for reading WIA and RVZ disc images
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "ArcData.hpp"
+#include "BlockCache.hpp"
+#include "Darch.hpp"
+#include "Nested.hpp"
+#include "Parallel.hpp"
+#include "Types.h"
+#include "Util.hpp"
+#include "Wii.hpp"
+
+#include <C/Alloc.h>
+#include <C/CpuArch.h>
+#include <C/Lzma2Dec.h>
+#include <C/LzmaDec.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamObjects.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+#include <CPP/7zip/Compress/BZip2Decoder.h>
+
+namespace Wia
+{
+
+static const UInt32 kWiaMagic = 0x57494101;
+static const UInt32 kRvzMagic = 0x52565A01;
+
+// The file header, then the disc header, which describes the tables
+static const UInt32 kFileHeaderSize = 0x48;
+static const UInt32 kDiscHeaderSize = 0xDC;
+// Start of the disc, kept in the disc header
+static const UInt32 kDiscHeadSize = 0x80;
+
+enum {
+    kDiscGameCube = 1,
+    kDiscWii = 2,
+};
+
+enum {
+    kMethodNone,
+    kMethodPurge,
+    kMethodBzip2,
+    kMethodLzma,
+    kMethodLzma2,
+    kMethodZstd,
+};
+
+// Partition data is stored decrypted and without its hashes, so a sector of
+// the disc holds less of it
+static const UInt32 kSectorSize = Wii::kClusterSize;
+static const UInt32 kSectorDataSize = Wii::kClusterDataSize;
+
+// Groups of partition data start with lists of the hashes that differ from
+// the ones computed from the data, one list for every 2 MiB of the disc. The
+// data is given decrypted, so they are skipped.
+static const UInt32 kExceptionListSpan = 0x200000;
+static const UInt32 kExceptionSize = 2 + 20;
+static const UInt32 kHashesPerSector = Wii::kHashSize / 20;
+
+static const UInt32 kPartEntrySize = 0x30;
+static const UInt32 kRawEntrySize = 0x18;
+static const UInt32 kPurgeHashSize = 20;
+
+static const UInt32 kNumPartsMax = 64;
+// Refuse to allocate more than these for the tables and for a group
+static const UInt32 kTableSizeMax = 1 << 26;
+static const UInt32 kChunkSizeMax = 1 << 26;
+
+// Groups each thread decodes in one batch
+static const UInt32 kBatchGroupsPerThread = 2;
+
+// RVZ stores runs of the junk that pads discs as the seed of the lagged
+// Fibonacci generator that made them
+static const unsigned kLfgK = 521;
+static const unsigned kLfgJ = 32;
+static const unsigned kLfgSeedWords = 17;
+static const UInt32 kSeedSize = kLfgSeedWords * 4;
+
+class CJunkGenerator
+{
+public:
+    void SetSeed(const Byte* seed);
+    // Skip count bytes
+    void Forward(size_t count);
+    void GetBytes(Byte* data, size_t size);
+
+private:
+    // Output bytes, in the order they come out
+    UInt32 _buf[kLfgK];
+    size_t _pos;
+
+    void Forward();
+};
+
+void CJunkGenerator::SetSeed(const Byte* seed)
+{
+    for (unsigned i = 0; i < kLfgSeedWords; i++) {
+        _buf[i] = GetBe32(seed + i * 4);
+    }
+    for (unsigned i = kLfgSeedWords; i < kLfgK; i++) {
+        _buf[i] = (_buf[i - 17] << 23) ^ (_buf[i - 16] >> 9) ^ _buf[i - 1];
+    }
+    // Each word gives out its bytes big endian, with one of them taken from
+    // 18 bits up instead of 16
+    for (unsigned i = 0; i < kLfgK; i++) {
+        const UInt32 x = _buf[i];
+        SetBe32(&_buf[i], (x & 0xFF00FFFF) | ((x >> 2) & 0x00FF0000));
+    }
+    for (unsigned i = 0; i < 4; i++) {
+        Forward();
+    }
+    _pos = 0;
+}
+
+void CJunkGenerator::Forward()
+{
+    for (unsigned i = 0; i < kLfgJ; i++) {
+        _buf[i] ^= _buf[i + kLfgK - kLfgJ];
+    }
+    for (unsigned i = kLfgJ; i < kLfgK; i++) {
+        _buf[i] ^= _buf[i - kLfgJ];
+    }
+}
+
+void CJunkGenerator::Forward(size_t count)
+{
+    _pos += count;
+    while (_pos >= sizeof(_buf)) {
+        Forward();
+        _pos -= sizeof(_buf);
+    }
+}
+
+void CJunkGenerator::GetBytes(Byte* data, size_t size)
+{
+    while (size != 0) {
+        size_t cur = sizeof(_buf) - _pos;
+        if (cur > size) {
+            cur = size;
+        }
+        memcpy(data, (const Byte*) _buf + _pos, cur);
+        _pos += cur;
+        data += cur;
+        size -= cur;
+        if (_pos == sizeof(_buf)) {
+            Forward();
+            _pos = 0;
+        }
+    }
+}
+
+// Purged data is zeros apart from the segments that are given, followed by
+// a SHA-1 hash
+static bool Unpurge(const Byte* in, size_t inSize, Byte* out, size_t outSize)
+{
+    if (inSize < kPurgeHashSize) {
+        return false;
+    }
+    inSize -= kPurgeHashSize;
+    memset(out, 0, outSize);
+    size_t pos = 0;
+    while (pos < inSize) {
+        if (inSize - pos < 8) {
+            return false;
+        }
+        const UInt32 offset = GetBe32(in + pos);
+        const UInt32 size = GetBe32(in + pos + 4);
+        pos += 8;
+        if (size > inSize - pos || offset > outSize ||
+            size > outSize - offset) {
+            return false;
+        }
+        memcpy(out + offset, in + pos, size);
+        pos += size;
+    }
+    return true;
+}
+
+// RVZ data is packed as runs, each a size with the top bit set for junk,
+// followed by the data or the junk's seed. dataOffset is where the data goes
+// in the disc or partition, as junk restarts every sector.
+static bool UnpackRvz(
+    const Byte* in, size_t inSize, Byte* out, size_t outSize, UInt64 dataOffset
+)
+{
+    CJunkGenerator lfg;
+    size_t pos = 0;
+    size_t done = 0;
+    while (done < outSize) {
+        if (inSize - pos < 4) {
+            return false;
+        }
+        const UInt32 word = GetBe32(in + pos);
+        const UInt32 size = word & 0x7FFFFFFF;
+        pos += 4;
+        if (size > outSize - done) {
+            return false;
+        }
+        if (word & 0x80000000) {
+            if (inSize - pos < kSeedSize) {
+                return false;
+            }
+            lfg.SetSeed(in + pos);
+            pos += kSeedSize;
+            lfg.Forward((size_t) ((dataOffset + done) % kSectorSize));
+            lfg.GetBytes(out + done, size);
+        } else {
+            if (inSize - pos < size) {
+                return false;
+            }
+            memcpy(out + done, in + pos, size);
+            pos += size;
+        }
+        done += size;
+    }
+    return true;
+}
+
+// Skip numLists exception lists at the start of data, aligning the end to 4
+// bytes if they're stored uncompressed
+static bool SkipExceptions(
+    const Byte*& data, size_t& size, UInt32 numLists, bool align
+)
+{
+    size_t pos = 0;
+    for (UInt32 i = 0; i < numLists; i++) {
+        if (size - pos < 2) {
+            return false;
+        }
+        const size_t listSize =
+            2 + (size_t) GetBe16(data + pos) * kExceptionSize;
+        if (size - pos < listSize) {
+            return false;
+        }
+        pos += listSize;
+    }
+    if (align) {
+        pos = (pos + 3) & ~(size_t) 3;
+        if (pos > size) {
+            return false;
+        }
+    }
+    data += pos;
+    size -= pos;
+    return true;
+}
+
+// Data stored in a run of groups: raw data of the disc, or one of the two
+// parts of a partition's data
+struct CRegion {
+    // -1 for raw data, otherwise the partition
+    int Part;
+    // Offset in the disc, or in the partition's data
+    UInt64 Offset;
+    UInt64 Size;
+    UInt32 FirstGroup;
+    UInt32 NumGroups;
+    // Data in each group, all but the last of which are full
+    UInt32 GroupSize;
+};
+
+struct CGroup {
+    UInt64 Offset;
+    UInt32 Size;
+    // RVZ stores groups that don't compress as they are
+    bool IsCompressed;
+    // Size of the RVZ packed data, or 0 if it isn't packed
+    UInt32 PackedSize;
+};
+
+// Buffers for decoding one group of a batch
+struct CJob {
+    UInt32 Group;
+    UInt32 Slot;
+    HRESULT Result;
+    CByteBuffer Stored;
+    CByteBuffer Decoded;
+    CMyComPtr<ICompressCoder> Bzip2;
+};
+
+// The decoded data of the disc and its partitions. Groups are decoded in
+// batches on up to numThreads threads and kept in an LRU cache, as with the
+// clusters of a Wii partition.
+class CReader
+{
+public:
+    CReader()
+      : _discType(0)
+      , _method(kMethodNone)
+      , _isRvz(false)
+      , _chunkSize(0)
+      , _discSize(0)
+      , _numThreads(1)
+      , _batchSize(1)
+      , _lastGroup(kNoGroup)
+    {
+    }
+
+    // Returns S_FALSE if the headers or tables are bad
+    HRESULT Open(IInStream* stream, UInt32 numThreads, UInt64 cacheSize);
+    void Close();
+
+    UInt32 GetDiscType() const
+    {
+        return _discType;
+    }
+
+    // Zstandard, which RVZ images are usually compressed with, isn't
+    // supported. Nothing can be read from those.
+    bool IsSupported() const
+    {
+        return _method != kMethodZstd;
+    }
+
+    // Partition whose data starts at dataOffset in the disc, or -1
+    int FindPartition(UInt64 dataOffset) const;
+
+    // Read exactly size bytes at offset in the disc, if part is -1, or in the
+    // data of partition part. Returns S_FALSE if they go past the end or
+    // can't be decoded.
+    HRESULT Read(int part, UInt64 offset, void* data, size_t size);
+
+    // Copy size bytes at offset to outStream, which may be NULL to only test
+    // the data. isOk is cleared if the data ends first or can't be decoded.
+    HRESULT Copy(
+        int part, UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+        ICompressProgressInfo* progress, bool& isOk
+    );
+
+private:
+    static const UInt32 kNoGroup = (UInt32) (Int32) -1;
+
+    CMyComPtr<IInStream> _stream;
+    UInt32 _discType;
+    UInt32 _method;
+    bool _isRvz;
+    UInt32 _chunkSize;
+    Byte _props[7];
+    UInt64 _discSize;
+    Byte _discHead[kDiscHeadSize];
+
+    CRecordVector<UInt64> _partOffsets;
+    CRecordVector<UInt64> _partSizes;
+    CRecordVector<CRegion> _regions;
+    CRecordVector<CGroup> _groups;
+
+    UInt32 _numThreads;
+    UInt32 _batchSize;
+    CObjectVector<CJob> _jobs;
+    // Decoded groups, each slot big enough for any group
+    BlockCache::CCache _cache;
+    UInt32 _lastGroup;
+
+    HRESULT ReadAt(UInt64 offset, void* data, size_t size);
+    HRESULT Decompress(
+        CJob& job, const Byte* in, size_t inSize, Byte* out, size_t outSize,
+        size_t& outProcessed
+    ) const;
+    HRESULT ReadTable(
+        UInt64 offset, UInt32 storedSize, size_t size, CByteBuffer& table
+    );
+    UInt32 GetNumExceptionLists() const;
+    HRESULT DecodeGroup(const CRegion& region, CJob& job);
+    HRESULT DecodeBatch(const CRegion& region, UInt32 first, UInt32 count);
+    HRESULT GetGroup(
+        unsigned regionIndex, UInt32 group, UInt64 numWanted, const Byte*& data
+    );
+    HRESULT GetData(
+        int part, UInt64 offset, UInt64 numWanted, const Byte*& data,
+        size_t& size
+    );
+};
+
+HRESULT CReader::ReadAt(UInt64 offset, void* data, size_t size)
+{
+    RINOK(InStream_SeekSet(_stream, offset))
+    return ReadStream_FALSE(_stream, data, size);
+}
+
+// Decode the compressed data at in, up to outSize bytes of it. The methods
+// stop at the end of the data or of the output, whichever is first.
+HRESULT CReader::Decompress(
+    CJob& job, const Byte* in, size_t inSize, Byte* out, size_t outSize,
+    size_t& outProcessed
+) const
+{
+    outProcessed = 0;
+    switch (_method) {
+    case kMethodBzip2: {
+        if (!job.Bzip2) {
+            job.Bzip2 = new NCompress::NBZip2::CDecoder;
+        }
+        CBufInStream* inSpec = new CBufInStream;
+        CMyComPtr<ISequentialInStream> inStream = inSpec;
+        inSpec->Init(in, inSize);
+        CBufPtrSeqOutStream* outSpec = new CBufPtrSeqOutStream;
+        CMyComPtr<ISequentialOutStream> outStream = outSpec;
+        outSpec->Init(out, outSize);
+        const HRESULT res =
+            job.Bzip2->Code(inStream, outStream, NULL, NULL, NULL);
+        outProcessed = outSpec->GetPos();
+        if (res == E_OUTOFMEMORY) {
+            return res;
+        }
+        return res == S_OK ? S_OK : S_FALSE;
+    }
+
+    case kMethodLzma:
+    case kMethodLzma2: {
+        SizeT destLen = outSize;
+        SizeT srcLen = inSize;
+        ELzmaStatus status;
+        const SRes res =
+            _method == kMethodLzma
+                ? LzmaDecode(
+                      out, &destLen, in, &srcLen, _props, LZMA_PROPS_SIZE,
+                      LZMA_FINISH_ANY, &status, &g_Alloc
+                  )
+                : Lzma2Decode(
+                      out, &destLen, in, &srcLen, _props[0], LZMA_FINISH_ANY,
+                      &status, &g_Alloc
+                  );
+        outProcessed = destLen;
+        if (res == SZ_ERROR_MEM) {
+            return E_OUTOFMEMORY;
+        }
+        return res == SZ_OK || res == SZ_ERROR_INPUT_EOF ? S_OK : S_FALSE;
+    }
+    }
+    return S_FALSE;
+}
+
+// Read a table stored with the image's compression method
+HRESULT CReader::ReadTable(
+    UInt64 offset, UInt32 storedSize, size_t size, CByteBuffer& table
+)
+{
+    if (storedSize > kTableSizeMax) {
+        return S_FALSE;
+    }
+    CByteBuffer stored(storedSize);
+    RINOK(ReadAt(offset, stored, storedSize))
+    table.Alloc(size);
+    switch (_method) {
+    case kMethodNone:
+        if (storedSize < size) {
+            return S_FALSE;
+        }
+        memcpy(table, stored, size);
+        return S_OK;
+    case kMethodPurge:
+        return Unpurge(stored, storedSize, table, size) ? S_OK : S_FALSE;
+    }
+    size_t processed;
+    RINOK(Decompress(_jobs[0], stored, storedSize, table, size, processed))
+    return processed == size ? S_OK : S_FALSE;
+}
+
+HRESULT CReader::Open(IInStream* stream, UInt32 numThreads, UInt64 cacheSize)
+{
+    Close();
+    _stream = stream;
+
+    Byte header[kFileHeaderSize];
+    RINOK(ReadAt(0, header, kFileHeaderSize))
+    const UInt32 magic = GetBe32(header);
+    if (magic != kWiaMagic && magic != kRvzMagic) {
+        return S_FALSE;
+    }
+    _isRvz = magic == kRvzMagic;
+    if (GetBe32(header + 0xC) < kDiscHeaderSize) {
+        return S_FALSE;
+    }
+    _discSize = GetBe64(header + 0x24);
+
+    Byte disc[kDiscHeaderSize];
+    RINOK(ReadAt(kFileHeaderSize, disc, kDiscHeaderSize))
+    _discType = GetBe32(disc);
+    _method = GetBe32(disc + 0x4);
+    _chunkSize = GetBe32(disc + 0xC);
+    if ((_discType != kDiscGameCube && _discType != kDiscWii) ||
+        _method > kMethodZstd || _chunkSize == 0 ||
+        _chunkSize % kSectorSize != 0 || _chunkSize > kChunkSizeMax) {
+        return S_FALSE;
+    }
+    memcpy(_discHead, disc + 0x10, kDiscHeadSize);
+    // Properties of LZMA, or the dictionary size of LZMA2
+    const unsigned propsSize = disc[0xD4];
+    memcpy(_props, disc + 0xD5, sizeof(_props));
+    if ((_method == kMethodLzma && propsSize < LZMA_PROPS_SIZE) ||
+        (_method == kMethodLzma2 && propsSize < 1)) {
+        return S_FALSE;
+    }
+    if (!IsSupported()) {
+        return S_OK;
+    }
+
+    _numThreads = numThreads != 0 ? numThreads : 1;
+    _batchSize = _numThreads * kBatchGroupsPerThread;
+    for (UInt32 i = 0; i < _batchSize; i++) {
+        _jobs.AddNew();
+    }
+
+    // Partitions, whose data is stored in two parts: the start of it, up to
+    // the end of the FST, and the rest
+    const UInt32 numParts = GetBe32(disc + 0x90);
+    const UInt32 partEntrySize = GetBe32(disc + 0x94);
+    if (numParts > kNumPartsMax ||
+        (numParts != 0 &&
+         (partEntrySize < kPartEntrySize || partEntrySize > kTableSizeMax))) {
+        return S_FALSE;
+    }
+    CByteBuffer parts((size_t) numParts * partEntrySize);
+    RINOK(ReadAt(GetBe64(disc + 0x98), parts, parts.Size()))
+    const UInt32 partGroupSize = _chunkSize / kSectorSize * kSectorDataSize;
+    for (UInt32 i = 0; i < numParts; i++) {
+        const Byte* entry = parts + i * partEntrySize;
+        const UInt32 firstSector = GetBe32(entry + 0x10);
+        UInt64 size = 0;
+        for (unsigned j = 0; j < 2; j++) {
+            const Byte* p = entry + 0x10 + j * 0x10;
+            CRegion region;
+            region.Part = (int) i;
+            if (GetBe32(p) < firstSector) {
+                return S_FALSE;
+            }
+            region.Offset = (UInt64) (GetBe32(p) - firstSector) *
+                            kSectorDataSize;
+            region.Size = (UInt64) GetBe32(p + 4) * kSectorDataSize;
+            region.FirstGroup = GetBe32(p + 8);
+            region.NumGroups = GetBe32(p + 0xC);
+            region.GroupSize = partGroupSize;
+            if (region.Size != 0) {
+                _regions.Add(region);
+            }
+            if (size < region.Offset + region.Size) {
+                size = region.Offset + region.Size;
+            }
+        }
+        _partOffsets.Add((UInt64) firstSector * kSectorSize);
+        _partSizes.Add(size);
+    }
+
+    // Everything outside the partitions' data
+    const UInt32 numRaw = GetBe32(disc + 0xB4);
+    if (numRaw > kTableSizeMax / kRawEntrySize) {
+        return S_FALSE;
+    }
+    CByteBuffer raw;
+    RINOK(ReadTable(
+        GetBe64(disc + 0xB8), GetBe32(disc + 0xC0),
+        (size_t) numRaw * kRawEntrySize, raw
+    ))
+    for (UInt32 i = 0; i < numRaw; i++) {
+        const Byte* p = raw + i * kRawEntrySize;
+        CRegion region;
+        region.Part = -1;
+        // Stored from the start of the sector
+        const UInt64 offset = GetBe64(p);
+        region.Offset = offset - offset % kSectorSize;
+        region.Size = GetBe64(p + 8) + offset % kSectorSize;
+        region.FirstGroup = GetBe32(p + 0x10);
+        region.NumGroups = GetBe32(p + 0x14);
+        region.GroupSize = _chunkSize;
+        if (region.Size != 0) {
+            _regions.Add(region);
+        }
+    }
+
+    const UInt32 numGroups = GetBe32(disc + 0xC4);
+    const UInt32 groupEntrySize = _isRvz ? 12 : 8;
+    if (numGroups > kTableSizeMax / groupEntrySize) {
+        return S_FALSE;
+    }
+    CByteBuffer groups;
+    RINOK(ReadTable(
+        GetBe64(disc + 0xC8), GetBe32(disc + 0xD0),
+        (size_t) numGroups * groupEntrySize, groups
+    ))
+    _groups.ClearAndReserve(numGroups);
+    for (UInt32 i = 0; i < numGroups; i++) {
+        const Byte* p = groups + i * groupEntrySize;
+        CGroup group;
+        group.Offset = (UInt64) GetBe32(p) << 2;
+        const UInt32 size = GetBe32(p + 4);
+        group.Size = _isRvz ? size & 0x7FFFFFFF : size;
+        group.IsCompressed = !_isRvz || (size & 0x80000000) != 0;
+        group.PackedSize = _isRvz ? GetBe32(p + 8) : 0;
+        _groups.AddInReserved(group);
+    }
+
+    for (unsigned i = 0; i < _regions.Size(); i++) {
+        const CRegion& region = _regions[i];
+        if (region.FirstGroup > numGroups ||
+            region.NumGroups > numGroups - region.FirstGroup ||
+            (region.Size - 1) / region.GroupSize >= region.NumGroups) {
+            return S_FALSE;
+        }
+    }
+
+    UInt64 numSlots = cacheSize / _chunkSize;
+    if (numSlots < _batchSize) {
+        numSlots = _batchSize;
+    }
+    if (numSlots > numGroups) {
+        numSlots = numGroups != 0 ? numGroups : 1;
+    }
+    if (numSlots > ((size_t) 1 << 30) / _chunkSize) {
+        numSlots = ((size_t) 1 << 30) / _chunkSize;
+    }
+    if (_batchSize > numSlots) {
+        _batchSize = (UInt32) numSlots;
+    }
+    return _cache.Alloc(_chunkSize, (UInt32) numSlots);
+}
+
+void CReader::Close()
+{
+    _stream.Release();
+    _discType = 0;
+    _method = kMethodNone;
+    _partOffsets.Clear();
+    _partSizes.Clear();
+    _regions.Clear();
+    _groups.Clear();
+    _jobs.Clear();
+    _cache.Free();
+    _lastGroup = kNoGroup;
+}
+
+int CReader::FindPartition(UInt64 dataOffset) const
+{
+    for (unsigned i = 0; i < _partOffsets.Size(); i++) {
+        if (_partOffsets[i] == dataOffset) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+// Lists per group of partition data
+UInt32 CReader::GetNumExceptionLists() const
+{
+    return _chunkSize > kExceptionListSpan ? _chunkSize / kExceptionListSpan
+                                           : 1;
+}
+
+// Decode the group of job, read into job.Stored, into its slot
+HRESULT CReader::DecodeGroup(const CRegion& region, CJob& job)
+{
+    const CGroup& group = _groups[job.Group];
+    const UInt64 start = (UInt64) (job.Group - region.FirstGroup) *
+                         region.GroupSize;
+    size_t outSize = region.GroupSize;
+    if (outSize > region.Size - start) {
+        outSize = (size_t) (region.Size - start);
+    }
+    Byte* out = _cache.GetData(job.Slot);
+    if (group.Size == 0) {
+        memset(out, 0, outSize);
+        return S_OK;
+    }
+
+    const Byte* data = job.Stored;
+    size_t size = group.Size;
+    // Exception lists are compressed along with the data if it is
+    const bool hasExceptions = region.Part >= 0;
+    const bool isCompressed = _method > kMethodPurge && group.IsCompressed;
+    if (hasExceptions && !isCompressed &&
+        !SkipExceptions(data, size, GetNumExceptionLists(), true)) {
+        return S_FALSE;
+    }
+
+    if (isCompressed) {
+        size_t decodedSize =
+            group.PackedSize != 0 ? group.PackedSize : outSize;
+        if (hasExceptions) {
+            // At most every hash of every sector can be an exception
+            decodedSize += GetNumExceptionLists() * 2 +
+                           _chunkSize / kSectorSize * kHashesPerSector *
+                               kExceptionSize;
+        }
+        job.Decoded.AllocAtLeast(decodedSize);
+        RINOK(Decompress(job, data, size, job.Decoded, decodedSize, size))
+        data = job.Decoded;
+        if (hasExceptions &&
+            !SkipExceptions(data, size, GetNumExceptionLists(), false)) {
+            return S_FALSE;
+        }
+    } else if (_method == kMethodPurge) {
+        return Unpurge(data, size, out, outSize) ? S_OK : S_FALSE;
+    }
+
+    if (group.PackedSize != 0) {
+        return UnpackRvz(data, size, out, outSize, region.Offset + start)
+                   ? S_OK
+                   : S_FALSE;
+    }
+    if (size < outSize) {
+        return S_FALSE;
+    }
+    memcpy(out, data, outSize);
+    return S_OK;
+}
+
+// Read groups of region from first on, up to count of them or the first one
+// that's already cached, and decode them in parallel. Groups that can't be
+// decoded are left out of the cache.
+HRESULT CReader::DecodeBatch(const CRegion& region, UInt32 first, UInt32 count)
+{
+    UInt32 num = 1;
+    while (num < count && _cache.Find(first + num) == BlockCache::kNoSlot) {
+        num++;
+    }
+
+    // Reading has to be done on this thread, since the stream is shared
+    for (UInt32 i = 0; i < num; i++) {
+        CJob& job = _jobs[i];
+        const CGroup& group = _groups[first + i];
+        job.Group = first + i;
+        job.Slot = _cache.Take();
+        job.Result = S_OK;
+        if (group.Size == 0) {
+            continue;
+        }
+        job.Stored.AllocAtLeast(group.Size);
+        RINOK(InStream_SeekSet(_stream, group.Offset))
+        size_t size = group.Size;
+        RINOK(ReadStream(_stream, job.Stored, &size))
+        if (size != group.Size) {
+            job.Result = S_FALSE;
+        }
+    }
+
+    auto decodeJob = [&](UInt32 index) -> HRESULT {
+        CJob& job = _jobs[index];
+        if (job.Result == S_OK) {
+            job.Result = DecodeGroup(region, job);
+        }
+        return job.Result == S_FALSE ? S_OK : job.Result;
+    };
+    RINOK(Parallel::For(_numThreads, num, decodeJob))
+
+    for (UInt32 i = 0; i < num; i++) {
+        if (_jobs[i].Result == S_OK) {
+            _cache.Set(_jobs[i].Slot, first + i);
+        }
+    }
+    return S_OK;
+}
+
+// Get the decoded data of group in the region. numWanted is how many groups
+// the read covers from there, which are decoded together if they aren't
+// cached.
+HRESULT CReader::GetGroup(
+    unsigned regionIndex, UInt32 group, UInt64 numWanted, const Byte*& data
+)
+{
+    UInt32 slot = _cache.Find(group);
+    if (slot == BlockCache::kNoSlot) {
+        const CRegion& region = _regions[regionIndex];
+        // Reading on from the last group decodes a whole batch ahead
+        UInt64 count = numWanted;
+        if (group == _lastGroup + 1 && count < _batchSize) {
+            count = _batchSize;
+        }
+        if (count > _batchSize) {
+            count = _batchSize;
+        }
+        const UInt32 end = region.FirstGroup +
+                           (UInt32) ((region.Size - 1) / region.GroupSize) + 1;
+        if (count > end - group) {
+            count = end - group;
+        }
+        RINOK(DecodeBatch(region, group, (UInt32) count))
+        slot = _cache.Find(group);
+        if (slot == BlockCache::kNoSlot) {
+            return S_FALSE;
+        }
+    }
+    _cache.Touch(slot);
+    _lastGroup = group;
+    data = _cache.GetData(slot);
+    return S_OK;
+}
+
+// Get the data at offset, up to size bytes of it. data is NULL where nothing
+// is stored, which reads as zeros.
+HRESULT CReader::GetData(
+    int part, UInt64 offset, UInt64 numWanted, const Byte*& data, size_t& size
+)
+{
+    // The disc header is kept apart, and may not be in the raw data
+    if (part < 0 && offset < kDiscHeadSize) {
+        data = _discHead + offset;
+        size = (size_t) (kDiscHeadSize - offset);
+        return S_OK;
+    }
+
+    UInt64 holeEnd = part < 0 ? _discSize : _partSizes[part];
+    for (unsigned i = 0; i < _regions.Size(); i++) {
+        const CRegion& region = _regions[i];
+        if (region.Part != part) {
+            continue;
+        }
+        if (offset >= region.Offset && offset - region.Offset < region.Size) {
+            const UInt64 group = (offset - region.Offset) / region.GroupSize;
+            const size_t pos = (size_t) ((offset - region.Offset) %
+                                         region.GroupSize);
+            const UInt64 groupStart = group * region.GroupSize;
+            RINOK(GetGroup(
+                i, region.FirstGroup + (UInt32) group,
+                (pos + numWanted + region.GroupSize - 1) / region.GroupSize,
+                data
+            ))
+            data += pos;
+            size = region.GroupSize - pos;
+            if (size > region.Size - groupStart - pos) {
+                size = (size_t) (region.Size - groupStart - pos);
+            }
+            return S_OK;
+        }
+        if (region.Offset > offset && region.Offset < holeEnd) {
+            holeEnd = region.Offset;
+        }
+    }
+    data = NULL;
+    size = holeEnd - offset > ((size_t) 1 << 30) ? (size_t) 1 << 30
+                                                  : (size_t) (holeEnd - offset);
+    return S_OK;
+}
+
+HRESULT CReader::Read(int part, UInt64 offset, void* data, size_t size)
+{
+    const UInt64 end = part < 0 ? _discSize : _partSizes[part];
+    if (offset > end || size > end - offset) {
+        return S_FALSE;
+    }
+
+    Byte* dest = (Byte*) data;
+    while (size != 0) {
+        const Byte* p;
+        size_t cur;
+        RINOK(GetData(part, offset, size, p, cur))
+        if (cur > size) {
+            cur = size;
+        }
+        if (p) {
+            memcpy(dest, p, cur);
+        } else {
+            memset(dest, 0, cur);
+        }
+        dest += cur;
+        offset += cur;
+        size -= cur;
+    }
+    return S_OK;
+}
+
+// Data is written straight from the cache
+HRESULT CReader::Copy(
+    int part, UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+    ICompressProgressInfo* progress, bool& isOk
+)
+{
+    const UInt64 end = part < 0 ? _discSize : _partSizes[part];
+    UInt64 avail = offset > end ? 0 : end - offset;
+    if (avail > size) {
+        avail = size;
+    }
+
+    static const Byte kZeros[1 << 12] = {};
+    UInt64 done = 0;
+    while (done < avail) {
+        const Byte* p;
+        size_t cur;
+        const HRESULT res = GetData(part, offset + done, avail - done, p, cur);
+        if (res == S_FALSE) {
+            break;
+        }
+        RINOK(res)
+
+        if (cur > avail - done) {
+            cur = (size_t) (avail - done);
+        }
+        if (!p && cur > sizeof(kZeros)) {
+            cur = sizeof(kZeros);
+        }
+        if (outStream) {
+            RINOK(WriteStream(outStream, p ? p : kZeros, cur))
+        }
+        done += cur;
+        if (progress) {
+            RINOK(progress->SetRatioInfo(&done, &done))
+        }
+    }
+    if (done != size) {
+        isOk = false;
+    }
+    return S_OK;
+}
+
+typedef Darch::CItem CItem;
+
+Z7_CLASS_IMP_CHandler_IInArchive_3(
+    IArchiveGetRawProps, IInArchiveGetStream, ISetProperties
+)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CHandlerProps _handlerProps;
+    CReader _reader;
+    Wii::CDiscItems _disc;
+    // Partition in the image of each partition in _disc.Parts, or -1
+    CRecordVector<int> _partMap;
+
+    // Partitions whose files can't be listed
+    bool _isPartitionBad;
+
+    // Archives found among the files, when opening them is turned on
+    Nested::CExpander _nested;
+
+    static HRESULT ReadDisc(
+        void* param, int part, UInt64 offset, void* data, size_t size
+    );
+    HRESULT Open2(IInStream* stream);
+
+public:
+    CHandler()
+      : _isPartitionBad(false)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidWarning,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+HRESULT CHandler::ReadDisc(
+    void* param, int part, UInt64 offset, void* data, size_t size
+)
+{
+    CHandler* handler = (CHandler*) param;
+    if (part >= 0) {
+        part = handler->_partMap[part];
+        if (part < 0) {
+            return S_FALSE;
+        }
+    }
+    return handler->_reader.Read(part, offset, data, size);
+}
+
+HRESULT CHandler::Open2(IInStream* stream)
+{
+    RINOK(_reader.Open(
+        stream, _handlerProps.NumThreads, _handlerProps.CacheSize
+    ))
+    if (!_reader.IsSupported()) {
+        return S_OK;
+    }
+    if (_reader.GetDiscType() == kDiscGameCube) {
+        return _disc.AddFiles(ReadDisc, this, -1);
+    }
+
+    RINOK(_disc.AddWiiDisc(ReadDisc, this))
+    for (unsigned i = 0; i < _disc.Parts.Size(); i++) {
+        _partMap.Add(_reader.FindPartition(_disc.Parts[i].DataOffset));
+    }
+    for (unsigned i = 0; i < _disc.Parts.Size(); i++) {
+        const HRESULT res = _disc.AddFiles(ReadDisc, this, (int) i);
+        if (res == S_FALSE) {
+            _isPartitionBad = true;
+        } else {
+            RINOK(res)
+        }
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        if (Open2(stream) != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        // The disc itself is fine even if none of its files open
+        if (_nested.Expand(
+                (IInArchive*) this, _disc.Items.Size(),
+                _handlerProps.RecurseDepth, _handlerProps.CacheSize
+            ) != S_OK) {
+            _nested.Clear();
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _nested.Clear();
+    _reader.Close();
+    _disc.Clear();
+    _partMap.Clear();
+    _isPartitionBad = false;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _disc.Items.Size() + _nested.GetNumItems();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidExtension:
+        prop = "iso";
+        break;
+    case kpidIsTree:
+        prop = true;
+        break;
+    case kpidWarning:
+        if (_isPartitionBad) {
+            prop = "Partition data could not be read";
+        }
+        break;
+    case kpidErrorFlags:
+        if (!_reader.IsSupported()) {
+            prop = (UInt32) kpv_ErrorFlags_UnsupportedMethod;
+        }
+        break;
+    case kpidError:
+        if (!_reader.IsSupported()) {
+            prop = "Zstandard compression is not supported";
+        }
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetProperty(index, propID, value);
+    }
+
+    NWindows::NCOM::CPropVariant prop;
+    const CItem& item = _disc.Items[index];
+
+    switch (propID) {
+    case kpidPath: {
+        const char* path = _disc.GetPath(index);
+        if (path == NULL) {
+            return E_OUTOFMEMORY;
+        }
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(path, strlen(path), us);
+        prop = us;
+        break;
+    }
+
+    case kpidName: {
+        const char* name = _disc.GetName(index);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(name, strlen(name), us);
+        prop = us;
+        break;
+    }
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+        prop = item.Size;
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+)
+{
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetParent(index, parent, parentType);
+    }
+
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _disc.Items[index].Parent;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetRawProp(index, propID, data, dataSize, propType);
+    }
+
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (propID == kpidName) {
+        const char* name = _disc.GetName(index);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    const UInt32 numIndices = allFilesMode ? _disc.Items.Size() : numItems;
+
+    // Ranges are ordered by where they were on the disc, which is close to
+    // the order of the groups
+    CRecordVector<ArcData::CRange> ranges;
+    for (UInt32 i = 0; i < numIndices; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        if (index >= _disc.Items.Size())
+            continue;
+        const CItem& item = _disc.Items[index];
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = 0;
+        range.Size = 0;
+        if (!item.IsDir) {
+            range.Offset = _disc.GetDiscOffset(index);
+            range.Size = item.Size;
+        }
+        ranges.Add(range);
+    }
+
+    auto copy = [&](const ArcData::CRange& range,
+                    ISequentialOutStream* outStream,
+                    ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+        const CItem& item = _disc.Items[range.Index];
+        const int part = _disc.ItemParts[range.Index];
+        return _reader.Copy(
+            part < 0 ? -1 : _partMap[part], item.Offset, item.Size, outStream,
+            progress, isOk
+        );
+    };
+
+    auto extractOwn = [&](IArchiveExtractCallback* callback) -> HRESULT {
+        if (ranges.Size() == 0) {
+            return S_OK;
+        }
+        return ArcData::ExtractRanges(ranges, testMode, callback, copy);
+    };
+    return _nested.Extract(
+        indices, numItems, testMode, extractCallback, extractOwn
+    );
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    PRINT("GetStream\n");
+
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetStream(index, stream);
+    }
+
+    const CItem& item = _disc.Items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    Wii::CreateDiscStream(
+        ReadDisc, this, _disc.ItemParts[index], item.Offset, item.Size,
+        _nested.GetStreamRef(this), stream
+    );
+    return S_OK;
+    COM_TRY_END
+}
+
+// The thread count and cache size set how groups are decoded
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        HRESULT hres;
+        if (_handlerProps.SetProperty(name, values[i], hres)) {
+            RINOK(hres)
+        } else {
+            return E_INVALIDARG;
+        }
+    }
+    return S_OK;
+}
+
+static const Byte k_Signature[] = {
+    4, 'W', 'I', 'A', 1, //
+    4, 'R', 'V', 'Z', 1, //
+};
+
+REGISTER_ARC_I(
+    "wia", "wia rvz", NULL, 0xA9, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kMultiSignature, 0
+)
+
+} // namespace Wia
@@ -0,0 +1,1275 @@
+// Wii.cpp - File for reading Wii disc images
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Wii.hpp"
+#include "ArcData.hpp"
+#include "Darch.hpp"
+#include "Gcm.hpp"
+#include "Nested.hpp"
+#include "Parallel.hpp"
+#include "Types.h"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+#include <C/Sha1.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/IntToString.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/UTFConvert.h>
+#include <CPP/Windows/FileIO.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+namespace Wii
+{
+
+static const UInt64 kNoCluster = (UInt64) (Int64) -1;
+
+// Clusters each thread decrypts in one batch, enough to be worth starting
+// the threads for
+static const UInt32 kBatchClustersPerThread = 16;
+
+// The decrypted hash block of a cluster has the hashes of its data blocks
+// (H0), and copies of the H1 table of its subgroup of 8 clusters and the H2
+// table of its group of 8 subgroups. Each table is hashed into the next one
+// up, and the H2 table into the H3 table.
+static const UInt32 kBlockSize = 0x400;
+static const unsigned kNumBlocks = kClusterDataSize / kBlockSize;
+static const UInt32 kH1Offset = 0x280;
+static const UInt32 kH2Offset = 0x340;
+static const unsigned kNumSubHashes = 8;
+
+// Hash check results in _clusterStates
+enum {
+    kClusterUnchecked,
+    kClusterOk,
+    kClusterBad,
+};
+
+static struct CCryptoInit {
+    CCryptoInit()
+    {
+        AesGenTables();
+        Sha1Prepare();
+    }
+} g_CryptoInit;
+
+// The AES code wants its key schedule and data 16-byte aligned
+static UInt32* GetAligned(UInt32* p)
+{
+    return p + ((0 - (unsigned) (ptrdiff_t) p) & 0xF) / sizeof(UInt32);
+}
+
+void DecryptTitleKey(const Byte* ticket, const Byte* commonKey, Byte* titleKey)
+{
+    UInt32 aesBuf[AES_NUM_IVMRK_WORDS + 3];
+    UInt32* aes = GetAligned(aesBuf);
+    Aes_SetKey_Dec(aes + 4, commonKey, 16);
+
+    // The IV is the title ID, padded with zeros
+    Byte iv[AES_BLOCK_SIZE] = {};
+    memcpy(iv, ticket + 0x1DC, 8);
+    AesCbc_Init(aes, iv);
+
+    UInt32 dataBuf[4 + 3];
+    Byte* data = (Byte*) GetAligned(dataBuf);
+    memcpy(data, ticket + 0x1BF, AES_BLOCK_SIZE);
+    g_AesCbc_Decode(aes, data, 1);
+    memcpy(titleKey, data, AES_BLOCK_SIZE);
+}
+
+static const unsigned kNumCommonKeysMax = 8;
+
+static const char* const kKeyFileName = "common-key.bin";
+
+void LoadCommonKeys(const FString& keyFile, CByteBuffer& keys)
+{
+    FString path = keyFile;
+    if (path.IsEmpty()) {
+        ArcData::GetUserDir(path);
+        if (path.IsEmpty()) {
+            return;
+        }
+        path.Add_PathSepar();
+        path += FTEXT(kKeyFileName);
+    }
+
+    NWindows::NFile::NIO::CInFile file;
+    UInt64 size;
+    if (!file.Open(path) || !file.GetLength(size) || size < kKeySize) {
+        PRINT("No common key\n");
+        return;
+    }
+    if (size > kKeySize * kNumCommonKeysMax) {
+        size = kKeySize * kNumCommonKeysMax;
+    }
+    keys.Alloc((size_t) size / kKeySize * kKeySize);
+    size_t processed;
+    if (!file.ReadFull(keys, keys.Size(), processed) ||
+        processed != keys.Size()) {
+        keys.Free();
+    }
+}
+
+CPartitionReader::CPartitionReader()
+  : _dataOffset(0)
+  , _numClusters(0)
+  , _numThreads(1)
+  , _batchSize(1)
+  , _aesOffset(0)
+  , _lastCluster(kNoCluster)
+{
+}
+
+HRESULT CPartitionReader::Init(
+    IInStream* stream, UInt64 dataOffset, UInt64 dataSize,
+    const Byte* titleKey, UInt32 numThreads, UInt64 cacheSize
+)
+{
+    Free();
+    _stream = stream;
+    _dataOffset = dataOffset;
+    _numClusters = dataSize / kClusterSize;
+    _numThreads = numThreads != 0 ? numThreads : 1;
+    _batchSize = _numThreads * kBatchClustersPerThread;
+
+    UInt64 numSlots = cacheSize / kClusterSize;
+    if (numSlots < _batchSize) {
+        numSlots = _batchSize;
+    }
+    if (numSlots > _numClusters) {
+        numSlots = _numClusters != 0 ? _numClusters : 1;
+    }
+    if (numSlots > ((size_t) 1 << 30) / kClusterSize) {
+        numSlots = ((size_t) 1 << 30) / kClusterSize;
+    }
+    if (_batchSize > numSlots) {
+        _batchSize = (UInt32) numSlots;
+    }
+    RINOK(_cache.Alloc(kClusterSize, (UInt32) numSlots))
+
+    _aesOffset = (unsigned) (GetAligned(_aes) - _aes);
+    Aes_SetKey_Dec(_aes + _aesOffset + 4, titleKey, 16);
+    return S_OK;
+}
+
+void CPartitionReader::Free()
+{
+    StopVerify();
+    _stream.Release();
+    _cache.Free();
+    _lastCluster = kNoCluster;
+    _numClusters = 0;
+}
+
+void CPartitionReader::DecryptCluster(Byte* p) const
+{
+    // Decrypting changes the IV stored with the key schedule, so every
+    // thread works on its own copy
+    UInt32 aesBuf[AES_NUM_IVMRK_WORDS + 3];
+    UInt32* aes = GetAligned(aesBuf);
+    memcpy(
+        aes + 4, _aes + _aesOffset + 4,
+        (AES_NUM_IVMRK_WORDS - 4) * sizeof(UInt32)
+    );
+
+    // The IV of the data is in the hash block as stored, so it's taken out
+    // before that is decrypted
+    Byte iv[AES_BLOCK_SIZE];
+    memcpy(iv, p + 0x3D0, AES_BLOCK_SIZE);
+    const Byte zeroIv[AES_BLOCK_SIZE] = {};
+    AesCbc_Init(aes, zeroIv);
+    g_AesCbc_Decode(aes, p, kHashSize / AES_BLOCK_SIZE);
+    AesCbc_Init(aes, iv);
+    g_AesCbc_Decode(aes, p + kHashSize, kClusterDataSize / AES_BLOCK_SIZE);
+}
+
+static bool CheckHash(const Byte* data, size_t size, const Byte* hash)
+{
+    CSha1 sha;
+    Byte digest[SHA1_DIGEST_SIZE];
+    Sha1_Init(&sha);
+    Sha1_Update(&sha, data, size);
+    Sha1_Final(&sha, digest);
+    return memcmp(digest, hash, SHA1_DIGEST_SIZE) == 0;
+}
+
+// Check the decrypted cluster at p up the hash tree to the H3 table
+bool CPartitionReader::VerifyCluster(const Byte* p, UInt64 cluster) const
+{
+    const UInt64 group = cluster / (kNumSubHashes * kNumSubHashes);
+    if ((group + 1) * SHA1_DIGEST_SIZE > _h3.Size()) {
+        return false;
+    }
+    for (unsigned i = 0; i < kNumBlocks; i++) {
+        if (!CheckHash(
+                p + kHashSize + i * kBlockSize, kBlockSize,
+                p + i * SHA1_DIGEST_SIZE
+            )) {
+            return false;
+        }
+    }
+    return CheckHash(
+               p, kNumBlocks * SHA1_DIGEST_SIZE,
+               p + kH1Offset + cluster % kNumSubHashes * SHA1_DIGEST_SIZE
+           ) &&
+           CheckHash(
+               p + kH1Offset, kNumSubHashes * SHA1_DIGEST_SIZE,
+               p + kH2Offset +
+                   cluster / kNumSubHashes % kNumSubHashes * SHA1_DIGEST_SIZE
+           ) &&
+           CheckHash(
+               p + kH2Offset, kNumSubHashes * SHA1_DIGEST_SIZE,
+               _h3 + group * SHA1_DIGEST_SIZE
+           );
+}
+
+// Read clusters from first on, up to count of them or the first one that's
+// already cached, and decrypt them in parallel
+HRESULT CPartitionReader::DecodeBatch(UInt64 first, UInt32 count)
+{
+    UInt32 num = 1;
+    while (num < count && _cache.Find(first + num) == BlockCache::kNoSlot) {
+        num++;
+    }
+
+    CRecordVector<UInt32> batch;
+    batch.ClearAndReserve(num);
+    for (UInt32 i = 0; i < num; i++) {
+        batch.AddInReserved(_cache.Take());
+    }
+
+    // Reading has to be done on this thread, since the stream is shared
+    RINOK(InStream_SeekSet(_stream, _dataOffset + first * kClusterSize))
+    UInt32 numRead = 0;
+    for (; numRead < num; numRead++) {
+        size_t size = kClusterSize;
+        RINOK(ReadStream(_stream, _cache.GetData(batch[numRead]), &size))
+        if (size != kClusterSize) {
+            break;
+        }
+    }
+    if (numRead == 0) {
+        return S_FALSE;
+    }
+
+    // While verifying, each cluster is checked right after it's decrypted,
+    // on the same thread
+    const bool verify = _h3.Size() != 0;
+    auto decryptJob = [&](UInt32 index) -> HRESULT {
+        Byte* p = _cache.GetData(batch[index]);
+        DecryptCluster(p);
+        if (verify) {
+            _clusterStates[(size_t) (first + index)] =
+                VerifyCluster(p, first + index) ? kClusterOk : kClusterBad;
+        }
+        return S_OK;
+    };
+    RINOK(Parallel::For(_numThreads, numRead, decryptJob))
+
+    for (UInt32 i = 0; i < numRead; i++) {
+        _cache.Set(batch[i], first + i);
+    }
+    return S_OK;
+}
+
+// Get the decrypted data of cluster. numWanted is how many clusters the read
+// covers from there, which are decrypted together if they aren't cached.
+HRESULT CPartitionReader::GetCluster(
+    UInt64 cluster, UInt64 numWanted, const Byte*& data
+)
+{
+    UInt32 slot = _cache.Find(cluster);
+    if (slot == BlockCache::kNoSlot) {
+        if (cluster >= _numClusters) {
+            return S_FALSE;
+        }
+        // Reading on from the last cluster decrypts a whole batch ahead
+        UInt64 count = numWanted;
+        if (cluster == _lastCluster + 1 && count < _batchSize) {
+            count = _batchSize;
+        }
+        if (count > _batchSize) {
+            count = _batchSize;
+        }
+        if (count > _numClusters - cluster) {
+            count = _numClusters - cluster;
+        }
+        RINOK(DecodeBatch(cluster, (UInt32) count))
+        slot = _cache.Find(cluster);
+    }
+    _cache.Touch(slot);
+    _lastCluster = cluster;
+    data = _cache.GetData(slot) + kHashSize;
+    return S_OK;
+}
+
+HRESULT CPartitionReader::Read(UInt64 offset, void* data, size_t size)
+{
+    if (offset > GetSize() || size > GetSize() - offset) {
+        return S_FALSE;
+    }
+
+    Byte* dest = (Byte*) data;
+    while (size != 0) {
+        const UInt64 cluster = offset / kClusterDataSize;
+        const UInt32 pos = (UInt32) (offset % kClusterDataSize);
+        const Byte* p;
+        RINOK(GetCluster(
+            cluster, (pos + size + kClusterDataSize - 1) / kClusterDataSize, p
+        ))
+        size_t cur = kClusterDataSize - pos;
+        if (cur > size) {
+            cur = size;
+        }
+        memcpy(dest, p + pos, cur);
+        dest += cur;
+        offset += cur;
+        size -= cur;
+    }
+    return S_OK;
+}
+
+// Data is written straight from the cache
+HRESULT CPartitionReader::Copy(
+    UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+    ICompressProgressInfo* progress, bool& isOk
+)
+{
+    UInt64 done = 0;
+    while (done < size) {
+        const UInt64 cluster = (offset + done) / kClusterDataSize;
+        const UInt32 pos = (UInt32) ((offset + done) % kClusterDataSize);
+        const Byte* p;
+        const HRESULT res = GetCluster(
+            cluster,
+            (pos + size - done + kClusterDataSize - 1) / kClusterDataSize, p
+        );
+        if (res == S_FALSE) {
+            break;
+        }
+        RINOK(res)
+
+        size_t cur = kClusterDataSize - pos;
+        if (cur > size - done) {
+            cur = (size_t) (size - done);
+        }
+        if (outStream) {
+            RINOK(WriteStream(outStream, p + pos, cur))
+        }
+        if (_h3.Size() != 0 &&
+            _clusterStates[(size_t) cluster] == kClusterBad) {
+            isOk = false;
+        }
+        done += cur;
+        if (progress) {
+            RINOK(progress->SetRatioInfo(&done, &done))
+        }
+    }
+    if (done != size) {
+        isOk = false;
+    }
+    return S_OK;
+}
+
+HRESULT CPartitionReader::StartVerify(const Byte* h3)
+{
+    _h3.CopyFrom(h3, kH3Size);
+    _clusterStates.Alloc((size_t) _numClusters);
+    if (_numClusters != 0) {
+        memset(_clusterStates, kClusterUnchecked, (size_t) _numClusters);
+    }
+    _cache.Flush();
+    _lastCluster = kNoCluster;
+    return S_OK;
+}
+
+void CPartitionReader::StopVerify()
+{
+    _h3.Free();
+    _clusterStates.Free();
+}
+
+HRESULT CPartitionReader::VerifyRest()
+{
+    for (UInt64 cluster = 0; cluster < _numClusters; cluster++) {
+        if (_clusterStates[(size_t) cluster] != kClusterUnchecked) {
+            continue;
+        }
+        // Decrypts a batch from here, or stops at the end of the disc
+        const Byte* p;
+        const HRESULT res = GetCluster(cluster, _numClusters - cluster, p);
+        if (res == S_FALSE) {
+            break;
+        }
+        RINOK(res)
+    }
+    return S_OK;
+}
+
+bool CPartitionReader::FindBadClusters(
+    UInt64 start, UInt64& first, UInt64& end
+) const
+{
+    if (_clusterStates.Size() == 0) {
+        return false;
+    }
+    const Byte* states = _clusterStates;
+    first = start;
+    while (first < _numClusters && states[first] != kClusterBad) {
+        first++;
+    }
+    if (first == _numClusters) {
+        return false;
+    }
+    end = first + 1;
+    while (end < _numClusters && states[end] == kClusterBad) {
+        end++;
+    }
+    return true;
+}
+
+// Stream over a file read through a DiscReadFunc, for GetStream
+Z7_CLASS_IMP_IInStream(CDiscStream)
+#if CLANG_FORMAT_WORKAROUND
+    class CDiscStream
+{
+#endif
+    CMyComPtr<IUnknown> _ref;
+    DiscReadFunc _read;
+    void* _param;
+    int _part;
+    UInt64 _offset;
+    UInt64 _size;
+    UInt64 _pos;
+
+public:
+    void Init(
+        DiscReadFunc read, void* param, int part, UInt64 offset, UInt64 size,
+        IUnknown* ref
+    )
+    {
+        _ref = ref;
+        _read = read;
+        _param = param;
+        _part = part;
+        _offset = offset;
+        _size = size;
+        _pos = 0;
+    }
+};
+
+Z7_COM7F_IMF(CDiscStream::Read(void* data, UInt32 size, UInt32* processed))
+{
+    if (processed) {
+        *processed = 0;
+    }
+    if (_pos >= _size) {
+        return S_OK;
+    }
+    if (size > _size - _pos) {
+        size = (UInt32) (_size - _pos);
+    }
+    // A file cut off by the end of the disc just ends early
+    const HRESULT res = _read(_param, _part, _offset + _pos, data, size);
+    if (res != S_OK) {
+        return res == S_FALSE ? S_OK : res;
+    }
+    _pos += size;
+    if (processed) {
+        *processed = size;
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CDiscStream::Seek(Int64 offset, UInt32 seekOrigin, UInt64* newPosition)
+)
+{
+    switch (seekOrigin) {
+    case STREAM_SEEK_SET:
+        break;
+    case STREAM_SEEK_CUR:
+        offset += _pos;
+        break;
+    case STREAM_SEEK_END:
+        offset += _size;
+        break;
+    default:
+        return STG_E_INVALIDFUNCTION;
+    }
+    if (offset < 0) {
+        return HRESULT_WIN32_ERROR_NEGATIVE_SEEK;
+    }
+    _pos = (UInt64) offset;
+    if (newPosition) {
+        *newPosition = _pos;
+    }
+    return S_OK;
+}
+
+void CreateDiscStream(
+    DiscReadFunc read, void* param, int part, UInt64 offset, UInt64 size,
+    IUnknown* ref, ISequentialInStream** stream
+)
+{
+    CDiscStream* streamSpec = new CDiscStream;
+    CMyComPtr<ISequentialInStream> streamTemp = streamSpec;
+    streamSpec->Init(read, param, part, offset, size, ref);
+    *stream = streamTemp.Detach();
+}
+
+typedef Darch::CItem CItem;
+
+static const UInt32 kMagic = 0x5D1C9EA3;
+static const UInt32 kMagicOffset = 0x18;
+static const UInt32 kDiscHeaderSize = 0x100;
+static const UInt32 kRegionOffset = 0x4E000;
+static const UInt32 kRegionSize = 0x20;
+
+// Four groups of partitions, each a count and the offset of its table
+static const UInt32 kPartitionInfoOffset = 0x40000;
+static const unsigned kNumPartitionGroups = 4;
+static const unsigned kNumPartitionsMax = 64;
+
+void CDiscItems::Clear()
+{
+    Items.Clear();
+    ItemParts.Clear();
+    Parts.Clear();
+    _names.Free();
+    _namesSize = 0;
+    _pathArena.Clear();
+    _pathOffsets.Clear();
+}
+
+// Append to the names, returning the offset of the data
+UInt32 CDiscItems::AddName(const void* data, size_t size)
+{
+    const size_t needed = _namesSize + size;
+    if (needed > _names.Size()) {
+        size_t newSize = _names.Size() < (1 << 12) ? (1 << 12) : _names.Size();
+        while (newSize < needed) {
+            newSize *= 2;
+        }
+        _names.ChangeSize_KeepData(newSize, _namesSize);
+    }
+    memcpy(_names + _namesSize, data, size);
+    const UInt32 offset = (UInt32) _namesSize;
+    _namesSize = needed;
+    return offset;
+}
+
+int CDiscItems::AddItem(
+    UInt32 nameOffset, int parent, bool isDir, UInt64 offset, UInt32 size,
+    int part
+)
+{
+    CItem item;
+    item.NameOffset = nameOffset;
+    item.Parent = parent;
+    item.IsDir = isDir;
+    item.Offset = offset;
+    item.Size = size;
+    ItemParts.Add(part);
+    return Items.Add(item);
+}
+
+const char* CDiscItems::GetPath(UInt32 index)
+{
+    if (_pathOffsets.Size() == 0 &&
+        !Darch::BuildPathArena(Items, _names, _pathArena, _pathOffsets)) {
+        return NULL;
+    }
+    return &_pathArena[_pathOffsets[index]];
+}
+
+UInt64 CDiscItems::GetDiscOffset(UInt32 index) const
+{
+    const CItem& item = Items[index];
+    const int part = ItemParts[index];
+    return part < 0 ? item.Offset : Parts[part].GetDiscOffset(item.Offset);
+}
+
+HRESULT CDiscItems::AddWiiDisc(DiscReadFunc read, void* param)
+{
+    Byte header[kDiscHeaderSize];
+    RINOK(read(param, -1, 0, header, kDiscHeaderSize))
+    if (GetBe32(header + kMagicOffset) != kMagic) {
+        return S_FALSE;
+    }
+
+    const int disc = AddItem(AddName("disc"), -1, true, 0, 0, -1);
+    AddItem(AddName("header.bin"), disc, false, 0, kDiscHeaderSize, -1);
+    AddItem(
+        AddName("region.bin"), disc, false, kRegionOffset, kRegionSize, -1
+    );
+
+    Byte info[kNumPartitionGroups * 8];
+    RINOK(read(param, -1, kPartitionInfoOffset, info, sizeof(info)))
+    for (unsigned group = 0; group < kNumPartitionGroups; group++) {
+        const UInt32 count = GetBe32(info + group * 8);
+        const UInt64 tableOffset = (UInt64) GetBe32(info + group * 8 + 4)
+                                   << 2;
+        if (count > kNumPartitionsMax - Parts.Size()) {
+            return S_FALSE;
+        }
+        for (UInt32 i = 0; i < count; i++) {
+            Byte entry[8];
+            RINOK(read(param, -1, tableOffset + i * 8, entry, 8))
+            CPartitionInfo& part = Parts.AddNew();
+            part.Offset = (UInt64) GetBe32(entry) << 2;
+            part.Type = GetBe32(entry + 4);
+            RINOK(read(
+                param, -1, part.Offset, part.Header, kPartitionHeaderSize
+            ))
+        }
+    }
+
+    // Named by type as Dolphin does, or by number for other types and for
+    // a second partition of the same type
+    const char* const kTypeNames[] = {"DATA", "UPDATE", "CHANNEL"};
+    for (unsigned index = 0; index < Parts.Size(); index++) {
+        CPartitionInfo& part = Parts[index];
+        const Byte* header = part.Header;
+        bool isNamed = part.Type < Z7_ARRAY_SIZE(kTypeNames);
+        for (unsigned i = 0; isNamed && i < index; i++) {
+            isNamed = Parts[i].Type != part.Type;
+        }
+        if (isNamed) {
+            part.Name = kTypeNames[part.Type];
+        } else {
+            part.Name = "P";
+            part.Name.Add_UInt32(index);
+        }
+        part.H3Offset = part.Offset + ((UInt64) GetBe32(header + 0x2B4) << 2);
+        part.DataOffset = part.Offset +
+                          ((UInt64) GetBe32(header + 0x2B8) << 2);
+        part.DataSize = (UInt64) GetBe32(header + 0x2BC) << 2;
+
+        part.Dir = AddItem(AddName(part.Name), -1, true, 0, 0, -1);
+        AddItem(
+            AddName("ticket.bin"), part.Dir, false, part.Offset, kTicketSize,
+            -1
+        );
+        AddItem(
+            AddName("tmd.bin"), part.Dir, false,
+            part.Offset + ((UInt64) GetBe32(header + 0x2A8) << 2),
+            GetBe32(header + 0x2A4), -1
+        );
+        AddItem(
+            AddName("cert.bin"), part.Dir, false,
+            part.Offset + ((UInt64) GetBe32(header + 0x2B0) << 2),
+            GetBe32(header + 0x2AC), -1
+        );
+        part.H3Item = AddItem(
+            AddName("h3.bin"), part.Dir, false, part.H3Offset, kH3Size, -1
+        );
+    }
+    return S_OK;
+}
+
+HRESULT CDiscItems::AddFiles(DiscReadFunc read, void* param, int part)
+{
+    const unsigned numItems = Items.Size();
+    const size_t namesSize = _namesSize;
+    const HRESULT res = AddFiles2(read, param, part);
+    if (res != S_OK) {
+        Items.DeleteFrom(numItems);
+        ItemParts.DeleteFrom(numItems);
+        _namesSize = namesSize;
+    }
+    return res;
+}
+
+HRESULT CDiscItems::AddFiles2(DiscReadFunc read, void* param, int part)
+{
+    // Offsets in the header of a Wii partition are shifted right by 2
+    const bool isWii = part >= 0;
+    const int parent = isWii ? Parts[part].Dir : -1;
+    const unsigned shift = isWii ? 2 : 0;
+
+    Byte boot[Gcm::kBootSize];
+    RINOK(read(param, part, 0, boot, Gcm::kBootSize))
+    // A wrong common key gives garbage here
+    if (isWii ? GetBe32(boot + kMagicOffset) != kMagic
+              : GetBe32(boot + Gcm::kMagicOffset) != Gcm::kMagic) {
+        return S_FALSE;
+    }
+
+    const UInt64 dolOffset = (UInt64) GetBe32(boot + 0x420) << shift;
+    const UInt64 fstOffset = (UInt64) GetBe32(boot + 0x424) << shift;
+    const UInt64 fstSize = (UInt64) GetBe32(boot + 0x428) << shift;
+    if (fstSize < 0xC || fstSize > Gcm::kFstSizeMax) {
+        return S_FALSE;
+    }
+
+    Byte apploader[Gcm::kApploaderHeaderSize];
+    RINOK(read(
+        param, part, Gcm::kApploaderOffset, apploader,
+        Gcm::kApploaderHeaderSize
+    ))
+    Byte dol[Gcm::kDolHeaderSize];
+    RINOK(read(param, part, dolOffset, dol, Gcm::kDolHeaderSize))
+    CByteBuffer fst((size_t) fstSize);
+    RINOK(read(param, part, fstOffset, fst, (size_t) fstSize))
+
+    const int sys = AddItem(AddName("sys"), parent, true, 0, 0, -1);
+    AddItem(AddName("boot.bin"), sys, false, 0, Gcm::kBootSize, part);
+    AddItem(
+        AddName("bi2.bin"), sys, false, Gcm::kBi2Offset, Gcm::kBi2Size, part
+    );
+    AddItem(
+        AddName("apploader.img"), sys, false, Gcm::kApploaderOffset,
+        Gcm::GetApploaderSize(apploader), part
+    );
+    AddItem(
+        AddName("main.dol"), sys, false, dolOffset, Gcm::GetDolSize(dol), part
+    );
+    AddItem(AddName("fst.bin"), sys, false, fstOffset, (UInt32) fstSize, part);
+    const int files = AddItem(AddName("files"), parent, true, 0, 0, -1);
+
+    // FST names are looked up in the names of all items
+    const unsigned first = Items.Size();
+    if (!Darch::ParseNodes(fst, (size_t) fstSize, files, shift, Items)) {
+        return S_FALSE;
+    }
+    const UInt32 nameBase = AddName(fst, (size_t) fstSize);
+    for (unsigned i = first; i < Items.Size(); i++) {
+        Items[i].NameOffset += nameBase;
+        ItemParts.Add(Items[i].IsDir ? -1 : part);
+    }
+    return S_OK;
+}
+
+struct CPartition {
+    // Only set up if the partition's common key was found
+    bool IsDecrypted;
+    CPartitionReader Reader;
+};
+
+Z7_CLASS_IMP_CHandler_IInArchive_3(
+    IArchiveGetRawProps, IInArchiveGetStream, ISetProperties
+)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    ArcData::CSource _source;
+    ArcData::CHandlerProps _handlerProps;
+    CMyComPtr<IInStream> _stream;
+    // -mkey: file holding the common keys, one after another in the order
+    // of the key index in the tickets
+    FString _keyFile;
+
+    CDiscItems _disc;
+    // Readers for the partitions in _disc.Parts
+    CObjectVector<CPartition> _parts;
+
+    // Partitions whose files can't be listed
+    bool _isKeyMissing;
+    bool _isPartitionBad;
+    // Clusters that failed the hash check in the last test. Only for hosts
+    // that read the archive properties again after testing; the items with a
+    // bad cluster and the partitions' h3.bin are what report the failure, as
+    // data errors.
+    AString _hashError;
+
+    // Archives found among the files, when opening them is turned on
+    Nested::CExpander _nested;
+
+    static HRESULT ReadDisc(
+        void* param, int part, UInt64 offset, void* data, size_t size
+    );
+    HRESULT OpenPartition(unsigned index, const CByteBuffer& keys);
+    HRESULT Open2();
+    HRESULT StartVerify();
+    int GetH3Part(UInt32 index) const;
+    HRESULT VerifyPartition(unsigned index, bool& isOk);
+    void FinishVerify();
+
+public:
+    CHandler()
+      : _isKeyMissing(false)
+      , _isPartitionBad(false)
+    {
+    }
+};
+
+static const Byte kArcProps[] = {
+    kpidWarning,
+};
+
+static const Byte kProps[] = {
+    kpidPath,
+    kpidIsDir,
+    kpidSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+HRESULT CHandler::ReadDisc(
+    void* param, int part, UInt64 offset, void* data, size_t size
+)
+{
+    CHandler* handler = (CHandler*) param;
+    if (part < 0) {
+        return handler->_source.Read(offset, data, size);
+    }
+    return handler->_parts[part].Reader.Read(offset, data, size);
+}
+
+HRESULT CHandler::OpenPartition(unsigned index, const CByteBuffer& keys)
+{
+    const CPartitionInfo& info = _disc.Parts[index];
+    CPartition& part = _parts[index];
+    part.IsDecrypted = false;
+
+    const unsigned keyIndex = info.GetKeyIndex();
+    if ((keyIndex + 1) * kKeySize > keys.Size()) {
+        _isKeyMissing = true;
+        return S_OK;
+    }
+    Byte titleKey[kKeySize];
+    DecryptTitleKey(info.Header, keys + keyIndex * kKeySize, titleKey);
+    RINOK(part.Reader.Init(
+        _stream, info.DataOffset, info.DataSize, titleKey,
+        _handlerProps.NumThreads, _handlerProps.CacheSize
+    ))
+
+    // The partition's own items are kept if its files can't be read
+    const HRESULT res = _disc.AddFiles(ReadDisc, this, (int) index);
+    if (res == S_FALSE) {
+        _isPartitionBad = true;
+        part.Reader.Free();
+        return S_OK;
+    }
+    part.IsDecrypted = res == S_OK;
+    return res;
+}
+
+HRESULT CHandler::Open2()
+{
+    RINOK(_disc.AddWiiDisc(ReadDisc, this))
+
+    CByteBuffer keys;
+    LoadCommonKeys(_keyFile, keys);
+    for (unsigned i = 0; i < _disc.Parts.Size(); i++) {
+        _parts.AddNew().IsDecrypted = false;
+    }
+    for (unsigned i = 0; i < _disc.Parts.Size(); i++) {
+        RINOK(OpenPartition(i, keys))
+    }
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+        _stream = stream;
+        if (_source.Open(stream) != S_OK || Open2() != S_OK) {
+            PRINT("Open failure\n");
+            Close();
+            return S_FALSE;
+        }
+        // The disc itself is fine even if none of its files open
+        if (_nested.Expand(
+                (IInArchive*) this, _disc.Items.Size(),
+                _handlerProps.RecurseDepth, _handlerProps.CacheSize
+            ) != S_OK) {
+            _nested.Clear();
+        }
+        PRINT("Open ok\n");
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _nested.Clear();
+    _source.Close();
+    _stream.Release();
+    _disc.Clear();
+    _parts.Clear();
+    _isKeyMissing = false;
+    _isPartitionBad = false;
+    _hashError.Empty();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = _disc.Items.Size() + _nested.GetNumItems();
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidExtension:
+        prop = "iso";
+        break;
+    case kpidIsTree:
+        prop = true;
+        break;
+    case kpidWarning:
+        if (_isKeyMissing) {
+            prop = "Common key not found, the files of encrypted partitions "
+                   "are not listed";
+        } else if (_isPartitionBad) {
+            prop = "Partition could not be decrypted with the common key";
+        }
+        break;
+    // Informational: 7-Zip reads these right after opening, before any test
+    // has filled them in, and goes by the items' data errors instead
+    case kpidErrorFlags:
+        if (!_hashError.IsEmpty()) {
+            prop = (UInt32) kpv_ErrorFlags_DataError;
+        }
+        break;
+    case kpidError:
+        if (!_hashError.IsEmpty()) {
+            prop = _hashError;
+        }
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetProperty(UInt32 index, PROPID propID, PROPVARIANT* value)
+)
+{
+    COM_TRY_BEGIN
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetProperty(index, propID, value);
+    }
+
+    NWindows::NCOM::CPropVariant prop;
+    const CItem& item = _disc.Items[index];
+
+    switch (propID) {
+    case kpidPath: {
+        const char* path = _disc.GetPath(index);
+        if (path == NULL) {
+            return E_OUTOFMEMORY;
+        }
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(path, strlen(path), us);
+        prop = us;
+        break;
+    }
+
+    case kpidName: {
+        const char* name = _disc.GetName(index);
+        UString us;
+        Convert_UTF8_Buf_To_Unicode(name, strlen(name), us);
+        prop = us;
+        break;
+    }
+
+    case kpidIsDir:
+        prop = item.IsDir;
+        break;
+
+    case kpidSize:
+    case kpidPackSize:
+        prop = item.Size;
+        break;
+    }
+
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetNumRawProps(UInt32* numProps))
+{
+    *numProps = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawPropInfo(UInt32, BSTR* name, PROPID* propID))
+{
+    *name = NULL;
+    *propID = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(
+    CHandler::GetParent(UInt32 index, UInt32* parent, UInt32* parentType)
+)
+{
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetParent(index, parent, parentType);
+    }
+
+    *parentType = NParentType::kDir;
+    *parent = (UInt32) _disc.Items[index].Parent;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetRawProp(
+    UInt32 index, PROPID propID, const void** data, UInt32* dataSize,
+    UInt32* propType
+))
+{
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetRawProp(index, propID, data, dataSize, propType);
+    }
+
+    *data = NULL;
+    *dataSize = 0;
+    *propType = 0;
+
+    if (propID == kpidName) {
+        const char* name = _disc.GetName(index);
+        *data = name;
+        *dataSize = (UInt32) strlen(name) + 1;
+        *propType = NPropDataType::kUtf8z;
+    }
+    return S_OK;
+}
+
+// Check the hash trees of the decrypted partitions while testing
+HRESULT CHandler::StartVerify()
+{
+    _hashError.Empty();
+    CByteBuffer h3(kH3Size);
+    for (unsigned i = 0; i < _parts.Size(); i++) {
+        CPartition& part = _parts[i];
+        if (part.IsDecrypted) {
+            RINOK(_source.Read(_disc.Parts[i].H3Offset, h3, kH3Size))
+            RINOK(part.Reader.StartVerify(h3))
+        }
+    }
+    return S_OK;
+}
+
+// Partition whose hash check the item's test reports, if it's the h3.bin of
+// a decrypted partition, or else -1
+int CHandler::GetH3Part(UInt32 index) const
+{
+    for (unsigned i = 0; i < _parts.Size(); i++) {
+        if (_disc.Parts[i].H3Item == (int) index && _parts[i].IsDecrypted) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+// Check the clusters of a partition that no item covered, and fail the test
+// of its h3.bin if any cluster in the partition is bad
+HRESULT CHandler::VerifyPartition(unsigned index, bool& isOk)
+{
+    CPartitionReader& reader = _parts[index].Reader;
+    RINOK(reader.VerifyRest())
+    UInt64 first, end;
+    if (reader.FindBadClusters(0, first, end)) {
+        isOk = false;
+    }
+    return S_OK;
+}
+
+// List the clusters that failed in the archive error. The failures have
+// already been reported as data errors, this only adds where they were.
+void CHandler::FinishVerify()
+{
+    for (unsigned i = 0; i < _parts.Size(); i++) {
+        CPartition& part = _parts[i];
+        if (!part.IsDecrypted) {
+            continue;
+        }
+
+        UInt64 first, end = 0;
+        bool isFirstRun = true;
+        while (part.Reader.FindBadClusters(end, first, end)) {
+            if (isFirstRun) {
+                if (_hashError.IsEmpty()) {
+                    _hashError = "Hash check failed in partition ";
+                } else {
+                    _hashError += "; partition ";
+                }
+                _hashError += _disc.Parts[i].Name;
+                _hashError += " at clusters ";
+                isFirstRun = false;
+            } else {
+                _hashError += ", ";
+            }
+            _hashError.Add_UInt64(first);
+            if (end - first > 1) {
+                _hashError.Add_Minus();
+                _hashError.Add_UInt64(end - 1);
+            }
+        }
+        part.Reader.StopVerify();
+    }
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    const bool allFilesMode = (numItems == (UInt32) (Int32) -1);
+    const UInt32 numIndices = allFilesMode ? _disc.Items.Size() : numItems;
+
+    // Ranges are ordered by where they are on the disc, whichever partition
+    // they're in
+    CRecordVector<ArcData::CRange> ranges;
+    for (UInt32 i = 0; i < numIndices; i++) {
+        const UInt32 index = allFilesMode ? i : indices[i];
+        if (index >= _disc.Items.Size())
+            continue;
+        const CItem& item = _disc.Items[index];
+        ArcData::CRange range;
+        range.Index = index;
+        range.IsDir = item.IsDir;
+        range.Offset = 0;
+        range.Size = 0;
+        if (!item.IsDir) {
+            range.Offset = _disc.GetDiscOffset(index);
+            range.Size = item.Size;
+            // A partition's h3.bin is tested after its files, so that only
+            // the clusters they didn't cover are left to check
+            const int h3Part = testMode ? GetH3Part(index) : -1;
+            if (h3Part >= 0) {
+                const CPartitionInfo& info = _disc.Parts[h3Part];
+                range.Offset = info.DataOffset + info.DataSize;
+            }
+        }
+        ranges.Add(range);
+    }
+
+    auto copy = [&](const ArcData::CRange& range,
+                    ISequentialOutStream* outStream,
+                    ICompressProgressInfo* progress, bool& isOk) -> HRESULT {
+        const CItem& item = _disc.Items[range.Index];
+        const int part = _disc.ItemParts[range.Index];
+        if (part < 0) {
+            RINOK(_source.Copy(
+                item.Offset, item.Size, outStream, progress, isOk
+            ))
+            const int h3Part = testMode ? GetH3Part(range.Index) : -1;
+            if (h3Part >= 0) {
+                RINOK(VerifyPartition((unsigned) h3Part, isOk))
+            }
+            return S_OK;
+        }
+        return _parts[part].Reader.Copy(
+            item.Offset, item.Size, outStream, progress, isOk
+        );
+    };
+
+    // Testing a partition's h3.bin checks every cluster of the partition,
+    // not just the ones with files in them
+    auto extractOwn = [&](IArchiveExtractCallback* callback) -> HRESULT {
+        if (testMode) {
+            RINOK(StartVerify())
+        }
+        HRESULT res = S_OK;
+        if (ranges.Size() != 0) {
+            res = ArcData::ExtractRanges(ranges, testMode, callback, copy);
+        }
+        if (testMode) {
+            FinishVerify();
+        }
+        return res;
+    };
+    return _nested.Extract(
+        indices, numItems, testMode, extractCallback, extractOwn
+    );
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetStream(UInt32 index, ISequentialInStream** stream))
+{
+    PRINT("GetStream\n");
+
+    *stream = NULL;
+    COM_TRY_BEGIN
+
+    if (index >= _disc.Items.Size()) {
+        return _nested.GetStream(index, stream);
+    }
+
+    const CItem& item = _disc.Items[index];
+    if (item.IsDir) {
+        return S_FALSE;
+    }
+    const int part = _disc.ItemParts[index];
+    if (part < 0) {
+        return _source.GetStream(
+            item.Offset, item.Size, _nested.GetStreamRef(this), stream
+        );
+    }
+    CreateDiscStream(
+        ReadDisc, this, part, item.Offset, item.Size,
+        _nested.GetStreamRef(this), stream
+    );
+    return S_OK;
+    COM_TRY_END
+}
+
+// Besides the common key file, the thread count and cache size set how
+// partitions are decrypted
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    _keyFile.Empty();
+    _handlerProps.Init();
+    for (UInt32 i = 0; i < numProps; i++) {
+        UString name = names[i];
+        name.MakeLower_Ascii();
+        HRESULT hres;
+        if (name.IsEqualTo("key")) {
+            if (values[i].vt != VT_BSTR) {
+                return E_INVALIDARG;
+            }
+            _keyFile = us2fs(values[i].bstrVal);
+        } else if (_handlerProps.SetProperty(name, values[i], hres)) {
+            RINOK(hres)
+        } else {
+            return E_INVALIDARG;
+        }
+    }
+    _source.SetBlockSize(_handlerProps.BlockSize);
+    return S_OK;
+}
+
+static const Byte k_Signature[] = {0x5D, 0x1C, 0x9E, 0xA3};
+
+REGISTER_ARC_I(
+    "wii", "iso wii", NULL, 0xA8, //
+    k_Signature, //
+    kMagicOffset, //
+    0, 0
+)
+
+} // namespace Wii
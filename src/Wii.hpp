@@ -0,0 +1,227 @@
+#pragma once
+
+#include "BlockCache.hpp"
+#include "Darch.hpp"
+#include "Types.h"
+#include <C/Aes.h>
+#include <CPP/7zip/ICoder.h>
+#include <CPP/7zip/IStream.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+#include <CPP/Common/MyString.h>
+#include <CPP/Common/MyVector.h>
+
+namespace Wii
+{
+
+// Partition data is stored in clusters, each a block of hashes followed by
+// the data, encrypted separately with the partition's title key
+static const UInt32 kClusterSize = 0x8000;
+static const UInt32 kHashSize = 0x400;
+static const UInt32 kClusterDataSize = kClusterSize - kHashSize;
+
+static const UInt32 kTicketSize = 0x2A4;
+// The ticket, then the sizes and offsets of the TMD, certificates, H3 table
+// and data
+static const UInt32 kPartitionHeaderSize = 0x2C0;
+
+// The H3 table has a SHA-1 hash of the H2 table for each group of clusters
+static const UInt32 kH3Size = 0x18000;
+
+// Size of the common keys and of the title keys they decrypt
+static const unsigned kKeySize = 16;
+
+// Load the common keys from keyFile, one after another in the order of the
+// key index in the tickets, or from the plugin's directory if keyFile is
+// empty. keys is left empty if there are none.
+void LoadCommonKeys(const FString& keyFile, CByteBuffer& keys);
+
+// Decrypt the title key in ticket with commonKey, the key the ticket's
+// common key index selects
+void DecryptTitleKey(const Byte* ticket, const Byte* commonKey, Byte* titleKey);
+
+// Which common key the title key in ticket is encrypted with
+inline unsigned GetKeyIndex(const Byte* ticket)
+{
+    return ticket[0x1F1];
+}
+
+// Decrypted data of a partition, without the hashes, as one flat range.
+// Clusters are decrypted in batches on up to numThreads threads and kept in
+// an LRU cache, so reads anywhere in the partition only decrypt the clusters
+// they cover, and reading front to back decrypts ahead of the reads.
+class CPartitionReader
+{
+public:
+    CPartitionReader();
+
+    // Read the data area of dataSize bytes at dataOffset in stream. The cache
+    // holds cacheSize bytes of clusters, but never less than one batch.
+    HRESULT Init(
+        IInStream* stream, UInt64 dataOffset, UInt64 dataSize,
+        const Byte* titleKey, UInt32 numThreads, UInt64 cacheSize
+    );
+    void Free();
+
+    UInt64 GetSize() const
+    {
+        return _numClusters * kClusterDataSize;
+    }
+
+    // Read exactly size bytes at offset. Returns S_FALSE if they go past the
+    // end of the partition or the disc.
+    HRESULT Read(UInt64 offset, void* data, size_t size);
+
+    // Copy size bytes at offset to outStream, which may be NULL to only test
+    // the data. isOk is cleared if the disc ends first, or if a cluster fails
+    // the hash check while verifying.
+    HRESULT Copy(
+        UInt64 offset, UInt64 size, ISequentialOutStream* outStream,
+        ICompressProgressInfo* progress, bool& isOk
+    );
+
+    // Check every cluster decrypted from now on against the hash tree that
+    // ends in h3, the partition's H3 table of kH3Size bytes. The cache is
+    // emptied so no cluster goes unchecked.
+    HRESULT StartVerify(const Byte* h3);
+    void StopVerify();
+
+    // Check the clusters that haven't been read since verifying started
+    HRESULT VerifyRest();
+
+    // Find the first run of clusters at or after start that failed the hash
+    // check, setting end past its last cluster. Returns false if none did.
+    bool FindBadClusters(UInt64 start, UInt64& first, UInt64& end) const;
+
+private:
+    CMyComPtr<IInStream> _stream;
+    UInt64 _dataOffset;
+    UInt64 _numClusters;
+    UInt32 _numThreads;
+    UInt32 _batchSize;
+
+    // Key schedule at _aes + _aesOffset, aligned as the AES code needs
+    UInt32 _aes[AES_NUM_IVMRK_WORDS + 3];
+    unsigned _aesOffset;
+
+    // Whole clusters, decrypted in place. The cache's alignment suits the
+    // wide AES code, which loads whole vectors of data.
+    BlockCache::CCache _cache;
+    UInt64 _lastCluster;
+
+    // While verifying, the H3 table and the result for each cluster
+    CByteBuffer _h3;
+    CByteBuffer _clusterStates;
+
+    void DecryptCluster(Byte* p) const;
+    bool VerifyCluster(const Byte* p, UInt64 cluster) const;
+    HRESULT DecodeBatch(UInt64 first, UInt32 count);
+    HRESULT GetCluster(UInt64 cluster, UInt64 numWanted, const Byte*& data);
+};
+
+// Read exactly size bytes at offset from the disc as it's stored if part is
+// -1, or else from the decrypted data of partition part. Returns S_FALSE if
+// they go past the end.
+typedef HRESULT (*DiscReadFunc)(
+    void* param, int part, UInt64 offset, void* data, size_t size
+);
+
+// A partition from the partition table of a Wii disc
+struct CPartitionInfo {
+    UInt64 Offset;
+    UInt32 Type;
+    // Name of the partition's directory
+    AString Name;
+    int Dir;
+    UInt64 H3Offset;
+    // Item of the H3 table, whose test covers the hash check of the whole
+    // partition
+    int H3Item;
+    // Clusters of the partition's data, with their hashes
+    UInt64 DataOffset;
+    UInt64 DataSize;
+    Byte Header[kPartitionHeaderSize];
+
+    unsigned GetKeyIndex() const
+    {
+        return Wii::GetKeyIndex(Header);
+    }
+
+    // Offset in the disc of the decrypted data at offset
+    UInt64 GetDiscOffset(UInt64 offset) const
+    {
+        return DataOffset + offset / kClusterDataSize * kClusterSize +
+               kHashSize + offset % kClusterDataSize;
+    }
+};
+
+// Items of a GameCube or Wii disc, laid out as Dolphin extracts them. Data is
+// read through a DiscReadFunc, so any container the disc is stored in lists
+// the same.
+class CDiscItems
+{
+public:
+    CRecordVector<Darch::CItem> Items;
+    // Partition whose data each item is in, or -1 if it's read from the disc
+    // as it's stored
+    CRecordVector<int> ItemParts;
+    CObjectVector<CPartitionInfo> Parts;
+
+    CDiscItems()
+      : _namesSize(0)
+    {
+    }
+
+    void Clear();
+
+    const char* GetName(UInt32 index) const
+    {
+        return (const char*) (_names + Items[index].NameOffset);
+    }
+
+    // Full path of an item, built for all items the first time it's needed.
+    // NULL if they'd take more than Darch::kPathArenaSizeMax.
+    const char* GetPath(UInt32 index);
+
+    // Offset in the disc of an item's data, to extract in disc order
+    UInt64 GetDiscOffset(UInt32 index) const;
+
+    // Add the disc header and region, and a directory for each partition with
+    // the files in front of its data. Returns S_FALSE if the disc isn't a Wii
+    // disc or its partition table is bad.
+    HRESULT AddWiiDisc(DiscReadFunc read, void* param);
+
+    // Add the system files and the FST from the data of a GameCube disc, if
+    // part is -1, or of a Wii partition. Returns S_FALSE, adding nothing, if
+    // the data doesn't start with a disc header, as with a partition
+    // decrypted with the wrong key.
+    HRESULT AddFiles(DiscReadFunc read, void* param, int part);
+
+private:
+    // Names of all items, the FSTs among them
+    CByteBuffer _names;
+    size_t _namesSize;
+
+    CRecordVector<char> _pathArena;
+    CRecordVector<UInt32> _pathOffsets;
+
+    UInt32 AddName(const void* data, size_t size);
+    UInt32 AddName(const char* name)
+    {
+        return AddName(name, strlen(name) + 1);
+    }
+    int AddItem(
+        UInt32 nameOffset, int parent, bool isDir, UInt64 offset, UInt32 size,
+        int part
+    );
+    HRESULT AddFiles2(DiscReadFunc read, void* param, int part);
+};
+
+// Stream over size bytes at offset read through read, for GetStream. ref
+// keeps the handler behind param alive.
+void CreateDiscStream(
+    DiscReadFunc read, void* param, int part, UInt64 offset, UInt64 size,
+    IUnknown* ref, ISequentialInStream** stream
+);
+
+} // namespace Wii
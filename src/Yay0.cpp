@@ -0,0 +1,435 @@
+// Yay0.cpp - File for Yay0 (szp) compression
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Yay0.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Windows/PropVariant.h>
+
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/ProgressUtils.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/RegisterCodec.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <cstring>
+
+namespace Yay0
+{
+
+// Largest compressed file read whole
+static const size_t kPackSizeMax = (size_t) 1 << 31;
+
+HRESULT CLazyBuffer::Open(ISequentialInStream* stream, size_t packSize)
+{
+    Free();
+
+    if (packSize < kHeaderSize) {
+        return S_FALSE;
+    }
+    _packed.Alloc(packSize);
+    RINOK(ReadStream_FALSE(stream, _packed, packSize))
+    return Init();
+}
+
+HRESULT CLazyBuffer::Open(ISequentialInStream* stream)
+{
+    Free();
+
+    CByteBuffer data(1 << 16);
+    size_t size = 0;
+    for (;;) {
+        if (size == data.Size()) {
+            if (size >= kPackSizeMax) {
+                return S_FALSE;
+            }
+            data.ChangeSize_KeepData(size * 2, size);
+        }
+        size_t n = data.Size() - size;
+        RINOK(ReadStream(stream, data + size, &n))
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    if (size < kHeaderSize) {
+        return S_FALSE;
+    }
+    _packed.CopyFrom(data, size);
+    return Init();
+}
+
+// Check the header of the file in _packed and get ready to decode it
+HRESULT CLazyBuffer::Init()
+{
+    const size_t packSize = _packed.Size();
+    const Byte* p = _packed;
+    if (!IsHeader(p)) {
+        return S_FALSE;
+    }
+    _size = GetBe32(p + 4);
+    _linkPos = GetBe32(p + 8);
+    _chunkPos = GetBe32(p + 12);
+    if (_linkPos > packSize || _chunkPos > packSize) {
+        return S_FALSE;
+    }
+
+    _buf.Alloc(_size == 0 ? 1 : _size);
+    if (!_buf.IsAllocated()) {
+        return E_OUTOFMEMORY;
+    }
+    _pos = 0;
+    _maskPos = kHeaderSize;
+    _mask = 0;
+    _numMaskBits = 0;
+    _matchDist = 0;
+    _matchRem = 0;
+    return S_OK;
+}
+
+void CLazyBuffer::Free()
+{
+    _packed.Free();
+    _buf.Free();
+    _size = 0;
+    _pos = 0;
+    _error = false;
+}
+
+bool CLazyBuffer::Decode(UInt32 limit)
+{
+    const Byte* packed = _packed;
+    const size_t packSize = _packed.Size();
+    Byte* buf = _buf;
+    UInt32 pos = _pos;
+    UInt32 mask = _mask;
+    UInt32 numMaskBits = _numMaskBits;
+    bool ok = true;
+
+    while (pos < limit) {
+        if (_matchRem != 0) {
+            UInt32 n = limit - pos;
+            if (n > _matchRem) {
+                n = _matchRem;
+            }
+            _matchRem -= n;
+
+            const Byte* src = buf + pos - _matchDist;
+            Byte* dest = buf + pos;
+            pos += n;
+            if (_matchDist >= n) {
+                memcpy(dest, src, n);
+            } else {
+                do {
+                    *dest++ = *src++;
+                } while (--n != 0);
+            }
+            continue;
+        }
+
+        if (numMaskBits == 0) {
+            if (_maskPos + 4 > packSize) {
+                ok = false;
+                break;
+            }
+            mask = GetBe32(packed + _maskPos);
+            _maskPos += 4;
+            numMaskBits = 32;
+        }
+
+        if (mask & 0x80000000) {
+            // Literals are stored one after another in the chunk stream, so a
+            // run of them is copied in one go
+            UInt32 n = 1;
+            while (n < numMaskBits && (mask << n) & 0x80000000) {
+                n++;
+            }
+            if (n > limit - pos) {
+                n = limit - pos;
+            }
+            if (n > packSize - _chunkPos) {
+                ok = false;
+                break;
+            }
+            memcpy(buf + pos, packed + _chunkPos, n);
+            pos += n;
+            _chunkPos += n;
+            mask = n < 32 ? mask << n : 0;
+            numMaskBits -= n;
+            continue;
+        }
+        numMaskBits--;
+        mask <<= 1;
+
+        if (_linkPos + 2 > packSize) {
+            ok = false;
+            break;
+        }
+        const UInt32 link = GetBe16(packed + _linkPos);
+        _linkPos += 2;
+        UInt32 len = link >> 12;
+        if (len == 0) {
+            if (_chunkPos >= packSize) {
+                ok = false;
+                break;
+            }
+            len = (UInt32) packed[_chunkPos++] + 0x12;
+        } else {
+            len += 2;
+        }
+        const UInt32 dist = (link & 0xFFF) + 1;
+        if (dist > pos) {
+            PRINT("Yay0: bad distance %u at %u\n", dist, pos);
+            ok = false;
+            break;
+        }
+        _matchDist = dist;
+        _matchRem = len;
+    }
+
+    _pos = pos;
+    _mask = mask;
+    _numMaskBits = numMaskBits;
+    return ok;
+}
+
+HRESULT CLazyBuffer::EnsureDecoded(UInt64 end)
+{
+    if (end > _size) {
+        return S_FALSE;
+    }
+    if (end <= _pos) {
+        return S_OK;
+    }
+    if (_error) {
+        return S_FALSE;
+    }
+
+    if (Decode((UInt32) end) && _pos >= end) {
+        return S_OK;
+    }
+    _error = true;
+    return S_FALSE;
+}
+
+//
+// Codec
+//
+
+// Method IDs for the plugin's own codecs are 0x7F4D00xx
+static const UInt64 kMethodIdYay0 = 0x7F4D0059;
+
+// Size of the pieces written out as they're decoded
+static const UInt32 kStepSize = 1 << 20;
+
+Z7_COM7F_IMF(CCoder::Code(
+    ISequentialInStream* inStream, ISequentialOutStream* outStream,
+    const UInt64* /* inSize */, const UInt64* outSize,
+    ICompressProgressInfo* progress
+))
+{
+    COM_TRY_BEGIN
+    // The three streams can be anywhere in the file, so it's read whole
+    CLazyBuffer buf;
+    RINOK(buf.Open(inStream))
+    UInt64 unpackSize = buf.GetSize();
+    if (outSize && *outSize < unpackSize) {
+        unpackSize = *outSize;
+    }
+
+    const UInt64 packSize = buf.GetPackSize();
+    for (UInt64 pos = 0; pos < unpackSize;) {
+        UInt64 end = pos + kStepSize;
+        if (end > unpackSize) {
+            end = unpackSize;
+        }
+        RINOK(buf.EnsureDecoded(end))
+        if (outStream) {
+            RINOK(WriteStream(
+                outStream, buf.GetData() + pos, (size_t) (end - pos)
+            ))
+        }
+        pos = end;
+        if (progress) {
+            RINOK(progress->SetRatioInfo(&packSize, &pos))
+        }
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+static void* CreateDecoder()
+{
+    return (void*) (ICompressCoder*) (new CCoder);
+}
+
+REGISTER_CODEC_2(Yay0, CreateDecoder, NULL, kMethodIdYay0, "Yay0")
+
+//
+// Archive handler
+//
+
+Z7_CLASS_IMP_CHandler_IInArchive_0
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    CMyComPtr<IInStream> _inStream;
+    UInt32 _unpackSize;
+    UInt64 _packSize;
+};
+
+static const Byte kArcProps[] = {
+    kpidPhySize,
+};
+
+static const Byte kProps[] = {
+    kpidSize,
+    kpidPackSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+
+        Byte header[kHeaderSize];
+        RINOK(ReadStream_FALSE(stream, header, kHeaderSize))
+        if (!IsHeader(header)) {
+            return S_FALSE;
+        }
+        RINOK(InStream_GetSize_SeekToEnd(stream, _packSize))
+        // The link and chunk streams start inside the file
+        if (_packSize > kPackSizeMax || GetBe32(header + 8) > _packSize ||
+            GetBe32(header + 12) > _packSize) {
+            return S_FALSE;
+        }
+        _unpackSize = GetBe32(header + 4);
+        _inStream = stream;
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _inStream.Release();
+    _unpackSize = 0;
+    _packSize = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = 1;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidPhySize:
+        prop = _packSize;
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetProperty(
+    UInt32 /* index */, PROPID propID, PROPVARIANT* value
+))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidSize:
+        prop = _unpackSize;
+        break;
+    case kpidPackSize:
+        prop = _packSize;
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    if (numItems == 0) {
+        return S_OK;
+    }
+    if (numItems != (UInt32) (Int32) -1 && (numItems != 1 || indices[0] != 0)) {
+        return E_INVALIDARG;
+    }
+
+    RINOK(extractCallback->SetTotal(_unpackSize))
+
+    CMyComPtr<ISequentialOutStream> realOutStream;
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+    RINOK(extractCallback->GetStream(0, &realOutStream, askMode))
+    if (!testMode && !realOutStream) {
+        return S_OK;
+    }
+    RINOK(extractCallback->PrepareOperation(askMode))
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, true);
+
+    CMyComPtr<ICompressCoder> coder = new CCoder;
+    RINOK(InStream_SeekSet(_inStream, 0))
+    const HRESULT res =
+        coder->Code(_inStream, realOutStream, NULL, NULL, progress);
+
+    Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
+    if (res == S_FALSE) {
+        opRes = NArchive::NExtract::NOperationResult::kDataError;
+    } else {
+        RINOK(res)
+    }
+
+    realOutStream.Release();
+    return extractCallback->SetOperationResult(opRes);
+    COM_TRY_END
+}
+
+static const Byte k_Signature[] = {'Y', 'a', 'y', '0'};
+
+// Archives wrapped in Yay0 are opened by their own handlers, this is for
+// anything else
+REGISTER_ARC_I(
+    "yay0", "szp yay0", ".arc *", 0xAD, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kKeepName, 0
+)
+
+} // namespace Yay0
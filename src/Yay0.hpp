@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Types.h"
+#include <CPP/7zip/ICoder.h>
+#include <CPP/7zip/IStream.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyBuffer2.h>
+#include <CPP/Common/MyCom.h>
+
+namespace Yay0
+{
+
+static const UInt32 kHeaderSize = 0x10;
+
+static inline bool IsHeader(const Byte* p)
+{
+    return p[0] == 'Y' && p[1] == 'a' && p[2] == 'y' && p[3] == '0';
+}
+
+// Yay0 keeps the flag words, the match (link) halfwords and the literal
+// (chunk) bytes in three separate streams, so unlike Yaz0 it can't be decoded
+// from a forward-only stream. The whole compressed file is read into memory
+// at open and decoded only as far as has been requested so far.
+class CLazyBuffer
+{
+public:
+    CLazyBuffer()
+      : _size(0)
+      , _pos(0)
+      , _error(false)
+    {
+    }
+
+    // The stream must be positioned at the Yay0 header. packSize is the size
+    // of the compressed file.
+    HRESULT Open(ISequentialInStream* stream, size_t packSize);
+    // Same for a stream whose size isn't known, read to the end
+    HRESULT Open(ISequentialInStream* stream);
+    void Free();
+
+    // Make sure data[0 .. end) is decoded. Returns S_FALSE if the data is
+    // corrupt or end is past the decompressed size.
+    HRESULT EnsureDecoded(UInt64 end);
+
+    const Byte* GetData() const
+    {
+        return _buf;
+    }
+
+    UInt64 GetSize() const
+    {
+        return _size;
+    }
+
+    size_t GetPackSize() const
+    {
+        return _packed.Size();
+    }
+
+private:
+    HRESULT Init();
+    bool Decode(UInt32 limit);
+
+    CByteBuffer _packed;
+    CMidBuffer _buf;
+    UInt32 _size;
+    UInt32 _pos;
+    bool _error;
+
+    UInt32 _maskPos;
+    UInt32 _linkPos;
+    UInt32 _chunkPos;
+    UInt32 _mask;
+    UInt32 _numMaskBits;
+    UInt32 _matchDist;
+    UInt32 _matchRem;
+};
+
+// Decoder registered as a codec. The input is a complete compressed file,
+// header included.
+Z7_CLASS_IMP_COM_1(CCoder, ICompressCoder)
+#if CLANG_FORMAT_WORKAROUND
+    class CCoder
+{
+#endif
+};
+
+} // namespace Yay0
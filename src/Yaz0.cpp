@@ -0,0 +1,551 @@
+// Yaz0.cpp - File for Yaz0 (szs) compression
+//   Written by mkwcat
+//
+// This file is part of the mkwcat 7-Zip plugin project.
+
+#include "Yaz0.hpp"
+#include "LzEncoder.hpp"
+#include "Util.hpp"
+
+#include <C/CpuArch.h>
+
+#include <CPP/Common/ComTry.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyCom.h>
+
+#include <CPP/7zip/Archive/Common/HandlerOut.h>
+#include <CPP/7zip/Archive/IArchive.h>
+#include <CPP/7zip/Common/ProgressUtils.h>
+#include <CPP/7zip/Common/RegisterArc.h>
+#include <CPP/7zip/Common/StreamUtils.h>
+
+#include <CPP/7zip/Compress/CopyCoder.h>
+
+#include <cstring>
+
+namespace Yaz0
+{
+
+CDecoder::CDecoder()
+  : _buf(NULL)
+  , _bufSize(0)
+  , _bufPos(0)
+  , _bufStart(0)
+  , _unpackSize(0)
+{
+}
+
+bool CDecoder::Create(size_t inBufSize)
+{
+    return _in.Create(inBufSize);
+}
+
+void CDecoder::Init(Byte* buf, size_t bufSize, UInt64 unpackSize)
+{
+    _in.Init();
+    _buf = buf;
+    _bufSize = bufSize;
+    _bufPos = 0;
+    _bufStart = 0;
+    _unpackSize = unpackSize;
+    _flags = 0;
+    _numFlagBits = 0;
+    _matchDist = 0;
+    _matchRem = 0;
+}
+
+HRESULT CDecoder::Decode(size_t limit)
+{
+    if (limit > _bufSize) {
+        limit = _bufSize;
+    }
+    if (_bufStart + limit > _unpackSize) {
+        limit = (size_t) (_unpackSize - _bufStart);
+    }
+
+    Byte* buf = _buf;
+    size_t pos = _bufPos;
+    UInt32 flags = _flags;
+    UInt32 numFlagBits = _numFlagBits;
+    HRESULT res = S_OK;
+
+    while (pos < limit) {
+        if (_matchRem != 0) {
+            size_t n = limit - pos;
+            if (n > _matchRem) {
+                n = _matchRem;
+            }
+            _matchRem -= (UInt32) n;
+
+            const Byte* src = buf + pos - _matchDist;
+            Byte* dest = buf + pos;
+            pos += n;
+            if (_matchDist >= n) {
+                memcpy(dest, src, n);
+            } else {
+                do {
+                    *dest++ = *src++;
+                } while (--n != 0);
+            }
+            continue;
+        }
+
+        if (numFlagBits == 0) {
+            Byte b;
+            if (!_in.ReadByte(b)) {
+                res = S_FALSE;
+                break;
+            }
+            flags = b;
+            numFlagBits = 8;
+        }
+        numFlagBits--;
+
+        if (flags & 0x80) {
+            flags <<= 1;
+            Byte b;
+            if (!_in.ReadByte(b)) {
+                res = S_FALSE;
+                break;
+            }
+            buf[pos++] = b;
+            continue;
+        }
+        flags <<= 1;
+
+        Byte b0, b1;
+        if (!_in.ReadByte(b0) || !_in.ReadByte(b1)) {
+            res = S_FALSE;
+            break;
+        }
+        UInt32 len = b0 >> 4;
+        if (len == 0) {
+            Byte b2;
+            if (!_in.ReadByte(b2)) {
+                res = S_FALSE;
+                break;
+            }
+            len = (UInt32) b2 + 0x12;
+        } else {
+            len += 2;
+        }
+        const UInt32 dist = (((UInt32) (b0 & 0xF) << 8) | b1) + 1;
+        if (dist > pos) {
+            PRINT("Yaz0: bad distance %u at %zu\n", dist, pos);
+            res = S_FALSE;
+            break;
+        }
+        _matchDist = dist;
+        _matchRem = len;
+    }
+
+    _bufPos = pos;
+    _flags = flags;
+    _numFlagBits = numFlagBits;
+    return res;
+}
+
+void CDecoder::ShiftWindow()
+{
+    size_t keep = kMaxDistance;
+    if (keep > _bufPos) {
+        keep = _bufPos;
+    }
+    memmove(_buf, _buf + _bufPos - keep, keep);
+    _bufStart += _bufPos - keep;
+    _bufPos = keep;
+}
+
+HRESULT CLazyBuffer::Open(ISequentialInStream* stream)
+{
+    Byte header[kHeaderSize];
+    RINOK(ReadStream_FALSE(stream, header, kHeaderSize))
+    return Open(stream, header);
+}
+
+HRESULT CLazyBuffer::Open(ISequentialInStream* stream, const Byte* header)
+{
+    Free();
+
+    if (!IsHeader(header)) {
+        return S_FALSE;
+    }
+    _size = GetBe32(header + 4);
+
+    _buf.Alloc(_size == 0 ? 1 : _size);
+    if (!_buf.IsAllocated() || !_decoder.Create()) {
+        return E_OUTOFMEMORY;
+    }
+    _stream = stream;
+    _decoder.SetStream(stream);
+    _decoder.Init(_buf, _size, _size);
+    return S_OK;
+}
+
+void CLazyBuffer::Free()
+{
+    _stream.Release();
+    _buf.Free();
+    _size = 0;
+    _error = false;
+}
+
+HRESULT CLazyBuffer::EnsureDecoded(UInt64 end)
+{
+    if (end > _size) {
+        return S_FALSE;
+    }
+    if (end <= _decoder.GetBufPos()) {
+        return S_OK;
+    }
+    if (_error) {
+        return S_FALSE;
+    }
+
+    const HRESULT res = _decoder.Decode((size_t) end);
+    if (_decoder.GetBufPos() >= end) {
+        return S_OK;
+    }
+    _error = true;
+    return res == S_OK ? S_FALSE : res;
+}
+
+//
+// Encoder
+//
+
+// Token cost in bits, including the flag bit
+static const UInt32 kLiteralCost = 9;
+static const UInt32 kShortMatchCost = 17;
+static const UInt32 kLongMatchCost = 25;
+
+static UInt32 GetMatchCost(UInt32 len)
+{
+    return len < 0x12 ? kShortMatchCost : kLongMatchCost;
+}
+
+static unsigned PutMatch(Byte* p, UInt32 len, UInt32 dist)
+{
+    dist--;
+    if (len < 0x12) {
+        p[0] = (Byte) (((len - 2) << 4) | (dist >> 8));
+        p[1] = (Byte) dist;
+        return 2;
+    }
+    p[0] = (Byte) (dist >> 8);
+    p[1] = (Byte) dist;
+    p[2] = (Byte) (len - 0x12);
+    return 3;
+}
+
+static unsigned GetMatchSize(const Byte* p)
+{
+    return (p[0] >> 4) != 0 ? 2 : 3;
+}
+
+static const LzEncoder::CFormat kFormat = {
+    kMinMatch, kMaxMatch, kMaxDistance, kLiteralCost,
+    GetMatchCost, PutMatch, GetMatchSize, true,
+};
+
+HRESULT Encode(
+    const Byte* data, size_t size, const CEncodeProps& props, CByteBuffer& out,
+    size_t& outSize, ICompressProgressInfo* progress
+)
+{
+    if (size > 0xFFFFFFFF) {
+        return E_INVALIDARG;
+    }
+
+    RINOK(LzEncoder::Encode(
+        kFormat, data, size, props, kHeaderSize, out, outSize, progress
+    ))
+
+    Byte* p = out;
+    memcpy(p, "Yaz0", 4);
+    SetBe32(p + 4, (UInt32) size);
+    memset(p + 8, 0, 8);
+    return S_OK;
+}
+
+//
+// Archive handler
+//
+
+Z7_CLASS_IMP_CHandler_IInArchive_2(IOutArchive, ISetProperties)
+#if CLANG_FORMAT_WORKAROUND
+    class CHandler
+{
+#endif
+    CMyComPtr<IInStream> _inStream;
+    UInt64 _packSize;
+    UInt32 _unpackSize;
+
+    NArchive::CSingleMethodProps _props;
+};
+
+static const Byte kArcProps[] = {
+    kpidPhySize,
+};
+
+static const Byte kProps[] = {
+    kpidSize,
+    kpidPackSize,
+};
+
+IMP_IInArchive_Props;
+IMP_IInArchive_ArcProps;
+
+Z7_COM7F_IMF(CHandler::Open(
+    IInStream* stream, const UInt64* /* maxCheckStartPosition */,
+    IArchiveOpenCallback* /* openArchiveCallback */
+))
+{
+    PRINT("Open\n");
+
+    COM_TRY_BEGIN
+    {
+        Close();
+
+        Byte buf[kHeaderSize];
+        RINOK(ReadStream_FALSE(stream, buf, kHeaderSize))
+        if (!IsHeader(buf)) {
+            return S_FALSE;
+        }
+        _unpackSize = GetBe32(buf + 4);
+
+        UInt64 size;
+        RINOK(InStream_GetSize_SeekToEnd(stream, size))
+        _packSize = size;
+        _inStream = stream;
+    }
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Close())
+{
+    PRINT("Close\n");
+
+    _inStream.Release();
+    _packSize = 0;
+    _unpackSize = 0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetNumberOfItems(UInt32* numItems))
+{
+    *numItems = 1;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::GetArchiveProperty(PROPID propID, PROPVARIANT* value))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidPhySize:
+        prop = _packSize;
+        break;
+    case kpidExtension:
+        prop = "szs";
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetProperty(
+    UInt32 /* index */, PROPID propID, PROPVARIANT* value
+))
+{
+    COM_TRY_BEGIN
+    NWindows::NCOM::CPropVariant prop;
+    switch (propID) {
+    case kpidSize:
+        prop = _unpackSize;
+        break;
+    case kpidPackSize:
+        prop = _packSize;
+        break;
+    }
+    prop.Detach(value);
+    return S_OK;
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::Extract(
+    const UInt32* indices, UInt32 numItems, Int32 testMode,
+    IArchiveExtractCallback* extractCallback
+))
+{
+    PRINT("Extract\n");
+
+    COM_TRY_BEGIN
+    if (numItems == 0) {
+        return S_OK;
+    }
+    if (numItems != (UInt32) (Int32) -1 && (numItems != 1 || indices[0] != 0)) {
+        return E_INVALIDARG;
+    }
+
+    extractCallback->SetTotal(_unpackSize);
+
+    CMyComPtr<ISequentialOutStream> realOutStream;
+    const Int32 askMode = testMode ? NArchive::NExtract::NAskMode::kTest
+                                   : NArchive::NExtract::NAskMode::kExtract;
+    RINOK(extractCallback->GetStream(0, &realOutStream, askMode))
+    if (!testMode && !realOutStream) {
+        return S_OK;
+    }
+    RINOK(extractCallback->PrepareOperation(askMode))
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(extractCallback, false);
+
+    static const size_t kWindowSize = kMaxDistance + (1 << 20);
+    CByteBuffer window(kWindowSize);
+
+    CDecoder decoder;
+    if (!decoder.Create()) {
+        return E_OUTOFMEMORY;
+    }
+    RINOK(InStream_SeekSet(_inStream, kHeaderSize))
+    decoder.SetStream(_inStream);
+    decoder.Init(window, kWindowSize, _unpackSize);
+
+    Int32 opRes = NArchive::NExtract::NOperationResult::kOK;
+    size_t written = 0;
+    for (;;) {
+        const HRESULT res = decoder.Decode(kWindowSize);
+        const size_t pos = decoder.GetBufPos();
+        if (realOutStream && pos > written) {
+            RINOK(WriteStream(realOutStream, window + written, pos - written))
+        }
+
+        lps->InSize = decoder.GetInProcessed();
+        lps->OutSize = decoder.GetOutProcessed();
+        RINOK(lps->SetCur())
+
+        if (decoder.IsFinished()) {
+            break;
+        }
+        if (res != S_OK) {
+            opRes = NArchive::NExtract::NOperationResult::kDataError;
+            break;
+        }
+        decoder.ShiftWindow();
+        written = decoder.GetBufPos();
+    }
+
+    realOutStream.Release();
+    return extractCallback->SetOperationResult(opRes);
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::GetFileTimeType(UInt32* type))
+{
+    *type = k_PropVar_TimePrec_0;
+    return S_OK;
+}
+
+Z7_COM7F_IMF(CHandler::UpdateItems(
+    ISequentialOutStream* outStream, UInt32 numItems,
+    IArchiveUpdateCallback* updateCallback
+))
+{
+    PRINT("UpdateItems\n");
+
+    COM_TRY_BEGIN
+    if (numItems != 1) {
+        return E_INVALIDARG;
+    }
+
+    Int32 newData, newProps;
+    UInt32 indexInArchive;
+    RINOK(updateCallback->GetUpdateItemInfo(
+        0, &newData, &newProps, &indexInArchive
+    ))
+
+    if (IntToBool(newProps)) {
+        NWindows::NCOM::CPropVariant prop;
+        RINOK(updateCallback->GetProperty(0, kpidIsDir, &prop))
+        if (prop.vt == VT_BOOL && prop.boolVal != VARIANT_FALSE) {
+            return E_INVALIDARG;
+        }
+    }
+
+    if (!IntToBool(newData)) {
+        // Unchanged, copy the archive as is
+        if (indexInArchive != 0 || !_inStream) {
+            return E_NOTIMPL;
+        }
+        RINOK(InStream_SeekToBegin(_inStream))
+        CLocalProgress* lps = new CLocalProgress;
+        CMyComPtr<ICompressProgressInfo> progress = lps;
+        lps->Init(updateCallback, true);
+        return NCompress::CopyStream(_inStream, outStream, progress);
+    }
+
+    UInt64 size;
+    {
+        NWindows::NCOM::CPropVariant prop;
+        RINOK(updateCallback->GetProperty(0, kpidSize, &prop))
+        if (prop.vt != VT_UI8) {
+            return E_INVALIDARG;
+        }
+        size = prop.uhVal.QuadPart;
+    }
+    if (size > 0xFFFFFFFF) {
+        return E_INVALIDARG;
+    }
+    RINOK(updateCallback->SetTotal(size))
+
+    CMyComPtr<ISequentialInStream> fileInStream;
+    RINOK(updateCallback->GetStream(0, &fileInStream))
+    if (!fileInStream) {
+        return S_FALSE;
+    }
+
+    CByteBuffer data((size_t) size);
+    RINOK(ReadStream_FAIL(fileInStream, data, (size_t) size))
+    fileInStream.Release();
+
+    CLocalProgress* lps = new CLocalProgress;
+    CMyComPtr<ICompressProgressInfo> progress = lps;
+    lps->Init(updateCallback, true);
+
+    CEncodeProps props;
+    props.Level = (UInt32) _props.GetLevel();
+    props.NumThreads = _props._numThreads;
+
+    CByteBuffer out;
+    size_t outSize;
+    RINOK(Encode(data, (size_t) size, props, out, outSize, progress))
+    RINOK(WriteStream(outStream, out, outSize))
+
+    return updateCallback->SetOperationResult(
+        NArchive::NUpdate::NOperationResult::kOK
+    );
+    COM_TRY_END
+}
+
+Z7_COM7F_IMF(CHandler::SetProperties(
+    const wchar_t* const* names, const PROPVARIANT* values, UInt32 numProps
+))
+{
+    return _props.SetProperties(names, values, numProps);
+}
+
+static const Byte k_Signature[] = {'Y', 'a', 'z', '0'};
+
+REGISTER_ARC_IO(
+    "yaz0", "szs carc yaz0", ".arc .arc *", 0xA3, //
+    k_Signature, //
+    0, //
+    NArcInfoFlags::kKeepName, 0, 0
+)
+
+} // namespace Yaz0
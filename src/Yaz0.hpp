@@ -0,0 +1,131 @@
+#pragma once
+
+#include "LzEncoder.hpp"
+#include "Types.h"
+#include <CPP/7zip/Common/InBuffer.h>
+#include <CPP/7zip/ICoder.h>
+#include <CPP/Common/MyBuffer.h>
+#include <CPP/Common/MyBuffer2.h>
+#include <CPP/Common/MyCom.h>
+
+namespace Yaz0
+{
+
+static const UInt32 kHeaderSize = 0x10;
+static const UInt32 kMinMatch = 3;
+static const UInt32 kMaxMatch = 0x111;
+static const UInt32 kMaxDistance = 0x1000;
+
+static inline bool IsHeader(const Byte* p)
+{
+    return p[0] == 'Y' && p[1] == 'a' && p[2] == 'z' && p[3] == '0';
+}
+
+// Incremental decoder. Output goes to a caller-owned buffer which is either
+// the whole decompressed file, or a window that is shifted down with
+// ShiftWindow() once full.
+class CDecoder
+{
+public:
+    CDecoder();
+
+    bool Create(size_t inBufSize = 1 << 16);
+    void SetStream(ISequentialInStream* stream)
+    {
+        _in.SetStream(stream);
+    }
+
+    void Init(Byte* buf, size_t bufSize, UInt64 unpackSize);
+
+    // Decode until buf[0 .. limit) is filled or the end of the data is
+    // reached. Returns S_FALSE on corrupt or truncated input.
+    HRESULT Decode(size_t limit);
+
+    // Move the last kMaxDistance bytes to the start of the buffer so that
+    // decoding can continue into the freed space.
+    void ShiftWindow();
+
+    size_t GetBufPos() const
+    {
+        return _bufPos;
+    }
+
+    UInt64 GetOutProcessed() const
+    {
+        return _bufStart + _bufPos;
+    }
+
+    UInt64 GetInProcessed() const
+    {
+        return _in.GetProcessedSize();
+    }
+
+    bool IsFinished() const
+    {
+        return GetOutProcessed() == _unpackSize;
+    }
+
+private:
+    CInBuffer _in;
+    Byte* _buf;
+    size_t _bufSize;
+    size_t _bufPos;
+    UInt64 _bufStart;
+    UInt64 _unpackSize;
+
+    UInt32 _flags;
+    UInt32 _numFlagBits;
+    UInt32 _matchDist;
+    UInt32 _matchRem;
+};
+
+// Whole decompressed file held in memory, decoded only as far as has been
+// requested so far. Lets archive handlers parse headers out of a Yaz0 file
+// without decoding (or writing out) the rest of it first.
+class CLazyBuffer
+{
+public:
+    CLazyBuffer()
+      : _size(0)
+      , _error(false)
+    {
+    }
+
+    // The stream must be positioned at the Yaz0 header
+    HRESULT Open(ISequentialInStream* stream);
+    // Same, but the kHeaderSize byte header has already been read from the
+    // stream
+    HRESULT Open(ISequentialInStream* stream, const Byte* header);
+    void Free();
+
+    // Make sure data[0 .. end) is decoded. Returns S_FALSE if the data is
+    // corrupt or end is past the decompressed size.
+    HRESULT EnsureDecoded(UInt64 end);
+
+    const Byte* GetData() const
+    {
+        return _buf;
+    }
+
+    UInt64 GetSize() const
+    {
+        return _size;
+    }
+
+private:
+    CMyComPtr<ISequentialInStream> _stream;
+    CMidBuffer _buf;
+    CDecoder _decoder;
+    UInt32 _size;
+    bool _error;
+};
+
+typedef LzEncoder::CEncodeProps CEncodeProps;
+
+// Compress data into a complete Yaz0 file, header included
+HRESULT Encode(
+    const Byte* data, size_t size, const CEncodeProps& props, CByteBuffer& out,
+    size_t& outSize, ICompressProgressInfo* progress
+);
+
+} // namespace Yaz0